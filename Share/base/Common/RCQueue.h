@@ -170,6 +170,27 @@ public:
         return node;
     }
 
+    /**
+     * Enqueue a chain of nodes which has been linked by the caller, from first to last. It works
+     * like the Enqueue, but only moves the tail once for the whole chain, so that a batch of
+     * elements costs the same CAS operations as one element.
+     * @param first, the first node of the chain, created by new RCNode<T>(t).
+     * @param last, the last node of the chain, its next must be nullptr.
+     * @param count, the count of the nodes in the chain.
+     * @return a pointer to the last node.
+     */
+    RCNode<T> *EnqueueChain(RCNode<T> *first, RCNode<T> *last, int count) {
+        if (first == nullptr || last == nullptr || count <= 0) {
+            return nullptr;
+        }
+        RCNode<T> *local = tail;
+        while (!compare_and_set_strong(&tail, &local, &last));
+        RCNode<T> *ln = local->next;
+        while (!compare_and_set_strong(&(local->next), &ln, &first));
+        add_and_fetch(&size, count);
+        return last;
+    }
+
     /**
      * The elements count. Be aware of that the size is the normal elements count, not the real
      * element count. Because there are removed elements remained on the queue.
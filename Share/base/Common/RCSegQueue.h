@@ -0,0 +1,527 @@
+//
+//  RCSegQueue.h
+//  RCSegQueue
+//
+//  Created by  on 2022/9/18.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#ifndef RCSEGQUEUE_H
+#define RCSEGQUEUE_H
+
+#include "Atomic.h"
+#include "Epoch.h"
+#include "TMQMutex.h"
+
+/// Const definitions
+// The count of slots in one segment.
+#define RC_SEGMENT_SIZE         32
+// The max count of free segments kept in the pool of one queue, the others are deleted.
+#define RC_SEGMENT_POOL_MAX     8
+// States of a slot.
+#define RC_SLOT_EMPTY           0
+#define RC_SLOT_READY           1
+#define RC_SLOT_TAKEN           2
+
+/**
+ * This is the segmented variant of the RCQueue, with the same random consuming semantics. Instead
+ * of a node and a value allocated for each element, the elements are saved into the inline slots
+ * of fixed size segments, and a consumed segment is recycled through a lock-free pool of its queue,
+ * so that enqueuing allocates nothing in the steady state, and the iterators traverse the elements
+ * in arrays instead of chasing one pointer for each.
+ *
+ * Concurrent theory of RCSegQueue:
+ * Each slot has its own state word, EMPTY -> READY -> TAKEN, never goes back until its segment is
+ * recycled.
+ *  Producers reserve a range of slots in the tail segment by a CAS on the reserved count, write the
+ *   values, then publish each slot by setting it READY. A full tail is extended by a new segment.
+ *  Consumers take a READY slot by a CAS to TAKEN, the value is copied after the CAS succeeds, it is
+ *   never written again while the segment is alive.
+ *  An iterator never passes an EMPTY slot, which is still being written, so the elements are
+ *   always found in the order of their reservation, the same as the RCQueue.
+ * The first segment is created by the first enqueuing, an empty queue costs no segment.
+ * Every access to the segments is wrapped by the shared Epoch. An iterator also pins the segment
+ * it stopped on between its lookups, by the refs of the segment. A segment is retired when all of
+ * its slots are taken, it is not the last one, and no iterator pins it, it can be anywhere in the
+ * queue, then it is put into the pool after the readers entered before are gone.
+ * Pinning and retiring are ordered like the Dekker's, the iterator adds the refs before checking
+ * the retired flag, and the retirer sets the flag before checking the refs, so at least one of
+ * them sees the other and backs off.
+ */
+template<typename T, int N>
+class RCSegQueue;
+
+/**
+ * RCSegment definition, a fixed array of slots.
+ * @tparam T, template parameter, it should be copy assignable.
+ * @tparam N, the count of slots.
+ */
+template<typename T, int N>
+class RCSegment {
+public:
+    // The values of the slots.
+    T slots[N];
+    // The states of the slots.
+    volatile unsigned int states[N];
+    // The count of the reserved slots.
+    volatile int reserved;
+    // The count of the taken slots.
+    volatile int taken;
+    // The count of the iterators pinning this segment.
+    volatile int refs;
+    // Whether this segment has been retired.
+    volatile int retired;
+    // A pointer to the next segment.
+    RCSegment *volatile next;
+    // A pointer to the previous segment, modified under the retire mutex of the queue.
+    RCSegment *prev;
+    // A pointer to the next free segment in the pool.
+    RCSegment *free;
+    // The queue owning this segment.
+    RCSegQueue<T, N> *owner;
+
+public:
+    /**
+     * Construct an empty segment.
+     * @param owner, the queue owning this segment.
+     */
+    RCSegment(RCSegQueue<T, N> *owner) : slots{}, owner(owner) {
+        Reset();
+    }
+
+    /**
+     * Reset the segment for reusing, the stale values are overwritten on enqueuing.
+     */
+    void Reset() {
+        for (int i = 0; i < N; ++i) {
+            states[i] = RC_SLOT_EMPTY;
+        }
+        reserved = 0;
+        taken = 0;
+        refs = 0;
+        retired = 0;
+        next = nullptr;
+        prev = nullptr;
+        free = nullptr;
+    }
+};
+
+/**
+ * RCSegQueue definition and implementation.
+ * @tparam T, template parameter, it should be default constructible and copy assignable.
+ * @tparam N, the count of slots in one segment.
+ */
+template<typename T, int N = RC_SEGMENT_SIZE>
+class RCSegQueue {
+public:
+    // A pointer to the first segment, nullptr before the first enqueuing.
+    RCSegment<T, N> *volatile head;
+    // A pointer to the last segment, nullptr before the first enqueuing.
+    RCSegment<T, N> *volatile tail;
+    // Count of the normal values.
+    volatile int size;
+
+private:
+    // The free segments.
+    RCSegment<T, N> *volatile pool;
+    // The count of the free segments.
+    volatile int pooled;
+    // Flag for popping the pool, the pool is popped by one thread at a time to avoid ABA.
+    volatile int popping;
+    // The count of the retired segments not released by the epoch yet.
+    volatile int retiring;
+    // Mutex for unlinking the retired segments.
+    TMQMutex retireMutex;
+    // The epoch protecting the segments.
+    Epoch *epoch;
+
+private:
+    /**
+     * Release a retired segment into the pool of its owner, called by the Epoch.
+     * @param ptr, a pointer to the segment.
+     */
+    static void ReleaseSegment(void *ptr) {
+        auto *segment = (RCSegment<T, N> *) ptr;
+        RCSegQueue<T, N> *owner = segment->owner;
+        owner->Recycle(segment);
+        sub_and_fetch_seq_cst(&(owner->retiring), 1);
+    }
+
+    /**
+     * Get a segment from the pool, or create one if the pool is empty or popped by others.
+     * @return a pointer to the reset segment.
+     */
+    RCSegment<T, N> *Obtain() {
+        RCSegment<T, N> *segment = nullptr;
+        int local = 0;
+        int expect = 1;
+        if (compare_and_set_seq_cst(&popping, &local, &expect)) {
+            segment = load_acquire(&pool);
+            while (segment && !compare_and_set_seq_cst(&pool, &segment, &(segment->free)));
+            store_release(&popping, 0);
+        }
+        if (segment == nullptr) {
+            return new RCSegment<T, N>(this);
+        }
+        sub_and_fetch(&pooled, 1);
+        segment->Reset();
+        return segment;
+    }
+
+    /**
+     * Push a segment into the pool, it is deleted if the pool is full.
+     * @param segment, a segment unreachable for all threads.
+     */
+    void Recycle(RCSegment<T, N> *segment) {
+        if (add_and_fetch(&pooled, 1) > RC_SEGMENT_POOL_MAX) {
+            sub_and_fetch(&pooled, 1);
+            delete segment;
+            return;
+        }
+        RCSegment<T, N> *local = load_acquire(&pool);
+        do {
+            segment->free = local;
+        } while (!compare_and_set_seq_cst(&pool, &local, &segment));
+    }
+
+    /**
+     * Create the first segment if there is none, and set the tail to it. The head is set first,
+     * so a queue never has a tail without a head. Should be called inside the epoch.
+     */
+    void Start() {
+        RCSegment<T, N> *first = load_acquire(&head);
+        if (first == nullptr) {
+            auto *created = new RCSegment<T, N>(this);
+            if (compare_and_set_seq_cst(&head, &first, &created)) {
+                first = created;
+            } else {
+                // Created by others, the created one is never published.
+                delete created;
+            }
+        }
+        RCSegment<T, N> *local = nullptr;
+        compare_and_set_seq_cst(&tail, &local, &first);
+    }
+
+    /**
+     * Link a new segment after the full one if it is not linked yet, and move the tail to it.
+     * Should be called inside the epoch.
+     * @param segment, the full segment.
+     */
+    void Extend(RCSegment<T, N> *segment) {
+        RCSegment<T, N> *next = load_acquire(&(segment->next));
+        if (next == nullptr) {
+            RCSegment<T, N> *created = Obtain();
+            created->prev = segment;
+            if (compare_and_set_seq_cst(&(segment->next), &next, &created)) {
+                next = created;
+            } else {
+                // Linked by others, the created one is never published.
+                Recycle(created);
+            }
+        }
+        RCSegment<T, N> *local = segment;
+        compare_and_set_seq_cst(&tail, &local, &next);
+        // The segment may be taken up before it has the next.
+        TryRetire(segment);
+    }
+
+    /**
+     * Retire the segment if all of its slots are taken, it is not the last one and no iterator
+     * pins it. Should be called inside the epoch.
+     * @param segment, the segment to check.
+     */
+    void TryRetire(RCSegment<T, N> *segment) {
+        if (load_seq_cst(&(segment->taken)) < N || load_acquire(&(segment->next)) == nullptr
+            || load_seq_cst(&(segment->refs)) != 0) {
+            return;
+        }
+        retireMutex.Lock();
+        RCSegment<T, N> *next = load_acquire(&(segment->next));
+        bool retire = !segment->retired && next != nullptr;
+        if (retire) {
+            store_seq_cst(&(segment->retired), 1);
+            if (load_seq_cst(&(segment->refs)) != 0) {
+                // Pinned by an iterator after the check, it will try again on unpinning.
+                store_seq_cst(&(segment->retired), 0);
+                retire = false;
+            }
+        }
+        if (retire) {
+            // Move the tail first, the producers can not find the segment from now on.
+            RCSegment<T, N> *local = segment;
+            compare_and_set_seq_cst(&tail, &local, &next);
+            if (segment->prev) {
+                store_release(&(segment->prev->next), next);
+            } else {
+                store_release(&head, next);
+            }
+            next->prev = segment->prev;
+        }
+        retireMutex.UnLock();
+        if (retire) {
+            add_and_fetch_seq_cst(&retiring, 1);
+            epoch->Retire(segment, ReleaseSegment);
+            epoch->Reclaim();
+        }
+    }
+
+public:
+    /*
+     * Construct a empty RCSegQueue, the segments are created on enqueuing.
+     */
+    RCSegQueue() : head(nullptr), tail(nullptr), size(0), pool(nullptr), pooled(0), popping(0),
+                   retiring(0), epoch(Epoch::GetInstance()) {
+    }
+
+    /**
+     * Destructor, there should be no iterator any more. The retired segments are put into the
+     * pool by the epoch first if there are any, then all segments are deleted.
+     */
+    ~RCSegQueue() {
+        if (load_seq_cst(&retiring) > 0) {
+            epoch->Synchronize();
+        }
+        RCSegment<T, N> *segment = head;
+        while (segment) {
+            RCSegment<T, N> *isolated = segment;
+            segment = segment->next;
+            delete isolated;
+        }
+        segment = pool;
+        while (segment) {
+            RCSegment<T, N> *isolated = segment;
+            segment = segment->free;
+            delete isolated;
+        }
+    }
+
+    /**
+     * Enter the epoch of the queue, the segments reached from now on are valid until Exit.
+     * @return a token for Exit.
+     */
+    int Enter() {
+        return epoch->Enter();
+    }
+
+    /**
+     * Exit the epoch of the queue.
+     * @param token, the token returned by Enter.
+     */
+    void Exit(int token) {
+        epoch->Exit(token);
+    }
+
+    /**
+     * Enqueue a element.
+     * @param t, the new value.
+     */
+    void Enqueue(const T &t) {
+        EnqueueBatch(&t, 1);
+    }
+
+    /**
+     * Enqueue a batch of elements. The slots are reserved by ranges, as many as the tail segment
+     * can hold at once, so a batch costs one CAS for each segment it spans, and its elements are
+     * continuous unless it spans segments.
+     * @param values, the values in order.
+     * @param count, the count of the values.
+     */
+    void EnqueueBatch(const T *values, int count) {
+        if (values == nullptr || count <= 0) {
+            return;
+        }
+        int token = epoch->Enter();
+        int written = 0;
+        while (written < count) {
+            RCSegment<T, N> *segment = load_acquire(&tail);
+            if (segment == nullptr) {
+                Start();
+                continue;
+            }
+            int local = load_acquire(&(segment->reserved));
+            if (local >= N) {
+                Extend(segment);
+                continue;
+            }
+            int expect = count - written < N - local ? local + count - written : N;
+            if (!compare_and_set_seq_cst(&(segment->reserved), &local, &expect)) {
+                continue;
+            }
+            for (int i = local; i < expect; ++i) {
+                segment->slots[i] = values[written++];
+                store_release(&(segment->states[i]), RC_SLOT_READY);
+            }
+            add_and_fetch(&size, expect - local);
+        }
+        epoch->Exit(token);
+    }
+
+    /**
+     * The elements count. Be aware of that the size is the count of untaken elements.
+     * @return the size of this queue.
+     */
+    int Size() {
+        return size;
+    }
+
+    /**
+     * Pin a segment for an iterator, if it has been retired, the next one is tried. Should be
+     * called inside the epoch.
+     * @param segment, the segment to pin.
+     * @return the pinned segment, it is never nullptr, the last segment is never retired.
+     */
+    RCSegment<T, N> *Pin(RCSegment<T, N> *segment) {
+        while (true) {
+            add_and_fetch_seq_cst(&(segment->refs), 1);
+            if (!load_seq_cst(&(segment->retired))) {
+                return segment;
+            }
+            RCSegment<T, N> *next = load_acquire(&(segment->next));
+            Unpin(segment);
+            segment = next;
+        }
+    }
+
+    /**
+     * Unpin a segment, it is retired if it is taken up. Should be called inside the epoch.
+     * @param segment, the pinned segment.
+     */
+    void Unpin(RCSegment<T, N> *segment) {
+        if (sub_and_fetch_seq_cst(&(segment->refs), 1) == 0) {
+            TryRetire(segment);
+        }
+    }
+
+    /**
+     * CAS operation on slot state to consume a slot.
+     * @param segment, the segment pinned by the caller.
+     * @param index, the index of the slot.
+     * @return a boolean value indicate whether the take is success or not.
+     */
+    bool Take(RCSegment<T, N> *segment, int index) {
+        unsigned int local = RC_SLOT_READY;
+        unsigned int expect = RC_SLOT_TAKEN;
+        if (!compare_and_set_seq_cst(&(segment->states[index]), &local, &expect)) {
+            return false;
+        }
+        sub_and_fetch(&size, 1);
+        add_and_fetch_seq_cst(&(segment->taken), 1);
+        return true;
+    }
+};
+
+/**
+ * RCSegIterator to consume elements on the RCSegQueue, it works like the RCIterator. One iterator
+ * pins the segment it stopped on, and releases it when moving to the next one.
+ * @tparam T, template parameter.
+ * @tparam N, the count of slots in one segment.
+ */
+template<typename T, int N = RC_SEGMENT_SIZE>
+class RCSegIterator {
+public:
+    // a pointer to the RCSegQueue.
+    RCSegQueue<T, N> *queue;
+    // a pointer to the segment which the iterator stopped on.
+    RCSegment<T, N> *segment;
+    // the index of the next slot to check in the segment.
+    int index;
+
+public:
+    /**
+     * Default constructor fot the RCSegIterator.
+     */
+    RCSegIterator() : queue(nullptr), segment(nullptr), index(0) {
+
+    }
+
+    /**
+     * Construct a RCSegIterator withe the RCSegQueue.
+     * @param queue
+     */
+    RCSegIterator(RCSegQueue<T, N> *queue) : queue(queue), segment(nullptr), index(0) {
+
+    }
+
+    /**
+     * Default destructor, unpin the segment stopped on.
+     */
+    virtual ~RCSegIterator() {
+        if (segment) {
+            int token = queue->Enter();
+            queue->Unpin(segment);
+            queue->Exit(token);
+        }
+    }
+
+    /**
+     * A virtual function to compare the element in slot.
+     * @param t, the element in RCSegQueue.
+     * @return, true if the iterator consume this element, false if it do not consume it.
+     */
+    virtual bool OnCompare(const T &/* t */) {
+        return false;
+    }
+
+    /**
+     * Lookup action to consume the RCSegQueue. Lookup will traverse the slots from where it stopped
+     * and search the element by the compare function. If finding a element success, it will take it
+     * and return the value. It stops at the first slot being written, the elements after will be
+     * found by the next lookup.
+     * @param val, a value reference to save the result.
+     * @return, a boolean value indicate whether we had found a value or not.
+     */
+    bool Lookup(T &val) {
+        // Check parameter
+        if (queue == nullptr) {
+            return false;
+        }
+        int token = queue->Enter();
+        if (segment == nullptr) {
+            RCSegment<T, N> *first = load_acquire(&(queue->head));
+            if (first == nullptr) {
+                // Nothing has been enqueued yet.
+                queue->Exit(token);
+                return false;
+            }
+            segment = queue->Pin(first);
+            index = 0;
+        }
+        bool found = false;
+        while (!found) {
+            int reserved = load_acquire(&(segment->reserved));
+            reserved = reserved < N ? reserved : N;
+            while (index < reserved) {
+                unsigned int state = load_acquire(&(segment->states[index]));
+                if (state == RC_SLOT_EMPTY) {
+                    break;
+                }
+                if (state == RC_SLOT_READY && OnCompare(segment->slots[index])
+                    && queue->Take(segment, index)) {
+                    val = segment->slots[index];
+                    found = true;
+                }
+                index++;
+                if (found) {
+                    break;
+                }
+            }
+            if (found || index < N) {
+                break;
+            }
+            // All slots are checked, move to the next segment.
+            RCSegment<T, N> *next = load_acquire(&(segment->next));
+            if (next == nullptr) {
+                break;
+            }
+            RCSegment<T, N> *pinned = queue->Pin(next);
+            queue->Unpin(segment);
+            segment = pinned;
+            index = 0;
+        }
+        queue->Exit(token);
+        return found;
+    }
+};
+
+#endif //RCSEGQUEUE_H
@@ -0,0 +1,112 @@
+//
+//  WorkDeque.h
+//  WorkDeque
+//
+//  Created by  on 2022/5/28.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#ifndef WORK_DEQUE_H
+#define WORK_DEQUE_H
+
+#include "Atomic.h"
+
+/// Const definitions
+// Default capacity of the work deque, must be a power of two.
+#define WORK_DEQUE_CAPACITY     64
+
+/**
+ * A fixed-capacity work-stealing deque (Chase-Lev). The owner thread pushes and pops at the bottom
+ * without lock, other threads steal from the top with a CAS. The items are never moved, so the
+ * type T should be trivially copyable, usually a pointer.
+ *
+ * Only the owner can call Push and Pop, any thread can call Steal.
+ */
+template<typename T, long Capacity = WORK_DEQUE_CAPACITY>
+class WorkDeque {
+private:
+    // The position to steal from, increased by thieves and the owner popping the last item.
+    volatile long top;
+    // The position to push to, modified by the owner only.
+    volatile long bottom;
+    // The ring of items.
+    T items[Capacity];
+
+public:
+    WorkDeque() : top(0), bottom(0), items{} {
+
+    }
+
+    /**
+     * Push an item at the bottom, owner only.
+     * @param t, the item to push.
+     * @return false if the deque is full.
+     */
+    bool Push(const T &t) {
+        long b = bottom;
+        if (b - load_acquire(&top) >= Capacity) {
+            return false;
+        }
+        items[b & (Capacity - 1)] = t;
+        store_release(&bottom, b + 1);
+        return true;
+    }
+
+    /**
+     * Pop the item pushed last, owner only. When there is only one item, the owner races with the
+     * thieves by a CAS on the top.
+     * @param t, a reference to receive the item.
+     * @return false if the deque is empty, or the last item is stolen.
+     */
+    bool Pop(T &t) {
+        long b = bottom - 1;
+        store_seq_cst(&bottom, b);
+        fence_seq_cst();
+        long local = load_seq_cst(&top);
+        if (local > b) {
+            store_seq_cst(&bottom, b + 1);
+            return false;
+        }
+        t = items[b & (Capacity - 1)];
+        if (local == b) {
+            long next = local + 1;
+            bool success = compare_and_set_seq_cst(&top, &local, &next);
+            store_seq_cst(&bottom, b + 1);
+            return success;
+        }
+        return true;
+    }
+
+    /**
+     * Steal the item pushed first, any thread.
+     * @param t, a reference to receive the item.
+     * @return false if the deque is empty, or another thread takes the item.
+     */
+    bool Steal(T &t) {
+        long local = load_seq_cst(&top);
+        fence_seq_cst();
+        long b = load_seq_cst(&bottom);
+        if (local >= b) {
+            return false;
+        }
+        // The slot can not be reused by Push before the top is moved over it.
+        T item = items[local & (Capacity - 1)];
+        long next = local + 1;
+        if (!compare_and_set_seq_cst(&top, &local, &next)) {
+            return false;
+        }
+        t = item;
+        return true;
+    }
+
+    /**
+     * The count of items, it is an estimate for threads other than the owner.
+     * @return the size.
+     */
+    long Size() {
+        long size = load_acquire(&bottom) - load_acquire(&top);
+        return size > 0 ? size : 0;
+    }
+};
+
+#endif //WORK_DEQUE_H
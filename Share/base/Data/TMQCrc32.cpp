@@ -0,0 +1,85 @@
+//
+//  TMQCrc32.cpp
+//  TMQCrc32
+//
+//  Created by  on 2022/9/22.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#include "TMQCrc32.h"
+#include <cstring>
+
+// The 64 bits crc32 instructions are available on 64 bits targets only.
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__ARM_FEATURE_CRC32) && defined(__aarch64__)
+#include <arm_acle.h>
+#define CRC32C_ARM
+#endif
+
+/// Const definitions
+// The reversed polynomial of CRC32C.
+#define CRC32C_POLY             0x82F63B78
+
+USING_TMQ_NAMESPACE
+
+#if !defined(CRC32C_X86) && !defined(CRC32C_ARM)
+
+/**
+ * The lookup table of the bytes, built on the first use.
+ */
+class Crc32Table {
+public:
+    // The checksum of each byte.
+    unsigned int values[256];
+
+public:
+    Crc32Table() : values{0} {
+        for (unsigned int i = 0; i < 256; ++i) {
+            unsigned int crc = i;
+            for (int j = 0; j < 8; ++j) {
+                crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+            }
+            values[i] = crc;
+        }
+    }
+};
+
+#endif
+
+/*
+ * Update the inverted checksum, 8 bytes at a time with the instructions, and the remained bytes one
+ * by one.
+ */
+unsigned int TMQCrc32::Update(unsigned int crc, const void *data, long length) {
+    const auto *bytes = (const unsigned char *) data;
+    crc = ~crc;
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+    unsigned long long crc64 = crc;
+    for (; length >= 8; length -= 8, bytes += 8) {
+        unsigned long long word;
+        memcpy(&word, bytes, sizeof(word));
+#if defined(CRC32C_X86)
+        crc64 = _mm_crc32_u64(crc64, word);
+#else
+        crc64 = __crc32cd((unsigned int) crc64, word);
+#endif
+    }
+    crc = (unsigned int) crc64;
+    for (; length > 0; --length, ++bytes) {
+#if defined(CRC32C_X86)
+        crc = _mm_crc32_u8(crc, *bytes);
+#else
+        crc = __crc32cb(crc, *bytes);
+#endif
+    }
+#else
+    // Built once, the initialization of a local static is thread safe.
+    static const Crc32Table table;
+    for (; length > 0; --length, ++bytes) {
+        crc = table.values[(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
+    }
+#endif
+    return ~crc;
+}
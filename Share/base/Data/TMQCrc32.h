@@ -0,0 +1,35 @@
+//
+//  TMQCrc32.h
+//  TMQCrc32
+//
+//  Created by  on 2022/9/22.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#ifndef TMQ_CRC32_H
+#define TMQ_CRC32_H
+
+#include "Defines.h"
+
+TMQ_NAMESPACE
+
+/**
+ * CRC32C (Castagnoli) checksum, for checking the records in the persistence. It is computed by the
+ * crc32 instructions when the target supports them (SSE4.2 on x86, the CRC extension on ARMv8),
+ * otherwise by a lookup table.
+ */
+    class TMQCrc32 {
+    public:
+        /**
+         * Update a checksum with more data, so a record can be checked in pieces.
+         * @param crc, the checksum of the previous data, 0 for the beginning.
+         * @param data, a pointer to the data.
+         * @param length, the length of the data.
+         * @return the checksum of the previous data and this data.
+         */
+        static unsigned int Update(unsigned int crc, const void *data, long length);
+    };
+
+TMQ_NAMESPACE_END
+
+#endif //TMQ_CRC32_H
@@ -8,17 +8,152 @@
 
 #include "TMQSettings.h"
 #include "TMQUtils.h"
+#include "Atomic.h"
+#include <cstring>
 
 USING_TMQ_NAMESPACE
 
 /*
- * Put a key-value pair.
+ * Copy the pairs in the order of the RbTree, which is the order of String.
+ */
+TMQSettingsSnapshot::TMQSettingsSnapshot(const RbTree<String, String> &kvs, TMQSize version)
+        : version(version), count((int) kvs.Size()), refs(1) {
+    keys = new String[count > 0 ? count : 1];
+    values = new String[count > 0 ? count : 1];
+    int i = 0;
+    for (RbIterator<String, String> it = kvs.begin(); it != kvs.end() && i < count; ++it, ++i) {
+        keys[i] = it->key;
+        values[i] = it->value;
+    }
+    count = i;
+}
+
+TMQSettingsSnapshot::~TMQSettingsSnapshot() {
+    delete[] keys;
+    delete[] values;
+}
+
+void TMQSettingsSnapshot::Retain() {
+    add_and_fetch_acq_rel(&refs, 1);
+}
+
+void TMQSettingsSnapshot::Release() {
+    if (sub_and_fetch_acq_rel(&refs, 1) == 0) {
+        delete this;
+    }
+}
+
+TMQSize TMQSettingsSnapshot::GetVersion() const {
+    return version;
+}
+
+/*
+ * Binary search with the order of String, the size is compared first, then the data.
+ */
+int TMQSettingsSnapshot::Find(const char *key) const {
+    if (key == nullptr) {
+        return -1;
+    }
+    TMQSize size = strlen(key);
+    int low = 0, high = count - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        const String &middleKey = keys[middle];
+        int res = middleKey.Size() == size ? memcmp(middleKey.c_str(), key, size)
+                                           : (middleKey.Size() < size ? -1 : 1);
+        if (res == 0) {
+            return middle;
+        } else if (res < 0) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return -1;
+}
+
+const char *TMQSettingsSnapshot::Get(const char *key) const {
+    int position = Find(key);
+    return position >= 0 ? values[position].c_str() : nullptr;
+}
+
+int TMQSettingsSnapshot::GetInt(const char *key, int defaultValue) const {
+    int position = Find(key);
+    int value = defaultValue;
+    if (position < 0 || !TMQUtils::ToInt(values[position].c_str(), (int) values[position].Size(),
+                                         &value)) {
+        return defaultValue;
+    }
+    return value;
+}
+
+int TMQSettingsSnapshot::GetTopicInt(const char *key, const char *topic, int defaultValue) const {
+    int value = GetInt(key, defaultValue);
+    if (topic) {
+        char topicKey[TOPIC_SETTINGS_KEY_LENGTH] = {0};
+        snprintf(topicKey, TOPIC_SETTINGS_KEY_LENGTH, "%s:%s", key, topic);
+        value = GetInt(topicKey, value);
+    }
+    return value;
+}
+
+long long TMQSettingsSnapshot::GetLong(const char *key, long long defaultValue) const {
+    int position = Find(key);
+    long long value = defaultValue;
+    if (position < 0 || !TMQUtils::ToLong(values[position].c_str(), (int) values[position].Size(),
+                                          &value)) {
+        return defaultValue;
+    }
+    return value;
+}
+
+long long TMQSettingsSnapshot::GetTopicLong(const char *key, const char *topic,
+                                            long long defaultValue) const {
+    long long value = GetLong(key, defaultValue);
+    if (topic) {
+        char topicKey[TOPIC_SETTINGS_KEY_LENGTH] = {0};
+        snprintf(topicKey, TOPIC_SETTINGS_KEY_LENGTH, "%s:%s", key, topic);
+        value = GetLong(topicKey, value);
+    }
+    return value;
+}
+
+bool TMQSettingsSnapshot::GetBool(const char *key, bool defaultValue) const {
+    const char *value = Get(key);
+    if (value == nullptr) {
+        return defaultValue;
+    }
+    if (strcmp(value, "1") == 0 || strcmp(value, "true") == 0 || strcmp(value, "yes") == 0) {
+        return true;
+    }
+    if (strcmp(value, "0") == 0 || strcmp(value, "false") == 0 || strcmp(value, "no") == 0) {
+        return false;
+    }
+    return defaultValue;
+}
+
+/*
+ * Default constructor, the version starts from 1, so a reader starting from 0 reads it at least
+ * once.
+ */
+TMQSettings::TMQSettings() : version(1) {
+    snapshot = new TMQSettingsSnapshot(kvs, version);
+}
+
+/*
+ * Put a key-value pair, the value of an exist key is replaced.
  */
 void TMQSettings::Put(const char *key, const char *value) {
     String mqKey(key);
     String mqVal(value);
     mutex.Lock();
-    kvs.Insert(Pair<String, String>(mqKey, mqVal));
+    RbIterator<String, String> iterator = kvs.Find(mqKey);
+    if (iterator != kvs.end()) {
+        iterator->value = mqVal;
+    } else {
+        kvs.Insert(Pair<String, String>(mqKey, mqVal));
+    }
+    Publish();
     mutex.UnLock();
 }
 
@@ -44,7 +179,74 @@ String TMQSettings::Get(const char *key) {
 void TMQSettings::Remove(const char *key) {
     mutex.Lock();
     // Find and Erase.
-    kvs.Erase(kvs.Find(key));
+    RbIterator<String, String> iterator = kvs.Find(key);
+    if (iterator != kvs.end()) {
+        kvs.Erase(iterator);
+        Publish();
+    }
+    mutex.UnLock();
+}
+
+/*
+ * Replace the snapshot, the old one is released when its readers release it.
+ */
+void TMQSettings::Publish() {
+    TMQSettingsSnapshot *origin = snapshot;
+    snapshot = new TMQSettingsSnapshot(kvs, version + 1);
+    origin->Release();
+    store_release(&version, version + 1);
+    for (int i = 0; i < observers.Size(); ++i) {
+        observers.Get(i)->OnSettingsChanged(snapshot);
+    }
+}
+
+/*
+ * Get the version without lock.
+ */
+TMQSize TMQSettings::GetVersion() {
+    return load_acquire(&version);
+}
+
+/*
+ * Retain the snapshot with the mutex, so that it can not be replaced and released before retained.
+ */
+TMQSettingsSnapshot *TMQSettings::Acquire() {
+    mutex.Lock();
+    TMQSettingsSnapshot *local = snapshot;
+    local->Retain();
+    mutex.UnLock();
+    return local;
+}
+
+/*
+ * Add an observer, an observer added twice is notified once.
+ */
+void TMQSettings::AddObserver(TMQSettingsObserver *observer) {
+    if (observer == nullptr) {
+        return;
+    }
+    mutex.Lock();
+    bool exist = false;
+    for (int i = 0; i < observers.Size() && !exist; ++i) {
+        exist = observers.Get(i) == observer;
+    }
+    if (!exist) {
+        observers.Add(observer);
+    }
+    mutex.UnLock();
+}
+
+/*
+ * Remove an observer.
+ */
+void TMQSettings::RemoveObserver(TMQSettingsObserver *observer) {
+    mutex.Lock();
+    for (int i = 0; i < observers.Size(); ++i) {
+        if (observers.Get(i) == observer) {
+            observers.Remove(i);
+            break;
+        }
+    }
     mutex.UnLock();
 }
 
@@ -83,8 +285,10 @@ bool TMQSettings::Parse(const char *data, int len) {
     if (keyLen <= 0 || valueLen <= 0) {
         return false;
     }
-    // put the key-value into settings.
-    TMQSettings::GetInstance()->Put(key, value);
+    // put the key-value into settings, the key and value are not terminated in the data.
+    String mqKey(key, keyLen);
+    String mqVal(value, valueLen);
+    TMQSettings::GetInstance()->Put(mqKey.c_str(), mqVal.c_str());
     return true;
 }
 
@@ -14,6 +14,8 @@
 #include "RbTree.h"
 #include "Chars.h"
 #include "TMQMutex.h"
+#include "TMQTopic.h"
+#include "List.h"
 
 TMQ_NAMESPACE
 
@@ -27,10 +29,139 @@ TMQ_NAMESPACE
 #define TOPIC_SETTINGS              "__SETTINGS__"
 // Define the max message(value) length of the setting.
 #define TOPIC_SETTINGS_LENGTH       128
+// The max length of a setting key for one topic, as "KEY:topic".
+#define TOPIC_SETTINGS_KEY_LENGTH   (TOPIC_SETTINGS_LENGTH + TMQ_TOPIC_MAX_LENGTH)
+
+/**
+ * An immutable snapshot of the settings, taken after each change of the settings. It is shared by
+ * readers with a reference count, so reading it needs no lock. The keys are sorted, the lookup is a
+ * binary search.
+ */
+    class TMQSettingsSnapshot {
+    private:
+        // The version of the settings when the snapshot is taken.
+        TMQSize version;
+        // The count of the key-value pairs.
+        int count;
+        // The sorted keys.
+        String *keys;
+        // The values, values[i] is the value of keys[i].
+        String *values;
+        // The reference count, the snapshot is released when it reaches zero.
+        volatile int refs;
+
+    private:
+        /**
+         * Find the position of a key.
+         * @param key, a pointer to the key.
+         * @return the position, -1 if not found.
+         */
+        int Find(const char *key) const;
+
+    public:
+        /**
+         * Construct a snapshot with the key-value pairs, one reference is held by the creator.
+         * @param kvs, the key-value pairs to copy.
+         * @param version, the version of the settings.
+         */
+        TMQSettingsSnapshot(const RbTree<String, String> &kvs, TMQSize version);
+
+        /**
+         * Destructor, release the keys and values.
+         */
+        ~TMQSettingsSnapshot();
+
+        /**
+         * Add a reference.
+         */
+        void Retain();
+
+        /**
+         * Remove a reference, the snapshot is deleted when it is the last one.
+         */
+        void Release();
+
+        /**
+         * Get method for the version.
+         * @return the version of the settings when the snapshot is taken.
+         */
+        TMQSize GetVersion() const;
+
+        /**
+         * Get the value of a key, the pointer is valid until the snapshot is released.
+         * @param key, a pointer to the key.
+         * @return a pointer to the value, nullptr if the key does not exist.
+         */
+        const char *Get(const char *key) const;
+
+        /**
+         * Get the value of a key as an integer.
+         * @param key, a pointer to the key.
+         * @param defaultValue, the value returned when the key does not exist or is not an integer.
+         * @return the integer value.
+         */
+        int GetInt(const char *key, int defaultValue) const;
+
+        /**
+         * Get an integer setting for a topic, the setting "key:topic" for the topic overrides the
+         * one for all topics.
+         * @param key, a pointer to the key.
+         * @param topic, the name of the topic, nullptr for the setting of all topics.
+         * @param defaultValue, the value returned when neither exists.
+         * @return the integer value.
+         */
+        int GetTopicInt(const char *key, const char *topic, int defaultValue) const;
+
+        /**
+         * Get the value of a key as a 64-bit integer, for the settings of bytes and milliseconds.
+         * @param key, a pointer to the key.
+         * @param defaultValue, the value returned when the key does not exist or is not an integer.
+         * @return the integer value.
+         */
+        long long GetLong(const char *key, long long defaultValue) const;
+
+        /**
+         * Get a 64-bit integer setting for a topic, overridden like GetTopicInt.
+         * @param key, a pointer to the key.
+         * @param topic, the name of the topic, nullptr for the setting of all topics.
+         * @param defaultValue, the value returned when neither exists.
+         * @return the integer value.
+         */
+        long long GetTopicLong(const char *key, const char *topic, long long defaultValue) const;
+
+        /**
+         * Get the value of a key as a boolean, "1", "true" and "yes" are true, "0", "false" and "no"
+         * are false.
+         * @param key, a pointer to the key.
+         * @param defaultValue, the value returned when the key does not exist or is not a boolean.
+         * @return the boolean value.
+         */
+        bool GetBool(const char *key, bool defaultValue) const;
+    };
+
+/**
+ * Observer of the settings, it is notified after each change of the settings.
+ */
+    class TMQSettingsObserver {
+    public:
+        /**
+         * Called after the settings are changed, on the thread changing the settings with the mutex
+         * of the settings held, so the settings should not be changed in it.
+         * @param snapshot, the snapshot after the change, valid during the call only, Retain it to
+         *  keep it longer.
+         */
+        virtual void OnSettingsChanged(TMQSettingsSnapshot *snapshot) = 0;
+
+        virtual ~TMQSettingsObserver() {}
+    };
 
 /**
  * TMQSettings has a simple RbTree member to save the key-value pair. It can be used as a map, or It
  * can parse settings from tmq messages using Parse method.
+ *
+ * Each change increases the version and publishes a new snapshot. The readers on the hot path
+ * compare the version only, which is a single atomic load, and take the snapshot with its typed
+ * accessors when the version is changed.
  */
     class TMQSettings {
     private:
@@ -38,8 +169,26 @@ TMQ_NAMESPACE
         TMQMutex mutex;
         // RbTree member with key and value are both String type.
         RbTree<String, String> kvs;
+        // The version of the settings, increased by each change.
+        volatile TMQSize version;
+        // The snapshot of the current version.
+        TMQSettingsSnapshot *snapshot;
+        // The observers notified after each change.
+        List<TMQSettingsObserver *> observers;
+
+    private:
+        /**
+         * Increase the version and publish a new snapshot, then notify the observers. The mutex
+         * should be held by the caller.
+         */
+        void Publish();
 
     public:
+        /**
+         * Default constructor, the settings start with an empty snapshot.
+         */
+        TMQSettings();
+
         /**
          * Put method to save key and value into the TMQSettings.
          * @param key, a const pointer to the key.
@@ -60,6 +209,30 @@ TMQ_NAMESPACE
          */
         void Remove(const char *key);
 
+        /**
+         * Get method for the version, a cheap way to know whether the settings are changed.
+         * @return the version of the settings.
+         */
+        TMQSize GetVersion();
+
+        /**
+         * Take the snapshot of the current version, it must be released by the caller.
+         * @return a pointer to the snapshot, never nullptr.
+         */
+        TMQSettingsSnapshot *Acquire();
+
+        /**
+         * Add an observer.
+         * @param observer, a pointer to the observer.
+         */
+        void AddObserver(TMQSettingsObserver *observer);
+
+        /**
+         * Remove an observer.
+         * @param observer, a pointer to the observer.
+         */
+        void RemoveObserver(TMQSettingsObserver *observer);
+
         /**
          * Parse tmq settings from tmq messages. The topic of the message must be TOPIC_SETTINGS, and
          * the length of the message data should not exceed TOPIC_SETTINGS_LENGTH. The data of a setting
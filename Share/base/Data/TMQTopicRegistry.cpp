@@ -0,0 +1,123 @@
+//
+//  TMQTopicRegistry.cpp
+//  TMQTopicRegistry
+//
+//  Created by  on 2022/5/28.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#include "TMQTopicRegistry.h"
+#include "Atomic.h"
+#include <cstring>
+
+USING_TMQ_NAMESPACE
+
+// A global static pointer to the instance.
+static TMQTopicRegistry *registry;
+
+/**
+ * Static method for TopicName compare, required by the ordered index.
+ * @param one, the first element to be compared.
+ * @param another, the second element to be compared.
+ * @return, a int value of the compare result.
+ */
+int TopicNameCompare(void *one, void *another) {
+    return strcmp(((TopicName *) one)->name, ((TopicName *) another)->name);
+}
+
+/*
+ * Default constructor.
+ */
+TMQTopicRegistry::TMQTopicRegistry() : count(0) {
+
+}
+
+/*
+ * Release the chunks of names.
+ */
+TMQTopicRegistry::~TMQTopicRegistry() {
+    for (int i = 0; i < TOPIC_CHUNK_COUNT && chunks[i]; ++i) {
+        delete[] chunks[i];
+    }
+}
+
+/*
+ * Find the id from the ordered index with read lock.
+ */
+TMQTopicId TMQTopicRegistry::Find(const char *topic) {
+    if (topic == nullptr) {
+        return ID_INT_INVALID;
+    }
+    TopicName key = {topic, ID_INT_INVALID};
+    int res = indexMutex.RLock();
+    int position = index.GetPosition(key, TopicNameCompare);
+    TMQTopicId id = position >= 0 ? index.Get(position).id : ID_INT_INVALID;
+    indexMutex.RUnlock(res);
+    return id;
+}
+
+/*
+ * Find the id, if not exist, register the topic with write lock. The name is put into the chunk
+ * before the count increased, so that GetName without lock can see the completed name.
+ */
+TMQTopicId TMQTopicRegistry::Intern(const char *topic) {
+    TMQTopicId id = Find(topic);
+    if (id != ID_INT_INVALID || topic == nullptr || strlen(topic) == 0
+        || strlen(topic) >= TMQ_TOPIC_MAX_LENGTH) {
+        return id;
+    }
+    TopicName key = {topic, ID_INT_INVALID};
+    indexMutex.WLock();
+    // Check again, it may be registered by others before the write lock.
+    int position = index.GetPosition(key, TopicNameCompare);
+    if (position >= 0) {
+        id = index.Get(position).id;
+    } else if (count < TOPIC_CHUNK_SIZE * TOPIC_CHUNK_COUNT) {
+        TMQSize chunk = count / TOPIC_CHUNK_SIZE;
+        if (chunks[chunk] == nullptr) {
+            chunks[chunk] = new char[TOPIC_CHUNK_SIZE * TMQ_TOPIC_MAX_LENGTH]{0};
+        }
+        char *name = chunks[chunk] + (count % TOPIC_CHUNK_SIZE) * TMQ_TOPIC_MAX_LENGTH;
+        strncpy(name, topic, TMQ_TOPIC_MAX_LENGTH - 1);
+        id = (TMQTopicId) count;
+        key.name = name;
+        key.id = id;
+        index.Add(key, TopicNameCompare);
+        store_release(&count, count + 1);
+    }
+    indexMutex.WUnlock();
+    return id;
+}
+
+/*
+ * Get the name from chunks directly.
+ */
+const char *TMQTopicRegistry::GetName(TMQTopicId id) {
+    if (id < 0 || (TMQSize) id >= Size()) {
+        return nullptr;
+    }
+    return chunks[id / TOPIC_CHUNK_SIZE] + (id % TOPIC_CHUNK_SIZE) * TMQ_TOPIC_MAX_LENGTH;
+}
+
+/*
+ * The count of the registered topics.
+ */
+TMQSize TMQTopicRegistry::Size() {
+    return load_acquire(&count);
+}
+
+/*
+ * A method for the TMQTopicRegistry singleton, implemented by CAS to handle concurrency issues.
+ */
+TMQTopicRegistry *TMQTopicRegistry::GetInstance() {
+    if (registry == nullptr) {
+        auto *instance = new TMQTopicRegistry();
+        TMQTopicRegistry *local = nullptr;
+        // CAS fail, instance has been created, and the real instance has been assigned to local.
+        if (!compare_and_set(&registry, &local, &instance)) {
+            delete instance;
+            return local;
+        }
+    }
+    return registry;
+}
@@ -0,0 +1,104 @@
+//
+//  TMQTopicRegistry.h
+//  TMQTopicRegistry
+//
+//  Created by  on 2022/5/28.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#ifndef TMQ_TOPIC_REGISTRY_H
+#define TMQ_TOPIC_REGISTRY_H
+
+#include "Defines.h"
+#include "TMQTopic.h"
+#include "Ordered.h"
+#include "RWMutex.h"
+
+/// Const definitions
+// The count of topic names in one chunk.
+#define TOPIC_CHUNK_SIZE            256
+// The max count of chunks, so the max count of topics is TOPIC_CHUNK_SIZE * TOPIC_CHUNK_COUNT.
+#define TOPIC_CHUNK_COUNT           256
+
+TMQ_NAMESPACE
+
+/**
+ * Key of the registered topic, used for the ordered index by name.
+ */
+    class TopicName {
+    public:
+        // The name of the topic, points to the name saved in the registry.
+        const char *name;
+        // The id of the topic.
+        TMQTopicId id;
+    };
+
+/**
+ * TMQTopicRegistry interns the topic names to compact integer ids. A topic is registered at its
+ * first publish, subscribe or pick, and then only its id is carried by the shadows, queues and the
+ * dispatcher, so that comparing two topics is an integer comparison instead of strcmp.
+ *
+ * The ids are dense, starting from zero in registration order, and never be reused. The names are
+ * saved into chunks that are never moved, so GetName needs no lock. Mapping a name to its id goes
+ * through an ordered index with a read-write mutex.
+ */
+    class TMQTopicRegistry {
+    private:
+        // Read-write mutex for the index.
+        RWMutex indexMutex;
+        // The ordered index by name.
+        Ordered<TopicName> index;
+        // The chunks of names, the name of id is at chunks[id / TOPIC_CHUNK_SIZE].
+        char *chunks[TOPIC_CHUNK_COUNT]{nullptr};
+        // The count of the registered topics.
+        volatile TMQSize count;
+
+    public:
+        /**
+         * Default constructor.
+         */
+        TMQTopicRegistry();
+
+        /**
+         * Destructor, release the chunks.
+         */
+        ~TMQTopicRegistry();
+
+        /**
+         * Find the id of a topic.
+         * @param topic, the name of the topic.
+         * @return the id of the topic, ID_INT_INVALID if the topic is not registered.
+         */
+        TMQTopicId Find(const char *topic);
+
+        /**
+         * Find the id of a topic, register it if not exist.
+         * @param topic, the name of the topic.
+         * @return the id of the topic, ID_INT_INVALID if the topic is invalid or the count of
+         *  topics reaches the limit.
+         */
+        TMQTopicId Intern(const char *topic);
+
+        /**
+         * Get the name of a topic id.
+         * @param id, the topic id.
+         * @return a pointer to the name, nullptr if the id is not registered.
+         */
+        const char *GetName(TMQTopicId id);
+
+        /**
+         * The count of the registered topics.
+         * @return the size.
+         */
+        TMQSize Size();
+
+        /**
+         * A singleton method for the TMQTopicRegistry.
+         * @return a pointer to the singleton of the TMQTopicRegistry.
+         */
+        static TMQTopicRegistry *GetInstance();
+    };
+
+TMQ_NAMESPACE_END
+
+#endif //TMQ_TOPIC_REGISTRY_H
@@ -9,22 +9,97 @@
 #include "Defines.h"
 #include "TMQTopic.h"
 #include "Topic.h"
+#include "Atomic.h"
 #include <cstring>
 
+/*
+ * Construct a buffer with the ownership of data, the creator holds the first reference.
+ */
+TMQBuffer::TMQBuffer(void *data, int length) : data(data), length(length), refCount(1) {
+
+}
+
+/*
+ * Destructor of the buffer, free the data allocated by tmq_malloc.
+ */
+TMQBuffer::~TMQBuffer() {
+    delete[] (char *) data;
+}
+
+/*
+ * Wrap the data into a buffer without copy.
+ */
+TMQBuffer *TMQBuffer::Wrap(void *data, int length) {
+    // Check the parameters.
+    if (length <= 0 || data == nullptr) {
+        return nullptr;
+    }
+    return new TMQBuffer(data, length);
+}
+
+/*
+ * Copy the data into a new buffer.
+ */
+TMQBuffer *TMQBuffer::Copy(const void *data, int length) {
+    // Check the parameters.
+    if (length <= 0 || data == nullptr) {
+        return nullptr;
+    }
+    char *copied = new char[length];
+    memcpy(copied, data, length);
+    return new TMQBuffer(copied, length);
+}
+
+/*
+ * Get the data pointer.
+ */
+void *TMQBuffer::Data() const {
+    return data;
+}
+
+/*
+ * Get the length of the data.
+ */
+int TMQBuffer::Length() const {
+    return length;
+}
+
+/*
+ * Add a reference.
+ */
+TMQBuffer *TMQBuffer::Retain() {
+    add_and_fetch_acq_rel(&refCount, 1);
+    return this;
+}
+
+/*
+ * Drop a reference, and delete this buffer with the last reference.
+ */
+void TMQBuffer::Release() {
+    if (sub_and_fetch_acq_rel(&refCount, 1) == 0) {
+        delete this;
+    }
+}
+
 /*
  * Default construct for tmq message, all members set to zero.
  */
-TMQMsg::TMQMsg() : length(0), data(nullptr), priority(0), flag(0), msgId(0) {
+TMQMsg::TMQMsg() : length(0), data(nullptr), priority(0), flag(0), msgId(0), buffer(nullptr) {
 
 }
 
 /*
- * Construct a tmq message with an existed message.
+ * Construct a tmq message with an existed message. The buffer will be shared if it exists.
  */
-TMQMsg::TMQMsg(const TMQMsg &tmqMsg) : length(0), data(nullptr), priority(0), flag(0), msgId(0) {
+TMQMsg::TMQMsg(const TMQMsg &tmqMsg) : length(0), data(nullptr), priority(0), flag(0), msgId(0),
+                                       buffer(nullptr) {
     length = tmqMsg.length;
-    // Apply memory space and copy the data.
-    if (length > 0) {
+    if (tmqMsg.buffer) {
+        // Share the buffer, no need to copy.
+        buffer = tmqMsg.buffer->Retain();
+        data = tmqMsg.data;
+    } else if (length > 0) {
+        // Apply memory space and copy the data.
         data = new char[length];
         memcpy(data, tmqMsg.data, length);
     }
@@ -37,7 +112,7 @@ TMQMsg::TMQMsg(const TMQMsg &tmqMsg) : length(0), data(nullptr), priority(0), fl
  * Construct a tmq message with the binary data and its length.
  */
 TMQMsg::TMQMsg(const void *data, int length) : length(0), data(nullptr), priority(0), flag(0),
-                                                msgId(0) {
+                                                msgId(0), buffer(nullptr) {
     // Check the parameters.
     if (length <= 0 || data == nullptr) {
         return;
@@ -48,7 +123,21 @@ TMQMsg::TMQMsg(const void *data, int length) : length(0), data(nullptr), priorit
 }
 
 /*
- * Override operator =
+ * Construct a tmq message sharing the buffer.
+ */
+TMQMsg::TMQMsg(TMQBuffer *buffer) : length(0), data(nullptr), priority(0), flag(0), msgId(0),
+                                    buffer(nullptr) {
+    // Check the parameters.
+    if (buffer == nullptr) {
+        return;
+    }
+    this->buffer = buffer->Retain();
+    this->data = buffer->Data();
+    this->length = buffer->Length();
+}
+
+/*
+ * Override operator =, release the current data first, then share or copy the data from msg.
  */
 TMQMsg &TMQMsg::operator=(const TMQMsg &msg) {
     if (this == &msg) {
@@ -57,8 +146,21 @@ TMQMsg &TMQMsg::operator=(const TMQMsg &msg) {
     this->priority = msg.priority;
     this->flag = msg.flag;
     this->msgId = msg.msgId;
-    // Apply memory space and copy data from msg.
-    if (msg.length > 0 || msg.data != nullptr) {
+    TMQBuffer *sharedBuffer = msg.buffer ? msg.buffer->Retain() : nullptr;
+    if (buffer) {
+        buffer->Release();
+    } else {
+        delete[] (char *) data;
+    }
+    buffer = sharedBuffer;
+    data = nullptr;
+    length = 0;
+    if (buffer) {
+        // Share the buffer of msg.
+        this->data = msg.data;
+        this->length = msg.length;
+    } else if (msg.length > 0 && msg.data != nullptr) {
+        // Apply memory space and copy data from msg.
         this->data = new char[msg.length];
         this->length = msg.length;
         memcpy(this->data, msg.data, msg.length);
@@ -73,6 +175,9 @@ TMQMsg::~TMQMsg() {
     flag = 0;
     length = 0;
     msgId = -1;
-    delete[] (char *) data;
+    if (buffer) {
+        buffer->Release();
+    } else {
+        delete[] (char *) data;
+    }
 }
-
@@ -7,6 +7,7 @@
 //
 
 #include "TMQUtils.h"
+#include <ctime>
 
 USING_TMQ_NAMESPACE
 
@@ -59,11 +60,56 @@ bool TMQUtils::ToInt(const char *str, int len, int *res) {
     // For 0-9, convert them into integer.
     int result = 0;
     for (int i = start; i < len; ++i) {
-        if (str[i] - '0' < 0 || str[i] - '9' >= 0) {
+        if (str[i] < '0' || str[i] > '9') {
             return false;
         }
         result = result * 10 + (str[i] - '0');
     }
     *res = sign * result;
     return true;
-}
\ No newline at end of file
+}
+
+/*
+ * Convert string to long long.
+ */
+bool TMQUtils::ToLong(const char *str, int len, long long *res) {
+    if (str == nullptr || len <= 0) {
+        return false;
+    }
+    long long sign = 1;
+    int start = 0;
+    if (str[0] == '-') {
+        sign = -1;
+        start = 1;
+    }
+    long long result = 0;
+    for (int i = start; i < len; ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return false;
+        }
+        result = result * 10 + (str[i] - '0');
+    }
+    *res = sign * result;
+    return true;
+}
+// Read the monotonic clock if it is supported, otherwise the calendar time.
+long long TMQUtils::NowMillis() {
+    struct timespec ts = {0, 0};
+#if defined(CLOCK_MONOTONIC)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// The same clock as NowMillis, in microseconds.
+long long TMQUtils::NowMicros() {
+    struct timespec ts = {0, 0};
+#if defined(CLOCK_MONOTONIC)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
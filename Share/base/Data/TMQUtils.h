@@ -38,6 +38,28 @@ TMQ_NAMESPACE
          * is failed, the result value pointed by res is undefined.
          */
         static bool ToInt(const char *str, int len, int *res);
+
+        /**
+         * Convert string to a 64-bit integer, the same as ToInt.
+         * @param str, a pointer to the string.
+         * @param len, the length of the string.
+         * @param res, a pointer to the result.
+         * @return, a boolean value indicate whether the conversion is success or not. If the conversion
+         * is failed, the result value pointed by res is undefined.
+         */
+        static bool ToLong(const char *str, int len, long long *res);
+
+        /**
+         * Get the time of a monotonic clock in milliseconds, for measuring intervals only.
+         * @return the milliseconds since an unspecified point.
+         */
+        static long long NowMillis();
+
+        /**
+         * Get the time of a monotonic clock in microseconds, for measuring short intervals only.
+         * @return the microseconds since an unspecified point.
+         */
+        static long long NowMicros();
     };
 
 TMQ_NAMESPACE_END
@@ -34,6 +34,8 @@ typedef unsigned long TMQLongSize;
 typedef unsigned long long TMQMsgId;
 // Common id for long integer.
 typedef long TMQId;
+// Compact id for an interned topic, refer TMQTopicRegistry.
+typedef int TMQTopicId;
 // This is the invalid value define.
 #define ID_INT_INVALID              -1
 #define ID_LONG_INVALID             -1
@@ -60,5 +62,16 @@ typedef long TMQId;
 // GET_MSG_TYPE, get the message type from the flag. The low 16 bits represent the type of a message.
 #define GET_MSG_TYPE(flag)      (flag & 0x0000ffff)
 #define FORCE_TYPE_ALL(flag)    (flag | 0x0000ffff)
+// GET_DURABILITY, get the durability level set by TMQ_MSG_DURABILITY, -1 if it is not set.
+#define GET_DURABILITY(flag)    (((flag >> 28) & 0x3) - 1)
+// PERSIST_PRIORITY, keep the priority in the flag of a persisted shadow, bits 20-23, refer
+// GET_PERSIST_PRIORITY, -1 if it is not kept.
+#define PERSIST_PRIORITY(flag, priority) ((flag & ~0x00f00000) | ((((priority) + 1) & 0xf) << 20))
+#define GET_PERSIST_PRIORITY(flag)       (((flag >> 20) & 0xf) - 1)
+// PERSIST_CONSUMED, mark a persisted shadow consumed, it is recovered into the history.
+#define PERSIST_CONSUMED(flag)  (flag | 0x01000000)
+#define IS_CONSUMED(flag)       (flag & 0x01000000)
+// CLEAR_PERSIST_BITS, clear the bits kept by the storage from the flag of a persisted shadow.
+#define CLEAR_PERSIST_BITS(flag) (flag & ~0x01f00000)
 
 #endif //APP_DEFINES_H
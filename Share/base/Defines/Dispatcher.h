@@ -25,8 +25,9 @@ public:
      * @param activeSelf, a boolean value indicate whether active the caller itself as a thread
      *  executor to dispatch messages. True if you want to dispatch the message immediately, False
      *  indicate that the call of the Wakeup will send a signal to the dispatcher.
+     * @param count, the count of the arrived messages, a batch of messages needs one wakeup only.
      */
-    virtual void Wakeup(bool activeSelf = false) = 0;
+    virtual void Wakeup(bool activeSelf = false, int count = 1) = 0;
 
     /**
      * Add a receiver to subscribe a topic.
@@ -36,6 +37,17 @@ public:
      */
     virtual TMQId AddReceiver(const char *topic, TMQReceiver *receiver) = 0;
 
+    /**
+     * Add a receiver to subscribe a topic, the messages are delivered to it in batches.
+     * @param topic, a const pointer to the topic.
+     * @param receiver, a pointer to the TMQReceiver.
+     * @param maxBatch, the max count of the messages in a batch, 1 or less for no batching.
+     * @param lingerMs, the max time in milliseconds for a message waiting for its batch.
+     * @return the id represent the topic receiver.
+     */
+    virtual TMQId AddReceiver(const char *topic, TMQReceiver *receiver, int maxBatch,
+                              int lingerMs) = 0;
+
     /**
      * Remove a topic receiver from the subscription.
      * @param receiverId, the receiverId returned by AddReceiver
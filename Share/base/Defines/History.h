@@ -14,8 +14,8 @@
 
 /**
  * An interface definition for history messages. The history is used to store the messages that have
- * been consumed by pickers or dispatched by the dispatcher. There is only one function in IHistory,
- * that is defined to get the history messages with the specified topics.
+ * been consumed by pickers or dispatched by the dispatcher. The history messages with the specified
+ * topics can be got all at once, or page by page with a cursor.
  */
 class IHistory {
 public:
@@ -28,6 +28,17 @@ public:
      */
     virtual TMQSize GetHistory(const char **topics, int len, TMQMsg **msg) = 0;
 
+    /**
+     * Create a cursor for the history messages with the specified topics.
+     * @param topics, a pointer to the topics pointer, nullptr for all topics.
+     * @param len, the length of the topics.
+     * @param direction, the direction of the cursor, refer TMQ_HISTORY_XXX.
+     * @param limit, the max count of the messages read by the cursor, 0 for no limit.
+     * @return a pointer to the cursor, which should be deleted by the caller.
+     */
+    virtual IHistoryCursor *CreateCursor(const char **topics, int len, int direction,
+                                         int limit) = 0;
+
     /**
      * Virtual destructor for this interface.
      */
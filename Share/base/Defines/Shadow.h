@@ -20,6 +20,14 @@
 #define STORAGE_TYPE_MEMORY 0
 // Persistent storage type, indicates that the content is stored in persistent space.
 #define STORAGE_TYPE_PERSIST 1
+// Staged storage type, indicates that the content is going to be committed to persistent space.
+#define STORAGE_TYPE_STAGED 2
+// Recovered storage type, indicates that the content is recovered from the backup space, the meta
+// address is the address in the backup space.
+#define STORAGE_TYPE_RECOVERED 3
+// Log storage type, indicates that the content is appended to a segment of the log storage, the
+// meta address is the number of the segment, and the data address is the offset in it.
+#define STORAGE_TYPE_LOG 4
 
 /**
  * Base class for the shadow, that uses to describe the storage types and its address. There are two
@@ -49,14 +57,14 @@ public:
 /**
  * A shadow class for a tmq message. It is based on Store to describe the basic information of a tmq
  * message except its raw data. It is like a shadow, using between TMQTopic, Dispatcher, History and
- * other tmq modules.
+ * other tmq modules. The topic is carried by its interned id, refer TMQTopicRegistry.
  */
 class Shadow : public Store {
 public:
     // The long id for this shadow(message).
     TMQMsgId msgId;
-    // The topic of this shadow(message).
-    char topic[TMQ_TOPIC_MAX_LENGTH]{0};
+    // The topic id of this shadow(message).
+    TMQTopicId topicId;
     // The length of this message.
     TMQSize length;
     // The flag of this shadow(message).
@@ -66,49 +74,95 @@ public:
     /**
      * Default constructor.
      */
-    Shadow() : Store(), length(0), flag(0), msgId(0) {
+    Shadow() : Store(), msgId(0), topicId(ID_INT_INVALID), length(0), flag(0) {
 
     }
 
     /**
-     * Default constructor with a topic.
-     * @param topic
+     * Default constructor with a topic id.
+     * @param topicId, the id of the topic.
      */
-    explicit Shadow(const char *topic) : Store(), length(0), flag(0), msgId(0) {
-        if (topic) {
-            // Copy topic
-            strncpy(this->topic, topic, sizeof(this->topic));
-        }
+    explicit Shadow(TMQTopicId topicId) : Store(), msgId(0), topicId(topicId), length(0), flag(0) {
+
     }
 
     /**
-     * Construct a Shadow with topic and the tmq message.
-     * @param topic, a pointer to the topic.
+     * Construct a Shadow with topic id and the tmq message.
+     * @param topicId, the id of the topic.
      * @param tmqMsg, a refer of the tmq message.
      */
-    Shadow(const char *topic, const TMQMsg &tmqMsg) : Store(), msgId(0) {
-        if (topic) {
-            strncpy(this->topic, topic, sizeof(this->topic));
-        }
+    Shadow(TMQTopicId topicId, const TMQMsg &tmqMsg) : Store(), msgId(0), topicId(topicId) {
         length = tmqMsg.length;
         flag = tmqMsg.flag;
     }
+};
+
+/**
+ * The shadow record saved into the persistence. The topic ids are valid in the current process
+ * only, so the record keeps the topic name, and its layout is the same as the shadow of the early
+ * versions, the messages persisted by them can be recovered as well.
+ */
+class PersistShadow : public Store {
+public:
+    // The long id for this shadow(message).
+    TMQMsgId msgId;
+    // The topic of this shadow(message).
+    char topic[TMQ_TOPIC_MAX_LENGTH]{0};
+    // The length of this message.
+    TMQSize length;
+    // The flag of this shadow(message).
+    int flag;
+
+public:
+    /**
+     * Default constructor.
+     */
+    PersistShadow() : Store(), msgId(0), length(0), flag(0) {
+
+    }
 
     /**
-     * Override the operator '='
-     * @param shadow the source shadow.
-     * @return a ref to *this.
+     * Construct a record with the shadow and the name of its topic.
+     * @param shadow, the shadow of the message.
+     * @param topic, the name of the topic.
      */
-    Shadow &operator=(const Shadow &shadow) {
-        this->flag = shadow.flag;
-        this->msgId = shadow.msgId;
-        this->length = shadow.length;
-        this->type = shadow.type;
-        this->metaAddress = shadow.metaAddress;
-        this->dataAddress = shadow.dataAddress;
-        strncpy(this->topic, shadow.topic, sizeof(this->topic));
-        return *this;
+    PersistShadow(const Shadow &shadow, const char *topic) : Store(shadow), msgId(shadow.msgId),
+                                                             length(shadow.length),
+                                                             flag(shadow.flag) {
+        if (topic) {
+            strncpy(this->topic, topic, sizeof(this->topic) - 1);
+        }
     }
+
+    /**
+     * Restore the shadow with the topic id.
+     * @param topicId, the id of the topic.
+     * @return the shadow of the message.
+     */
+    Shadow ToShadow(TMQTopicId topicId) const {
+        Shadow shadow(topicId);
+        shadow.metaAddress = metaAddress;
+        shadow.dataAddress = dataAddress;
+        shadow.type = type;
+        shadow.msgId = msgId;
+        shadow.length = length;
+        shadow.flag = flag;
+        return shadow;
+    }
+};
+
+/**
+ * A message recovered by a storage on enabling the persistence, from the messages persisted by the
+ * last run.
+ */
+class RecoveredShadow {
+public:
+    // The shadow of the message, the bits kept by the storage are cleared from its flag.
+    Shadow shadow;
+    // The priority of the message, -1 if it is not kept.
+    int priority;
+    // Whether the message is consumed, it belongs to the history then.
+    bool consumed;
 };
 
 #endif //SHADOW_H
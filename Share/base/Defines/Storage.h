@@ -25,11 +25,31 @@ class IStorage {
 public:
     /**
      * Write a tmq message and return the shadow of this message.
-     * @param topic, a const pointer to the topic
+     * @param topicId, the id of the topic.
      * @param msg, the tmq message to save.
      * @return, Shadow, the shadow of this message
      */
-    virtual Shadow Write(const char *topic, const TMQMsg &msg) = 0;
+    virtual Shadow Write(TMQTopicId topicId, const TMQMsg &msg) = 0;
+    /**
+     * Write a tmq message with an id generated by caller, and return the shadow of this message.
+     * @param topicId, the id of the topic.
+     * @param msg, the tmq message to save.
+     * @param msgId, the id for this message.
+     * @return, Shadow, the shadow of this message
+     */
+    virtual Shadow Write(TMQTopicId topicId, const TMQMsg &msg, TMQMsgId msgId) = 0;
+
+    /**
+     * Write a tmq message with an id generated by caller, and notify the listener when it is
+     * durable, the shadow is returned before that.
+     * @param topicId, the id of the topic.
+     * @param msg, the tmq message to save.
+     * @param msgId, the id for this message.
+     * @param listener, the listener for the durability, nullptr for none.
+     * @return, Shadow, the shadow of this message
+     */
+    virtual Shadow Write(TMQTopicId topicId, const TMQMsg &msg, TMQMsgId msgId,
+                         TMQDurableListener *listener) = 0;
 
     /**
      * Read a tmq message by a shadow.
@@ -46,6 +66,21 @@ public:
      */
     virtual bool Remove(const Shadow &store) = 0;
 
+    /**
+     * Remove a batch of tmq messages by their shadows.
+     * @param stores, the shadows to find tmq messages.
+     * @param count, the count of the shadows.
+     * @return bool, a boolean value indicate whether remove the messages success or not.
+     */
+    virtual bool Remove(const Shadow *stores, int count) = 0;
+
+    /**
+     * Mark a tmq message consumed, it is kept for the history, and recovered into the history
+     * rather than delivered again on the next startup.
+     * @param store, the shadow of the consumed message.
+     */
+    virtual void MarkConsumed(const Shadow &store) = 0;
+
     /**
      * pick the remained shadows that not picked or dispatched timely during the past running.
      * @param topics, a const pointer to the topic pointer.
@@ -57,6 +92,28 @@ public:
     virtual void FindShadows(const char **topics, int len, List<Shadow> &shadowList,
                              int limit = -1) = 0;
 
+    /**
+     * Enable or disable the persistence. The messages persisted by the last run are recovered on
+     * enabling, refer TakeRecovered.
+     * @param enable, whether to enable the persistence.
+     * @param file, the path of the persistence, a file or a directory by the storage.
+     * @return whether the persistence is enabled after the call.
+     */
+    virtual bool EnablePersist(bool enable, const char *file) = 0;
+
+    /**
+     * Get the statistics of the synchronizations of the persistence.
+     * @param stats, a reference to receive the statistics.
+     * @return false if the persistence is not enabled.
+     */
+    virtual bool GetSyncStats(TMQSyncStats &stats) = 0;
+
+    /**
+     * Take the messages recovered on enabling the persistence, they are taken once.
+     * @param shadows, the list to receive the messages, in the order of the message ids.
+     */
+    virtual void TakeRecovered(List<RecoveredShadow> &shadows) = 0;
+
     /**
      * Virtual destructor for this interface.
      */
@@ -33,4 +33,54 @@
 #define sub_and_fetch(ptr, val) \
         __atomic_sub_fetch(ptr, val, __ATOMIC_RELAXED)
 
+/**
+ * Atomic operations with acquire and release order, used for reference counting.
+ */
+#define add_and_fetch_acq_rel(ptr, val) \
+        __atomic_add_fetch(ptr, val, __ATOMIC_ACQ_REL)
+
+#define sub_and_fetch_acq_rel(ptr, val) \
+        __atomic_sub_fetch(ptr, val, __ATOMIC_ACQ_REL)
+
+/**
+ * Atomic load with acquire order and atomic store with release order, used to publish an object
+ * to other threads.
+ */
+#define load_acquire(ptr) \
+        __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+
+#define store_release(ptr, val) \
+        __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+/**
+ * Atomic operations with sequentially consistent order, used when a store must be visible before
+ * a later load of another address, such as entering an epoch.
+ */
+#define add_and_fetch_seq_cst(ptr, val) \
+        __atomic_add_fetch(ptr, val, __ATOMIC_SEQ_CST)
+
+#define sub_and_fetch_seq_cst(ptr, val) \
+        __atomic_sub_fetch(ptr, val, __ATOMIC_SEQ_CST)
+
+#define load_seq_cst(ptr) \
+        __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+
+#define store_seq_cst(ptr, val) \
+        __atomic_store_n(ptr, val, __ATOMIC_SEQ_CST)
+
+#define compare_and_set_seq_cst(ptr, local, expect)   \
+        __atomic_compare_exchange(ptr, local, expect, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+
+/**
+ * Atomic bitwise operations with sequentially consistent order, return the old value.
+ */
+#define fetch_or_seq_cst(ptr, val) \
+        __atomic_fetch_or(ptr, val, __ATOMIC_SEQ_CST)
+
+#define fetch_and_seq_cst(ptr, val) \
+        __atomic_fetch_and(ptr, val, __ATOMIC_SEQ_CST)
+
+#define fence_seq_cst() \
+        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
 #endif //ATOMIC_H
@@ -0,0 +1,161 @@
+//
+//  Epoch.cpp
+//  Epoch
+//
+//  Created by  on 2022/3/28.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#include "Epoch.h"
+#include "Atomic.h"
+#include <sched.h>
+
+// The slot of the current thread, assigned on its first entering.
+static thread_local int threadSlot = -1;
+// Counter for assigning the slots to threads.
+static volatile TMQSize slotCounter = 0;
+// A global static pointer to the shared instance.
+static Epoch *shared;
+
+/*
+ * Default constructor, the epoch starts from EPOCH_PHASE_COUNT, so that the previous phase is
+ * always valid.
+ */
+Epoch::Epoch() : global(EPOCH_PHASE_COUNT) {
+
+}
+
+/*
+ * Release all retired objects.
+ */
+Epoch::~Epoch() {
+    for (int i = 0; i < retired.Size(); ++i) {
+        retired.Get(i).release(retired.Get(i).ptr);
+    }
+}
+
+/*
+ * Enter the epoch. The counter is added on the phase of the global epoch, then the global epoch is
+ * checked again. If it has been changed, a writer may have missed this reader, so retry on the new
+ * phase.
+ */
+int Epoch::Enter() {
+    if (threadSlot < 0) {
+        threadSlot = (int) ((add_and_fetch(&slotCounter, 1) - 1) % EPOCH_SLOT_COUNT);
+    }
+    EpochSlot &slot = slots[threadSlot];
+    while (true) {
+        TMQSize epoch = load_seq_cst(&global);
+        int phase = (int) (epoch % EPOCH_PHASE_COUNT);
+        add_and_fetch_seq_cst(&(slot.readers[phase]), 1);
+        if (load_seq_cst(&global) == epoch) {
+            return phase * EPOCH_SLOT_COUNT + threadSlot;
+        }
+        sub_and_fetch_acq_rel(&(slot.readers[phase]), 1);
+    }
+}
+
+/*
+ * Exit the epoch, the phase and the slot are decoded from the token.
+ */
+void Epoch::Exit(int token) {
+    sub_and_fetch_acq_rel(&(slots[token % EPOCH_SLOT_COUNT].readers[token / EPOCH_SLOT_COUNT]), 1);
+}
+
+/*
+ * Check the counters of the phase in all slots.
+ */
+bool Epoch::IsQuiescent(TMQSize phase) {
+    for (int i = 0; i < EPOCH_SLOT_COUNT; ++i) {
+        if (load_seq_cst(&(slots[i].readers[phase])) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Advance the global epoch if the readers of the previous phase are gone.
+ */
+bool Epoch::TryAdvance() {
+    TMQSize epoch = global;
+    if (!IsQuiescent((epoch - 1) % EPOCH_PHASE_COUNT)) {
+        return false;
+    }
+    store_seq_cst(&global, epoch + 1);
+    return true;
+}
+
+/*
+ * Release the objects retired two epochs ago at least.
+ */
+void Epoch::ReleaseRetired() {
+    int i = 0;
+    while (i < retired.Size()) {
+        if (retired.Get(i).epoch + 2 <= global) {
+            retired.Get(i).release(retired.Get(i).ptr);
+            retired.Remove(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+/*
+ * Put the object into the retired list with the current epoch.
+ */
+void Epoch::Retire(void *ptr, void (*release)(void *)) {
+    if (ptr == nullptr || release == nullptr) {
+        return;
+    }
+    mutex.Lock();
+    EpochRetired item = {ptr, release, global};
+    retired.Add(item);
+    mutex.UnLock();
+}
+
+/*
+ * Advance as far as possible without waiting, then release the unreachable objects.
+ */
+void Epoch::Reclaim() {
+    mutex.Lock();
+    if (!retired.Empty() && TryAdvance()) {
+        TryAdvance();
+    }
+    ReleaseRetired();
+    mutex.UnLock();
+}
+
+/*
+ * Advance the global epoch twice from now, yielding to the readers between the tries, then the
+ * objects retired before are all released.
+ */
+void Epoch::Synchronize() {
+    mutex.Lock();
+    TMQSize target = global + 2;
+    while (global < target) {
+        if (!TryAdvance()) {
+            mutex.UnLock();
+            sched_yield();
+            mutex.Lock();
+        }
+    }
+    ReleaseRetired();
+    mutex.UnLock();
+}
+
+/*
+ * A method for the shared Epoch singleton, implemented by CAS to handle concurrency issues.
+ */
+Epoch *Epoch::GetInstance() {
+    if (shared == nullptr) {
+        auto *instance = new Epoch();
+        Epoch *local = nullptr;
+        // CAS fail, instance has been created, and the real instance has been assigned to local.
+        if (!compare_and_set(&shared, &local, &instance)) {
+            delete instance;
+            return local;
+        }
+    }
+    return shared;
+}
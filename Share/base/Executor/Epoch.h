@@ -0,0 +1,138 @@
+//
+//  Epoch.h
+//  Epoch
+//
+//  Created by  on 2022/3/28.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include "Defines.h"
+#include "List.h"
+#include "TMQMutex.h"
+
+/// Const definitions
+// The count of the reader slots, threads are spread over the slots.
+#define EPOCH_SLOT_COUNT        16
+// The count of the epochs that readers may stay in at the same time.
+#define EPOCH_PHASE_COUNT       3
+// The size of a cache line, each slot takes one line at least to avoid false sharing.
+#define EPOCH_CACHE_LINE        64
+
+/**
+ * The reader counters of one slot, one counter for each phase of the epoch.
+ */
+class EpochSlot {
+public:
+    // The count of readers in each phase.
+    volatile int readers[EPOCH_PHASE_COUNT]{0};
+    // Padding to the cache line.
+    char padding[EPOCH_CACHE_LINE - EPOCH_PHASE_COUNT * sizeof(int)]{0};
+};
+
+/**
+ * An object retired by writers, it will be released after the readers that may hold it are gone.
+ */
+class EpochRetired {
+public:
+    // A pointer to the retired object.
+    void *ptr;
+    // The function to release the object.
+    void (*release)(void *);
+    // The epoch when the object is retired.
+    TMQSize epoch;
+};
+
+/**
+ * Epoch based reclamation for read-mostly data. Readers wrap their access with Enter and Exit,
+ * which touch a counter of their own slot only, no lock and no allocation. Writers publish a new
+ * version of the data, then retire the old one with Retire, it is released by a later Reclaim once
+ * all readers entered before are gone.
+ *
+ * A reader is counted in the phase of the global epoch when it enters. The global epoch can be
+ * advanced only if there is no reader in the previous phase, so an object retired at epoch e is
+ * unreachable for all readers once the global epoch reaches e + 2.
+ */
+class Epoch {
+private:
+    // The global epoch.
+    volatile TMQSize global;
+    // The reader slots.
+    EpochSlot slots[EPOCH_SLOT_COUNT];
+    // Mutex for advancing the epoch and the retired list.
+    TMQMutex mutex;
+    // The retired objects waiting for releasing.
+    List<EpochRetired> retired;
+
+private:
+    /**
+     * Check whether there is any reader in the phase.
+     * @param phase, the phase of the epoch.
+     * @return true if no reader is in the phase.
+     */
+    bool IsQuiescent(TMQSize phase);
+
+    /**
+     * Advance the global epoch if there is no reader in the previous phase, the mutex should be
+     * held by the caller.
+     * @return true if the epoch is advanced.
+     */
+    bool TryAdvance();
+
+    /**
+     * Release the retired objects that are unreachable, the mutex should be held by the caller.
+     */
+    void ReleaseRetired();
+
+public:
+    /**
+     * Default constructor.
+     */
+    Epoch();
+
+    /**
+     * Destructor, release all retired objects, there should be no reader any more.
+     */
+    ~Epoch();
+
+    /**
+     * Enter the epoch as a reader, the data published by writers can be read safely until Exit.
+     * @return a token for Exit.
+     */
+    int Enter();
+
+    /**
+     * Exit the epoch.
+     * @param token, the token returned by Enter.
+     */
+    void Exit(int token);
+
+    /**
+     * Retire an object, it will be released by Reclaim later.
+     * @param ptr, a pointer to the object, unreachable for the readers entering from now on.
+     * @param release, the function to release the object.
+     */
+    void Retire(void *ptr, void (*release)(void *));
+
+    /**
+     * Try to advance the epoch, and release the retired objects that are unreachable. It never
+     * waits for readers.
+     */
+    void Reclaim();
+
+    /**
+     * Wait until the objects retired before are released. It should not be called inside the
+     * epoch, or it waits for itself.
+     */
+    void Synchronize();
+
+    /**
+     * A singleton method for the Epoch shared by the structures without their own one.
+     * @return a pointer to the shared Epoch, it is never released.
+     */
+    static Epoch *GetInstance();
+};
+
+#endif //EPOCH_H
@@ -44,6 +44,20 @@ public:
      * @return bool, a boolean value indicate whether to call this method again.
      */
     virtual bool OnExecute(long eid) = 0;
+
+    /**
+     * The delay before calling OnExecute again, used when OnExecute returns true. A wakeup during
+     * the delay calls it at once.
+     * @return long, the delay in milliseconds, 0 to call it again immediately.
+     */
+    virtual long GetRecallDelay() {
+        return 0;
+    }
+
+    /**
+     * Default destructor for this virtual class, the callables may be deleted by this interface.
+     */
+    virtual ~TMQCallable() = default;
 };
 
 /**
@@ -55,6 +55,15 @@ void IDGenerator::SetMsgId(TMQMsgId id) {
     while (!compare_and_set(&mid, &local, &id));
 }
 
+/**
+ * Raise the message id, the id is not changed if it is larger already.
+ * @param id, the max id used.
+ */
+void IDGenerator::RaiseMsgId(TMQMsgId id) {
+    TMQMsgId local = mid;
+    while (local < id && !compare_and_set(&mid, &local, &id));
+}
+
 /**
  * Get a id for topic. if the id increases to the ID_INT_MAX, it will start all over again.
  * @return id for a topic.
@@ -68,6 +77,31 @@ TMQId IDGenerator::GetTopicId() {
     return value;
 }
 
+/**
+ * Get a contiguous range of ids for messages. The range never crosses ID_INT_MAX, if it does, the
+ * range will start all over again from ID_INT_MIN.
+ * @param count, the count of the ids.
+ * @return the first id of the range.
+ */
+TMQMsgId IDGenerator::GetMsgIds(int count) {
+    if (count <= 1) {
+        return GetMsgId();
+    }
+    TMQMsgId local = mid;
+    TMQMsgId first;
+    TMQMsgId last;
+    // CAS operation until the whole range is reserved.
+    do {
+        first = local + ID_INC;
+        last = local + count;
+        if (last >= ID_INT_MAX) {
+            first = ID_INT_MIN;
+            last = first + count - 1;
+        }
+    } while (!compare_and_set_strong(&mid, &local, &last));
+    return first;
+}
+
 /**
  * Get a id for message. if the id increases to the ID_INT_MAX, it will start all over again.
  * @return id for a topic.
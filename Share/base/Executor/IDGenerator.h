@@ -47,12 +47,26 @@ public:
  */
  TMQMsgId GetMsgId();
 
+ /**
+ * 获取一段连续的tmq消息ID，这将使mid增加count。
+ * 如果这段ID将超过ID_INT_MAX，则从ID_INT_MIN重新开始。
+ * @param count，需要的ID数量，必须大于0。
+ * @return 这段ID中的第一个ID，其余的ID依次递增。
+ */
+ TMQMsgId GetMsgIds(int count);
+
  /**
  * 设置消息ID。
  * @param id，要设置的ID。
  */
  void SetMsgId(TMQMsgId id);
 
+ /**
+ * 将消息ID提高到指定ID，之后获取的ID都大于它，已经更大时不变。
+ * @param id，已使用的最大ID。
+ */
+ void RaiseMsgId(TMQMsgId id);
+
  /**
  * IDGenerator实例的静态单例方法。
  * @return 一个指向IDGenerator实例的指针。
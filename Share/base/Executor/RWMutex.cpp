@@ -34,16 +34,17 @@ int RWMutex::RLock() {
  * UnLock of the TMQMutex.
  */
 void RWMutex::RUnlock(int type) {
-    // Check the rw and type parameter. If it is RW_TYPE_SHARE type, minus 1 on readers.
-    if (rw && type == RW_TYPE_SHARE) {
+    // Check the type parameter. If it is RW_TYPE_SHARE type, minus 1 on readers.
+    if (type == RW_TYPE_SHARE) {
         int local = rw;
         int expect;
         do {
             expect = ((local >> 16) - 1) << 16 | (local & 0x0000ffff);
         } while (!compare_and_set(&rw, &local, &expect));
     }
-    // If the type is RW_TYPE_EXCLUSIVE, invoke UnLock of TMQMutex directly.
-    if (rw && type == RW_TYPE_EXCLUSIVE) {
+    // If the type is RW_TYPE_EXCLUSIVE, invoke UnLock of TMQMutex directly. The writers may have
+    // left already, so do not check the rw.
+    if (type == RW_TYPE_EXCLUSIVE) {
         mutex.UnLock();
     }
 }
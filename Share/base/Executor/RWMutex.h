@@ -32,7 +32,7 @@ class RWMutex {
 private:
     // Int value for recording the readers and writer. It is formatted as:
     // {writer}{readers}, where writes is on the high 16 bit and the readers on the low 16 bit.
-    int rw;
+    volatile int rw;
     // TMQMutex for writer.
     TMQMutex mutex;
 public:
@@ -0,0 +1,57 @@
+//
+//  TMQCondition.cpp
+//  TMQCondition
+//
+//  Created by  on 2022/3/28.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#include "TMQCondition.h"
+#include <ctime>
+
+/*
+ * Constructor for TMQCondition, init the mutex and the condition with default attributes.
+ */
+TMQCondition::TMQCondition() {
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&cond, nullptr);
+}
+
+/*
+ * Destructor for TMQCondition, destroy the mutex and the condition.
+ */
+TMQCondition::~TMQCondition() {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+// Lock the mutex, invoke pthread_mutex_lock directly.
+bool TMQCondition::Lock() {
+    return pthread_mutex_lock(&mutex) == 0;
+}
+
+// UnLock the mutex, invoke pthread_mutex_unlock directly.
+bool TMQCondition::UnLock() {
+    return pthread_mutex_unlock(&mutex) == 0;
+}
+
+// Wait for the condition, invoke pthread_cond_wait directly.
+bool TMQCondition::Wait() {
+    return pthread_cond_wait(&cond, &mutex) == 0;
+}
+
+// Wait for the condition with an absolute deadline of the calendar time, which is required by
+// pthread_cond_timedwait.
+bool TMQCondition::WaitFor(long timeout) {
+    struct timespec ts = {0, 0};
+    timespec_get(&ts, TIME_UTC);
+    long long nsec = (long long) ts.tv_nsec + (long long) (timeout % 1000) * 1000000;
+    ts.tv_sec += timeout / 1000 + (time_t) (nsec / 1000000000);
+    ts.tv_nsec = (long) (nsec % 1000000000);
+    return pthread_cond_timedwait(&cond, &mutex, &ts) == 0;
+}
+
+// Wakeup all waiting threads, invoke pthread_cond_broadcast directly.
+bool TMQCondition::Broadcast() {
+    return pthread_cond_broadcast(&cond) == 0;
+}
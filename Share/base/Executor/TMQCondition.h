@@ -0,0 +1,69 @@
+//
+//  TMQCondition.h
+//  TMQCondition
+//
+//  Created by  on 2022/3/28.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#ifndef TMQ_CONDITION_H
+#define TMQ_CONDITION_H
+
+#include "pthread.h"
+
+/**
+ * TMQCondition is a condition variable with its own mutex, using for a thread to park until a
+ * state is changed by others. The state should be checked and waited between Lock and UnLock.
+ */
+class TMQCondition {
+private:
+    // Mutex for the condition.
+    pthread_mutex_t mutex{};
+    // The condition variable.
+    pthread_cond_t cond{};
+public:
+    /*
+     * Default constructor
+     */
+    TMQCondition();
+
+    /*
+     * Destructor
+     */
+    ~TMQCondition();
+
+    /**
+     * Lock
+     * @return bool, a boolean value indicate whether the lock is success or not.
+     */
+    bool Lock();
+
+    /**
+     * Unlock
+     * @return bool, a boolean value indicate whether the unlock is success or not.
+     */
+    bool UnLock();
+
+    /**
+     * Wait for a signal, it should be called between Lock and UnLock. The mutex is released during
+     * waiting, and locked again before returning.
+     * @return bool, a boolean value indicate whether the wait is success or not.
+     */
+    bool Wait();
+
+    /**
+     * Wait for a signal at most timeout milliseconds, it should be called between Lock and UnLock.
+     * @param timeout, the max time to wait in milliseconds.
+     * @return bool, false if the wait is timeout or failed.
+     */
+    bool WaitFor(long timeout);
+
+    /**
+     * Wakeup all waiting threads.
+     * @return bool, a boolean value indicate whether the broadcast is success or not.
+     */
+    bool Broadcast();
+};
+
+
+#endif //TMQ_CONDITION_H
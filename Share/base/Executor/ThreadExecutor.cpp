@@ -8,6 +8,13 @@
 
 
 #include "pthread.h"
+#if defined(__linux__) || defined(__ANDROID__)
+#include <sched.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#include <ctime>
 
 class TExe {
 public:
@@ -24,7 +31,7 @@ public:
 
 #include "ThreadExecutor.h"
 
-ThreadExecutor::ThreadExecutor(const TMQCallable *callable) : thread(nullptr) {
+ThreadExecutor::ThreadExecutor(const TMQCallable *callable) : pending(false), thread(nullptr) {
     state = EXECUTOR_STATE_INIT;
     this->callable = const_cast<TMQCallable *>(callable);
     thread = new TExe();
@@ -56,20 +63,53 @@ void ThreadExecutor::SetState(TMQExecutorState executorState) {
     pthread_mutex_unlock(&thread->mutex);
 }
 
+/*
+ * Wait for a signal at most delay milliseconds, the mutex of the thread should be held.
+ */
+static void TimedWait(TExe *thread, long delay) {
+    struct timespec ts = {0, 0};
+    timespec_get(&ts, TIME_UTC);
+    long long nsec = (long long) ts.tv_nsec + (long long) (delay % 1000) * 1000000;
+    ts.tv_sec += delay / 1000 + (time_t) (nsec / 1000000000);
+    ts.tv_nsec = (long) (nsec % 1000000000);
+    pthread_cond_timedwait(&thread->cond, &thread->mutex, &ts);
+}
+
+/*
+ * Move the executor to the state unless it is ending, the ending state set by the destructor must
+ * not be overwritten, or the destructor waits forever.
+ */
+static bool Advance(ThreadExecutor *threadExecutor, TMQExecutorState executorState) {
+    pthread_mutex_lock(&threadExecutor->thread->mutex);
+    bool ending = threadExecutor->GetState() == EXECUTOR_STATE_ENDING;
+    if (!ending) {
+        threadExecutor->SetState(executorState);
+    }
+    pthread_mutex_unlock(&threadExecutor->thread->mutex);
+    return !ending;
+}
+
 void *OnExecute(void *executor) {
     auto *threadExecutor = (ThreadExecutor *) executor;
-    threadExecutor->SetState(EXECUTOR_STATE_READY);
-    while (threadExecutor->GetState() != EXECUTOR_STATE_ENDING) {
-        threadExecutor->SetState(EXECUTOR_STATE_RUNNING);
+    Advance(threadExecutor, EXECUTOR_STATE_READY);
+    while (Advance(threadExecutor, EXECUTOR_STATE_RUNNING)) {
 #if _WINDOWS
-        threadExecutor->GetCallable()->OnExecute((long)threadExecutor->thread->tid.x);
+        bool again = threadExecutor->GetCallable()->OnExecute((long)threadExecutor->thread->tid.x);
 #else
-        threadExecutor->GetCallable()->OnExecute((long) threadExecutor->thread->tid);
+        bool again = threadExecutor->GetCallable()->OnExecute((long) threadExecutor->thread->tid);
 #endif
+        long delay = again ? threadExecutor->GetCallable()->GetRecallDelay() : 0;
         pthread_mutex_lock(&threadExecutor->thread->mutex);
-        if (threadExecutor->GetState() == EXECUTOR_STATE_RUNNING) {
+        // A wakeup during running may come after the callable found nothing, run it again. If the
+        // callable asks to be called again, wait for its delay only.
+        if (threadExecutor->GetState() == EXECUTOR_STATE_RUNNING && !threadExecutor->TakePending()
+            && (!again || delay > 0)) {
             threadExecutor->SetState(EXECUTOR_STATE_WAITING);
-            pthread_cond_wait(&threadExecutor->thread->cond, &threadExecutor->thread->mutex);
+            if (again) {
+                TimedWait(threadExecutor->thread, delay);
+            } else {
+                pthread_cond_wait(&threadExecutor->thread->cond, &threadExecutor->thread->mutex);
+            }
         }
         pthread_mutex_unlock(&threadExecutor->thread->mutex);
     }
@@ -100,6 +140,9 @@ bool ThreadExecutor::Wakeup() {
     } else if (GetState() == EXECUTOR_STATE_WAITING) {
         pthread_cond_signal(&thread->cond);
         success = true;
+    } else if (GetState() == EXECUTOR_STATE_RUNNING) {
+        // Not counted as success, the caller may wakeup other executors for the congestion.
+        pending = true;
     }
     pthread_mutex_unlock(&thread->mutex);
     return success;
@@ -110,6 +153,35 @@ TMQCallable *ThreadExecutor::GetCallable() {
     return callable;
 }
 
+bool ThreadExecutor::TakePending() {
+    bool local = pending;
+    pending = false;
+    return local;
+}
+
+bool ThreadExecutor::SetAffinity(int cpu) {
+#if defined(__linux__) || defined(__ANDROID__)
+    if (cpu < 0) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % GetCpuCount(), &set);
+    return sched_setaffinity(0, sizeof(cpu_set_t), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+int ThreadExecutor::GetCpuCount() {
+#if defined(_SC_NPROCESSORS_ONLN)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int) count : 1;
+#else
+    return 1;
+#endif
+}
+
 TExe::TExe() : mutex{0}, cond{0} {
     pthread_mutexattr_t mutexAttr;
     pthread_mutexattr_init(&mutexAttr);
@@ -19,6 +19,8 @@ class ThreadExecutor : public IExecutor {
 private:
     TMQCallable *callable;
     volatile TMQExecutorState state;
+    // Set by a wakeup arriving while running, the callable is executed again instead of waiting.
+    volatile bool pending;
 public:
     Executor thread;
 public:
@@ -31,6 +33,25 @@ public:
 
     void SetState(TMQExecutorState state);
 
+    /**
+     * Take the pending wakeup, the mutex of the thread should be held by the caller.
+     * @return true if a wakeup arrived while running.
+     */
+    bool TakePending();
+
+    /**
+     * Bind the calling thread to a CPU, it works on linux and android only.
+     * @param cpu, the index of the CPU, wrapped by the count of CPUs.
+     * @return true if success.
+     */
+    static bool SetAffinity(int cpu);
+
+    /**
+     * Get the count of the online CPUs.
+     * @return the count, 1 at least.
+     */
+    static int GetCpuCount();
+
 public:
     virtual TMQExecutorState GetState();
 
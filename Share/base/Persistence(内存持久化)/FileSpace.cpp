@@ -5,6 +5,14 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <cstdio>
+#if defined(__linux__) || defined(__ANDROID__)
+#include <linux/falloc.h>
+#endif
+
+// 分块模式下的访问操作：读取、写入和置零。
+#define ACCESS_READ  0
+#define ACCESS_WRITE 1
+#define ACCESS_ZERO  2
 
 /*
  * 应用新的文件空间。如果所需空间超过文件的当前长度，文件将被扩展以满足请求。
@@ -18,7 +26,14 @@ int FileSpace::Allocate(int start, int count) {
     // 计算分配的起始页面索引。
     int realStart = (int)((start < 0) ? (length / TMQ_PAGE_SIZE) : start);
     // 计算文件的最终长度。
-    TMQLSize require = (realStart + count) * TMQ_PAGE_SIZE;
+    TMQLSize require = ((TMQLSize) realStart + count) * TMQ_PAGE_SIZE;
+    // 分块模式下使用预分配的磁盘空间增长文件。
+    if (require > length && fd >= 0) {
+        if (!Grow(require)) {
+            return PAGE_NULL;
+        }
+        length = require;
+    }
     // 扩展文件并填充新内容。
     if (require > length && truncate(file, (long)require) == 0) {
         // 如果填充操作不成功，恢复它。
@@ -37,11 +52,23 @@ int FileSpace::Allocate(int start, int count) {
  */
 void FileSpace::Deallocate(int page) {
     if (page >= 0) {
-        long newLen = page * TMQ_PAGE_SIZE;
-        // 设置新的文件长度。
-        if (truncate(file, newLen) == 0) {
+        TMQLSize newLen = (TMQLSize) page * TMQ_PAGE_SIZE;
+        // 设置新的文件长度。分块模式下超出文件末尾的映射保留，访问受文件长度限制。
+        if ((fd >= 0 ? ftruncate(fd, (off_t)newLen) : truncate(file, (off_t)newLen)) == 0) {
             length = newLen;
         }
+        // 截断释放了文件末尾之后预分配的磁盘空间。
+        if (fd >= 0) {
+            reserveMutex.Lock();
+            if (reserved > length) {
+                reserved = length;
+            }
+            if (reserveTarget > length) {
+                reserveTarget = length;
+            }
+            reserveEpoch++;
+            reserveMutex.UnLock();
+        }
     }
 }
 
@@ -54,9 +81,13 @@ int FileSpace::Read(int page, int offset, void *buf, int len) {
         return -1;
     }
     // 读取已到达或超过文件末尾，失败。
-    if (page * TMQ_PAGE_SIZE + offset + len > length) {
+    if ((TMQLSize) page * TMQ_PAGE_SIZE + offset + len > length) {
         return -1;
     }
+    if (fd >= 0) {
+        TMQLSize pos = (TMQLSize) page * TMQ_PAGE_SIZE + offset;
+        return Access(pos, (char *) buf, len, ACCESS_READ) ? len : -1;
+    }
     int rp = page + offset / TMQ_PAGE_SIZE;
     int ro = offset % TMQ_PAGE_SIZE;
     int size = len;
@@ -85,6 +116,14 @@ int FileSpace::Write(int page, int offset, void *buf, int len) {
     if (page < 0 || offset < 0 || !buf || len < 0) {
         return -1;
     }
+    if (fd >= 0) {
+        TMQLSize pos = (TMQLSize) page * TMQ_PAGE_SIZE + offset;
+        // 写入超过文件末尾的映射内容将导致 SIG_BUS 错误。
+        if (pos + len > length) {
+            return -1;
+        }
+        return Access(pos, (char *) buf, len, ACCESS_WRITE) ? len : -1;
+    }
     int rp = page + offset / TMQ_PAGE_SIZE;
     int ro = offset % TMQ_PAGE_SIZE;
     int size = len;
@@ -108,8 +147,33 @@ int FileSpace::Write(int page, int offset, void *buf, int len) {
  * 将数据从源复制到目标。此函数将直接使用mmap，不保留缓存。
  */
 bool FileSpace::Copy(int dp, int df, int sp, int sf, int len) {
-    int fd = open(file, O_RDWR);
-    if (fd <= 0) {
+    if (fd >= 0) {
+        // 分块模式下直接在块的映射上复制，跨越块边界时分段复制。
+        TMQLSize dst = (TMQLSize) dp * TMQ_PAGE_SIZE + df;
+        TMQLSize src = (TMQLSize) sp * TMQ_PAGE_SIZE + sf;
+        if (len <= 0 || dst + len > length || src + len > length) {
+            return false;
+        }
+        long size = len;
+        while (size > 0) {
+            long dstAvail = 0, srcAvail = 0;
+            char *dstPtr = Address(dst, dstAvail);
+            char *srcPtr = Address(src, srcAvail);
+            if (!dstPtr || !srcPtr) {
+                return false;
+            }
+            long count = size < dstAvail ? size : dstAvail;
+            count = count < srcAvail ? count : srcAvail;
+            memmove(dstPtr, srcPtr, count);
+            MarkDirty(dst, count);
+            dst += count;
+            src += count;
+            size -= count;
+        }
+        return true;
+    }
+    int handle = open(file, O_RDWR);
+    if (handle <= 0) {
         return false;
     }
     bool success = false;
@@ -118,11 +182,13 @@ bool FileSpace::Copy(int dp, int df, int sp, int sf, int len) {
     int rsp = sp + sf / TMQ_PAGE_SIZE;
     int rsf = sf % TMQ_PAGE_SIZE;
     // 映射目标内容。
-    void *dst = mmap(nullptr, len, PROT_WRITE | PROT_READ, MAP_SHARED, fd, rdp * TMQ_PAGE_SIZE);
+    void *dst = mmap(nullptr, len, PROT_WRITE | PROT_READ, MAP_SHARED, handle,
+                     (off_t) rdp * TMQ_PAGE_SIZE);
     // 映射源内容。
-    void *src = mmap(nullptr, len, PROT_WRITE | PROT_READ, MAP_SHARED, fd, rsp * TMQ_PAGE_SIZE);
+    void *src = mmap(nullptr, len, PROT_WRITE | PROT_READ, MAP_SHARED, handle,
+                     (off_t) rsp * TMQ_PAGE_SIZE);
     // mmap完成，关闭文件描述符。
-    close(fd);
+    close(handle);
     // 当源和目标内容的mmap都成功时，检查和复制内容。
     if (dst != MAP_FAILED && src != MAP_FAILED) {
         memcpy((char *) dst + rdf, (char *) src + rsf, len);
@@ -145,6 +211,13 @@ void FileSpace::Zero(int page, int offset, int len) {
     if (page < 0 || offset < 0 || len < 0) {
         return;
     }
+    if (fd >= 0) {
+        TMQLSize pos = (TMQLSize) page * TMQ_PAGE_SIZE + offset;
+        if (pos + len <= length) {
+            Access(pos, nullptr, len, ACCESS_ZERO);
+        }
+        return;
+    }
     int rp = page + offset / TMQ_PAGE_SIZE;
     int ro = offset % TMQ_PAGE_SIZE;
     int size = len;
@@ -162,40 +235,284 @@ void FileSpace::Zero(int page, int offset, int len) {
     }
 }
 
+/*
+ * 使用msync同步缓存的页面，再使用fsync同步文件。
+ */
+bool FileSpace::Sync() {
+    bool success = true;
+    for (int i = 0; i < RESERVE_COUNT; ++i) {
+        if (maps[i] && msync(maps[i], TMQ_PAGE_SIZE, MS_SYNC) != 0) {
+            success = false;
+        }
+    }
+    if (fd >= 0) {
+        // 分块模式下只同步文件长度内的脏区间，起始偏移按系统页面对齐。
+        long pageSize = sysconf(_SC_PAGESIZE);
+        pageSize = pageSize > 0 ? pageSize : TMQ_PAGE_SIZE;
+        for (int i = 0; i < (int) chunks.Size(); ++i) {
+            MappedChunk &chunk = chunks.Get(i);
+            TMQLSize start = (TMQLSize) i * CHUNK_SIZE;
+            if (!chunk.map || chunk.dirtyEnd <= chunk.dirtyStart || start >= length) {
+                continue;
+            }
+            long from = chunk.dirtyStart / pageSize * pageSize;
+            long to = length - start < (TMQLSize) chunk.dirtyEnd ? (long) (length - start)
+                                                                 : chunk.dirtyEnd;
+            if (to > from && msync((char *) chunk.map + from, to - from, MS_SYNC) != 0) {
+                success = false;
+                continue;
+            }
+            chunk.dirtyStart = 0;
+            chunk.dirtyEnd = 0;
+        }
+        if (success && syncedLength != length) {
+            success = fsync(fd) == 0;
+            syncedLength = success ? length : syncedLength;
+        }
+        return success;
+    }
+    int handle = open(file, O_RDWR);
+    if (handle <= 0) {
+        return false;
+    }
+    if (fsync(handle) != 0) {
+        success = false;
+    }
+    close(handle);
+    return success;
+}
+
+/*
+ * 逐块映射到文件末尾，读取只访问文件长度内的内容，所有的块都已映射后不会再添加或映射块。
+ */
+bool FileSpace::PrepareConcurrentRead() {
+    if (fd < 0) {
+        return false;
+    }
+    for (TMQLSize pos = 0; pos < length; pos += CHUNK_SIZE) {
+        long avail = 0;
+        if (!Address(pos, avail)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /*
  * 构造一个文件空间。它将尝试访问文件，如果不存在，将创建它。
  */
-FileSpace::FileSpace(const char *path) :
-    file{0}, pages{0}, maps{nullptr}, length(0) {
+FileSpace::FileSpace(const char *path, int mode) :
+    file{0}, pages{0}, maps{nullptr}, length(0), fd(-1), syncedLength(0), reserved(0),
+    reserveTarget(0), reserveEpoch(0), reserver(nullptr) {
     // 路径有效。
     if (path) {
         strncpy(file, path, sizeof(file));
+        // 分块模式下持有以读/写模式打开的文件描述符，失败时回退到页面模式。
+        if (mode == FILE_SPACE_CHUNKED) {
+            fd = open(file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if (fd >= 0) {
+                length = lseek(fd, 0, SEEK_END);
+                syncedLength = length;
+                reserved = length;
+                reserveTarget = length;
+                return;
+            }
+        }
         // 访问文件，并以正确的模式打开它。
-        int fd = -1;
-        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+        int handle = -1;
+        mode_t fileMode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
         if (access(file, F_OK) != 0) {
             // 以创建模式打开。
-            fd = open(file, O_RDWR | O_CREAT, mode);
+            handle = open(file, O_RDWR | O_CREAT, fileMode);
         }
-        if (fd <= 0) {
+        if (handle <= 0) {
             // 以只读模式打开。
-            fd = open(file, O_RDONLY, mode);
+            handle = open(file, O_RDONLY, fileMode);
         }
-        if (fd > 0) {
+        if (handle > 0) {
             // 获取文件长度。
-            length = lseek(fd, 0, SEEK_END);
-            close(fd);
+            length = lseek(handle, 0, SEEK_END);
+            close(handle);
+        }
+    }
+}
+
+/*
+ * 取消页面和块的映射，关闭分块模式下持有的文件描述符。
+ */
+FileSpace::~FileSpace() {
+    // 先停止后台线程，它可能正在使用文件描述符。
+    delete reserver;
+    for (int i = 0; i < RESERVE_COUNT; ++i) {
+        if (maps[i]) {
+            munmap(maps[i], TMQ_PAGE_SIZE);
+        }
+    }
+    for (int i = 0; i < (int) chunks.Size(); ++i) {
+        if (chunks.Get(i).map) {
+            munmap(chunks.Get(i).map, CHUNK_SIZE);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/*
+ * 映射文件位置所在的块。块的映射可以超出文件末尾，调用者保证只访问文件长度内的内容，文件增长时已映射的块仍然有效。
+ */
+char *FileSpace::Address(TMQLSize pos, long &avail) {
+    int chunk = (int) (pos / CHUNK_SIZE);
+    while ((int) chunks.Size() <= chunk) {
+        MappedChunk unmapped = {nullptr, 0, 0};
+        chunks.Add(unmapped);
+    }
+    void *&map = chunks.Get(chunk).map;
+    if (!map) {
+        void *addr = mmap(nullptr, CHUNK_SIZE, PROT_WRITE | PROT_READ, MAP_SHARED, fd,
+                          (off_t) chunk * CHUNK_SIZE);
+        if (addr == MAP_FAILED) {
+            return nullptr;
+        }
+        map = addr;
+    }
+    TMQLSize offset = pos % CHUNK_SIZE;
+    avail = (long) (CHUNK_SIZE - offset);
+    return (char *) map + offset;
+}
+
+/*
+ * 脏区间合并为包含所有写入内容的一个区间。
+ */
+void FileSpace::MarkDirty(TMQLSize pos, long len) {
+    MappedChunk &chunk = chunks.Get((int) (pos / CHUNK_SIZE));
+    long start = (long) (pos % CHUNK_SIZE);
+    if (chunk.dirtyEnd <= chunk.dirtyStart) {
+        chunk.dirtyStart = start;
+        chunk.dirtyEnd = start + len;
+        return;
+    }
+    chunk.dirtyStart = start < chunk.dirtyStart ? start : chunk.dirtyStart;
+    chunk.dirtyEnd = start + len > chunk.dirtyEnd ? start + len : chunk.dirtyEnd;
+}
+
+/*
+ * 按块处理文件内容，内容在一个块内时只有一次内存操作。
+ */
+bool FileSpace::Access(TMQLSize pos, char *buf, long len, int op) {
+    while (len > 0) {
+        long avail = 0;
+        char *data = Address(pos, avail);
+        if (!data) {
+            return false;
+        }
+        long count = len < avail ? len : avail;
+        if (op == ACCESS_READ) {
+            memcpy(buf, data, count);
+        } else if (op == ACCESS_WRITE) {
+            memcpy(data, buf, count);
+            MarkDirty(pos, count);
+        } else {
+            memset(data, 0, count);
+            MarkDirty(pos, count);
+        }
+        if (buf) {
+            buf += count;
         }
+        pos += count;
+        len -= count;
     }
+    return true;
+}
+
+/*
+ * 使用 fallocate 的 FALLOC_FL_KEEP_SIZE 预分配磁盘空间，文件大小不变，预分配的内容读取为零。
+ */
+bool FileSpace::Reserve(TMQLSize pos, TMQLSize len) {
+#ifdef FALLOC_FL_KEEP_SIZE
+    return fd >= 0 && len > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t) pos, (off_t) len) == 0;
+#else
+    return false;
+#endif
+}
+
+/*
+ * 增长文件。在预分配的磁盘空间内增长时只需设置文件长度，不再用零填充。预分配量随文件长度几何增长，
+ * 剩余的预分配不足一半时唤醒后台线程，使发布者几乎不需要等待文件增长。
+ */
+bool FileSpace::Grow(TMQLSize require) {
+    reserveMutex.Lock();
+    bool ready = require <= reserved;
+    reserveMutex.UnLock();
+    // 后台线程尚未预分配到所需长度，同步预分配。
+    if (!ready && Reserve(length, require - length)) {
+        ready = true;
+        reserveMutex.Lock();
+        if (reserved < require) {
+            reserved = require;
+        }
+        reserveMutex.UnLock();
+    }
+    if (ftruncate(fd, (off_t) require) != 0) {
+        return false;
+    }
+    // 不支持预分配，用零填充新内容，以免访问映射时出现 SIG_BUS 错误。
+    if (!ready) {
+        if (!Fill((long) length, (long) (require - length))) {
+            ftruncate(fd, (off_t) length);
+            return false;
+        }
+        return true;
+    }
+    TMQLSize ahead = require < PREALLOCATE_MIN ? PREALLOCATE_MIN : require;
+    ahead = ahead > PREALLOCATE_MAX ? PREALLOCATE_MAX : ahead;
+    bool wake = false;
+    reserveMutex.Lock();
+    if (reserved < require + ahead / 2 && reserveTarget < require + ahead) {
+        reserveTarget = require + ahead;
+        if (!reserver) {
+            reserver = new ThreadExecutor(this);
+        }
+        wake = true;
+    }
+    reserveMutex.UnLock();
+    if (wake) {
+        reserver->Wakeup();
+    }
+    return true;
+}
+
+/*
+ * 将预分配推进到目标长度。预分配期间文件被缩小时，本次预分配的空间已被释放，不再计入。
+ */
+bool FileSpace::OnExecute(long eid) {
+    reserveMutex.Lock();
+    TMQLSize from = reserved;
+    TMQLSize to = reserveTarget;
+    int epoch = reserveEpoch;
+    reserveMutex.UnLock();
+    if (to > from && Reserve(from, to - from)) {
+        reserveMutex.Lock();
+        if (epoch == reserveEpoch && reserved < to) {
+            reserved = to;
+        }
+        reserveMutex.UnLock();
+    }
+    return false;
 }
 
 /*
  * 加载页面上的数据。如果已经加载，直接使用地址，否则，使用mmap将内容映射到内存。
  */
 void *FileSpace::Load(int page) {
-    if ((page + 1) * TMQ_PAGE_SIZE > length) {
+    if (((TMQLSize) page + 1) * TMQ_PAGE_SIZE > length) {
         return nullptr;
     }
+    // 分块模式下页面的地址就是块内的地址。
+    if (fd >= 0) {
+        long avail = 0;
+        return Address((TMQLSize) page * TMQ_PAGE_SIZE, avail);
+    }
     // 使用%操作计算页面中的位置。
     int pos = page % RESERVE_COUNT;
     // 检查pages[pos]是否等于所需的页面，如果不等于，丢弃这个页面。
@@ -207,12 +524,12 @@ void *FileSpace::Load(int page) {
     }
     // 所需的页面尚未加载，打开文件并用mmap加载它。
     if (!maps[pos]) {
-        int fd = open(file, O_RDWR);
+        int handle = open(file, O_RDWR);
         // 成功以O_RDWR打开文件。
-        if (fd > 0) {
-            maps[pos] = mmap(nullptr, TMQ_PAGE_SIZE, PROT_WRITE | PROT_READ, MAP_SHARED, fd,
-                            page * TMQ_PAGE_SIZE);
-            close(fd);
+        if (handle > 0) {
+            maps[pos] = mmap(nullptr, TMQ_PAGE_SIZE, PROT_WRITE | PROT_READ, MAP_SHARED, handle,
+                            (off_t) page * TMQ_PAGE_SIZE);
+            close(handle);
         }
         // 打开文件失败，意味着加载失败。
         if (maps[pos] == MAP_FAILED) {
@@ -4,6 +4,8 @@
 #include "List.h"
 #include "Metas.h"
 #include "PageSpace.h"
+#include "TMQMutex.h"
+#include "ThreadExecutor.h"
 
 /// 文件空间的常量定义。
 // 文件路径最大长度
@@ -12,12 +14,37 @@
 #define RESERVE_COUNT 512
 // 打开文件的文件模式。当文件不存在时，将创建一个新文件。
 #define PAGE_FILE_MODE "rb+"
+// 页面模式，每次加载映射一个页面，并缓存 RESERVE_COUNT 个页面。
+#define FILE_SPACE_PAGED 0
+// 分块模式，持有打开的文件描述符，以 CHUNK_SIZE 为单位映射文件。
+#define FILE_SPACE_CHUNKED 1
+// 分块模式下每个映射块的字节大小，必须是页面大小的整数倍。
+#define CHUNK_SIZE (64L * 1024 * 1024)
+// 分块模式下提前预分配的最小字节数，预分配量随文件长度增长，直到 PREALLOCATE_MAX。
+#define PREALLOCATE_MIN (1024L * 1024)
+// 分块模式下提前预分配的最大字节数。
+#define PREALLOCATE_MAX CHUNK_SIZE
+
+/**
+ * 分块模式下映射的块，记录自上次同步以来写入的脏区间，同步时只同步脏区间。
+ */
+class MappedChunk {
+public:
+    // 块的映射地址，尚未映射时为 nullptr。
+    void *map;
+    // 脏区间在块内的起始偏移。
+    long dirtyStart;
+    // 脏区间在块内的结束偏移，不大于起始偏移时没有脏内容。
+    long dirtyEnd;
+};
 
 /**
  * FileSpace 是使用磁盘上文件的 IPageSpace 实现。FileSpace 持有的文件必须具有读/写/创建权限。
  * 当文件准备就绪时，我们将使用 mmap 访问原始数据。考虑到效率，我们将在内存中缓存一些页面，最大缓存计数限制为 RESERVE_COUNT。
+ * 分块模式下文件保持打开，映射按块进行且可以超出文件末尾，文件增长时无需重新映射，同一块内的读写只需一次内存复制。
+ * 分块模式下文件末尾之后的磁盘空间由后台线程使用 fallocate 提前预分配，不改变文件大小，分配页面时只需设置文件长度。
  */
-class FileSpace : public IPageSpace {
+class FileSpace : public IPageSpace, public TMQCallable {
 private:
     // 用于保存文件路径的字符数组。
     char file[PATH_LENGTH];
@@ -27,13 +54,76 @@ private:
     int pages[RESERVE_COUNT];
     // 从 mmap 缓存的内存地址，最大计数限制为 RESERVE_COUNT。
     void *maps[RESERVE_COUNT];
+    // 分块模式下持有的文件描述符，页面模式下为 -1。
+    int fd;
+    // 分块模式下映射的块，以块索引为下标。
+    List<MappedChunk> chunks;
+    // 分块模式下上次同步时的文件长度，长度改变后同步时才需要同步文件的元数据。
+    TMQLSize syncedLength;
+    // 已预分配磁盘空间的文件字节长度，可以超过文件长度。
+    TMQLSize reserved;
+    // 后台线程预分配的目标字节长度。
+    TMQLSize reserveTarget;
+    // 预分配的轮次，文件缩小时增加，后台线程在缩小之前完成的预分配不再计入。
+    int reserveEpoch;
+    // 保护预分配状态的互斥锁。
+    TMQMutex reserveMutex;
+    // 执行预分配的后台线程，第一次需要预分配时创建。
+    ThreadExecutor *reserver;
+
+private:
+    /**
+     * 分块模式下获取文件位置的内存地址，所在的块尚未映射时将映射整个块。
+     * @param pos, 文件中的字节位置。
+     * @param avail, 接收从该位置到块末尾的字节数。
+     * @return 该位置的内存地址，映射失败时返回 nullptr。
+     */
+    char *Address(TMQLSize pos, long &avail);
+
+    /**
+     * 分块模式下将写入的内容记入所在块的脏区间。
+     * @param pos, 文件中的起始字节位置。
+     * @param len, 写入的长度，要求不跨越块边界。
+     */
+    void MarkDirty(TMQLSize pos, long len);
+
+    /**
+     * 分块模式下读取、写入或置零文件的内容。跨越块边界时分段处理，每个块只需一次内存操作。
+     * @param pos, 文件中的起始字节位置，要求 pos + len 不超过文件长度。
+     * @param buf, 读取或写入的内存指针，置零时忽略。
+     * @param len, 要处理的长度。
+     * @param op, 操作类型，参考 FileSpace.cpp 中的定义。
+     * @return 表示操作是否成功的布尔值。
+     */
+    bool Access(TMQLSize pos, char *buf, long len, int op);
+
+    /**
+     * 为文件末尾之后的内容预分配磁盘空间，不改变文件大小。
+     * @param pos, 预分配的起始字节位置。
+     * @param len, 预分配的长度。
+     * @return 表示预分配是否成功的布尔值，平台或文件系统不支持时失败。
+     */
+    bool Reserve(TMQLSize pos, TMQLSize len);
+
+    /**
+     * 分块模式下将文件增长到所需长度。已预分配时只设置文件长度，否则同步预分配或用零填充，之后唤醒后台线程提前预分配。
+     * @param require, 文件所需的字节长度，大于当前长度。
+     * @return 表示增长是否成功的布尔值。
+     */
+    bool Grow(TMQLSize require);
 
 public:
     /**
      * 使用文件路径构造 FileSpace。
      * @param path, 文件的路径。它必须具有读、写和创建权限。
+     * @param mode, FILE_SPACE_PAGED 或 FILE_SPACE_CHUNKED，分块模式下无法打开文件时回退到页面模式。
+     */
+    explicit FileSpace(const char *path, int mode = FILE_SPACE_PAGED);
+
+    /**
+     * 析构函数，取消所有的映射并关闭持有的文件描述符。
      */
-    explicit FileSpace(const char *path);
+    ~FileSpace() override;
 
     /**
      * 加载页面并返回其内存地址。如果页面已加载，它将立即返回，否则，它将使用 mmap 或其他 IO 方法从磁盘文件加载数据。
@@ -103,6 +193,24 @@ public:
      * @param len, 要置零的长度。
      */
     virtual void Zero(int page, int offset, int len);
+    /**
+     * 同步已缓存的映射页面，然后同步整个文件，包括已取消映射的页面。分块模式下只同步各个块的脏区间，文件长度改变时再同步文件。
+     * @return 表示同步是否成功的布尔值。
+     */
+    virtual bool Sync();
+
+    /**
+     * 分块模式下映射文件长度内的所有块，之后的读取不再修改映射的块列表。页面模式下的读取会替换缓存的页面，不支持并发读取。
+     * @return 表示是否可以并发读取的布尔值。
+     */
+    bool PrepareConcurrentRead() override;
+
+    /**
+     * 后台线程的执行方法，将预分配推进到目标长度。
+     * @param eid, 线程的标识。
+     * @return 总是返回 false，等待下一次唤醒。
+     */
+    bool OnExecute(long eid) override;
 };
 
 #endif // FILE_SPACE_H
\ No newline at end of file
@@ -0,0 +1,817 @@
+#ifndef LAZY_BTREE_H
+#define LAZY_BTREE_H
+
+#include "Defines.h"
+#include "LinearSpace.h"
+#include "PageSpace.h"
+#include "LazyLinearList.h"
+
+/// 常量定义
+// 节点的字节大小。它是 TMQ_PAGE_SIZE 的约数，因此一个节点不会跨越页面，每次修改只写入一个页面。
+#define LAZY_BTREE_NODE_SIZE 512
+// 节点头部的字节大小：leaf、count、next、prev。
+#define LAZY_BTREE_NODE_HEAD 16
+// 节点数据区的字节大小，保存元素、分隔元素以及子节点索引。
+#define LAZY_BTREE_NODE_DATA (LAZY_BTREE_NODE_SIZE - LAZY_BTREE_NODE_HEAD)
+// 树的最大高度，用于在栈上记录查找路径。
+#define LAZY_BTREE_MAX_HEIGHT 16
+// 树头部的魔数，用于区分已初始化的树和其他数据。
+#define LAZY_BTREE_MAGIC 0x45455254
+// 无效节点的定义。
+#define LAZY_BTREE_NULL -1
+
+/**
+ * 懒惰 B+ 树的头部，保存在线性空间的第一个节点中。
+ */
+class LazyBTreeHeader {
+public:
+    // 魔数，参见 LAZY_BTREE_MAGIC。
+    unsigned int magic;
+    // 根节点的索引。
+    int root;
+    // 第一个叶子节点的索引。
+    int head;
+    // 最后一个叶子节点的索引。
+    int tail;
+    // 树的高度，只有一个叶子节点时为 1，空树为 0。
+    int height;
+    // 已使用过的节点计数，包括头部节点。
+    int nodeCount;
+    // 释放节点链表的头索引。
+    int freeNode;
+    // 释放节点链表的长度。
+    int freeCount;
+    // 树中的元素计数。
+    TMQLSize size;
+
+    /**
+     * 默认构造函数，构造一棵空树的头部。
+     */
+    LazyBTreeHeader() : magic(LAZY_BTREE_MAGIC), root(LAZY_BTREE_NULL), head(LAZY_BTREE_NULL),
+                        tail(LAZY_BTREE_NULL), height(0), nodeCount(1),
+                        freeNode(LAZY_BTREE_NULL), freeCount(0), size(0) {}
+};
+
+/**
+ * 懒惰 B+ 树的节点，其大小固定为 LAZY_BTREE_NODE_SIZE。叶子节点依次保存元素，
+ * 并通过 next 和 prev 链接成有序链表。内部节点保存 count 个分隔元素和 count + 1 个子节点索引，
+ * 分隔元素是其右侧子树中的最小元素。释放的节点通过 next 链接成释放节点链表。
+ *
+ * @tparam T, 模板名称。
+ */
+template<typename T>
+class LazyBTreeNode {
+public:
+    // 表示是否为叶子节点的整数值。
+    int leaf;
+    // 叶子节点中的元素计数，或者内部节点中的分隔元素计数。
+    int count;
+    // 下一个叶子节点或下一个释放节点的索引。
+    int next;
+    // 上一个叶子节点的索引。
+    int prev;
+    // 元素、分隔元素以及子节点索引的存储空间。
+    long long data[LAZY_BTREE_NODE_DATA / sizeof(long long)];
+
+    /**
+     * 默认构造函数。
+     */
+    LazyBTreeNode() : leaf(0), count(0), next(LAZY_BTREE_NULL), prev(LAZY_BTREE_NULL), data{0} {}
+
+    /**
+     * 叶子节点的元素容量。
+     */
+    static inline int LeafCapacity() {
+        return (int) (LAZY_BTREE_NODE_DATA / sizeof(T));
+    }
+
+    /**
+     * 内部节点的分隔元素容量，其子节点容量为此值加一。
+     */
+    static inline int InnerCapacity() {
+        return (int) ((LAZY_BTREE_NODE_DATA - sizeof(int)) / (sizeof(T) + sizeof(int)));
+    }
+
+    /**
+     * 获取元素数组，叶子节点中为元素，内部节点中为分隔元素。
+     */
+    inline T *Values() {
+        return (T *) data;
+    }
+
+    /**
+     * 获取内部节点的子节点索引数组，它位于分隔元素之后。
+     */
+    inline int *Children() {
+        return (int *) ((char *) data + InnerCapacity() * sizeof(T));
+    }
+};
+
+/**
+ * 模板类，用于在线性存储空间上读写 B+ 树。与 LazyLinearList 一样，它是懒惰的读写，
+ * 除了头部外，所有节点都保存在线性空间上，插入和删除只读写查找路径上的节点，
+ * 因此其时间复杂度为对数级，而不需要移动后续的所有元素。
+ * 懒惰 B+ 树的描述如下：
+ * [LazyBTreeHeader][LazyBTreeNode...]:
+ * 每个部分都占用 LAZY_BTREE_NODE_SIZE 字节，节点之间使用其索引互相引用，
+ * 因此整个空间可以复制到新的页面上，容量由新页面的长度决定。
+ * 插入时自上而下地预先分裂满节点，删除时只回收空节点，而不合并未满的节点。
+ * 元素的顺序由构造时传入的比较函数决定，相等的元素将被插入到已有元素之后。
+ *
+ * @tparam T, 模板名称。
+ */
+template<typename T>
+class LazyBTree {
+protected:
+    // 指向页面空间的指针。
+    IPageSpace *linearSpace;
+    // 懒惰 B+ 树的起始 tmq 地址。
+    TMQAddress address;
+    // 节点容量，包括头部节点。
+    int capacity;
+    // 比较元素的方法。
+    Compare compare;
+    // 树头部的内存副本。
+    LazyBTreeHeader header;
+
+public:
+    /**
+     * 使用线性空间、起始地址、长度和比较函数构造 LazyBTree。如果地址处没有树，将初始化一棵空树。
+     * @param linearSpace, 指向页面空间的指针。
+     * @param address, 树的起始地址。
+     * @param length, 树的总字节长度。
+     * @param compare, 比较元素的方法。
+     */
+    LazyBTree(IPageSpace *linearSpace, TMQAddress address, TMQLSize length, Compare compare);
+
+    /**
+     * 检查地址处是否已经有一棵树。
+     * @param linearSpace, 指向页面空间的指针。
+     * @param address, 树的起始地址。
+     * @return bool, 表示是否存在的布尔值。
+     */
+    static bool Exists(IPageSpace *linearSpace, TMQAddress address);
+
+    /**
+     * 获取元素计数的方法。
+     * @return 元素的计数。
+     */
+    TMQLSize GetSize();
+
+    /**
+     * 检查插入 expand 个元素是否会溢出。由于插入可能分裂查找路径上的所有节点，
+     * 这里按照最坏情况计算所需的节点数。
+     * @param expand, 要插入的元素计数。
+     * @return bool, 表示是否溢出的布尔值。
+     */
+    bool Overflow(TMQSize expand);
+
+    /**
+     * 插入元素。
+     * @param t, 元素的值。
+     * @return bool, 表示插入是否成功的布尔值，节点容量不足时失败。
+     */
+    bool Add(const T &t);
+
+    /**
+     * 查找与 t 相等的元素。
+     * @param t, 要查找的值。
+     * @param found, 找到的元素。
+     * @return bool, 表示是否找到的布尔值。
+     */
+    bool Find(const T &t, T &found);
+
+    /**
+     * 使用 t 替换与其相等的元素。
+     * @param t, 新值。
+     * @return bool, 表示是否找到并替换的布尔值。
+     */
+    bool Set(const T &t);
+
+    /**
+     * 移除与 t 相等的元素。叶子节点为空时将被回收，并从其父节点中移除。
+     * @param t, 要移除的值。
+     * @return bool, 表示移除是否成功的布尔值。
+     */
+    bool Remove(const T &t);
+
+    /**
+     * 获取最后一个元素。
+     * @param last, 最后一个元素。
+     * @return bool, 表示树是否不为空的布尔值。
+     */
+    bool Last(T &last);
+
+    /**
+     * 清除所有元素并回收所有节点。
+     */
+    void Clear();
+
+    /**
+     * 读取索引处的节点。
+     * @param index, 节点索引。
+     * @param node, 读取的节点。
+     */
+    void ReadNode(int index, LazyBTreeNode<T> &node);
+
+    /**
+     * 内联方法，用于检查树是否为空。
+     * @return 表示树是否为空的布尔值。
+     */
+    inline bool Empty() {
+        return header.size == 0;
+    }
+
+    /**
+     * 内联方法，获取第一个叶子节点的索引，用于按顺序遍历。
+     * @return 第一个叶子节点的索引。
+     */
+    inline int Head() {
+        return header.head;
+    }
+
+protected:
+    /**
+     * 计算节点的页面偏移量。
+     */
+    inline long Offset(int index) {
+        return OFFSET(address) + (long) index * LAZY_BTREE_NODE_SIZE;
+    }
+
+    /**
+     * 将节点写入索引处。
+     */
+    void WriteNode(int index, LazyBTreeNode<T> &node);
+
+    /**
+     * 将头部写入线性空间。
+     */
+    void WriteHeader();
+
+    /**
+     * 分配一个节点，优先使用释放的节点。
+     * @return 节点索引，容量不足时返回 LAZY_BTREE_NULL。
+     */
+    int AllocNode();
+
+    /**
+     * 回收索引处的节点。
+     */
+    void FreeNode(int index);
+
+    /**
+     * 计算 t 在节点中的上界，即第一个大于 t 的位置。
+     */
+    int UpperBound(LazyBTreeNode<T> &node, const T &t);
+
+    /**
+     * 分裂满的子节点，并将分隔元素插入其未满的父节点。
+     * @param parent, 父节点的索引。
+     * @param parentNode, 父节点。
+     * @param pos, 子节点在父节点中的位置。
+     * @param child, 子节点的索引。
+     * @param childNode, 子节点。
+     * @return bool, 表示分裂是否成功的布尔值。
+     */
+    bool SplitChild(int parent, LazyBTreeNode<T> &parentNode, int pos, int child,
+                    LazyBTreeNode<T> &childNode);
+
+    /**
+     * 内联方法，检查节点是否已满。
+     */
+    inline bool Full(LazyBTreeNode<T> &node) {
+        return node.count >= (node.leaf ? LazyBTreeNode<T>::LeafCapacity()
+                                        : LazyBTreeNode<T>::InnerCapacity());
+    }
+};
+
+/**
+ * 按顺序遍历懒惰 B+ 树的迭代器。它每次读取一个叶子节点，并支持移除刚刚返回的元素。
+ *
+ * @tparam T, 模板名称。
+ */
+template<typename T>
+class LazyBTreeIterator : public Iterator<T> {
+private:
+    // 指向树的指针。
+    LazyBTree<T> *tree;
+    // 当前叶子节点的索引。
+    int current;
+    // 当前叶子节点。
+    LazyBTreeNode<T> node;
+    // 下一个元素在当前叶子节点中的位置。
+    int position;
+
+public:
+    /**
+     * 使用树构造迭代器，从第一个元素开始。
+     * @param tree, 指向树的指针。
+     */
+    explicit LazyBTreeIterator(LazyBTree<T> *tree);
+
+    // 返回一个布尔值表示是否有元素。
+    virtual bool HasNext();
+
+    // 获取一个元素并将迭代器移动到下一个。
+    virtual T Next();
+
+    // 移除刚刚返回的元素。
+    virtual bool Remove();
+
+private:
+    /**
+     * 跳过空的位置，直到找到下一个元素或遍历结束。
+     */
+    void Seek();
+};
+
+/*
+ * 构造 LazyBTree。从线性空间中读取头部，如果魔数不匹配，则初始化一棵空树。
+ */
+template<typename T>
+LazyBTree<T>::LazyBTree(IPageSpace *linearSpace, TMQAddress address, TMQLSize length,
+                        Compare compare)
+    : linearSpace(linearSpace), address(address), compare(compare), header() {
+    capacity = (int) (length / LAZY_BTREE_NODE_SIZE);
+    LazyBTreeHeader stored;
+    linearSpace->Read(PAGE(address), OFFSET(address), &stored, sizeof(LazyBTreeHeader));
+    if (stored.magic == LAZY_BTREE_MAGIC) {
+        header = stored;
+    } else {
+        WriteHeader();
+    }
+}
+
+/*
+ * 读取魔数并检查。
+ */
+template<typename T>
+bool LazyBTree<T>::Exists(IPageSpace *linearSpace, TMQAddress address) {
+    unsigned int magic = 0;
+    linearSpace->Read(PAGE(address), OFFSET(address), &magic, sizeof(unsigned int));
+    return magic == LAZY_BTREE_MAGIC;
+}
+
+/*
+ * 直接返回大小。
+ */
+template<typename T>
+TMQLSize LazyBTree<T>::GetSize() {
+    return header.size;
+}
+
+/*
+ * 每次插入最多分裂查找路径上的每个节点并产生新的根节点，而且每次插入都可能增加树的高度。
+ */
+template<typename T>
+bool LazyBTree<T>::Overflow(TMQSize expand) {
+    int freeNodes = capacity - header.nodeCount + header.freeCount;
+    return freeNodes < (int) expand * (header.height + 1) + (int) (expand * (expand - 1) / 2);
+}
+
+/*
+ * 自上而下地插入元素。首先检查节点容量，然后分裂满的根节点，
+ * 在查找路径上分裂满的子节点，最后将元素插入未满的叶子节点。
+ */
+template<typename T>
+bool LazyBTree<T>::Add(const T &t) {
+    if (Overflow(1)) {
+        return false;
+    }
+    LazyBTreeNode<T> node;
+    // 空树，分配一个叶子节点作为根节点。
+    if (header.root == LAZY_BTREE_NULL) {
+        int leaf = AllocNode();
+        node.leaf = 1;
+        node.count = 1;
+        node.Values()[0] = t;
+        WriteNode(leaf, node);
+        header.root = header.head = header.tail = leaf;
+        header.height = 1;
+        header.size = 1;
+        WriteHeader();
+        return true;
+    }
+    int current = header.root;
+    ReadNode(current, node);
+    // 根节点已满，分配新的根节点，然后分裂旧的根节点。
+    if (Full(node)) {
+        int root = AllocNode();
+        LazyBTreeNode<T> rootNode;
+        rootNode.Children()[0] = current;
+        if (!SplitChild(root, rootNode, 0, current, node)) {
+            return false;
+        }
+        header.root = root;
+        header.height++;
+        current = root;
+        node = rootNode;
+    }
+    // 向下查找叶子节点，并分裂路径上的满节点。
+    while (!node.leaf) {
+        int pos = UpperBound(node, t);
+        int child = node.Children()[pos];
+        LazyBTreeNode<T> childNode;
+        ReadNode(child, childNode);
+        if (Full(childNode)) {
+            if (!SplitChild(current, node, pos, child, childNode)) {
+                return false;
+            }
+            pos = UpperBound(node, t);
+            child = node.Children()[pos];
+            ReadNode(child, childNode);
+        }
+        current = child;
+        node = childNode;
+    }
+    // 将元素插入叶子节点。
+    int pos = UpperBound(node, t);
+    T *values = node.Values();
+    for (int i = node.count; i > pos; --i) {
+        values[i] = values[i - 1];
+    }
+    values[pos] = t;
+    node.count++;
+    WriteNode(current, node);
+    header.size++;
+    WriteHeader();
+    return true;
+}
+
+/*
+ * 分裂子节点。叶子节点的右半部分移动到新节点，并将其第一个元素作为分隔元素；
+ * 内部节点的中间分隔元素上移到父节点，其右侧的分隔元素和子节点移动到新节点。
+ */
+template<typename T>
+bool LazyBTree<T>::SplitChild(int parent, LazyBTreeNode<T> &parentNode, int pos, int child,
+                              LazyBTreeNode<T> &childNode) {
+    int right = AllocNode();
+    if (right == LAZY_BTREE_NULL) {
+        return false;
+    }
+    LazyBTreeNode<T> rightNode;
+    rightNode.leaf = childNode.leaf;
+    int mid = childNode.count / 2;
+    T separator;
+    if (childNode.leaf) {
+        rightNode.count = childNode.count - mid;
+        for (int i = 0; i < rightNode.count; ++i) {
+            rightNode.Values()[i] = childNode.Values()[mid + i];
+        }
+        childNode.count = mid;
+        separator = rightNode.Values()[0];
+        // 将新节点链接到叶子链表中。
+        rightNode.prev = child;
+        rightNode.next = childNode.next;
+        if (childNode.next != LAZY_BTREE_NULL) {
+            LazyBTreeNode<T> nextNode;
+            ReadNode(childNode.next, nextNode);
+            nextNode.prev = right;
+            WriteNode(childNode.next, nextNode);
+        } else {
+            header.tail = right;
+        }
+        childNode.next = right;
+    } else {
+        rightNode.count = childNode.count - mid - 1;
+        for (int i = 0; i < rightNode.count; ++i) {
+            rightNode.Values()[i] = childNode.Values()[mid + 1 + i];
+        }
+        for (int i = 0; i <= rightNode.count; ++i) {
+            rightNode.Children()[i] = childNode.Children()[mid + 1 + i];
+        }
+        separator = childNode.Values()[mid];
+        childNode.count = mid;
+    }
+    // 将分隔元素和新节点插入父节点的 pos 位置。
+    T *values = parentNode.Values();
+    int *children = parentNode.Children();
+    for (int i = parentNode.count; i > pos; --i) {
+        values[i] = values[i - 1];
+        children[i + 1] = children[i];
+    }
+    values[pos] = separator;
+    children[pos + 1] = right;
+    parentNode.count++;
+    WriteNode(right, rightNode);
+    WriteNode(child, childNode);
+    WriteNode(parent, parentNode);
+    WriteHeader();
+    return true;
+}
+
+/*
+ * 从根节点向下查找，在叶子节点中检查相等的元素。
+ */
+template<typename T>
+bool LazyBTree<T>::Find(const T &t, T &found) {
+    if (header.root == LAZY_BTREE_NULL) {
+        return false;
+    }
+    LazyBTreeNode<T> node;
+    ReadNode(header.root, node);
+    while (!node.leaf) {
+        ReadNode(node.Children()[UpperBound(node, t)], node);
+    }
+    int pos = UpperBound(node, t) - 1;
+    if (pos >= 0 && compare((void *) &t, (void *) &node.Values()[pos]) == 0) {
+        found = node.Values()[pos];
+        return true;
+    }
+    return false;
+}
+
+/*
+ * 找到相等的元素后，只写入其所在的叶子节点。
+ */
+template<typename T>
+bool LazyBTree<T>::Set(const T &t) {
+    if (header.root == LAZY_BTREE_NULL) {
+        return false;
+    }
+    int current = header.root;
+    LazyBTreeNode<T> node;
+    ReadNode(current, node);
+    while (!node.leaf) {
+        current = node.Children()[UpperBound(node, t)];
+        ReadNode(current, node);
+    }
+    int pos = UpperBound(node, t) - 1;
+    if (pos < 0 || compare((void *) &t, (void *) &node.Values()[pos]) != 0) {
+        return false;
+    }
+    node.Values()[pos] = t;
+    WriteNode(current, node);
+    return true;
+}
+
+/*
+ * 移除元素，步骤如下：
+ * 1. 从根节点向下查找，并记录查找路径。
+ * 2. 从叶子节点中移除元素，如果叶子节点不为空，直接写入并返回。
+ * 3. 叶子节点为空时，将其从叶子链表中移除并回收，然后从父节点中移除其索引，
+ *  父节点也为空时继续向上处理。
+ * 4. 根节点只剩一个子节点时，使用该子节点作为新的根节点。
+ */
+template<typename T>
+bool LazyBTree<T>::Remove(const T &t) {
+    if (header.root == LAZY_BTREE_NULL) {
+        return false;
+    }
+    int path[LAZY_BTREE_MAX_HEIGHT];
+    int positions[LAZY_BTREE_MAX_HEIGHT];
+    int depth = 0;
+    int current = header.root;
+    LazyBTreeNode<T> node;
+    ReadNode(current, node);
+    while (!node.leaf && depth < LAZY_BTREE_MAX_HEIGHT) {
+        path[depth] = current;
+        positions[depth] = UpperBound(node, t);
+        current = node.Children()[positions[depth]];
+        depth++;
+        ReadNode(current, node);
+    }
+    int pos = UpperBound(node, t) - 1;
+    if (pos < 0 || compare((void *) &t, (void *) &node.Values()[pos]) != 0) {
+        return false;
+    }
+    T *values = node.Values();
+    for (int i = pos; i + 1 < node.count; ++i) {
+        values[i] = values[i + 1];
+    }
+    node.count--;
+    header.size--;
+    if (node.count > 0) {
+        WriteNode(current, node);
+        WriteHeader();
+        return true;
+    }
+    // 叶子节点为空，将其从叶子链表中移除。
+    LazyBTreeNode<T> linkNode;
+    if (node.prev != LAZY_BTREE_NULL) {
+        ReadNode(node.prev, linkNode);
+        linkNode.next = node.next;
+        WriteNode(node.prev, linkNode);
+    } else {
+        header.head = node.next;
+    }
+    if (node.next != LAZY_BTREE_NULL) {
+        ReadNode(node.next, linkNode);
+        linkNode.prev = node.prev;
+        WriteNode(node.next, linkNode);
+    } else {
+        header.tail = node.prev;
+    }
+    FreeNode(current);
+    // 从父节点中移除空节点，父节点为空时继续向上处理。
+    bool empty = true;
+    while (empty && depth > 0) {
+        depth--;
+        current = path[depth];
+        ReadNode(current, node);
+        if (node.count == 0) {
+            FreeNode(current);
+            continue;
+        }
+        int childPos = positions[depth];
+        int keyPos = childPos > 0 ? childPos - 1 : 0;
+        for (int i = keyPos; i + 1 < node.count; ++i) {
+            node.Values()[i] = node.Values()[i + 1];
+        }
+        for (int i = childPos; i < node.count; ++i) {
+            node.Children()[i] = node.Children()[i + 1];
+        }
+        node.count--;
+        WriteNode(current, node);
+        empty = false;
+    }
+    // 整棵树为空。
+    if (empty) {
+        header.root = header.head = header.tail = LAZY_BTREE_NULL;
+        header.height = 0;
+    }
+    // 降低树的高度。
+    while (header.root != LAZY_BTREE_NULL && header.height > 1) {
+        ReadNode(header.root, node);
+        if (node.count > 0) {
+            break;
+        }
+        FreeNode(header.root);
+        header.root = node.Children()[0];
+        header.height--;
+    }
+    WriteHeader();
+    return true;
+}
+
+/*
+ * 读取最后一个叶子节点，返回其最后一个元素。
+ */
+template<typename T>
+bool LazyBTree<T>::Last(T &last) {
+    if (header.tail == LAZY_BTREE_NULL) {
+        return false;
+    }
+    LazyBTreeNode<T> node;
+    ReadNode(header.tail, node);
+    if (node.count <= 0) {
+        return false;
+    }
+    last = node.Values()[node.count - 1];
+    return true;
+}
+
+/*
+ * 没有必要处理每个节点，直接重置头部。
+ */
+template<typename T>
+void LazyBTree<T>::Clear() {
+    header = LazyBTreeHeader();
+    WriteHeader();
+}
+
+/*
+ * 从线性空间中读取整个节点。
+ */
+template<typename T>
+void LazyBTree<T>::ReadNode(int index, LazyBTreeNode<T> &node) {
+    linearSpace->Read(PAGE(address), Offset(index), &node, sizeof(LazyBTreeNode<T>));
+}
+
+/*
+ * 将整个节点写入线性空间，节点不会跨越页面。
+ */
+template<typename T>
+void LazyBTree<T>::WriteNode(int index, LazyBTreeNode<T> &node) {
+    linearSpace->Write(PAGE(address), Offset(index), &node, sizeof(LazyBTreeNode<T>));
+}
+
+/*
+ * 写入头部。
+ */
+template<typename T>
+void LazyBTree<T>::WriteHeader() {
+    linearSpace->Write(PAGE(address), OFFSET(address), &header, sizeof(LazyBTreeHeader));
+}
+
+/*
+ * 首先从释放节点链表中分配，然后使用从未使用过的节点。
+ */
+template<typename T>
+int LazyBTree<T>::AllocNode() {
+    if (header.freeNode != LAZY_BTREE_NULL) {
+        int index = header.freeNode;
+        LazyBTreeNode<T> node;
+        ReadNode(index, node);
+        header.freeNode = node.next;
+        header.freeCount--;
+        return index;
+    }
+    if (header.nodeCount < capacity) {
+        return header.nodeCount++;
+    }
+    return LAZY_BTREE_NULL;
+}
+
+/*
+ * 将节点加入释放节点链表。
+ */
+template<typename T>
+void LazyBTree<T>::FreeNode(int index) {
+    LazyBTreeNode<T> node;
+    node.next = header.freeNode;
+    WriteNode(index, node);
+    header.freeNode = index;
+    header.freeCount++;
+}
+
+/*
+ * 二分查找第一个大于 t 的位置，范围为 [0-count]。
+ */
+template<typename T>
+int LazyBTree<T>::UpperBound(LazyBTreeNode<T> &node, const T &t) {
+    int start = 0, end = node.count;
+    T *values = node.Values();
+    while (start < end) {
+        int p = (start + end) / 2;
+        if (compare((void *) &t, (void *) &values[p]) >= 0) {
+            start = p + 1;
+        } else {
+            end = p;
+        }
+    }
+    return start;
+}
+
+/*
+ * 读取第一个叶子节点。
+ */
+template<typename T>
+LazyBTreeIterator<T>::LazyBTreeIterator(LazyBTree<T> *tree)
+    : tree(tree), current(tree->Head()), node(), position(0) {
+    if (current != LAZY_BTREE_NULL) {
+        tree->ReadNode(current, node);
+    }
+    Seek();
+}
+
+/*
+ * 当前叶子节点读取完毕时，读取下一个叶子节点。
+ */
+template<typename T>
+void LazyBTreeIterator<T>::Seek() {
+    while (current != LAZY_BTREE_NULL && position >= node.count) {
+        current = node.next;
+        position = 0;
+        if (current != LAZY_BTREE_NULL) {
+            tree->ReadNode(current, node);
+        }
+    }
+}
+
+template<typename T>
+bool LazyBTreeIterator<T>::HasNext() {
+    return current != LAZY_BTREE_NULL;
+}
+
+template<typename T>
+T LazyBTreeIterator<T>::Next() {
+    T t = node.Values()[position++];
+    Seek();
+    return t;
+}
+
+/*
+ * 从树中移除刚刚返回的元素，然后重新读取当前叶子节点，因为它的元素已经移动。
+ * 如果刚刚返回的元素位于上一个叶子节点，其移除不影响当前的位置。
+ */
+template<typename T>
+bool LazyBTreeIterator<T>::Remove() {
+    if (current == LAZY_BTREE_NULL) {
+        T last;
+        if (!tree->Last(last)) {
+            return false;
+        }
+        return tree->Remove(last);
+    }
+    if (position == 0) {
+        if (node.prev == LAZY_BTREE_NULL) {
+            return false;
+        }
+        LazyBTreeNode<T> prevNode;
+        tree->ReadNode(node.prev, prevNode);
+        if (!tree->Remove(prevNode.Values()[prevNode.count - 1])) {
+            return false;
+        }
+        tree->ReadNode(current, node);
+        return true;
+    }
+    if (!tree->Remove(node.Values()[position - 1])) {
+        return false;
+    }
+    position--;
+    tree->ReadNode(current, node);
+    return true;
+}
+
+#endif //LAZY_BTREE_H
@@ -64,6 +64,14 @@ public:
      * 用零初始化内存空间。
      */
     virtual void Zero(int page, int offset, int len);
+
+    /**
+     * 内存页面的读取只有内存复制，总是可以并发读取。
+     * @return 总是返回 true。
+     */
+    bool PrepareConcurrentRead() override {
+        return true;
+    }
 };
 
 #endif //MEMSPACE_H
\ No newline at end of file
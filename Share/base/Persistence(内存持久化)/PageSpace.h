@@ -73,6 +73,22 @@ public:
      */
     virtual void Zero(int page, int offset, int len) = 0;
 
+    /**
+     * 将写入的内容同步到存储介质，之后的断电不会丢失这些内容。默认什么都不做，适用于内存中的页面空间。
+     * @return 表示同步是否成功的布尔值。
+     */
+    virtual bool Sync() {
+        return true;
+    }
+
+    /**
+     * 准备并发读取，之后在没有写入和分配的期间多个线程可以同时读取。默认不支持。
+     * @return 表示是否可以并发读取的布尔值。
+     */
+    virtual bool PrepareConcurrentRead() {
+        return false;
+    }
+
     /**
      * 虚析构函数。
      */
@@ -2,6 +2,7 @@
 #include "Defines.h"
 #include "Persistence.h"
 #include "LazyLinearList.h"
+#include "LazyBTree.h"
 #include "LazyLinkList.h"
 #include "SectionSpace.h"
 
@@ -13,6 +14,7 @@
 #define SECTIONS_ADDRESS            ADDRESS(SECTIONS_PAGE_START, SECTIONS_PAGE_OFFSET)
 #define ALLOC_FACTOR                0.2
 #define ALLOC_OVERFLOW              2
+#define PAGE_TREE_GROWTH            3
 
 /*
  * Construct a persistence. Two important steps:
@@ -33,14 +35,18 @@ Persistence::Persistence(IPageSpace *pageSpace) : pageSpace(pageSpace), sectionS
         pageSpace->Allocate(SECTIONS_PAGE_START, SECTIONS_PAGE_COUNT);
         lazySectionList->Add(MetaSection(SECTION_ALLOC));
     }
+    UpgradePageTable();
 }
 
 /*
- * Destructor, delete lazySectionList.
+ * Destructor, delete the section spaces and lazySectionList.
  */
 /*
-析构函数，删除lazySectionList。 */
+析构函数，删除部分空间和lazySectionList。 */
 Persistence::~Persistence() {
+    for (int i = 0; i < sectionSpaces.Size(); ++i) {
+        delete (SectionSpace *) sectionSpaces.Get(i);
+    }
     delete lazySectionList;
 }
 
@@ -106,7 +112,11 @@ void Persistence::EraseLinearSpace(const char *name) {
     if (!name || strcmp(SECTION_ALLOC, name) == 0) {
         return;
     }
-    // Erase the section.
+    // Erase the section, the freed allocations of its space are gone.
+    auto *sectionSpace = (SectionSpace *) FindLinearSpace(name);
+    if (sectionSpace) {
+        sectionSpace->InvalidateFreeIndex();
+    }
     EraseSection(name);
 }
 
@@ -171,6 +181,7 @@ int Persistence::AllocPages(int size, int *real) {
     }
     MetaSection allocSection = lazySectionList->Get(secIndex);
     int oldSectionPage = PAGE_NULL;
+    bool created = allocSection.start == PAGE_NULL;
     // Check whether the allocSection is overflow, if it is overflow, move it to new section.
     if (allocSection.start == PAGE_NULL || Overflow(allocSection, ALLOC_OVERFLOW)) {
         int newCount = (int) (allocSection.count * (1 + ALLOC_FACTOR) + 1);
@@ -194,12 +205,16 @@ int Persistence::AllocPages(int size, int *real) {
     // save to alloc space
     TMQAddress allocAddress = ADDRESS(allocSection.start, 0);
     TMQSize allocCapacity = allocSection.count * TMQ_PAGE_SIZE;
-    LazyLinearList<MetaPage> lazyPageList(pageSpace, allocAddress, allocCapacity);
+    LazyBTree<MetaPage> pageTree(pageSpace, allocAddress, allocCapacity, PageCompare);
+    // The new pages of the section may hold stale data, start with an empty tree.
+    if (created) {
+        pageTree.Clear();
+    }
     if (sectionPage.start != PAGE_NULL && sectionPage.count > 0) {
-        lazyPageList.Add(sectionPage, PageCompare);
+        pageTree.Add(sectionPage);
     }
     if (allocPage.start != PAGE_NULL && allocPage.count > 0) {
-        lazyPageList.Add(allocPage, PageCompare);
+        pageTree.Add(allocPage);
     }
     *real = allocPage.count;
     // Deallocate old section page.
@@ -229,21 +244,25 @@ int Persistence::ReusePages(int size, int *real) {
         }
     }
     // Check whether the SECTION_ALLOC is exist or not.
+    MetaSection pageSection;
     if (sectionIndex >= 0) {
-        MetaSection pageSection = lazySectionList->Get(sectionIndex);
+        pageSection = lazySectionList->Get(sectionIndex);
+    }
+    if (pageSection.start > 0) {
         TMQAddress pageAddress = ADDRESS(pageSection.start, 0);
         TMQSize capacity = pageSection.count * TMQ_PAGE_SIZE;
-        LazyLinearList<MetaPage> lazyPageList(pageSpace, pageAddress, capacity);
+        LazyBTree<MetaPage> pageTree(pageSpace, pageAddress, capacity, PageCompare);
         // Algorithm for calculating the freed pages that can meet the required size.
         unsigned int last = PAGE_NULL;
         unsigned int combLen = 0;
-        int combIndex = -1;
-        for (int i = 0; i < lazyPageList.GetSize(); ++i) {
-            MetaPage indexPage = lazyPageList.Get(i);
+        unsigned int combStart = PAGE_NULL;
+        LazyBTreeIterator<MetaPage> iterator(&pageTree);
+        while (iterator.HasNext()) {
+            MetaPage indexPage = iterator.Next();
             if (indexPage.occupied) {
                 last = PAGE_NULL;
                 combLen = 0;
-                combIndex = -1;
+                combStart = PAGE_NULL;
                 continue;
             }
             if (last == indexPage.start && !indexPage.occupied) {
@@ -251,7 +270,7 @@ int Persistence::ReusePages(int size, int *real) {
             } else {
                 last = indexPage.start;
                 combLen = indexPage.count;
-                combIndex = i;
+                combStart = indexPage.start;
             }
             // The length is fulfilled the required size, break the loop.
             if (combLen >= size) {
@@ -260,20 +279,20 @@ int Persistence::ReusePages(int size, int *real) {
             last = indexPage.start + indexPage.count;
         }
         // Find success, do page reuse.
-        if (combIndex >= 0 && combLen >= size) {
-            LOG_DEBUG("Reuse pages, page:%d ,combine count:%d, combine index:%d, Size:%d",
-                      last, combLen, combIndex, size);
-            MetaPage combPage = lazyPageList.Get(combIndex);
-            unsigned int page = combPage.start;
-            // The left pages has been combined, Release them.
-            while (combPage.count > 0 && combPage.start <= last) {
-                lazyPageList.Remove(combIndex);
-                combPage = lazyPageList.Get(combIndex);
+        if (combStart != PAGE_NULL && combLen >= size) {
+            LOG_DEBUG("Reuse pages, page:%d ,combine count:%d, combine start:%d, Size:%d",
+                      last, combLen, combStart, size);
+            // The left pages has been combined, Release them one by one from the tree.
+            MetaPage combPage;
+            unsigned int page = combStart;
+            while (page <= last && pageTree.Find(MetaPage(page, 0), combPage)) {
+                pageTree.Remove(combPage);
+                page = combPage.start + combPage.count;
             }
             // Assigned the new real length.
             *real = combLen;
             // Return the page index.
-            return page;
+            return combStart;
         }
     }
     *real = 0;
@@ -298,27 +317,20 @@ void Persistence::DeallocPages(int page) {
     }
     TMQAddress allocAddress = ADDRESS(allocPageSection.start, 0);
     TMQSize allocCapacity = allocPageSection.count * TMQ_PAGE_SIZE;
-    LazyLinearList<MetaPage> lazyPageList(pageSpace, allocAddress, allocCapacity);
-    MetaPage metaPage(page, 0, false);
-    // Find its position with quick sort algorithm.
-    int pos = lazyPageList.FindPosition(metaPage, PageCompare);
-    if (pos < 0 || pos >= lazyPageList.GetSize()) {
-        return;
-    }
-    // Get the meta page at pos.
-    MetaPage allocPage = lazyPageList.Get(pos);
-    if (allocPage.start != metaPage.start) {
+    LazyBTree<MetaPage> pageTree(pageSpace, allocAddress, allocCapacity, PageCompare);
+    // Find the meta page through the tree.
+    MetaPage allocPage;
+    if (!pageTree.Find(MetaPage(page, 0, false), allocPage)) {
         return;
     }
     allocPage.occupied = false;
-    lazyPageList.Set(pos, allocPage);
+    pageTree.Set(allocPage);
     // Loop to free pages faraway
-    MetaPage allocFarawayPage = lazyPageList.Get(lazyPageList.GetSize() - 1);
-    while (!allocFarawayPage.occupied) {
+    MetaPage allocFarawayPage;
+    while (pageTree.Last(allocFarawayPage) && !allocFarawayPage.occupied) {
         LOG_DEBUG("Deallocate page:%d, %d", allocFarawayPage.start, allocFarawayPage.count);
         pageSpace->Deallocate(allocFarawayPage.start);
-        lazyPageList.Remove(lazyPageList.GetSize() - 1);
-        allocFarawayPage = lazyPageList.Get(lazyPageList.GetSize() - 1);
+        pageTree.Remove(allocFarawayPage);
     }
 }
 
@@ -372,6 +384,10 @@ bool Persistence::ResizeSection(MetaSection &section, TMQSize reserve) {
     }
     MetaPage tmpPage(section.start, section.count);
     int newLen = (int) (section.count + section.count * ALLOC_FACTOR + 1);
+    // Grow again until the reserve count fits, a large reserve needs more than one step.
+    while (Overflow(MetaSection(section.name, section.start, newLen), reserve)) {
+        newLen = (int) (newLen + newLen * ALLOC_FACTOR + 1);
+    }
     // Allocate new pages for this section.
     int newPage = AllocPages(newLen, &newLen);
     if (newPage < 0) {
@@ -514,19 +530,71 @@ bool Persistence::Overflow(const MetaSection &section, TMQSize expand) {
     if (section.start < 0 || section.count <= 0 || expand == 0) {
         return false;
     }
-    // If the section is SECTION_ALLOC, we use LazyLinearList<MetaPage> to check the overflow,
+    // If the section is SECTION_ALLOC, we use LazyBTree<MetaPage> to check the overflow,
     // if the section is others, we use LazyLinearList<SecAlloc> to check the overflow.
     TMQAddress address = ADDRESS(section.start, 0);
     TMQSize capacity = section.count * TMQ_PAGE_SIZE;
     if (strcmp(section.name, SECTION_ALLOC) == 0) {
-        LazyLinearList<MetaPage> lazyPageList(pageSpace, address, capacity);
-        return lazyPageList.GetSize() + expand > lazyPageList.GetCapacity();
+        LazyBTree<MetaPage> pageTree(pageSpace, address, capacity, PageCompare);
+        return pageTree.Overflow(expand);
     } else {
         LazyLinearList<SecAlloc> lazyAllocList(pageSpace, address, capacity);
         return lazyAllocList.GetSize() + expand > lazyAllocList.GetCapacity();
     }
 }
 
+/*
+ * Convert the page table saved as a linear list by earlier versions to a tree. The tree needs more
+ * space than the list, so it is built on new pages, then the old pages are released through it.
+ */
+/*
+将早期版本以线性列表保存的页面表转换为树。树需要比列表更多的空间，因此在新页面上构建，然后通过树释放旧页面。
+*/
+void Persistence::UpgradePageTable() {
+    int secIndex = -1;
+    for (int i = 0; i < lazySectionList->GetSize(); ++i) {
+        if (strcmp(lazySectionList->Get(i).name, SECTION_ALLOC) == 0) {
+            secIndex = i;
+            break;
+        }
+    }
+    if (secIndex < 0) {
+        return;
+    }
+    MetaSection pageSection = lazySectionList->Get(secIndex);
+    TMQAddress pageAddress = ADDRESS(pageSection.start, 0);
+    if (pageSection.start <= 0 || pageSection.count <= 0
+        || LazyBTree<MetaPage>::Exists(pageSpace, pageAddress)) {
+        return;
+    }
+    // Read all of the meta pages before the list is gone.
+    LazyLinearList<MetaPage> lazyPageList(pageSpace, pageAddress,
+                                          pageSection.count * TMQ_PAGE_SIZE);
+    List<MetaPage> metaPages;
+    for (int i = 0; i < lazyPageList.GetSize(); ++i) {
+        metaPages.Add(lazyPageList.Get(i));
+    }
+    int newCount = pageSection.count * PAGE_TREE_GROWTH + 1;
+    int newPage = pageSpace->Allocate(PAGE_UNFIXED, newCount);
+    if (newPage < 0) {
+        return;
+    }
+    LazyBTree<MetaPage> pageTree(pageSpace, ADDRESS(newPage, 0), newCount * TMQ_PAGE_SIZE,
+                                 PageCompare);
+    pageTree.Clear();
+    for (int i = 0; i < metaPages.Size(); ++i) {
+        pageTree.Add(metaPages.Get(i));
+    }
+    pageTree.Add(MetaPage(newPage, newCount, true));
+    pageSection.start = newPage;
+    pageSection.count = newCount;
+    lazySectionList->Set(secIndex, pageSection);
+    LOG_DEBUG("Upgrade page table, page:%d, count:%d, size:%d", newPage, newCount,
+              metaPages.Size());
+    // Release the pages of the list.
+    DeallocPages((int) PAGE(pageAddress));
+}
+
 /*
  * Get the allocated page size associated with specified page.
  */
@@ -547,15 +615,11 @@ int Persistence::GetAllocPageSize(int page) {
         // Read the meta page information from SECTION_ALLOC and return its count.
         TMQAddress pageAddress = ADDRESS(pageSection.start, 0);
         TMQSize capacity = pageSection.count * TMQ_PAGE_SIZE;
-        LazyLinearList<MetaPage> lazyPageList(pageSpace, pageAddress, capacity);
-        MetaPage metaPage(page, 0);
-        int pos = lazyPageList.FindPosition(metaPage, PageCompare);
-        if (pos >= 0 && pos < lazyPageList.GetSize()) {
-            MetaPage foundPage = lazyPageList.Get(pos);
-            // The meta page is found, return its count.
-            if (foundPage.start == page) {
-                return (int) foundPage.count;
-            }
+        LazyBTree<MetaPage> pageTree(pageSpace, pageAddress, capacity, PageCompare);
+        MetaPage foundPage;
+        // The meta page is found, return its count.
+        if (pageTree.Find(MetaPage(page, 0), foundPage)) {
+            return (int) foundPage.count;
         }
     }
     return -1;
@@ -564,14 +628,17 @@ int Persistence::GetAllocPageSize(int page) {
 /*
  * Copy data to the end of the destination section space from the source section space. Main steps:
  * 1. Find the meta section for the source and destination linear space.
- * 2. Resize the destination section space for adding new elements.
- * 3. Copy element from the source section space to destination section space one by one.
+ * 2. Resize the destination section space for adding new elements, through its section space if it
+ *  is created, so that the section space sees the moved section.
+ * 3. Copy element from the source section space to destination section space one by one. The
+ *  elements are renumbered after the last one of the destination, so that the section addresses
+ *  stay unique and ordered by their alloc ids, and the copied elements can be found by them.
  */
 /*
 将数据从源节空间复制到目标节空间的末尾。主要步骤：
 查找源和目标线性空间的元节。
-调整目标节空间的大小以添加新元素。
-逐一将元素从源节空间复制到目标节空间。
+调整目标节空间的大小以添加新元素，目标节空间已创建时通过它调整。
+逐一将元素从源节空间复制到目标节空间，并在目标的最后一个元素之后重新编号。
 */
 bool Persistence::AppendLinearSpace(const char *dst, const char *src) {
     // Find source meta section.
@@ -582,23 +649,44 @@ bool Persistence::AppendLinearSpace(const char *dst, const char *src) {
     if (srcSection.start <= 0 || dstSection.start <= 0) {
         return false;
     }
-    TMQAddress pageAddress = ADDRESS(dstSection.start, 0);
-    TMQSize capacity = dstSection.count * TMQ_PAGE_SIZE;
-    LazyLinearList<SecAlloc> dstAllocList(pageSpace, pageAddress, capacity);
-    pageAddress = ADDRESS(srcSection.start, 0);
-    capacity = srcSection.count * TMQ_PAGE_SIZE;
+    TMQAddress pageAddress = ADDRESS(srcSection.start, 0);
+    TMQSize capacity = srcSection.count * TMQ_PAGE_SIZE;
     LazyLinearList<SecAlloc> srcAllocList(pageSpace, pageAddress, capacity);
     // Resize the destination space for reserving srcAllocList.GetSize() space.
-    if (!ResizeSection(dstSection, srcAllocList.GetSize())) {
+    LazyLinearList<SecAlloc> localAllocList;
+    LazyLinearList<SecAlloc> *dstAllocList = nullptr;
+    auto *dstSpace = (SectionSpace *) FindLinearSpace(dst);
+    if (dstSpace) {
+        dstAllocList = dstSpace->GetLazyAllocList(srcAllocList.GetSize());
+    } else if (ResizeSection(dstSection, srcAllocList.GetSize())) {
+        pageAddress = ADDRESS(dstSection.start, 0);
+        capacity = dstSection.count * TMQ_PAGE_SIZE;
+        localAllocList = LazyLinearList<SecAlloc>(pageSpace, pageAddress, capacity);
+        dstAllocList = &localAllocList;
+    }
+    if (dstAllocList == nullptr) {
         return false;
     }
+    unsigned int allocId = 0;
+    if (dstAllocList->GetSize() > 0) {
+        allocId = SECTION_ALLOC_ID(dstAllocList->Get((long) dstAllocList->GetSize() - 1).secAddress);
+    }
     // Copy elements one by one to the end of the destination section space.
     for (int i = 0; i < srcAllocList.GetSize(); ++i) {
         SecAlloc srcAlloc = srcAllocList.Get(i);
-        dstAllocList.Add(srcAlloc);
+        srcAlloc.secAddress = SECTION_ADDRESS(dstAllocList->GetSize(), ++allocId);
+        dstAllocList->Add(srcAlloc);
     }
     // Clear source section space.
     srcAllocList.Clear();
+    // The freed allocations are moved, the free indexes are built again.
+    if (dstSpace) {
+        dstSpace->InvalidateFreeIndex();
+    }
+    auto *srcSpace = (SectionSpace *) FindLinearSpace(src);
+    if (srcSpace) {
+        srcSpace->InvalidateFreeIndex();
+    }
     return true;
 }
 
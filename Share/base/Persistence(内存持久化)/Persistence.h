@@ -62,6 +62,11 @@ private:
     // 元部分列表。
     LazyLinearList<MetaSection> *lazySectionList;
 
+    /**
+     * 将早期版本以 LazyLinearList 保存的页面表转换为 LazyBTree，构造时调用一次。
+     */
+    void UpgradePageTable();
+
 public:
     /**
      * 使用页面空间构造持久性。
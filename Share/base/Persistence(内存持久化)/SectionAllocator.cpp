@@ -21,11 +21,27 @@ int AllocCompare(void *p1, void *p2) {
     return allocId > anotherId ? 1 : -1;
 }
 
+/*
+ * 构造函数，释放索引在第一次使用时建立。
+ */
+SectionAllocator::SectionAllocator() : freeLists{nullptr}, indexed(false) {
+
+}
+
+/*
+ * 析构函数，删除释放索引中的所有块。
+ */
+SectionAllocator::~SectionAllocator() {
+    InvalidateFreeIndex();
+}
+
 /*
  * 分配所需长度的线性空间。在分配新的线性空间之前，首先进行地址重用。
  * 如果地址分配成功，将 tmq 地址保存到部分空间并返回部分 tmq 地址。
  */
 TMQAddress SectionAllocator::Allocate(TMQLSize length) {
+    // 建立释放索引。
+    BuildFreeIndex();
     // 进行地址重用，如果成功，直接返回地址。
     TMQAddress secAddress = ReuseAddress(length);
     if (secAddress != ADDRESS_NULL) {
@@ -40,10 +56,10 @@ TMQAddress SectionAllocator::Allocate(TMQLSize length) {
     }
     TMQAddress allocAddress = ADDRESS(allocPage, 0);
     TMQSize allocLen = allocSize * TMQ_PAGE_SIZE;
-    // 保存分配页面空间的释放部分。
+    // 保存分配页面空间的释放部分，新页面中没有相邻的释放块。
     SecAlloc leftAlloc(secAddress, allocAddress + length, allocLen - length, ADDRESS_FREE);
     leftAlloc.secAddress = AppendAlloc(leftAlloc.address, leftAlloc.size, leftAlloc.state);
-    freedAllocTree.Insert(Pair<TMQAddress, SecAlloc>(leftAlloc.address, leftAlloc));
+    AddChunk(leftAlloc);
     // 保存并返回分配的部分。
     SecAlloc metaAlloc(secAddress, allocAddress, length, ADDRESS_ALLOC);
     metaAlloc.secAddress = AppendAlloc(metaAlloc.address, metaAlloc.size, metaAlloc.state);
@@ -52,106 +68,78 @@ TMQAddress SectionAllocator::Allocate(TMQLSize length) {
 
 /*
  * 释放部分地址。当地址有效时，我们将找到与此部分地址关联的 SecAlloc。
- * 然后将 SecAlloc 的状态从 ADDRESS_ALLOC 更改为 ADDRESS_FREE，并将其放入释放地址映射中。
- * 最后，我们将切换 TryFreePage 任务。
+ * 然后将 SecAlloc 的状态从 ADDRESS_ALLOC 更改为 ADDRESS_FREE，并将其加入释放索引，
+ * 它将与相邻的释放块合并。已释放的地址将被忽略。
  */
 void SectionAllocator::Deallocate(TMQAddress address) {
     if (address == ADDRESS_NULL) {
         return;
     }
+    // 在部分空间改变之前建立释放索引。
+    BuildFreeIndex();
     // 查找与此部分地址关联的 SecAlloc
     SecAlloc indexAlloc;
     int allocIndex = FindAlloc(address, indexAlloc);
     // 查找失败，忽略。
-    if (allocIndex < 0) {
+    if (allocIndex < 0 || indexAlloc.state != ADDRESS_ALLOC) {
         return;
     }
     auto *lazyLinearList = GetLazyAllocList();
     if (!lazyLinearList) {
         return;
     }
-    // 将状态更改为 ADDRESS_FREE，并将此释放的 tmq 地址放入 freedAllocTree。
+    // 将状态更改为 ADDRESS_FREE，并将此释放的 tmq 地址加入释放索引。
     indexAlloc.state = ADDRESS_FREE;
     lazyLinearList->Set(allocIndex, indexAlloc);
-    freedAllocTree.Insert(Pair<TMQAddress, SecAlloc>(indexAlloc.address, indexAlloc));
-    // 调用页面释放任务。
-    TryFreePage(indexAlloc.address);
+    InsertFree(indexAlloc);
 }
 
 /*
- * 进行地址重用的方法。对于线性存储空间，我们总是重用线性空间开头的地址。
- * 这就是为什么我们使用 RbTree 存储 tmq 地址的原因。
- * 因为 RbTree 可以按升序存储所有释放的地址。因此，我们可以搜索 RbTree 开头的释放地址。
- * 找到一个满足空间要求的线性空间后，我们可以直接重用地址，
- * 或者我们可以分割长的线性空间，或者合并一些小的线性空间。
+ * 进行地址重用的方法。首先在请求大小所在的类别中检查有限个块，
+ * 然后从更大的类别中取第一个块，更大类别中的块都满足空间要求。
+ * 找到块后，我们直接重用地址，或者分割它，剩余部分作为新的释放块。
  */
 TMQAddress SectionAllocator::ReuseAddress(TMQSize size) {
     if (size == 0) {
         return ADDRESS_NULL;
     }
-    // 切换释放地址读取任务。
-    GetFreedAllocList();
-
-    // 遍历 freedAllocTree 以计算满足空间要求的线性空间。
-    int page = -1, count = 0;
-    TMQSize candidate = 0;
-    RbIterator<TMQAddress, SecAlloc> indexIterator = freedAllocTree.begin();
-    while (indexIterator != freedAllocTree.end()) {
-        SecAlloc metaAlloc = indexIterator->value;
-        if (page == PAGE(metaAlloc.address)) {
-            candidate += metaAlloc.size;
-            count += 1;
-        } else {
-            candidate = metaAlloc.size;
-            count = 1;
-            page = PAGE(metaAlloc.address);
-        }
-        if (candidate >= size) {
-            break;
-        }
-        indexIterator++;
+    FreeChunk *found = nullptr;
+    int sizeClass = SizeClass(size);
+    FreeChunk *chunk = freeLists[sizeClass];
+    for (int i = 0; chunk && i < FREE_CLASS_SCAN && !found; ++i, chunk = chunk->next) {
+        found = chunk->alloc.size >= size ? chunk : nullptr;
     }
-    // 检查候选者是否 < size，true 表示查找失败。
-    if (candidate < size) {
+    for (int i = sizeClass + 1; i < FREE_CLASS_COUNT && !found; ++i) {
+        found = freeLists[i];
+    }
+    if (!found) {
         return ADDRESS_NULL;
     }
     /**
-     * 我们找到了重用的地址（es），现在执行以下操作：
-     * 1th. 从部分空间释放候选地址（es）
-     * 2th. 将分配地址添加到部分空间
-     * 3th. 将左侧释放地址添加到部分空间
-     * 4th. 从 freeAllocList 中删除候选地址（es）
-     * 5th. 将左侧释放地址添加到 freeAllocList
-     * 6th. 返回重用的 tmq 地址
-     * 注意事项：步骤 1、2、3 应该原子性地成功，由于我们现在没有事务机制，这将被视为已知问题。
+     * 我们找到了重用的块，现在执行以下操作：
+     * 1th. 从部分空间释放块
+     * 2th. 从释放索引中删除块
+     * 3th. 将分配地址添加到部分空间
+     * 4th. 将剩余的释放地址添加到部分空间和释放索引
+     * 5th. 返回重用的 tmq 地址
+     * 注意事项：这些步骤应该原子性地成功，由于我们现在没有事务机制，这将被视为已知问题。
+     * 先释放再添加，中断时最多丢失空间，而不会重复分配。
      */
-
-    // 从部分释放所有线性空间。
-    RbIterator<TMQAddress, SecAlloc> startIterator = indexIterator;
-    for (int i = 0; i < count - 1; ++i) {
-        startIterator--;
-    }
-    RbIterator<TMQAddress, SecAlloc> iterator = indexIterator;
-    for (int i = 0; i < count; ++i, --iterator) {
-        ReleaseAlloc(iterator->value.secAddress);
-    }
-    // 记录（附加）候选线性空间到部分
-    SecAlloc startAlloc = startIterator->value;
+    SecAlloc startAlloc = found->alloc;
+    ReleaseAlloc(startAlloc.secAddress);
+    RemoveChunk(found);
     TMQAddress allocAddress = AppendAlloc(startAlloc.address, size, ADDRESS_ALLOC);
     if (allocAddress == ADDRESS_NULL) {
         return ADDRESS_NULL;
     }
-
-    RbIterator<TMQAddress, SecAlloc> endIterator = indexIterator;
-    endIterator++;
-    while (startIterator != endIterator) {
-        freedAllocTree.Erase(startIterator++);
-    }
     // 附加剩余空间
-    if (candidate > size) {
-        SecAlloc leftAlloc(ADDRESS_NULL, startAlloc.address + size, candidate - size, ADDRESS_FREE);
+    if (startAlloc.size > size) {
+        SecAlloc leftAlloc(ADDRESS_NULL, startAlloc.address + size, startAlloc.size - size,
+                           ADDRESS_FREE);
         leftAlloc.secAddress = AppendAlloc(leftAlloc.address, leftAlloc.size, ADDRESS_FREE);
-        freedAllocTree.Insert(Pair<TMQAddress, SecAlloc>(leftAlloc.address, leftAlloc));
+        if (leftAlloc.secAddress != ADDRESS_NULL) {
+            AddChunk(leftAlloc);
+        }
     }
     return allocAddress;
 }
@@ -191,78 +179,147 @@ int SectionAllocator::FindAlloc(TMQAddress secAddress, SecAlloc &metaAlloc) {
 }
 
 /*
- * 获取释放的分配并将它们放入 freedAllocTree。每次调用此函数时，它都会读取限制元素。
- * 最大读取元素数为 TMQ_PAGE_SIZE / sizeof(SecAlloc)，这意味着在一个页面中读取内容。
+ * 读取所有释放的分配，然后逐个加入释放索引，相邻的释放分配在此时合并。
+ * 先收集再加入，因为合并会改变部分空间。
  */
-void SectionAllocator::GetFreedAllocList() {
-    static int cold = 0;
-    static TMQSize limit = 0;
-    if (cold != -1) {
-        auto *lazyLinearList = GetLazyAllocList();
-        if (limit == 0) {
-            limit = lazyLinearList->GetSize();
-        }
-        // 计算最大读取长度。
-        int i = cold, max = TMQ_PAGE_SIZE / sizeof(SecAlloc);
-        for (; i < lazyLinearList->GetSize() && i - cold < max && i < limit; ++i) {
-            SecAlloc metaAlloc = lazyLinearList->Get(i);
-            if (metaAlloc.state == ADDRESS_FREE) {
-                // 读取一个释放的 SecAlloc，将其插入到 freedAllocTree
-                freedAllocTree.Insert(Pair<TMQAddress, SecAlloc>(metaAlloc.address, metaAlloc));
-            }
+void SectionAllocator::BuildFreeIndex() {
+    if (indexed) {
+        return;
+    }
+    auto *lazyLinearList = GetLazyAllocList();
+    if (lazyLinearList == nullptr) {
+        return;
+    }
+    indexed = true;
+    List<SecAlloc> freedList;
+    for (int i = 0; i < lazyLinearList->GetSize(); ++i) {
+        SecAlloc metaAlloc = lazyLinearList->Get(i);
+        if (metaAlloc.state == ADDRESS_FREE) {
+            freedList.Add(metaAlloc);
         }
-        cold = (i - cold == max) ? i : -1;
+    }
+    for (int i = 0; i < freedList.Size(); ++i) {
+        InsertFree(freedList.Get(i));
     }
 }
 
 /*
- * 此方法的重要动作是遍历 freedAllocTree 并获取与地址相同页面的释放部分地址。
- * 然后检查与这些部分地址关联的页面是否可以释放。如果为真，它将调用 DeallocPages 释放页面。
+ * 加入释放块后，在 freedChunkTree 中查找它前后的块，它们在同一页面中且地址相邻时合并。
+ * 合并的块从部分空间释放，合并后的块追加到部分空间。如果合并后的块覆盖整个页面，
+ * 直接释放页面。
  */
-bool SectionAllocator::TryFreePage(TMQAddress address) {
-    if (address == ADDRESS_NULL) {
-        return false;
+void SectionAllocator::InsertFree(const SecAlloc &alloc) {
+    FreeChunk *chunk = AddChunk(alloc);
+    if (chunk == nullptr) {
+        return;
+    }
+    int page = PAGE(alloc.address);
+    RbIterator<TMQAddress, FreeChunk *> iterator = freedChunkTree.Find(alloc.address);
+    RbIterator<TMQAddress, FreeChunk *> left = iterator;
+    RbIterator<TMQAddress, FreeChunk *> right = iterator;
+    --left;
+    ++right;
+    FreeChunk *leftChunk = nullptr, *rightChunk = nullptr;
+    if (left != freedChunkTree.end() && PAGE(left->value->alloc.address) == page
+        && left->value->alloc.address + left->value->alloc.size == alloc.address) {
+        leftChunk = left->value;
+    }
+    if (right != freedChunkTree.end() && PAGE(right->value->alloc.address) == page
+        && alloc.address + alloc.size == right->value->alloc.address) {
+        rightChunk = right->value;
     }
-    // 获取地址的页面。
-    int page = PAGE(address);
+    TMQAddress address = leftChunk ? leftChunk->alloc.address : alloc.address;
+    TMQSize size = alloc.size + (leftChunk ? leftChunk->alloc.size : 0)
+                   + (rightChunk ? rightChunk->alloc.size : 0);
     // 获取与此页面关联的大小。
-    int size = GetAllocPageSize(page) * TMQ_PAGE_SIZE;
-    if (size <= 0) {
-        return false;
-    }
-    // 从 freedAllocTree 中找到 SecAlloc
-    RbIterator<TMQAddress, SecAlloc> foundIterator = freedAllocTree.Find(address);
-    if (foundIterator == freedAllocTree.end()) {
-        return false;
-    }
-    RbIterator<TMQAddress, SecAlloc> left, right, iterator;
-    // 遍历左侧以释放长度，并将其添加到总计。
-    TMQSize total = 0;
-    iterator = foundIterator;
-    while (iterator != freedAllocTree.end() && page == PAGE(iterator->value.address)) {
-        total += iterator->value.size;
-        left = iterator;
-        iterator--;
-    }
-    // 遍历右侧以释放长度，并将其添加到总计。
-    right = foundIterator;
-    while (++right != freedAllocTree.end() && page == PAGE(right->value.address)) {
-        total += right->value.size;
-    }
-    // 如果释放的总长度等于页面分配的大小，这意味着从该页面分配的所有 tmq
-    // 地址都已被释放，因此释放该页面并从 freedAllocTree 中删除所有释放的地址并释放它们。
-    if (total == size) {
-        RbIterator<TMQAddress, SecAlloc> it = left;
-        do {
-            SecAlloc metaAlloc = it->value;
-            // 从部分空间释放它。
-            ReleaseAlloc(metaAlloc.secAddress);
-            // 从 freedAllocTree 中擦除
-            freedAllocTree.Erase(it++);
-        } while (it != right);
-        // 释放页面并返回成功。
+    int pageSize = GetAllocPageSize(page) * TMQ_PAGE_SIZE;
+    bool whole = OFFSET(address) == 0 && pageSize > 0 && size == (TMQSize) pageSize;
+    if (!leftChunk && !rightChunk && !whole) {
+        return;
+    }
+    // 从部分空间释放合并的块，并从释放索引中删除。
+    FreeChunk *parts[] = {leftChunk, chunk, rightChunk};
+    for (int i = 0; i < 3; ++i) {
+        if (parts[i]) {
+            ReleaseAlloc(parts[i]->alloc.secAddress);
+            RemoveChunk(parts[i]);
+        }
+    }
+    // 从该页面分配的所有 tmq 地址都已被释放，因此释放该页面。
+    if (whole) {
         DeallocPages(page);
-        return true;
+        return;
+    }
+    SecAlloc merged(ADDRESS_NULL, address, size, ADDRESS_FREE);
+    merged.secAddress = AppendAlloc(merged.address, merged.size, ADDRESS_FREE);
+    if (merged.secAddress != ADDRESS_NULL) {
+        AddChunk(merged);
+    }
+}
+
+/*
+ * 大小以 2 为底的对数的整数部分，最大的类别包含所有更大的块。
+ */
+int SectionAllocator::SizeClass(TMQSize size) {
+    int sizeClass = 0;
+    while (size > 1 && sizeClass < FREE_CLASS_COUNT - 1) {
+        size >>= 1;
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+/*
+ * 将块插入 freedChunkTree，并链接到其大小类别链表的头部。
+ */
+FreeChunk *SectionAllocator::AddChunk(const SecAlloc &alloc) {
+    if (freedChunkTree.Find(alloc.address) != freedChunkTree.end()) {
+        return nullptr;
     }
-    return false;
-}
\ No newline at end of file
+    auto *chunk = new FreeChunk();
+    chunk->alloc = alloc;
+    chunk->sizeClass = SizeClass(alloc.size);
+    chunk->prev = nullptr;
+    chunk->next = freeLists[chunk->sizeClass];
+    if (chunk->next) {
+        chunk->next->prev = chunk;
+    }
+    freeLists[chunk->sizeClass] = chunk;
+    freedChunkTree.Insert(Pair<TMQAddress, FreeChunk *>(alloc.address, chunk));
+    return chunk;
+}
+
+/*
+ * 将块从其大小类别链表中断开，并从 freedChunkTree 中擦除。
+ */
+void SectionAllocator::RemoveChunk(FreeChunk *chunk) {
+    if (chunk->prev) {
+        chunk->prev->next = chunk->next;
+    } else {
+        freeLists[chunk->sizeClass] = chunk->next;
+    }
+    if (chunk->next) {
+        chunk->next->prev = chunk->prev;
+    }
+    RbIterator<TMQAddress, FreeChunk *> iterator = freedChunkTree.Find(chunk->alloc.address);
+    if (iterator != freedChunkTree.end()) {
+        freedChunkTree.Erase(iterator);
+    }
+    delete chunk;
+}
+
+/*
+ * 删除所有块并清空释放索引。
+ */
+void SectionAllocator::InvalidateFreeIndex() {
+    RbIterator<TMQAddress, FreeChunk *> iterator = freedChunkTree.begin();
+    while (iterator != freedChunkTree.end()) {
+        delete iterator->value;
+        iterator++;
+    }
+    freedChunkTree.Clear();
+    for (int i = 0; i < FREE_CLASS_COUNT; ++i) {
+        freeLists[i] = nullptr;
+    }
+    indexed = false;
+}
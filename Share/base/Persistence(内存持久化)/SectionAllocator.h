@@ -11,17 +11,65 @@
 #define SECTION_INDEX(address) (unsigned int)(address >> 32)
 #define SECTION_ALLOC_ID(address) (unsigned int)(address)
 #define SECTION_ADDRESS(index, allocId) ((TMQAddress)index << 32 | (TMQAddress)allocId)
+// 释放块的大小类别数量，类别 k 包含大小在 [2^k, 2^(k+1)) 之间的块。
+#define FREE_CLASS_COUNT 32
+// 在请求大小所在的类别中查找时，最多检查的块数。
+#define FREE_CLASS_SCAN 8
+
+/**
+ * 释放块，是内存中释放索引的节点。它对应部分空间中一个 ADDRESS_FREE 状态的 SecAlloc，
+ * 按地址保存在 freedChunkTree 中，并链接在其大小类别的链表中。
+ */
+class FreeChunk {
+public:
+    // 部分空间中的释放分配。
+    SecAlloc alloc;
+    // 大小类别。
+    int sizeClass;
+    // 同一大小类别链表中的前一个块。
+    FreeChunk *prev;
+    // 同一大小类别链表中的后一个块。
+    FreeChunk *next;
+};
 
 /**
  * 部分分配器是 ISectionSpace 的部分实现，用于分配和
  * 释放线性空间。部分分配器最重要的能力是进行地址重用。
  * 部分分配器的第二个重要益处是它用添加操作替换了懒惰线性列表中元素的删除操作，
  * 这可以大大提高效率。
+ *
+ * 释放的分配保存在内存中的释放索引里，它在第一次分配或释放时从部分空间建立一次。
+ * 释放块按大小类别分离链接，分配时从请求大小所在的类别或更大的类别中直接取块，
+ * 不再遍历所有释放块。释放时与同一页面中相邻的释放块合并，合并后覆盖整个页面的块将释放页面。
  */
 class SectionAllocator : public ISectionSpace {
 private:
-    // 一个 RbTree，用于按 tmq 地址的升序存储释放的分配。
-    RbTree<TMQAddress, SecAlloc> freedAllocTree;
+    // 一个 RbTree，用于按 tmq 地址的升序存储释放块，用于查找相邻的块。
+    RbTree<TMQAddress, FreeChunk *> freedChunkTree;
+    // 按大小类别分离的释放块链表。
+    FreeChunk *freeLists[FREE_CLASS_COUNT];
+    // 释放索引是否已从部分空间建立。
+    bool indexed;
+
+    /**
+     * 计算大小所在的类别。
+     * @param size, 块的大小。
+     * @return 大小类别，即 size 以 2 为底的对数的整数部分。
+     */
+    static int SizeClass(TMQSize size);
+
+    /**
+     * 将释放块加入释放索引。
+     * @param alloc, 释放的分配。
+     * @return 加入的块，如果已存在相同地址的块，返回 nullptr。
+     */
+    FreeChunk *AddChunk(const SecAlloc &alloc);
+
+    /**
+     * 将释放块从释放索引中移除并删除它。
+     * @param chunk, 要移除的块。
+     */
+    void RemoveChunk(FreeChunk *chunk);
 
 protected:
     /**
@@ -40,19 +88,16 @@ protected:
     int FindAlloc(TMQAddress secAddress, SecAlloc &metaAlloc);
 
     /**
-     * 内部方法，读取释放的分配并将它们放入 freedAllocTree。
-     * 有时，从磁盘文件实现的线性空间读取数据将是耗时的。
-     * 因此，此方法将批量读取数据。
+     * 内部方法，读取部分空间中所有释放的分配并建立释放索引，只建立一次。
      */
-    void GetFreedAllocList();
+    void BuildFreeIndex();
 
     /**
-     * 尝试释放页面。它将根据 tmq 地址计算释放的页面。
-     * 当释放一个 tmq 地址时，我们将收集与同一页面相关的释放的 tmq 地址。
-     * 如果所有地址片段都已释放，其关联的页面也将被释放。
-     * @param address, 要释放的 tmq 地址。
+     * 将释放的分配加入释放索引，并与同一页面中相邻的释放块合并。
+     * 如果合并后的块覆盖整个页面，页面也将被释放。
+     * @param alloc, 释放的分配，它在部分空间中的状态为 ADDRESS_FREE。
      */
-    bool TryFreePage(TMQAddress address);
+    void InsertFree(const SecAlloc &alloc);
 
     /**
      * 获取 SecAlloc 元素类型的懒惰线性列表的方法。
@@ -99,6 +144,21 @@ protected:
     virtual TMQAddress AppendAlloc(TMQAddress tmqAddress, TMQSize size, TMQLState state) = 0;
 
 public:
+    /**
+     * 默认构造函数。
+     */
+    SectionAllocator();
+
+    /**
+     * 默认析构函数，删除释放索引。
+     */
+    virtual ~SectionAllocator();
+
+    /**
+     * 使释放索引失效，下一次分配或释放时重新建立。当部分空间的分配被外部移动时调用。
+     */
+    void InvalidateFreeIndex();
+
     /**
      * 分配指定长度的线性存储空间。
      * @param length, 要分配的线性存储空间的长度。
@@ -81,6 +81,29 @@ TMQ_EXPORTS bool tmq_unsubscribe(TMQId subId) {
 TMQ_EXPORTS TMQMsgId tmq_publish(const char *topic, void *data, int length, int flag, int priority) {
     return TMQFactory::GetTopicInstance()->Publish(topic, data, length, flag, priority);
 }
+//C Api for publish a topic message owned by tmq, delegating the tmq topic to publish.
+TMQ_EXPORTS TMQMsgId tmq_publish_owned(const char *topic, void *data, int length, int flag,
+                                       int priority) {
+    return TMQFactory::GetTopicInstance()->PublishOwned(topic, data, length, flag, priority);
+}
+// C Api implementation for setting the ordering key.
+TMQ_EXPORTS bool tmq_set_ordering_key(const char *topic, const char *key) {
+    return TMQFactory::GetTopicInstance()->SetOrderingKey(topic, key);
+}
+// C Api implementation for setting the limits of a topic.
+TMQ_EXPORTS bool tmq_set_topic_limit(const char *topic, int maxMsgs, long long maxBytes,
+                                     int policy, int timeoutMs) {
+    TMQTopicLimit limit;
+    limit.maxMsgs = maxMsgs;
+    limit.maxBytes = maxBytes;
+    limit.policy = policy;
+    limit.timeoutMs = timeoutMs;
+    return TMQFactory::GetTopicInstance()->SetTopicLimit(topic, limit);
+}
+// C Api implementation for getting the error of the last publish.
+TMQ_EXPORTS int tmq_get_last_error() {
+    return TMQFactory::GetTopicInstance()->GetLastError();
+}
 // C Api implementation for creating a tmq context.
 TMQ_EXPORTS TMQId tmq_create_ctx(TMQMessageCallback receiver) {
     auto *ctx = new TMQContext(receiver);
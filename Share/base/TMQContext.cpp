@@ -21,7 +21,9 @@ TMQContext::TMQContext(TMQMessageCallback messageCallback)
  */
 TMQContext::~TMQContext() {
     this->callback = nullptr;
-    delete picker;
+    if (picker) {
+        TMQFactory::GetTopicInstance()->DestroyPicker(picker);
+    }
 }
 
 /**
@@ -53,7 +55,7 @@ void TMQContext::AddTopic(const char *topic) {
     subscriberList.Add(TMQFactory::GetTopicInstance()->Subscribe(topic, this));
     // For topic list has being changed, release the picker and assign to nullptr if it exists.
     if (picker) {
-        delete picker;
+        TMQFactory::GetTopicInstance()->DestroyPicker(picker);
         picker = nullptr;
     }
     mutex.UnLock();
@@ -76,7 +78,7 @@ void TMQContext::RemoveTopic(const char *topic) {
             subscriberList.Remove(i);
             // release picker if it is exist.
             if (picker) {
-                delete picker;
+                TMQFactory::GetTopicInstance()->DestroyPicker(picker);
                 picker = nullptr;
             }
             // finish and break.
@@ -111,8 +113,9 @@ TMQSize TMQContext::Pick(void **data) {
         for (int i = 0; i < topicList.Size(); ++i) {
             pickerTopics[i] = (char *) topicList.Get(i).c_str();
         }
-        picker = new TMQPicker((const char **) pickerTopics,
-                               (int)topicList.Size(), TMQ_MSG_TYPE_ALL);
+        picker = TMQFactory::GetTopicInstance()->CreatePicker((const char **) pickerTopics,
+                                                             (int) topicList.Size(),
+                                                             TMQ_MSG_TYPE_ALL);
         delete[] pickerTopics;
     }
     // Check the picker valid before use.
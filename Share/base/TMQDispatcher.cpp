@@ -11,55 +11,89 @@
 #include "Shadow.h"
 #include "TMQSettings.h"
 #include "TMQUtils.h"
+#include "TMQTopicRegistry.h"
+#include "Atomic.h"
 #include <cstring>
 
 USING_TMQ_NAMESPACE
 
 // Define the key for the max executor count.
 #define TMQ_MAX_EXECUTOR_COUNT      "MAX_EXECUTOR_COUNT"
+// Define the key for binding the executors to CPUs, a true value binds the executor i to the CPU i
+// modulo the count of CPUs.
+#define TMQ_EXECUTOR_AFFINITY       "EXECUTOR_AFFINITY"
 
-// Constructor of the TMQDispatcher. In this constructor, we will create the executors and a
-// tmq message picker with message type TMQ_MSG_TYPE_DISPATCH.
+// The receiver running on the current thread, a receiver can remove itself in its callback.
+static thread_local TMQDispatcherReceiver *runningReceiver = nullptr;
+
+// Constructor of the TMQDispatcher. In this constructor, we will create the worker array and a
+// tmq message picker with message type TMQ_MSG_TYPE_DISPATCH. The workers are created lazily.
 TMQDispatcher::TMQDispatcher(TMQTopic *tmqTopic, int maxExecutorCount)
-        : activeExecutorCount(0), executors(nullptr), stop(false) {
+        : maxExecutorCount(0), activeExecutorCount(0),
+          workers(new TMQDispatchWorker *[EXECUTOR_COUNT_LIMIT]{nullptr}),
+          receiverTable(new TMQReceiverTable(nullptr, 0)), stop(false) {
     this->tmqTopic = tmqTopic;
-    // If the maxExecutorCount is valid, create executors.
+    // If the maxExecutorCount is valid, limit it by the length of the worker array.
     if (maxExecutorCount > 0) {
-        this->maxExecutorCount = maxExecutorCount;
-        this->executors = new IExecutor *[maxExecutorCount]{nullptr};
+        this->maxExecutorCount = maxExecutorCount < EXECUTOR_COUNT_LIMIT ? maxExecutorCount
+                                                                         : EXECUTOR_COUNT_LIMIT;
     }
     wakeupCount = 0;
     sentCount = 0;
     receiverIdCounter = 0;
     forceActiveSelf = false;
-    picker = tmqTopic->CreatePicker(nullptr, 0, TMQ_MSG_TYPE_DISPATCH);
+    settingsVersion = 0;
+    executorAffinity = false;
+    orderedDispatch = false;
+    flushTime = RECEIVER_FLUSH_NONE;
+    sentTopicId = TMQTopicRegistry::GetInstance()->Intern(TOPIC_SENT);
+    picker = (TMQPicker *) tmqTopic->CreatePicker(nullptr, 0, TMQ_MSG_TYPE_DISPATCH);
 }
 
 // Destructor of TMQDispatcher.
 TMQDispatcher::~TMQDispatcher() {
     // Set stop to true, this can make the method OnExecute return fast as soon as possible.
     stop = true;
-    // Release the executors.
+    // Release the executors first, the workers are not running any more.
+    for (int i = 0; i < activeExecutorCount; ++i) {
+        delete workers[i]->executor;
+    }
+    // Release the workers, and the batches not dispatched.
     for (int i = 0; i < activeExecutorCount; ++i) {
-        delete executors[i];
+        TMQDispatchBatch *batch = nullptr;
+        while (workers[i]->deque.Pop(batch)) {
+            delete batch;
+        }
+        delete workers[i]->spare;
+        tmqTopic->DestroyPicker(workers[i]->picker);
+        delete workers[i];
     }
-    delete[] executors;
+    delete[] workers;
     wakeupCount = 0;
     sentCount = 0;
     // Destroy the message picker.
     tmqTopic->DestroyPicker(picker);
+    // Release the receiver table and the receivers, there is no dispatching any more.
+    for (TMQSize i = 0; i < receiverTable->Size(); ++i) {
+        delete receiverTable->Find((TMQTopicId) i);
+    }
+    delete receiverTable;
+    for (int i = 0; i < receivers.Size(); ++i) {
+        delete receivers.Get(i);
+    }
 }
 
 /**
  * Set the max executor count. When the count is 0, the forceActiveSelf will be set to true.
- * That will lead to all message dispatch at activate self mode.
+ * That will lead to all message dispatch at activate self mode. The count is limited by
+ * EXECUTOR_COUNT_LIMIT.
  */
 void TMQDispatcher::SetMaxExecutorCount(int count) {
     if (count < 0) {
         return;
     }
     mutex.Lock();
-    maxExecutorCount = count;
+    maxExecutorCount = count < EXECUTOR_COUNT_LIMIT ? count : EXECUTOR_COUNT_LIMIT;
     // if count is zero, set forceActiveSelf to true, otherwise set to false.
     forceActiveSelf = count == 0;
     mutex.UnLock();
@@ -78,12 +112,10 @@ int TMQDispatcher::GetMaxExecutorCount() const {
  * 2. If the executor is not create, or the messages are congested, create a new executor.
  * 3. Send a signal to wakeup the waiting executor.
  */
-void TMQDispatcher::Wakeup(bool activeSelf) {
-    // Check max executor setting, and set its value.
-    String value = TMQSettings::GetInstance()->Get(TMQ_MAX_EXECUTOR_COUNT);
-    int max = -1;
-    if (TMQUtils::ToInt(value.c_str(), value.Size(), &max) && max != maxExecutorCount) {
-        SetMaxExecutorCount(max);
+void TMQDispatcher::Wakeup(bool activeSelf, int count) {
+    // Check the settings only if they are changed.
+    if (TMQSettings::GetInstance()->GetVersion() != settingsVersion) {
+        refreshSettings();
     }
     // Activate itself as the executor, dispatch message immediately.
     if (activeSelf || forceActiveSelf) {
@@ -91,35 +123,64 @@ void TMQDispatcher::Wakeup(bool activeSelf) {
         return;
     }
     dispatcherMutex.Lock();
-    wakeupCount += 1;
+    wakeupCount += count;
     for (int i = 0; i < activeExecutorCount; ++i) {
         // Wake up a executor and return if success.
-        if (executors[i]->Wakeup()) {
+        if (workers[i]->executor->Wakeup()) {
             dispatcherMutex.UnLock();
             return;
         }
     }
-    // Create new executor.
+    // Create new executor with a new worker, the picker of the worker starts from a different
+    // topic to the others.
     if (activeExecutorCount < maxExecutorCount
         && (wakeupCount - sentCount > activeExecutorCount * EXECUTOR_WAKE_COUNT)) {
-        executors[activeExecutorCount] = new ThreadExecutor(this);
-        executors[activeExecutorCount]->Wakeup();
-        ++activeExecutorCount;
+        int index = activeExecutorCount;
+        auto *workerPicker = (TMQPicker *) tmqTopic->CreatePicker(nullptr, 0,
+                                                                  TMQ_MSG_TYPE_DISPATCH);
+        workerPicker->SetCursorStart((TMQSize) index);
+        auto *worker = new TMQDispatchWorker(this, index, executorAffinity ? index : -1,
+                                             workerPicker);
+        worker->executor = new ThreadExecutor(worker);
+        workers[index] = worker;
+        // Publish the worker before the count, the stealing workers read the array without lock.
+        store_release(&activeExecutorCount, index + 1);
+        worker->executor->Wakeup();
     }
     dispatcherMutex.UnLock();
 }
 
+/*
+ * Read the max executor count and the affinity from the snapshot, the version is saved at last, so
+ * the concurrent wakeups read the settings again until the values are set.
+ */
+void TMQDispatcher::refreshSettings() {
+    TMQSettingsSnapshot *snapshot = TMQSettings::GetInstance()->Acquire();
+    int max = snapshot->GetInt(TMQ_MAX_EXECUTOR_COUNT, -1);
+    if (max > EXECUTOR_COUNT_LIMIT) {
+        max = EXECUTOR_COUNT_LIMIT;
+    }
+    if (max >= 0 && max != maxExecutorCount) {
+        SetMaxExecutorCount(max);
+    }
+    executorAffinity = snapshot->GetBool(TMQ_EXECUTOR_AFFINITY, false);
+    orderedDispatch = snapshot->GetBool(DISPATCH_ORDERED, false);
+    store_release(&settingsVersion, snapshot->GetVersion());
+    snapshot->Release();
+}
+
 /**
- * Find the topic receivers and invoke OnRunningReceiver method for each topic and receivers.
+ * Find the topic receivers from the receiver table and invoke OnRunningReceiver method for each
+ * receiver. The table is read in the epoch, no lock and no allocation.
  */
-bool TMQDispatcher::dispatchMessage(const char *topic, const TMQMsg &msg) {
-    TMQId *receiverIds = nullptr;
-    TMQSize count = GetTopicReceivers(topic, &receiverIds);
-    for (int i = 0; i < count; ++i) {
+bool TMQDispatcher::dispatchMessage(TMQTopicId topicId, const TMQMsg &msg) {
+    int token = epoch.Enter();
+    TMQTopicReceivers *topicReceivers = load_acquire(&receiverTable)->Find(topicId);
+    for (int i = 0; topicReceivers && i < topicReceivers->Size(); ++i) {
         // Call receivers of the topic.
-        OnRunningReceiver(topic, receiverIds[i], msg);
+        OnRunningReceiver(topicReceivers->Get(i), msg);
     }
-    delete[] receiverIds;
+    epoch.Exit(token);
     return true;
 }
 
@@ -128,155 +189,534 @@ bool TMQDispatcher::dispatchMessage(const char *topic, const TMQMsg &msg) {
  * The stop is true or can not pick message any more, exit the loop.
  */
 bool TMQDispatcher::OnExecute(TMQId eid) {
-    char topic[TMQ_TOPIC_MAX_LENGTH] = {0};
     int localSentCount = 0;
-    TMQMsg tmqMsg;
+    TMQDispatchBatch batch;
     // Loop for picking messages by picker.
-    while (!stop && this->picker->Pick(topic, tmqMsg)) {
-        // Dispatch the topic message.
-        dispatchMessage(topic, tmqMsg);
-        TMQMsg sentMsg(&(tmqMsg.msgId), sizeof(TMQMsgId));
-        // Dispatch a sent message.
-        dispatchMessage(TOPIC_SENT, sentMsg);
-        localSentCount += 1;
+    while (!stop && fillBatch(this->picker, &batch) > 0) {
+        dispatchBatch(&batch);
+        localSentCount += batch.count;
+        batch.count = 0;
     }
     // Counter the sent message.
     dispatcherMutex.Lock();
     sentCount += localSentCount;
     dispatcherMutex.UnLock();
+    // Without executors, no one comes back for the lingering batches, deliver them now. Otherwise
+    // wake up a worker to wait for them.
+    if (forceActiveSelf || load_acquire(&activeExecutorCount) == 0) {
+        flushBatches(-1);
+    } else if (flushBatches(TMQUtils::NowMillis()) != RECEIVER_FLUSH_NONE) {
+        dispatcherMutex.Lock();
+        workers[0]->executor->Wakeup();
+        dispatcherMutex.UnLock();
+    }
     return false;
 }
 
+/*
+ * Run the worker loop of the dispatcher.
+ */
+bool TMQDispatchWorker::OnExecute(long eid) {
+    return dispatcher->runWorker(this);
+}
+
+/**
+ * A loop for dispatching batches by a worker. The worker is bound to its CPU at the first run on
+ * its executor. The stop is true or there is no batch any more, exit the loop.
+ */
+bool TMQDispatcher::runWorker(TMQDispatchWorker *worker) {
+    if (worker->cpu >= 0) {
+        ThreadExecutor::SetAffinity(worker->cpu);
+        worker->cpu = -1;
+    }
+    int localSentCount = 0;
+    TMQDispatchBatch *batch = nullptr;
+    while (!stop && (batch = nextBatch(worker)) != nullptr) {
+        dispatchBatch(batch);
+        localSentCount += batch->count;
+        recycleBatch(worker, batch);
+        // Deliver the expired batches of receivers, the clock is read only if there are some.
+        if (load_acquire(&flushTime) != RECEIVER_FLUSH_NONE) {
+            flushBatches(TMQUtils::NowMillis());
+        }
+    }
+    // Counter the sent message.
+    dispatcherMutex.Lock();
+    sentCount += localSentCount;
+    dispatcherMutex.UnLock();
+    if (stop) {
+        return false;
+    }
+    // Run again when the lingering batches expire.
+    long long now = TMQUtils::NowMillis();
+    long long next = flushBatches(now);
+    if (next == RECEIVER_FLUSH_NONE) {
+        return false;
+    }
+    worker->recallDelay = next > now ? (long) (next - now) : 1;
+    return true;
+}
+
+/*
+ * The own deque first, so the batches picked by the worker are dispatched in the picked order
+ * unless they are stolen.
+ */
+TMQDispatchBatch *TMQDispatcher::nextBatch(TMQDispatchWorker *worker) {
+    TMQDispatchBatch *batch = nullptr;
+    if (worker->deque.Pop(batch)) {
+        return batch;
+    }
+    if ((batch = refillBatches(worker)) != nullptr) {
+        return batch;
+    }
+    return stealBatch(worker);
+}
+
+/*
+ * Fill up to DISPATCH_REFILL_COUNT batches. The extra batches are pushed in reverse, so the owner
+ * pops the earlier one first, and the thieves steal the later ones.
+ */
+TMQDispatchBatch *TMQDispatcher::refillBatches(TMQDispatchWorker *worker) {
+    TMQDispatchBatch *batches[DISPATCH_REFILL_COUNT]{nullptr};
+    int count = 0;
+    while (count < DISPATCH_REFILL_COUNT) {
+        TMQDispatchBatch *batch = worker->spare ? worker->spare : new TMQDispatchBatch();
+        worker->spare = nullptr;
+        batch->count = 0;
+        if (fillBatch(worker->picker, batch) == 0) {
+            worker->spare = batch;
+            break;
+        }
+        batches[count++] = batch;
+        // A batch not full means there is no more message, except in ordered mode, which picks
+        // one topic for a batch.
+        if (batch->count < DISPATCH_BATCH_SIZE && batch->stripe < 0) {
+            break;
+        }
+    }
+    if (count == 0) {
+        return nullptr;
+    }
+    // The deque is empty before refilling, it can hold all extra batches.
+    for (int i = count - 1; i > 0; --i) {
+        worker->deque.Push(batches[i]);
+    }
+    // Wake up a waiting executor to steal the extra batches.
+    dispatcherMutex.Lock();
+    for (int i = 0; count > 1 && i < activeExecutorCount; ++i) {
+        if (workers[i] != worker && workers[i]->executor->Wakeup()) {
+            break;
+        }
+    }
+    dispatcherMutex.UnLock();
+    return batches[0];
+}
+
+/*
+ * Steal from the next workers round, starting from the one after the thief.
+ */
+TMQDispatchBatch *TMQDispatcher::stealBatch(TMQDispatchWorker *worker) {
+    TMQDispatchBatch *batch = nullptr;
+    int count = load_acquire(&activeExecutorCount);
+    for (int i = 1; i < count; ++i) {
+        if (workers[(worker->index + i) % count]->deque.Steal(batch)) {
+            return batch;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * In ordered mode, pick under the claims. Otherwise pick one by one until the batch is full.
+ */
+int TMQDispatcher::fillBatch(TMQPicker *batchPicker, TMQDispatchBatch *batch) {
+    batch->stripe = -1;
+    if (orderedDispatch) {
+        TMQTopicId topicId = ID_INT_INVALID;
+        batch->count = batchPicker->PickClaimed(&orderClaims, topicId, batch->msgs,
+                                                DISPATCH_BATCH_SIZE, batch->stripe);
+        for (int i = 0; i < batch->count; ++i) {
+            batch->topicIds[i] = topicId;
+        }
+        return batch->count;
+    }
+    while (batch->count < DISPATCH_BATCH_SIZE
+           && batchPicker->Pick(batch->topicIds[batch->count], batch->msgs[batch->count])) {
+        batch->count += 1;
+    }
+    return batch->count;
+}
+
+/*
+ * The claim is released after all messages are dispatched, so the next batch of the topic can not
+ * overtake this one.
+ */
+void TMQDispatcher::dispatchBatch(TMQDispatchBatch *batch) {
+    for (int i = 0; i < batch->count; ++i) {
+        // Dispatch the topic message.
+        dispatchMessage(batch->topicIds[i], batch->msgs[i]);
+    }
+    dispatchReceipt(batch);
+    orderClaims.Release(batch->stripe);
+    batch->stripe = -1;
+}
+
+/*
+ * The receivers of TOPIC_SENT are checked first, so there is no receipt built for no one. The
+ * adjacent ids in the dispatched order are merged into one range.
+ */
+void TMQDispatcher::dispatchReceipt(TMQDispatchBatch *batch) {
+    int token = epoch.Enter();
+    bool subscribed = load_acquire(&receiverTable)->Find(sentTopicId) != nullptr;
+    epoch.Exit(token);
+    if (!subscribed || batch->count == 0) {
+        return;
+    }
+    TMQSentRange ranges[DISPATCH_BATCH_SIZE];
+    int count = 0;
+    for (int i = 0; i < batch->count; ++i) {
+        TMQMsgId msgId = batch->msgs[i].msgId;
+        if (count > 0 && ranges[count - 1].last + 1 == msgId) {
+            ranges[count - 1].last = msgId;
+        } else {
+            ranges[count].first = msgId;
+            ranges[count].last = msgId;
+            count += 1;
+        }
+    }
+    TMQMsg receipt(ranges, (int) (count * sizeof(TMQSentRange)));
+    dispatchMessage(sentTopicId, receipt);
+}
+
+/*
+ * Reset the messages to release their buffers, keep one batch per worker for reusing.
+ */
+void TMQDispatcher::recycleBatch(TMQDispatchWorker *worker, TMQDispatchBatch *batch) {
+    for (int i = 0; i < batch->count; ++i) {
+        batch->msgs[i] = TMQMsg();
+    }
+    batch->count = 0;
+    if (worker->spare == nullptr) {
+        worker->spare = batch;
+    } else {
+        delete batch;
+    }
+}
+
 /**
- * Find receivers and invoke them. Three key process:
- * 1. Find the topic receives and release the mutex.
- * 2. Invoke the virtual method OnReceive for each receivers.
- * 3. Clear the receiver that has called from the running receivers.
+ * Invoke the receiver, it is kept alive by the epoch entered by the caller. A batching receiver
+ * gets the message appended to its batch instead.
  */
-void TMQDispatcher::OnRunningReceiver(const char *topic, TMQId recId, const TMQMsg &msg) {
-    TMQDispatcherReceiver *receiver = nullptr;
-    if (topic == nullptr) {
+void TMQDispatcher::OnRunningReceiver(TMQDispatcherReceiver *receiver, const TMQMsg &msg) {
+    if (receiver == nullptr) {
         return;
     }
-    // Find the topic receivers.
-    receiverMutex.Lock();
-    for (int i = 0; i < topicReceivers.Size(); ++i) {
-        if (strncmp(topic, topicReceivers.Get(i)->GetName(), TMQ_TOPIC_MAX_LENGTH) == 0) {
-            for (int j = 0; j < topicReceivers.Get(i)->GetReceivers()->Size(); ++j) {
-                if (topicReceivers.Get(i)->GetReceivers()->Get(j)->id == recId) {
-                    receiver = topicReceivers.Get(i)->GetReceivers()->Get(j);
-                    break;
-                }
+    if (receiver->batch != nullptr) {
+        appendBatch(receiver, msg);
+        return;
+    }
+    if (enterReceiver(receiver)) {
+        TMQDispatcherReceiver *outer = runningReceiver;
+        runningReceiver = receiver;
+        receiver->receiver->OnReceive(&msg);
+        runningReceiver = outer;
+    }
+    leaveReceiver(receiver);
+}
+
+/*
+ * The inflight is added before checking removed, and RemoveReceiver sets removed before checking
+ * inflight, so either the callback is skipped, or RemoveReceiver waits for it.
+ */
+bool TMQDispatcher::enterReceiver(TMQDispatcherReceiver *receiver) {
+    add_and_fetch_seq_cst(&(receiver->inflight), 1);
+    return !load_seq_cst(&(receiver->removed));
+}
+
+/*
+ * Sub the inflight, and wakeup the waiting RemoveReceiver.
+ */
+void TMQDispatcher::leaveReceiver(TMQDispatcherReceiver *receiver) {
+    sub_and_fetch_seq_cst(&(receiver->inflight), 1);
+    if (load_seq_cst(&(receiver->removed))) {
+        receiverCondition.Lock();
+        receiverCondition.Broadcast();
+        receiverCondition.UnLock();
+    }
+}
+
+/*
+ * A full batch is delivered by the appender, and the appenders finding the batch full deliver it
+ * before appending, so the batch never overflows. The first message of a batch lowers the flush
+ * time to its expiration. The appending is entered like a callback, so RemoveReceiver waits for
+ * it, but the delivering is not, it enters by itself.
+ */
+void TMQDispatcher::appendBatch(TMQDispatcherReceiver *receiver, const TMQMsg &msg) {
+    TMQReceiverBatch *batch = receiver->batch;
+    long long expire = RECEIVER_FLUSH_NONE;
+    bool appended = false;
+    bool full = false;
+    while (!appended) {
+        if (!enterReceiver(receiver)) {
+            leaveReceiver(receiver);
+            return;
+        }
+        batch->mutex.Lock();
+        if (batch->count < batch->maxBatch) {
+            if (batch->count == 0) {
+                batch->firstTime = TMQUtils::NowMillis();
+                expire = batch->firstTime + batch->lingerMs;
             }
-            if (receiver != nullptr) {
-                runningReceivers.Add(receiver);
-                break;
+            batch->msgs[batch->count++] = msg;
+            full = batch->count >= batch->maxBatch;
+            appended = true;
+        }
+        batch->mutex.UnLock();
+        leaveReceiver(receiver);
+        if (!appended) {
+            flushReceiver(receiver, -1);
+        }
+    }
+    if (full) {
+        flushReceiver(receiver, -1);
+    } else if (expire != RECEIVER_FLUSH_NONE) {
+        lowerFlushTime(expire);
+    }
+}
+
+/*
+ * The batch is taken and delivered under the deliver mutex, so a later batch never overtakes an
+ * earlier one. The batch of a removed receiver is left to RemoveReceiver.
+ */
+long long TMQDispatcher::flushReceiver(TMQDispatcherReceiver *receiver, long long now) {
+    TMQReceiverBatch *batch = receiver->batch;
+    long long expire = RECEIVER_FLUSH_NONE;
+    int count = 0;
+    TMQMsg *msgs = nullptr;
+    batch->deliverMutex.Lock();
+    if (enterReceiver(receiver)) {
+        batch->mutex.Lock();
+        if (batch->count > 0) {
+            expire = batch->firstTime + batch->lingerMs;
+            if (now < 0 || now >= expire || batch->count >= batch->maxBatch) {
+                msgs = batch->Take(count);
+                expire = RECEIVER_FLUSH_NONE;
             }
         }
+        batch->mutex.UnLock();
+        if (msgs != nullptr) {
+            deliverBatch(receiver, msgs, count);
+        }
     }
-    receiverMutex.UnLock();
-    // Invoke the receiver and remove it from runningReceivers.
-    if (receiver != nullptr) {
-        receiver->receiver->OnReceive(&msg);
-        receiverMutex.Lock();
-        for (int i = 0; i < runningReceivers.Size(); ++i) {
-            if (runningReceivers.Get(i)->id == recId) {
-                runningReceivers.Remove(i);
-                break;
+    leaveReceiver(receiver);
+    batch->deliverMutex.UnLock();
+    return expire;
+}
+
+void TMQDispatcher::deliverBatch(TMQDispatcherReceiver *receiver, TMQMsg *msgs, int count) {
+    auto **ptrs = new const TMQMsg *[count];
+    for (int i = 0; i < count; ++i) {
+        ptrs[i] = &(msgs[i]);
+    }
+    TMQDispatcherReceiver *outer = runningReceiver;
+    runningReceiver = receiver;
+    receiver->receiver->OnReceiveBatch(ptrs, count);
+    runningReceiver = outer;
+    delete[] ptrs;
+    delete[] msgs;
+}
+
+/*
+ * The flush time is reset before scanning, the batches appended during the scan lower it again by
+ * themselves, and the remaining ones found by the scan are lowered at last.
+ */
+long long TMQDispatcher::flushBatches(long long now) {
+    if (now >= 0 && now < load_acquire(&flushTime)) {
+        return load_acquire(&flushTime);
+    }
+    store_seq_cst(&flushTime, RECEIVER_FLUSH_NONE);
+    long long next = RECEIVER_FLUSH_NONE;
+    int token = epoch.Enter();
+    TMQReceiverTable *table = load_acquire(&receiverTable);
+    for (TMQSize i = 0; i < table->Size(); ++i) {
+        TMQTopicReceivers *topicReceivers = table->Find((TMQTopicId) i);
+        for (int j = 0; topicReceivers && j < topicReceivers->Size(); ++j) {
+            if (topicReceivers->Get(j)->batch == nullptr) {
+                continue;
             }
+            long long expire = flushReceiver(topicReceivers->Get(j), now);
+            next = expire < next ? expire : next;
         }
-        receiverMutex.UnLock();
+    }
+    epoch.Exit(token);
+    if (next != RECEIVER_FLUSH_NONE) {
+        lowerFlushTime(next);
+    }
+    return load_acquire(&flushTime);
+}
+
+/*
+ * Lower the flush time by CAS, it is never raised except by flushBatches.
+ */
+void TMQDispatcher::lowerFlushTime(long long time) {
+    long long local = load_acquire(&flushTime);
+    while (time < local && !compare_and_set(&flushTime, &local, &time)) {
     }
 }
 
+/*
+ * Static method for releasing a retired receiver table.
+ */
+static void ReleaseTable(void *table) {
+    delete (TMQReceiverTable *) table;
+}
+
+/*
+ * Static method for releasing retired topic receivers.
+ */
+static void ReleaseTopicReceivers(void *topicReceivers) {
+    delete (TMQTopicReceivers *) topicReceivers;
+}
+
+/*
+ * Static method for releasing a removed receiver.
+ */
+static void ReleaseReceiver(void *receiver) {
+    delete (TMQDispatcherReceiver *) receiver;
+}
+
+/*
+ * Copy the current table with the new receivers of the topic, publish it, then retire the old
+ * table and the old receivers of the topic. The readers entered before may still read them.
+ */
+void TMQDispatcher::publishReceivers(TMQTopicId topicId, TMQTopicReceivers *topicReceivers) {
+    TMQReceiverTable *origin = receiverTable;
+    TMQSize size = origin->Size() > (TMQSize) topicId ? origin->Size() : (TMQSize) topicId + 1;
+    auto *table = new TMQReceiverTable(origin, size);
+    table->Set(topicId, topicReceivers);
+    store_release(&receiverTable, table);
+    epoch.Retire(origin->Find(topicId), ReleaseTopicReceivers);
+    epoch.Retire(origin, ReleaseTable);
+}
+
 /**
- * Add a topic receiver. All receivers are organized by the topics. So Add a receiver to a topic
- * should find the topic receiver list at first. Then put this receiver at the end of the list.
+ * Add a topic receiver. The receivers of the topic are copied with the new receiver at the end,
+ * and published by a new receiver table.
  */
 TMQId TMQDispatcher::AddReceiver(const char *topic, TMQReceiver *receiver) {
+    return AddReceiver(topic, receiver, 1, 0);
+}
+
+/**
+ * Add a topic receiver with batched delivery. The batch is created only if the max batch size is
+ * greater than 1, otherwise the receiver is called by OnReceive directly.
+ */
+TMQId TMQDispatcher::AddReceiver(const char *topic, TMQReceiver *receiver, int maxBatch,
+                                 int lingerMs) {
     TMQId receiverId = -1;
-    if (topic == nullptr || receiver == nullptr) {
+    TMQTopicId topicId = TMQTopicRegistry::GetInstance()->Intern(topic);
+    if (topicId == ID_INT_INVALID || receiver == nullptr) {
         return receiverId;
     }
     receiverMutex.Lock();
-    // Find the receiver list where the new receiver will be put into.
-    TMQTopicReceivers *tmqTopicReceivers = nullptr;
-    for (int i = 0; i < topicReceivers.Size(); i++) {
-        if (strncmp(topic, topicReceivers.Get(i)->GetName(), TMQ_TOPIC_MAX_LENGTH) == 0) {
-            tmqTopicReceivers = topicReceivers.Get(i);
-            break;
-        }
-    }
-    // If this topic receiver list is not exist, create a new tmq list for it.
-    if (tmqTopicReceivers == nullptr) {
-        tmqTopicReceivers = new TMQTopicReceivers(topic);
-        topicReceivers.Add(tmqTopicReceivers);
-    }
-    // Put the receiver to the topic receiver list.
     receiverIdCounter += 1;
     receiverId = receiverIdCounter;
-    tmqTopicReceivers->GetReceivers()->Add(new TMQDispatcherReceiver(receiver, receiverIdCounter));
+    TMQReceiverBatch *batch = nullptr;
+    if (maxBatch > 1) {
+        batch = new TMQReceiverBatch(maxBatch < RECEIVER_BATCH_LIMIT ? maxBatch
+                                                                     : RECEIVER_BATCH_LIMIT,
+                                     lingerMs > 0 ? lingerMs : 0);
+    }
+    auto *dispatcherReceiver = new TMQDispatcherReceiver(receiver, receiverId, topicId, batch);
+    receivers.Add(dispatcherReceiver);
+    // Copy the receivers of the topic, and put the new receiver at the end.
+    TMQTopicReceivers *origin = receiverTable->Find(topicId);
+    int count = origin ? origin->Size() : 0;
+    auto **topicReceivers = new TMQDispatcherReceiver *[count + 1];
+    for (int i = 0; i < count; ++i) {
+        topicReceivers[i] = origin->Get(i);
+    }
+    topicReceivers[count] = dispatcherReceiver;
+    publishReceivers(topicId, new TMQTopicReceivers(topicId, topicReceivers, count + 1));
+    delete[] topicReceivers;
     receiverMutex.UnLock();
+    // Release the tables retired before if possible.
+    epoch.Reclaim();
     return receiverId;
 }
 
 /**
  * Remove a receiver from the topic receivers. Attention, remove a running receiver will be
- * time-consumed, because the removing will wait until the receiver running to end.
+ * time-consumed, because the removing will park until its running callbacks end. If it is removed
+ * in its own callback, the callback on the current thread is not waited.
  */
 bool TMQDispatcher::RemoveReceiver(TMQId receiverId) {
     // remove exist receiver
     TMQDispatcherReceiver *dispatcherReceiver = nullptr;
     receiverMutex.Lock();
-    for (int i = 0; i < topicReceivers.Size(); i++) {
-        for (int j = 0; j < topicReceivers.Get(i)->GetReceivers()->Size(); ++j) {
-            if (topicReceivers.Get(i)->GetReceivers()->Get(j)->id == receiverId) {
-                dispatcherReceiver = topicReceivers.Get(i)->GetReceivers()->Get(j);
-                topicReceivers.Get(i)->GetReceivers()->Remove(j);
-                break;
-            }
-        }
-        if (dispatcherReceiver != nullptr) {
+    for (int i = 0; i < receivers.Size(); i++) {
+        if (receivers.Get(i)->id == receiverId) {
+            dispatcherReceiver = receivers.Get(i);
+            receivers.Remove(i);
             break;
         }
     }
-    receiverMutex.UnLock();
     if (dispatcherReceiver == nullptr) {
-        return receiverId;
+        receiverMutex.UnLock();
+        return false;
     }
-    // wait until running to end
-    while (true) {
-        bool isRunning = false;
-        receiverMutex.Lock();
-        for (int i = 0; i < runningReceivers.Size(); ++i) {
-            if (dispatcherReceiver == runningReceivers.Get(i)) {
-                isRunning = true;
-                break;
-            }
+    // Copy the receivers of the topic except the removed one.
+    TMQTopicId topicId = dispatcherReceiver->topicId;
+    TMQTopicReceivers *origin = receiverTable->Find(topicId);
+    int count = 0;
+    auto **topicReceivers = new TMQDispatcherReceiver *[origin->Size()];
+    for (int i = 0; i < origin->Size(); ++i) {
+        if (origin->Get(i) != dispatcherReceiver) {
+            topicReceivers[count++] = origin->Get(i);
         }
-        receiverMutex.UnLock();
-        if (!isRunning) {
-            break;
+    }
+    publishReceivers(topicId, count > 0 ? new TMQTopicReceivers(topicId, topicReceivers, count)
+                                        : nullptr);
+    delete[] topicReceivers;
+    receiverMutex.UnLock();
+    // No more callback or appending will start, park until the running ones end.
+    store_seq_cst(&(dispatcherReceiver->removed), true);
+    int self = runningReceiver == dispatcherReceiver ? 1 : 0;
+    receiverCondition.Lock();
+    while (load_seq_cst(&(dispatcherReceiver->inflight)) > self) {
+        receiverCondition.Wait();
+    }
+    receiverCondition.UnLock();
+    // Deliver the pending messages of a batching receiver, nothing is appended any more. If it is
+    // removed in its own callback, delivering now would overtake the running batch, so the pending
+    // messages are dropped with the receiver.
+    TMQReceiverBatch *batch = dispatcherReceiver->batch;
+    if (batch != nullptr && self == 0) {
+        int count = 0;
+        batch->deliverMutex.Lock();
+        batch->mutex.Lock();
+        TMQMsg *msgs = batch->Take(count);
+        batch->mutex.UnLock();
+        if (msgs != nullptr) {
+            deliverBatch(dispatcherReceiver, msgs, count);
         }
+        batch->deliverMutex.UnLock();
     }
-    delete dispatcherReceiver;
+    // The dispatching with the old table may still read it, release it by the epoch.
+    epoch.Retire(dispatcherReceiver, ReleaseReceiver);
+    epoch.Reclaim();
     return true;
 }
 
 /*
- * Find a receiver from the tmq topic receiver list.
+ * Find a receiver from the receiver list.
  */
 TMQReceiver *TMQDispatcher::FindReceiver(TMQId receiverId) {
     TMQDispatcherReceiver *dispatcherReceiver = nullptr;
     receiverMutex.Lock();
-    for (int i = 0; i < topicReceivers.Size(); i++) {
-        for (int j = 0; j < topicReceivers.Get(i)->GetReceivers()->Size(); ++j) {
-            if (topicReceivers.Get(i)->GetReceivers()->Get(j)->id == receiverId) {
-                dispatcherReceiver = topicReceivers.Get(i)->GetReceivers()->Get(j);
-                break;
-            }
-        }
-        if (dispatcherReceiver != nullptr) {
+    for (int i = 0; i < receivers.Size(); i++) {
+        if (receivers.Get(i)->id == receiverId) {
+            dispatcherReceiver = receivers.Get(i);
             break;
         }
     }
@@ -285,28 +725,23 @@ TMQReceiver *TMQDispatcher::FindReceiver(TMQId receiverId) {
 }
 
 /*
- * Get the receiver ids for a topic. This method will compare all the topic in topicReceivers, and
- * collect the matched receiver id.
+ * Get the receiver ids for a topic. This method will find the receivers of the topic from the
+ * receiver table, and collect their ids.
  */
-TMQSize TMQDispatcher::GetTopicReceivers(const char *topic, TMQId **ids) {
+TMQSize TMQDispatcher::GetTopicReceivers(TMQTopicId topicId, TMQId **ids) {
     TMQSize count = 0;
-    if (topic == nullptr || ids == nullptr) {
+    if (topicId == ID_INT_INVALID || ids == nullptr) {
         return count;
     }
-    receiverMutex.Lock();
-    for (int i = 0; i < topicReceivers.Size(); ++i) {
-        if (strncmp(topic, topicReceivers.Get(i)->GetName(), TMQ_TOPIC_MAX_LENGTH) == 0
-            && topicReceivers.Get(i)->GetReceivers()->Size() > 0) {
-            count = topicReceivers.Get(i)->GetReceivers()->Size();
-            *ids = new TMQId[count];
-            for (int j = 0; j < count; ++j) {
-                (*ids)[j] = topicReceivers.Get(i)->GetReceivers()->Get(j)->id;
-            }
-            break;
+    int token = epoch.Enter();
+    TMQTopicReceivers *topicReceivers = load_acquire(&receiverTable)->Find(topicId);
+    if (topicReceivers && topicReceivers->Size() > 0) {
+        count = topicReceivers->Size();
+        *ids = new TMQId[count];
+        for (int j = 0; j < count; ++j) {
+            (*ids)[j] = topicReceivers->Get(j)->id;
         }
     }
-    receiverMutex.UnLock();
+    epoch.Exit(token);
     return count;
 }
-
-
@@ -14,6 +14,11 @@
 #include "Executor.h"
 #include "TMQMutex.h"
 #include "Shadow.h"
+#include "TMQPicker.h"
+#include "Epoch.h"
+#include "TMQCondition.h"
+#include "WorkDeque.h"
+#include <climits>
 
 /// Const definitions
 // Default executor count for the dispatcher. This is not optimal. The count of the executor should
@@ -22,13 +27,79 @@
 #define DEFAULT_EXECUTOR_COUNT              4
 // max count of the remained messages for starting a new executor.
 #define EXECUTOR_WAKE_COUNT                 512
-// const string for sent topic
+// const string for sent topic, its messages are arrays of TMQSentRange.
 #define TOPIC_SENT                          "__SENT__"
+// The upper limit of the executor count.
+#define EXECUTOR_COUNT_LIMIT                64
+// max count of the messages in a dispatch batch, the unit of work stealing.
+#define DISPATCH_BATCH_SIZE                 8
+// max count of the batches picked by a worker at once, the batches except the first are pushed to
+// its deque for stealing.
+#define DISPATCH_REFILL_COUNT               4
+// const string for the setting key of ordered dispatching, refer to TMQDispatcher for detail.
+#define DISPATCH_ORDERED                    "DISPATCH_ORDERED"
+// The upper limit of the max batch size of a batching receiver.
+#define RECEIVER_BATCH_LIMIT                1024
+// The flush time when there is no pending batch.
+#define RECEIVER_FLUSH_NONE                 LLONG_MAX
 
 TMQ_NAMESPACE
 
+/**
+ * The pending messages of a batching receiver. The messages are appended under the mutex, and
+ * taken out as a batch under the deliver mutex, which is held until the batch is delivered, so the
+ * batches are delivered one by one in order.
+ */
+    class TMQReceiverBatch {
+    public:
+        // mutex for the pending messages.
+        TMQMutex mutex;
+        // mutex for delivering, held from taking a batch until the batch is delivered.
+        TMQMutex deliverMutex;
+        // the max count of the messages in a batch.
+        int maxBatch;
+        // the max time in milliseconds for the first pending message waiting for delivery.
+        int lingerMs;
+        // the count of the pending messages.
+        int count;
+        // the time when the first pending message is appended.
+        long long firstTime;
+        // the pending messages, the length is maxBatch.
+        TMQMsg *msgs;
+    public:
+        TMQReceiverBatch(int maxBatch, int lingerMs)
+                : maxBatch(maxBatch), lingerMs(lingerMs), count(0), firstTime(0),
+                  msgs(new TMQMsg[maxBatch]) {
+
+        }
+
+        /*
+         * Destructor, the pending messages are released without delivery.
+         */
+        ~TMQReceiverBatch() {
+            delete[] msgs;
+        }
+
+        /**
+         * Take the pending messages out, the mutex should be held by the caller.
+         * @param n, a reference to receive the count of the messages.
+         * @return the messages, should be released by delete[], nullptr if there is none.
+         */
+        TMQMsg *Take(int &n) {
+            n = count;
+            if (count == 0) {
+                return nullptr;
+            }
+            TMQMsg *taken = msgs;
+            msgs = new TMQMsg[maxBatch];
+            count = 0;
+            return taken;
+        }
+    };
+
 /*
- * Dispatcher receiver, used to wrapper the TMQReceiver and its unique id.
+ * Dispatcher receiver, used to wrapper the TMQReceiver and its unique id. The inflight and removed
+ * are used to wait the running callbacks when the receiver is removed.
  */
     class TMQDispatcherReceiver {
     public:
@@ -36,55 +107,202 @@ TMQ_NAMESPACE
         TMQReceiver *receiver;
         // the id for this receiver
         TMQId id;
+        // the topic id subscribed by this receiver
+        TMQTopicId topicId;
+        // the count of the running callbacks, including the ones going to check removed.
+        volatile int inflight;
+        // whether the receiver is removed, no more callback will start after it is set.
+        volatile bool removed;
+        // the pending messages for batched delivery, nullptr if the receiver is not batching.
+        TMQReceiverBatch *batch;
     public:
-        TMQDispatcherReceiver(TMQReceiver *tmqReceiver, TMQId id) {
+        TMQDispatcherReceiver(TMQReceiver *tmqReceiver, TMQId id, TMQTopicId topicId,
+                              TMQReceiverBatch *batch = nullptr)
+                : inflight(0), removed(false), batch(batch) {
             this->receiver = tmqReceiver;
             this->id = id;
+            this->topicId = topicId;
+        }
+
+        /*
+         * Destructor, release the pending messages.
+         */
+        ~TMQDispatcherReceiver() {
+            delete batch;
         }
     };
 
 /**
- * A topic receiver list for saving receivers with its topic.
+ * The receivers of one topic. It is never modified after being published to the receiver table, a
+ * subscription creates a new one instead.
  */
     class TMQTopicReceivers {
     private:
-        // topic for the receivers.
-        char name[TMQ_TOPIC_MAX_LENGTH] = {0};
-        // receiver list.
-        List<TMQDispatcherReceiver *> receivers;
+        // topic id for the receivers.
+        TMQTopicId topicId;
+        // receiver array.
+        TMQDispatcherReceiver **receivers;
+        // the count of the receivers.
+        int count;
     public:
         /**
-         * Constructor a TMQTopicReceivers with name.
-         * @param name
+         * Constructor a TMQTopicReceivers with topic id and the receivers.
+         * @param topicId, the id of the topic.
+         * @param receivers, the receivers to copy.
+         * @param count, the count of the receivers.
          */
-        TMQTopicReceivers(const char *name = nullptr) {
-            if (name) {
-                strncpy(this->name, name, sizeof(this->name));
+        TMQTopicReceivers(TMQTopicId topicId, TMQDispatcherReceiver **receivers, int count)
+                : topicId(topicId), receivers(new TMQDispatcherReceiver *[count > 0 ? count : 1]),
+                  count(count) {
+            for (int i = 0; i < count; ++i) {
+                this->receivers[i] = receivers[i];
             }
         }
 
         /*
-         * Get method for the name.
+         * Destructor, the receivers are owned by the dispatcher, release the array only.
+         */
+        ~TMQTopicReceivers() {
+            delete[] receivers;
+        }
+
+        /*
+         * Get method for the topic id.
          */
-        const char *GetName() {
-            return name;
+        TMQTopicId GetTopicId() const {
+            return topicId;
         }
 
+        /*
+         * Get method for the count of the receivers.
+         */
+        int Size() const {
+            return count;
+        }
+
+        /*
+         * Get method for the receiver at index.
+         */
+        TMQDispatcherReceiver *Get(int index) const {
+            return receivers[index];
+        }
+    };
+
+/**
+ * A snapshot of the receivers of all topics, indexed by the topic id. Like TMQTopicReceivers, it is
+ * never modified after being published, the unchanged TMQTopicReceivers are shared by snapshots.
+ */
+    class TMQReceiverTable {
+    private:
+        // The length of topics.
+        TMQSize size;
+        // The receivers of each topic id, nullptr if the topic has no receiver.
+        TMQTopicReceivers **topics;
+    public:
         /**
-         * Set method for name.
-         * @param s, a pointer to the topic
+         * Construct a table, copy the topic receivers of the origin table.
+         * @param origin, the table to copy, nullptr for an empty table.
+         * @param size, the length of topics, it is not less than the size of origin.
          */
-        void SetName(const char *topic) {
-            if (topic) {
-                strncpy(this->name, topic, sizeof(this->name));
+        TMQReceiverTable(const TMQReceiverTable *origin, TMQSize size)
+                : size(size), topics(new TMQTopicReceivers *[size > 0 ? size : 1]{nullptr}) {
+            for (TMQSize i = 0; origin && i < origin->size && i < size; ++i) {
+                topics[i] = origin->topics[i];
             }
         }
 
         /*
-         * Get method for the topic receiver list.
+         * Destructor, the topic receivers may be shared, release the array only.
+         */
+        ~TMQReceiverTable() {
+            delete[] topics;
+        }
+
+        /*
+         * Get method for the length of topics.
+         */
+        TMQSize Size() const {
+            return size;
+        }
+
+        /*
+         * Find the receivers of a topic id.
+         */
+        TMQTopicReceivers *Find(TMQTopicId topicId) const {
+            return topicId >= 0 && (TMQSize) topicId < size ? topics[topicId] : nullptr;
+        }
+
+        /*
+         * Set the receivers of a topic id, only for a table not published.
+         */
+        void Set(TMQTopicId topicId, TMQTopicReceivers *receivers) {
+            topics[topicId] = receivers;
+        }
+    };
+
+/**
+ * A batch of picked messages, it is dispatched by one worker, either the worker picking it, or an
+ * idle worker stealing it.
+ */
+    class TMQDispatchBatch {
+    public:
+        // the count of the messages.
+        int count;
+        // the claimed stripe for ordered dispatching, released after the batch is dispatched, -1
+        // for none.
+        int stripe;
+        // the topic ids of the messages.
+        TMQTopicId topicIds[DISPATCH_BATCH_SIZE];
+        // the messages.
+        TMQMsg msgs[DISPATCH_BATCH_SIZE];
+    public:
+        TMQDispatchBatch() : count(0), stripe(-1), topicIds{0} {
+
+        }
+    };
+
+    class TMQDispatcher;
+
+/**
+ * A dispatch worker, one for each executor. It picks messages with its own picker into batches,
+ * keeps the batches in its own deque, and steals batches from the others when it has nothing to
+ * pick.
+ */
+    class TMQDispatchWorker : public TMQCallable {
+    public:
+        // the dispatcher running this worker.
+        TMQDispatcher *dispatcher;
+        // the index of the worker in the dispatcher.
+        int index;
+        // the CPU to bind at the next execution, -1 for none.
+        int cpu;
+        // the picker owned by this worker, the pick mutex is not contended by other workers.
+        TMQPicker *picker;
+        // the batches picked by this worker, popped by itself and stolen by others.
+        WorkDeque<TMQDispatchBatch *> deque;
+        // a batch for reusing, to avoid allocating for each refill.
+        TMQDispatchBatch *spare;
+        // the executor running this worker.
+        IExecutor *executor;
+        // the delay to run again for flushing the lingering batches of receivers.
+        long recallDelay;
+    public:
+        TMQDispatchWorker(TMQDispatcher *dispatcher, int index, int cpu, TMQPicker *picker)
+                : dispatcher(dispatcher), index(index), cpu(cpu), picker(picker), spare(nullptr),
+                  executor(nullptr), recallDelay(0) {
+
+        }
+
+        /*
+         * Override method for TMQCallable, run the worker loop of the dispatcher.
          */
-        List<TMQDispatcherReceiver *> *GetReceivers() {
-            return &receivers;
+        bool OnExecute(long eid) override;
+
+        /*
+         * Override method for TMQCallable, the delay set by the worker loop.
+         */
+        long GetRecallDelay() override {
+            return recallDelay;
         }
     };
 
@@ -94,9 +312,12 @@ TMQ_NAMESPACE
  * This is class that uses to manage the topic receivers and thread executors.
  *
  *  For receivers:
- * It has an topic receiver list allowed to add, find and remove a topic receiver. All receivers are
- * organized by their subscribed topic, which can find a topic receiver more quick. The receivers
- * under one topic are ordered with fifo. Receivers registered more early will be invoked more fast.
+ * All receivers are organized by the id of their subscribed topic into a receiver table. The
+ * receivers under one topic are ordered with fifo. Receivers registered more early will be invoked
+ * more fast. The table is copied on write: adding or removing a receiver publishes a new table and
+ * retires the old one by the epoch, so that dispatching reads the table without lock and without
+ * allocation. Removing a receiver parks on a condition until its running callbacks are finished,
+ * then the receiver is retired by the epoch as well.
  *
  * For executors:
  * A dispatcher contains zero or several executors. if There are no any executors, maybe it is
@@ -107,6 +328,24 @@ TMQ_NAMESPACE
  * congested, there may be only one executor running. And when there are many messages congested,
  * the dispatcher will startup new executor for sending message.
  *
+ * Each executor runs a worker with its own picker and its own deque of message batches. A worker
+ * picks several batches at once, dispatches the first one and leaves the others in its deque, an
+ * idle worker is waked to steal them. So that the executors do not contend on one picker, and they
+ * are kept busy even if a few receivers are slow.
+ *
+ * For ordering:
+ * By default, two messages of one topic may be dispatched by two executors concurrently. With the
+ * setting DISPATCH_ORDERED=true, a batch only has messages of one topic, the order key of the topic
+ * is claimed before picking, and released after the batch is dispatched. So the messages of a topic
+ * are dispatched one by one in order, while the different topics are dispatched in parallel. The
+ * topics sharing an order key, set by SetOrderingKey of the topic, are dispatched one by one too.
+ *
+ * For batching:
+ * A receiver subscribed with a max batch size accumulates the dispatched messages, they are
+ * delivered by OnReceiveBatch when the batch is full, or when its linger time is expired. The
+ * expired batches are flushed by the workers between batches of dispatching and before waiting.
+ * A worker leaving lingering batches waits with a timeout, so that it runs again to flush them.
+ *
  */
     class TMQDispatcher : public Dispatcher, TMQCallable {
     private:
@@ -116,18 +355,22 @@ TMQ_NAMESPACE
         TMQMutex mutex;
         // The max count limits for executors.
         int maxExecutorCount;
-        // The active count of the executors.
-        int activeExecutorCount;
-        // The pointer to the executor array.
-        IExecutor **executors;
+        // The active count of the executors, read by the workers for stealing without lock.
+        volatile int activeExecutorCount;
+        // The worker array, each worker owns an executor.
+        TMQDispatchWorker **workers;
         // Dispatch mutex for running receivers.
         TMQMutex dispatcherMutex;
-        // receiverMutex, for topic receivers only
+        // receiverMutex, for the writers of receivers only
         TMQMutex receiverMutex;
-        // Topic receiver list, organized by subscribed topic. That means one topic has multiple receivers.
-        List<TMQTopicReceivers *> topicReceivers;
-        // Running receivers, for waiting when unsubscribe
-        List<TMQDispatcherReceiver *> runningReceivers;
+        // All receivers, for finding a receiver by its id.
+        List<TMQDispatcherReceiver *> receivers;
+        // The current receiver table, read by dispatching in the epoch.
+        TMQReceiverTable *volatile receiverTable;
+        // Epoch for reading and reclaiming the receiver tables and the removed receivers.
+        Epoch epoch;
+        // Condition for waiting the running callbacks of a removed receiver.
+        TMQCondition receiverCondition;
 
         // Counter for wakeup
         TMQLongSize wakeupCount;
@@ -135,10 +378,23 @@ TMQ_NAMESPACE
         TMQLongSize sentCount;
         // bool value, indicates whether this invoke can wakeup itself.
         volatile bool forceActiveSelf;
+        // The version of the settings read last time.
+        volatile TMQSize settingsVersion;
+        // Whether to bind the new executors to CPUs, read from the settings.
+        bool executorAffinity;
+        // Whether to dispatch the messages of a topic in order, read from the settings.
+        volatile bool orderedDispatch;
+        // The claims of the order keys for ordered dispatching.
+        TMQOrderClaims orderClaims;
         // Generate a id for the registered receiver.
         TMQId receiverIdCounter;
+        // The earliest time to flush the pending batches of receivers, RECEIVER_FLUSH_NONE if there
+        // is no pending batch.
+        volatile long long flushTime;
+        // The topic id of TOPIC_SENT.
+        TMQTopicId sentTopicId;
         // The picker using for pick message from tmq.
-        IPicker *picker;
+        TMQPicker *picker;
         // Indicates whether to stop the running or not. It is a volatile variable.
         volatile bool stop;
     public:
@@ -179,14 +435,13 @@ TMQ_NAMESPACE
         int GetMaxExecutorCount() const;
 
         /**
-         * RunTask a single topic receiver, internal method. With this method, we can release some mutex,
-         * which can avoids some block or time-consuming callbacks holding mutex on a long time.
-         * @param topic, topic of the running receiver.
-         * @param recId, receiver id to run.
+         * RunTask a single topic receiver, internal method. The caller should be in the epoch, so
+         * that the receiver can not be released during running. A removed receiver is skipped.
+         * @param receiver, the receiver to run.
          * @param msg, the tmq message to dispatch.
          * @return void, nothing to be returned.
          */
-        void OnRunningReceiver(const char *topic, TMQId recId, const TMQMsg &msg);
+        void OnRunningReceiver(TMQDispatcherReceiver *receiver, const TMQMsg &msg);
 
         /**
          * Override method for Dispatcher, uses to add a topic receiver.
@@ -196,6 +451,18 @@ TMQ_NAMESPACE
          */
         virtual TMQId AddReceiver(const char *topic, TMQReceiver *receiver);
 
+        /**
+         * Override method for Dispatcher, uses to add a batching topic receiver.
+         * @param topic, the topic of the receiver.
+         * @param receiver, a pointer to the receiver.
+         * @param maxBatch, the max count of the messages in a batch, limited by
+         *  RECEIVER_BATCH_LIMIT, 1 or less for no batching.
+         * @param lingerMs, the max time in milliseconds for a message waiting for its batch.
+         * @return a TMQId type id for this topic and receiver.
+         */
+        virtual TMQId AddReceiver(const char *topic, TMQReceiver *receiver, int maxBatch,
+                                  int lingerMs);
+
         /**
          * Override method for Dispatcher, uses to remove a topic receiver.
          * @param receiverId, the receiver id to remove.
@@ -217,25 +484,155 @@ TMQ_NAMESPACE
          * signal will be wake up.
          * @param activeSelf, a boolean value indicate whether activate itself as a executor to send
          *  message immediately.
+         * @param count, the count of the arrived messages.
          * @return void.
          */
-        virtual void Wakeup(bool activeSelf);
+        virtual void Wakeup(bool activeSelf, int count);
 
         /**
          * Dispatch topic messages, internal method.
-         * @param topic, the topic of the message.
+         * @param topicId, the topic id of the message.
          * @param msg, the tmq message.
          * @return bool, a boolean value indicate whether it is success or not.
          */
-        bool dispatchMessage(const char *topic, const TMQMsg &msg);
+        bool dispatchMessage(TMQTopicId topicId, const TMQMsg &msg);
 
         /**
          * Get the receivers subscribe a topic.
-         * @param topic the topic to be subscribed
+         * @param topicId the topic id to be subscribed
          * @param ids, results of the receiver id.
          * @return TMQSize, a TMQSize type value represent the size of the ids(receivers).
          */
-        TMQSize GetTopicReceivers(const char *topic, TMQId **ids);
+        TMQSize GetTopicReceivers(TMQTopicId topicId, TMQId **ids);
+
+        /**
+         * The loop of a worker, dispatch the batches from its deque, its picker, or other workers,
+         * until there is nothing to dispatch.
+         * @param worker, the worker running on the current executor.
+         * @return bool, true if there are lingering batches, the executor runs it again after the
+         *  recall delay of the worker. Otherwise false, the executor waits for the next wakeup.
+         */
+        bool runWorker(TMQDispatchWorker *worker);
+
+    private:
+        /**
+         * Get the next batch for a worker. The order is the deque of the worker, then picking with
+         * its picker, then stealing from the others.
+         * @param worker, the worker.
+         * @return a batch, nullptr if there is nothing to dispatch.
+         */
+        TMQDispatchBatch *nextBatch(TMQDispatchWorker *worker);
+
+        /**
+         * Pick batches with the picker of the worker, the batches except the first are pushed to the
+         * deque of the worker, and a waiting executor is waked to steal them.
+         * @param worker, the worker.
+         * @return the first batch, nullptr if no message is picked.
+         */
+        TMQDispatchBatch *refillBatches(TMQDispatchWorker *worker);
+
+        /**
+         * Steal a batch from the other workers.
+         * @param worker, the worker going to steal.
+         * @return a batch, nullptr if all deques are empty.
+         */
+        TMQDispatchBatch *stealBatch(TMQDispatchWorker *worker);
+
+        /**
+         * Pick messages into a batch. In ordered mode, the messages are of one topic, and its order
+         * key is claimed by the batch.
+         * @param batchPicker, the picker to pick with.
+         * @param batch, the batch to fill, it should be empty.
+         * @return the count of the picked messages.
+         */
+        int fillBatch(TMQPicker *batchPicker, TMQDispatchBatch *batch);
+
+        /**
+         * Dispatch the messages of a batch and their receipt, then release its claim.
+         * @param batch, the batch to dispatch.
+         */
+        void dispatchBatch(TMQDispatchBatch *batch);
+
+        /**
+         * Dispatch a receipt of the messages of a batch to TOPIC_SENT, the ids are coalesced into
+         * ranges. Nothing is done if TOPIC_SENT has no receiver.
+         * @param batch, the dispatched batch.
+         */
+        void dispatchReceipt(TMQDispatchBatch *batch);
+
+        /**
+         * Release the messages of a dispatched batch, and keep it as the spare of the worker.
+         * @param worker, the worker.
+         * @param batch, the dispatched batch.
+         */
+        void recycleBatch(TMQDispatchWorker *worker, TMQDispatchBatch *batch);
+
+        /**
+         * Whether the caller can run a callback of the receiver, if true, leaveReceiver should be
+         * called after the callback. The caller should be in the epoch.
+         * @param receiver, the receiver.
+         * @return false if the receiver is removed.
+         */
+        bool enterReceiver(TMQDispatcherReceiver *receiver);
+
+        /**
+         * Finish a callback of the receiver entered by enterReceiver, wake up the waiting
+         * RemoveReceiver if the receiver is removed.
+         * @param receiver, the receiver.
+         */
+        void leaveReceiver(TMQDispatcherReceiver *receiver);
+
+        /**
+         * Append a message to the pending batch of a batching receiver, deliver the batch if it is
+         * full.
+         * @param receiver, the batching receiver.
+         * @param msg, the message to append, it is copied into the batch.
+         */
+        void appendBatch(TMQDispatcherReceiver *receiver, const TMQMsg &msg);
+
+        /**
+         * Deliver the pending batch of a receiver if it is full or expired.
+         * @param receiver, the batching receiver.
+         * @param now, the current time by TMQUtils::NowMillis, -1 to deliver the batch anyway.
+         * @return the time when the remaining batch expires, RECEIVER_FLUSH_NONE for none.
+         */
+        long long flushReceiver(TMQDispatcherReceiver *receiver, long long now);
+
+        /**
+         * Call OnReceiveBatch of the receiver with the taken messages, and release them.
+         * @param receiver, the batching receiver.
+         * @param msgs, the messages taken from the batch.
+         * @param count, the count of the messages.
+         */
+        void deliverBatch(TMQDispatcherReceiver *receiver, TMQMsg *msgs, int count);
+
+        /**
+         * Deliver the expired batches of all batching receivers, the scan is skipped if the
+         * earliest flush time is not reached.
+         * @param now, the current time by TMQUtils::NowMillis, -1 to deliver all batches anyway.
+         * @return the earliest time to flush the remaining batches, RECEIVER_FLUSH_NONE for none.
+         */
+        long long flushBatches(long long now);
+
+        /**
+         * Lower the earliest flush time to a batch expiring at time.
+         * @param time, the time when the batch expires.
+         */
+        void lowerFlushTime(long long time);
+
+        /**
+         * Read the settings of the dispatcher from the snapshot of the settings, it is called only
+         * when the version of the settings is changed.
+         */
+        void refreshSettings();
+
+        /**
+         * Publish the receivers of a topic with a new receiver table, and retire the old table, the
+         * receiverMutex should be held by the caller.
+         * @param topicId, the topic id.
+         * @param topicReceivers, the new receivers of the topic, nullptr if there is no receiver.
+         */
+        void publishReceivers(TMQTopicId topicId, TMQTopicReceivers *topicReceivers);
 
     };
 
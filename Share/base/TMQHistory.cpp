@@ -7,111 +7,639 @@
 //
 
 #include "TMQHistory.h"
+#include "TMQTopicRegistry.h"
+#include "TMQUtils.h"
+#include "Atomic.h"
+#include <climits>
 
 USING_TMQ_NAMESPACE
 
-/**
- * Static method for TMQStat compare. This is a function required by order list.
- * @param one, the first element to be compared.
- * @param another, the second element to be compared.
- * @return, a int value of the compare result.
+/*
+ * Construct an empty ring with the default limits.
+ */
+HistoryRing::HistoryRing(TMQTopicId topicId)
+        : topicId(topicId), entries(nullptr), capacity(0), first(0), count(0), sequence(0), bytes(0),
+          msgMax(HISTORY_TOPIC_MSG_MAX), bytesMax(0), ageMax(0) {
+
+}
+
+HistoryRing::~HistoryRing() {
+    delete[] entries;
+}
+
+/*
+ * Evict the entries beyond the new max count first, then move the others to the new entries in
+ * order.
+ */
+void HistoryRing::SetLimits(int max, long long maxBytes, long long maxAge, List<Shadow> &evicted) {
+    max = max < 0 ? HISTORY_TOPIC_MSG_MAX : (max > HISTORY_TOPIC_MSG_LIMIT
+                                              ? HISTORY_TOPIC_MSG_LIMIT : max);
+    bytesMax = maxBytes > 0 ? maxBytes : 0;
+    ageMax = maxAge > 0 ? maxAge : 0;
+    if (entries == nullptr || max != msgMax) {
+        if (count > max) {
+            Evict(count - max, evicted);
+        }
+        int newCapacity = max + HISTORY_EVICT_BATCH;
+        auto *newEntries = new HistoryEntry[newCapacity];
+        for (int i = 0; i < count; ++i) {
+            newEntries[i] = entries[(first + i) % capacity];
+        }
+        delete[] entries;
+        entries = newEntries;
+        capacity = newCapacity;
+        first = 0;
+        store_release(&msgMax, max);
+    }
+    while (bytesMax > 0 && bytes > bytesMax && count > 0) {
+        Evict(1, evicted);
+    }
+}
+
+/*
+ * Put the shadow after the last one. A message over the max bytes alone is not kept either.
+ */
+void HistoryRing::Append(const Shadow &shadow, long long now, List<Shadow> &evicted) {
+    if (count == capacity) {
+        Evict(HISTORY_EVICT_BATCH, evicted);
+    }
+    HistoryEntry &entry = entries[(first + count) % capacity];
+    entry.shadow = shadow;
+    entry.time = now;
+    bytes += shadow.length;
+    store_release(&count, count + 1);
+    while (bytesMax > 0 && bytes > bytesMax && count > 0) {
+        Evict(1, evicted);
+    }
+}
+
+/*
+ * Move the oldest entries out.
+ */
+int HistoryRing::Evict(int n, List<Shadow> &evicted) {
+    int evictCount = 0;
+    for (; evictCount < n && evictCount < count; ++evictCount) {
+        const Shadow &shadow = entries[first].shadow;
+        evicted.Add(shadow);
+        bytes -= shadow.length;
+        first = (first + 1) % capacity;
+    }
+    sequence += evictCount;
+    store_release(&count, count - evictCount);
+    return evictCount;
+}
+
+/*
+ * Evict from the oldest one by one, until the oldest one is in all limits.
+ */
+int HistoryRing::Trim(long long now, int n, List<Shadow> &evicted) {
+    int evictCount = 0;
+    while (evictCount < n && count > 0
+           && (count > msgMax || (bytesMax > 0 && bytes > bytesMax)
+               || IsExpired(entries[first], now))) {
+        evictCount += Evict(1, evicted);
+    }
+    return evictCount;
+}
+
+/*
+ * The entries beyond the max count are waiting for eviction, they are invisible.
+ */
+int HistoryRing::Size() {
+    int size = load_acquire(&count);
+    int max = load_acquire(&msgMax);
+    return size < max ? size : max;
+}
+
+/*
+ * Skip the entries waiting for eviction, and get the entry from the ring directly.
+ */
+const HistoryEntry &HistoryRing::Get(int position) {
+    int skip = count - Size();
+    return entries[(first + skip + position) % capacity];
+}
+
+long long HistoryRing::First() {
+    return sequence + count - Size();
+}
+
+long long HistoryRing::End() {
+    return sequence + count;
+}
+
+const HistoryEntry &HistoryRing::At(long long seq) {
+    return entries[(first + (int) (seq - sequence)) % capacity];
+}
+
+bool HistoryRing::IsExpired(const HistoryEntry &entry, long long now) {
+    return ageMax > 0 && now - entry.time > ageMax;
+}
+
+/*
+ * Default constructor, the settings are applied on the first append.
+ */
+TMQHistory::TMQHistory() : TMQHistory(nullptr) {
+
+}
+
+TMQHistory::TMQHistory(IStorage *storage)
+        : count(0), storage(storage), bytes(0), settingsVersion(0), budget(0), aged(false),
+          maintainer(nullptr), scheduled(false), maintainDelay(0) {
+
+}
+
+/*
+ * Stop the maintainer first, it may be running on the rings. The messages in the history are left
+ * in the storage.
+ */
+TMQHistory::~TMQHistory() {
+    delete maintainer;
+    for (TMQSize i = 0; i < count; ++i) {
+        delete Get(i);
+    }
+    for (int i = 0; i < HISTORY_CHUNK_COUNT; ++i) {
+        delete[] slots[i];
+        delete[] chunks[i];
+    }
+}
+
+/*
+ * Find the ring from the slots directly, the slot is published by the creator with release
+ * order.
+ */
+HistoryRing *TMQHistory::Find(TMQTopicId topicId) {
+    if (topicId < 0 || topicId >= HISTORY_CHUNK_SIZE * HISTORY_CHUNK_COUNT) {
+        return nullptr;
+    }
+    HistoryRing **slot = load_acquire(&(slots[topicId / HISTORY_CHUNK_SIZE]));
+    return slot ? load_acquire(&(slot[topicId % HISTORY_CHUNK_SIZE])) : nullptr;
+}
+
+/*
+ * Find the ring, if not exist, create it with the mutex. The settings are applied before the ring
+ * is published, under the same mutex as RefreshSettings, so no ring misses a change. The new ring
+ * is put into the chunk before the count increased, so that readers without lock can see the
+ * completed ring.
+ */
+HistoryRing *TMQHistory::Obtain(TMQTopicId topicId) {
+    HistoryRing *ring = Find(topicId);
+    if (ring || topicId < 0 || topicId >= HISTORY_CHUNK_SIZE * HISTORY_CHUNK_COUNT) {
+        return ring;
+    }
+    createMutex.Lock();
+    // Check again, it may be created by others before the lock.
+    ring = Find(topicId);
+    if (ring == nullptr) {
+        TMQSize slotChunk = topicId / HISTORY_CHUNK_SIZE;
+        if (slots[slotChunk] == nullptr) {
+            store_release(&(slots[slotChunk]), new HistoryRing *[HISTORY_CHUNK_SIZE]{nullptr});
+        }
+        TMQSize chunk = count / HISTORY_CHUNK_SIZE;
+        if (chunks[chunk] == nullptr) {
+            chunks[chunk] = new HistoryRing *[HISTORY_CHUNK_SIZE]{nullptr};
+        }
+        ring = new HistoryRing(topicId);
+        TMQSettingsSnapshot *snapshot = TMQSettings::GetInstance()->Acquire();
+        List<Shadow> evicted;
+        ApplyLimits(ring, snapshot, evicted);
+        snapshot->Release();
+        if (ring->ageMax > 0) {
+            store_release(&aged, true);
+        }
+        chunks[chunk][count % HISTORY_CHUNK_SIZE] = ring;
+        store_release(&(slots[slotChunk][topicId % HISTORY_CHUNK_SIZE]), ring);
+        store_release(&count, count + 1);
+    }
+    createMutex.UnLock();
+    return ring;
+}
+
+/*
+ * Get the ring from chunks directly.
+ */
+HistoryRing *TMQHistory::Get(TMQSize position) {
+    return chunks[position / HISTORY_CHUNK_SIZE][position % HISTORY_CHUNK_SIZE];
+}
+
+/*
+ * Read the latest messages under the mutex of the ring, so that they can not be evicted and
+ * removed from the storage during reading.
+ */
+int TMQHistory::ReadRing(HistoryRing *ring, int limit, TMQMsg *msgs) {
+    long long now = TMQUtils::NowMillis();
+    int read = 0;
+    ring->mutex.Lock();
+    int size = ring->Size();
+    for (int i = size > limit ? size - limit : 0; i < size; ++i) {
+        const HistoryEntry &entry = ring->Get(i);
+        if (!ring->IsExpired(entry, now) && storage->Read(entry.shadow, msgs[read])) {
+            read++;
+        }
+    }
+    ring->mutex.UnLock();
+    return read;
+}
+
+/*
+ * Read the limits for the topic of the ring, and set them with the ring mutex.
+ */
+void TMQHistory::ApplyLimits(HistoryRing *ring, TMQSettingsSnapshot *snapshot,
+                             List<Shadow> &evicted) {
+    const char *topic = TMQTopicRegistry::GetInstance()->GetName(ring->topicId);
+    int msgMax = snapshot->GetTopicInt(KEY_HISTORY_MSG_MAX, topic, HISTORY_TOPIC_MSG_MAX);
+    long long bytesMax = snapshot->GetTopicLong(KEY_HISTORY_BYTES_MAX, topic, 0);
+    long long ageMax = snapshot->GetTopicLong(KEY_HISTORY_AGE_MAX, topic, 0);
+    ring->mutex.Lock();
+    long long before = ring->bytes;
+    ring->SetLimits(msgMax, bytesMax, ageMax, evicted);
+    add_and_fetch_seq_cst(&bytes, ring->bytes - before);
+    ring->mutex.UnLock();
+}
+
+/*
+ * Apply the settings to all rings with the mutex, the version is saved at last, so the concurrent
+ * appending threads read the settings again until they are applied.
+ */
+void TMQHistory::RefreshSettings() {
+    List<Shadow> evicted;
+    createMutex.Lock();
+    TMQSettingsSnapshot *snapshot = TMQSettings::GetInstance()->Acquire();
+    if (snapshot->GetVersion() != settingsVersion) {
+        long long value = snapshot->GetLong(KEY_HISTORY_BUDGET, 0);
+        store_release(&budget, value > 0 ? value : 0);
+        bool anyAged = false;
+        for (TMQSize i = 0; i < count; ++i) {
+            ApplyLimits(Get(i), snapshot, evicted);
+            anyAged = anyAged || Get(i)->ageMax > 0;
+        }
+        store_release(&aged, anyAged);
+        store_release(&settingsVersion, snapshot->GetVersion());
+    }
+    snapshot->Release();
+    createMutex.UnLock();
+    Remove(evicted);
+    if (NeedMaintain()) {
+        Schedule();
+    }
+}
+
+/*
+ * Remove the evicted messages in one batch.
  */
-int StatCompare(void *one, void *another) {
-    // use topic string compare directly.
-    return strcmp(((TMQStat *) one)->topic, ((TMQStat *) another)->topic);
+void TMQHistory::Remove(List<Shadow> &evicted) {
+    if (!evicted.Empty() && storage) {
+        storage->Remove(&(evicted.Get(0)), (int) evicted.Size());
+    }
+}
+
+bool TMQHistory::NeedMaintain() {
+    long long local = load_seq_cst(&bytes);
+    long long limit = load_acquire(&budget);
+    return (limit > 0 && local > limit) || (load_acquire(&aged) && local > 0);
 }
 
 /*
- * Get history messages for some topics. This will delegate the OverviewIterator to loop up in the
- * shadowQueue, but not consume them.
+ * Only the one setting the scheduled flag wakes the maintainer, refer OnExecute for clearing it.
+ */
+void TMQHistory::Schedule() {
+    bool local = false;
+    bool expect = true;
+    if (load_acquire(&scheduled) || !compare_and_set_seq_cst(&scheduled, &local, &expect)) {
+        return;
+    }
+    createMutex.Lock();
+    if (maintainer == nullptr) {
+        maintainer = new ThreadExecutor(this);
+    }
+    maintainer->Wakeup();
+    createMutex.UnLock();
+}
+
+/*
+ * Get history messages for some topics. The rings are counted first for the result array, a ring
+ * may grow before it is read, so the latest messages up to the counted size are read. The topics
+ * that are never registered have no history.
  */
 TMQSize TMQHistory::GetHistory(const char **topics, int len, TMQMsg **msg) {
-    // Create a OverviewIterator variable.
-    OverviewIterator overviewIterator(&shadowQueue, topics, len);
-    Shadow shadow;
-    // OverviewIterator will return false always, so Lookup will return false, but traverse all
-    // shadows.
-    overviewIterator.Lookup(shadow);
-    // Check found results, and read them if founds are not empty..
-    if (!overviewIterator.founds.Empty()) {
-        *msg = new TMQMsg[overviewIterator.founds.Size()];
-        for (int i = 0; i < overviewIterator.founds.Size(); ++i) {
-            storage->Read(overviewIterator.founds.Get(i), (*msg)[i]);
+    if (storage == nullptr) {
+        return 0;
+    }
+    bool all = topics == nullptr || len <= 0;
+    TMQSize ringCount = load_acquire(&count);
+    int ringLen = 0;
+    auto **rings = new HistoryRing *[all ? (ringCount > 0 ? ringCount : 1) : len];
+    if (all) {
+        for (TMQSize i = 0; i < ringCount; ++i) {
+            rings[ringLen++] = Get(i);
+        }
+    } else {
+        for (int i = 0; i < len; ++i) {
+            HistoryRing *ring = Find(TMQTopicRegistry::GetInstance()->Find(topics[i]));
+            // Skip the topics without history, and the duplicated ones.
+            for (int j = 0; ring && j < ringLen; ++j) {
+                ring = rings[j] == ring ? nullptr : ring;
+            }
+            if (ring) {
+                rings[ringLen++] = ring;
+            }
         }
     }
+    auto *sizes = new int[ringLen > 0 ? ringLen : 1];
+    int total = 0;
+    for (int i = 0; i < ringLen; ++i) {
+        sizes[i] = rings[i]->Size();
+        total += sizes[i];
+    }
+    int position = 0;
+    if (total > 0) {
+        auto *msgs = new TMQMsg[total];
+        for (int i = 0; i < ringLen; ++i) {
+            position += ReadRing(rings[i], sizes[i], msgs + position);
+        }
+        if (position > 0) {
+            *msg = msgs;
+        } else {
+            delete[] msgs;
+        }
+    }
+    delete[] sizes;
+    delete[] rings;
     // Return the size of found results.
-    return (int) (overviewIterator.founds.Size());
+    return position;
+}
+
+/*
+ * Create a cursor on this history.
+ */
+IHistoryCursor *TMQHistory::CreateCursor(const char **topics, int len, int direction, int limit) {
+    return new TMQHistoryCursor(this, topics, len, direction, limit);
+}
+
+void TMQHistory::GetTopicIds(List<TMQTopicId> &topicIds) {
+    TMQSize ringCount = load_acquire(&count);
+    for (TMQSize i = 0; i < ringCount; ++i) {
+        topicIds.Add(Get(i)->topicId);
+    }
+}
+
+/*
+ * Read the entries from the position under the mutex of the ring, the position is moved into the
+ * visible range first, the entries evicted after the last page are skipped in this way.
+ */
+int TMQHistory::ReadPage(TMQTopicId topicId, bool forward, bool started, long long &position,
+                         bool &finished, int max, TMQMsg *msgs, bool payload,
+                         List<HistoryMark> &marks) {
+    HistoryRing *ring = Find(topicId);
+    finished = ring == nullptr;
+    if (ring == nullptr || storage == nullptr || max <= 0) {
+        return 0;
+    }
+    long long now = TMQUtils::NowMillis();
+    int read = 0;
+    ring->mutex.Lock();
+    long long begin = ring->First();
+    long long end = ring->End();
+    if (!started) {
+        position = forward ? begin : end - 1;
+    } else if (forward) {
+        position = position < begin ? begin : position;
+    } else {
+        position = position >= end ? end - 1 : position;
+    }
+    while (read < max && position >= begin && position < end) {
+        const HistoryEntry &entry = ring->At(position);
+        if (!ring->IsExpired(entry, now)) {
+            TMQMsg &msg = msgs[read];
+            bool suc = true;
+            if (payload) {
+                suc = storage->Read(entry.shadow, msg);
+            } else {
+                msg = TMQMsg();
+                msg.msgId = entry.shadow.msgId;
+                msg.length = (int) entry.shadow.length;
+                msg.flag = entry.shadow.flag;
+            }
+            if (suc) {
+                HistoryMark mark = {topicId, position};
+                marks.Add(mark);
+                read++;
+            }
+        }
+        position += forward ? 1 : -1;
+    }
+    finished = position < begin || position >= end;
+    ring->mutex.UnLock();
+    return read;
 }
 
 /*
- * Append a history message. Upon appending, we will calculate the the message count of one topic.
- * If the length reaches to HISTORY_TOPIC_MSG_MAX, invoke CalReduce task immediately.
+ * The sequence of an entry never changes, so the entry at the position is the same message if it
+ * is still visible.
+ */
+bool TMQHistory::ReadAt(const HistoryMark &mark, TMQMsg &msg) {
+    HistoryRing *ring = Find(mark.topicId);
+    if (ring == nullptr || storage == nullptr) {
+        return false;
+    }
+    bool suc = false;
+    ring->mutex.Lock();
+    if (mark.sequence >= ring->First() && mark.sequence < ring->End()) {
+        const HistoryEntry &entry = ring->At(mark.sequence);
+        suc = !ring->IsExpired(entry, TMQUtils::NowMillis()) && storage->Read(entry.shadow, msg);
+    }
+    ring->mutex.UnLock();
+    return suc;
+}
+
+/*
+ * Search the visible entries from the latest, the history of a topic is small enough.
+ */
+long long TMQHistory::Locate(TMQTopicId topicId, TMQMsgId msgId) {
+    HistoryRing *ring = Find(topicId);
+    if (ring == nullptr) {
+        return -1;
+    }
+    long long found = -1;
+    ring->mutex.Lock();
+    for (long long seq = ring->End() - 1; seq >= ring->First(); --seq) {
+        if (ring->At(seq).shadow.msgId == msgId) {
+            found = seq;
+            break;
+        }
+    }
+    ring->mutex.UnLock();
+    return found;
+}
+
+/*
+ * Append a history message into the ring of its topic. The evicted messages are removed from the
+ * storage in one batch after the mutex of the ring is released, they are unreachable already.
  */
 void TMQHistory::Append(Shadow &shadow) {
-    shadowQueue.Enqueue(shadow);
-    TMQSize topicStatSize = CalStat(shadow.topic, 1);
-    if (topicStatSize > HISTORY_TOPIC_MSG_MAX) {
-        // invoke CalReduce task
-        CalReduce(shadow.topic, (int) (topicStatSize - HISTORY_TOPIC_MSG_MAX));
-    }
-}
-
-/*
- * Calculate the statistics information. Two key action of this process:
- * 1. Find the TMQStat of the topic from the topicStats, create and add a new TMQStat if necessary.
- * 2. Add up the count in TMQStat using CAS.
- */
-TMQSize TMQHistory::CalStat(const char *topic, int count) {
-    // Construct a TMQStat variable.
-    TMQStat tmqStat(topic);
-    // Read lock for topicStats
-    int res = statMutex.RLock();
-    int sp = topicStats.GetPosition(tmqStat, StatCompare);
-    statMutex.RUnlock(res);
-    // Write lock for topicStats
-    statMutex.WLock();
-    if (sp < 0) {
-        // Add a new topic statistic
-        sp = topicStats.Add(tmqStat, StatCompare);
-    }
-    TMQStat &stat = topicStats.Get(sp);
-    TMQSize local = stat.count;
-    TMQSize expect;
-    // CAS for add up the stat.count.
-    do {
-        if (count < 0 && local < -count) {
-            expect = 0;
-        } else {
-            expect = local + count;
+    if (TMQSettings::GetInstance()->GetVersion() != load_acquire(&settingsVersion)) {
+        RefreshSettings();
+    }
+    if (storage) {
+        storage->MarkConsumed(shadow);
+    }
+    HistoryRing *ring = Obtain(shadow.topicId);
+    if (ring == nullptr) {
+        return;
+    }
+    List<Shadow> evicted(HISTORY_EVICT_BATCH);
+    ring->mutex.Lock();
+    long long before = ring->bytes;
+    ring->Append(shadow, TMQUtils::NowMillis(), evicted);
+    add_and_fetch_seq_cst(&bytes, ring->bytes - before);
+    ring->mutex.UnLock();
+    Remove(evicted);
+    if (NeedMaintain()) {
+        Schedule();
+    }
+}
+
+long long TMQHistory::GetBytes() {
+    return load_acquire(&bytes);
+}
+
+/*
+ * One maintenance step. Three key steps:
+ * 1. Trim the rings out of their limits, the expired messages mostly.
+ * 2. Evict the oldest messages of all topics until the bytes fall into the budget, the ring with the
+ *  oldest message is found by comparing the oldest entries of all rings.
+ * 3. Decide the next step, at once if the step is full, or after HISTORY_MAINTAIN_INTERVAL if there
+ *  are messages with the age limit, otherwise sleep until the next Schedule.
+ */
+bool TMQHistory::OnExecute(long eid) {
+    if (TMQSettings::GetInstance()->GetVersion() != load_acquire(&settingsVersion)) {
+        RefreshSettings();
+    }
+    long long now = TMQUtils::NowMillis();
+    List<Shadow> evicted;
+    TMQSize ringCount = load_acquire(&count);
+    for (TMQSize i = 0; i < ringCount && evicted.Size() < HISTORY_MAINTAIN_BATCH; ++i) {
+        HistoryRing *ring = Get(i);
+        ring->mutex.Lock();
+        long long before = ring->bytes;
+        ring->Trim(now, HISTORY_MAINTAIN_BATCH - (int) evicted.Size(), evicted);
+        add_and_fetch_seq_cst(&bytes, ring->bytes - before);
+        ring->mutex.UnLock();
+    }
+    while (budget > 0 && load_seq_cst(&bytes) > budget
+           && evicted.Size() < HISTORY_MAINTAIN_BATCH) {
+        HistoryRing *oldest = nullptr;
+        long long oldestTime = LLONG_MAX;
+        for (TMQSize i = 0; i < ringCount; ++i) {
+            HistoryRing *ring = Get(i);
+            ring->mutex.Lock();
+            if (ring->count > 0 && ring->entries[ring->first].time < oldestTime) {
+                oldest = ring;
+                oldestTime = ring->entries[ring->first].time;
+            }
+            ring->mutex.UnLock();
         }
-    } while (!compare_and_set(&(stat.count), &local, &expect));
-    statMutex.WUnlock();
-    return expect;
+        if (oldest == nullptr) {
+            break;
+        }
+        oldest->mutex.Lock();
+        long long before = oldest->bytes;
+        oldest->Evict(HISTORY_EVICT_BATCH, evicted);
+        add_and_fetch_seq_cst(&bytes, oldest->bytes - before);
+        oldest->mutex.UnLock();
+    }
+    bool full = evicted.Size() >= HISTORY_MAINTAIN_BATCH;
+    Remove(evicted);
+    if (full || (budget > 0 && load_seq_cst(&bytes) > budget)) {
+        store_release(&maintainDelay, 0);
+        return true;
+    }
+    if (NeedMaintain()) {
+        store_release(&maintainDelay, HISTORY_MAINTAIN_INTERVAL);
+        return true;
+    }
+    // Clear the flag before checking again, a message appended meanwhile either sees the flag
+    // cleared and schedules, or is seen here.
+    store_seq_cst(&scheduled, false);
+    bool local = false;
+    bool expect = true;
+    if (NeedMaintain() && compare_and_set_seq_cst(&scheduled, &local, &expect)) {
+        store_release(&maintainDelay, 0);
+        return true;
+    }
+    return false;
+}
+
+long TMQHistory::GetRecallDelay() {
+    return load_acquire(&maintainDelay);
 }
 
 /*
- * Reduce task for a topic.
- * This will look up at the shadowQueue, find and consume the topic shadows. The consume to the
- * the topic shadows should be limit to count. For example, if the message count with the topic is
- * 10, the count in parameters is 2, so the Lookup should be executed 2, and the result size will
- * be 8 at last.
+ * Construct a cursor, the topics are resolved to their ids now, the ones never registered have no
+ * history, so they are skipped.
  */
-void TMQHistory::CalReduce(const char *topic, int count) {
-    // count is zero, return quickly.
-    if (count <= 0) {
+TMQHistoryCursor::TMQHistoryCursor(TMQHistory *history, const char **topics, int len,
+                                   int direction, int limit)
+        : history(history), forward(direction == TMQ_HISTORY_OLDEST_FIRST),
+          limit(limit > 0 ? limit : 0), total(0), topicIndex(0), started(false),
+          position(0) {
+    if (topics == nullptr || len <= 0) {
+        history->GetTopicIds(topicIds);
         return;
     }
-    // The shadow queue iterator.
-    TopicIterator topicIterator(&shadowQueue, &topic, 1);
-    Shadow shadow;
-    int reduceCount = count;
-    // Loop for releasing the tmq messages.
-    while (reduceCount > 0 && topicIterator.Lookup(shadow)) {
-        if (storage) {
-            // Remove a message from storage.
-            storage->Remove(shadow);
+    for (int i = 0; i < len; ++i) {
+        TMQTopicId topicId = TMQTopicRegistry::GetInstance()->Find(topics[i]);
+        for (int j = 0; topicId != ID_INT_INVALID && j < (int) topicIds.Size(); ++j) {
+            topicId = topicIds.Get(j) == topicId ? ID_INT_INVALID : topicId;
+        }
+        if (topicId != ID_INT_INVALID) {
+            topicIds.Add(topicId);
+        }
+    }
+}
+
+bool TMQHistoryCursor::Seek(TMQMsgId msgId) {
+    for (int i = 0; i < (int) topicIds.Size(); ++i) {
+        long long found = history->Locate(topicIds.Get(i), msgId);
+        if (found >= 0) {
+            topicIndex = i;
+            started = true;
+            position = found;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Read the topics one by one, a topic is finished when it returns less than asked, or its position
+ * leaves the history.
+ */
+int TMQHistoryCursor::NextPage(TMQMsg *msgs, int max, bool payload) {
+    marks.Clear();
+    if (msgs == nullptr || max <= 0) {
+        return 0;
+    }
+    int read = 0;
+    while (read < max && topicIndex < (int) topicIds.Size() && (limit == 0 || total < limit)) {
+        int want = max - read;
+        want = limit > 0 && limit - total < want ? limit - total : want;
+        bool finished = false;
+        int got = history->ReadPage(topicIds.Get(topicIndex), forward, started, position,
+                                    finished, want, msgs + read, payload, marks);
+        read += got;
+        total += got;
+        started = true;
+        if (got < want || finished) {
+            topicIndex++;
+            started = false;
         }
-        reduceCount--;
     }
-    CalStat(topic, count);
+    return read;
+}
+
+bool TMQHistoryCursor::Fetch(int index, TMQMsg &msg) {
+    if (index < 0 || index >= (int) marks.Size()) {
+        return false;
+    }
+    return history->ReadAt(marks.Get(index), msg);
 }
@@ -10,179 +10,451 @@
 #define TMQ_HISTORY_H
 
 #include "History.h"
-#include "RCQueue.h"
 #include "Shadow.h"
-#include "Ordered.h"
-#include "RWMutex.h"
+#include "List.h"
+#include "TMQMutex.h"
 #include "Storage.h"
-#include "Watcher.h"
+#include "TMQTopicRegistry.h"
+#include "TMQSettings.h"
+#include "ThreadExecutor.h"
 
 /// const definitions
-// The max count of tmq message for each topic.
-#define HISTORY_TOPIC_MSG_MAX   128
+// The default max count of tmq message for each topic.
+#define HISTORY_TOPIC_MSG_MAX       128
+// The upper bound of the max count of tmq message for each topic.
+#define HISTORY_TOPIC_MSG_LIMIT     65536
+// The count of the oldest messages evicted at once, the messages beyond the max count are kept
+// until there are so many of them, then removed from the storage in one batch.
+#define HISTORY_EVICT_BATCH         16
+// The max count of messages evicted by one maintenance step.
+#define HISTORY_MAINTAIN_BATCH      256
+// The interval of the maintenance in milliseconds while any topic has the age limit.
+#define HISTORY_MAINTAIN_INTERVAL   1000
+// The count of rings in one chunk.
+#define HISTORY_CHUNK_SIZE          TOPIC_CHUNK_SIZE
+// The max count of chunks, it is the same as the registry, so that every topic can have its ring.
+#define HISTORY_CHUNK_COUNT         TOPIC_CHUNK_COUNT
+/// Setting keys, a key followed by ":{topic}" is the setting for one topic, which overrides the
+/// setting for all topics.
+// The max count of messages kept for each topic, HISTORY_TOPIC_MSG_MAX by default.
+#define KEY_HISTORY_MSG_MAX         "HISTORY_TOPIC_MSG_MAX"
+// The max bytes of messages kept for each topic, 0 for unlimited by default.
+#define KEY_HISTORY_BYTES_MAX       "HISTORY_TOPIC_BYTES_MAX"
+// The max age of messages kept in milliseconds, 0 for unlimited by default.
+#define KEY_HISTORY_AGE_MAX         "HISTORY_MSG_AGE_MAX"
+// The max bytes of messages kept for all topics, 0 for unlimited by default, for all topics only.
+#define KEY_HISTORY_BUDGET          "HISTORY_BYTES_BUDGET"
 
 TMQ_NAMESPACE
 /**
- * TMQStat a class for count the tmq messages. It can record message count for different topic,
- * using to release the storage.
- * The current mechanism for history message is that limit the message count for each topic.
- * Default message count of each topic is HISTORY_TOPIC_MSG_MAX.
+ * A message in the history, the shadow with the time it is appended.
  */
-    class TMQStat {
+    class HistoryEntry {
     public:
-        // tmq topic
-        char topic[TMQ_TOPIC_MAX_LENGTH]{0};
-        // the count of the history message.
-        TMQSize count;
-    public:
-        // Default constructor.
-        TMQStat() : count(0) {}
-
-        // Construct a TMQStat with a topic.
-        TMQStat(const char *topic) : count(0) {
-            if (topic) {
-                strncpy(this->topic, topic, sizeof(this->topic));
-            }
-        }
+        // The shadow of the message.
+        Shadow shadow;
+        // The time appended, refer TMQUtils::NowMillis.
+        long long time;
     };
 
 /**
- * This is the class implementing the RCIterator, using to lookup the history queue.
- * The TopicIterator contains a watcher, which can include multiply topics and compare another topic
- * to see if it is contained by the watcher. A special logic in this iterator is that when there are
- * no any topics in the watcher, the compare of lookup will be always true, that means the
- * TopicIterator will consume all of the message in the history queue.
+ * The history ring of one topic, a ring buffer of the messages in consuming order, sized by the
+ * max count of the topic. Appending and evicting only move the positions, reading the latest
+ * messages copies them from the ring directly. All methods except Size should be called with the
+ * mutex held.
  */
-    class TopicIterator : public RCIterator<Shadow> {
-    private:
-        // A watcher included multiply topics.
-        Watcher watcher;
+    class HistoryRing {
+    public:
+        // The topic id of this ring.
+        TMQTopicId topicId;
+        // Mutex for the ring.
+        TMQMutex mutex;
+        // The entries.
+        HistoryEntry *entries;
+        // The capacity of the entries, the max count and HISTORY_EVICT_BATCH more.
+        int capacity;
+        // The position of the oldest entry.
+        int first;
+        // The count of the entries.
+        volatile int count;
+        // The sequence of the oldest entry, the entries are numbered in appending order.
+        long long sequence;
+        // The bytes of the entries.
+        long long bytes;
+        // The max count of messages visible.
+        volatile int msgMax;
+        // The max bytes of messages, 0 for unlimited.
+        long long bytesMax;
+        // The max age of messages in milliseconds, 0 for unlimited.
+        long long ageMax;
+
     public:
         /**
-         * Constructor for the TopicIterator.
-         * @param queue, the pointer to the random access queue.
-         * @param topics, the pointer to a topic array.
-         * @param len, the length of the topics that will be add into the watcher.
-         * @param copy, a boolean value indicate whether to copy the topics into new memory(deep copy).
+         * Construct an empty ring of a topic, it has no entry until SetLimits.
+         * @param topicId, the topic id of the ring.
+         */
+        explicit HistoryRing(TMQTopicId topicId);
+
+        /**
+         * Destructor, release the entries.
+         */
+        ~HistoryRing();
+
+        /**
+         * Set the limits, the entries are reallocated if the max count is changed, the oldest ones
+         * beyond the new max count are evicted.
+         * @param msgMax, the max count of messages.
+         * @param bytesMax, the max bytes of messages, 0 for unlimited.
+         * @param ageMax, the max age of messages in milliseconds, 0 for unlimited.
+         * @param evicted, a list to receive the evicted shadows.
+         */
+        void SetLimits(int msgMax, long long bytesMax, long long ageMax, List<Shadow> &evicted);
+
+        /**
+         * Append a shadow, the oldest HISTORY_EVICT_BATCH ones are evicted if the ring is full, and
+         * the oldest ones over the max bytes are evicted then.
+         * @param shadow, the shadow to append.
+         * @param now, the current time.
+         * @param evicted, a list to receive the evicted shadows.
          */
-        TopicIterator(RCQueue<Shadow> *queue, const char **topics, int len, bool copy = false)
-                : watcher(topics, len, copy), RCIterator<Shadow>(queue) {
+        void Append(const Shadow &shadow, long long now, List<Shadow> &evicted);
 
-        }
+        /**
+         * Evict the oldest entries.
+         * @param n, the count to evict at most.
+         * @param evicted, a list to receive the evicted shadows.
+         * @return the count evicted.
+         */
+        int Evict(int n, List<Shadow> &evicted);
 
         /**
-         * An override method for lookup compare.
-         * @param shadow, the tmq message shadow.
-         * @return, true if ready to consume this message, otherwise, return false.
+         * Evict the oldest entries beyond the max count, over the max bytes, or expired.
+         * @param now, the current time.
+         * @param n, the count to evict at most.
+         * @param evicted, a list to receive the evicted shadows.
+         * @return the count evicted.
          */
-        virtual bool OnCompare(const Shadow &shadow) {
-            // Special logic for no topics.
-            if (watcher.Size() <= 0) {
-                return true;
-            }
-            // Delegate the watcher to do the comparison.
-            return watcher.Contains(shadow.topic);
-        }
+        int Trim(long long now, int n, List<Shadow> &evicted);
+
+        /**
+         * The count of the entries visible for reading, the max count at most.
+         * @return the size.
+         */
+        int Size();
+
+        /**
+         * Get the entry at position, the oldest visible one is at 0.
+         * @param position, the position, should be less than Size.
+         * @return a reference to the entry.
+         */
+        const HistoryEntry &Get(int position);
+
+        /**
+         * The sequence of the oldest entry visible for reading.
+         * @return the sequence.
+         */
+        long long First();
+
+        /**
+         * The sequence after the latest entry.
+         * @return the sequence.
+         */
+        long long End();
+
+        /**
+         * Get the entry by its sequence.
+         * @param seq, the sequence, should be in [First, End).
+         * @return a reference to the entry.
+         */
+        const HistoryEntry &At(long long seq);
+
+        /**
+         * Check whether an entry is expired.
+         * @param entry, the entry to check.
+         * @param now, the current time.
+         * @return true if the age of the entry is over the max age.
+         */
+        bool IsExpired(const HistoryEntry &entry, long long now);
     };
 
 /**
- * An overview iterator, inheriting from the TopicIterator, using to do consume random access queue
- * from the history messages. It is not same with the TopicIterator, OverviewIterator will traverse
- * the whole history messages, collect the topic messages but not consume it (remove from queue).
+ * The position of a message read by a cursor, to fetch its data later.
  */
-    class OverviewIterator : public TopicIterator {
+    class HistoryMark {
     public:
-        // Shadow list to be found.
-        List<Shadow> founds;
-    public:
-        /**
-         * Constructor for OverviewIterator
-         * @param queue, see TopicIterator
-         * @param topics, see TopicIterator
-         * @param len, see TopicIterator
-         * @param copy, see TopicIterator
-         */
-        OverviewIterator(RCQueue<Shadow> *queue, const char **topics, int len, bool copy = false)
-                : TopicIterator(queue, topics, len, copy) {
-
-        }
-
-        // Compare method for traversing.
-        virtual bool OnCompare(const Shadow &t) {
-            // If the shadow is what we want.
-            if (TopicIterator::OnCompare(t)) {
-                founds.Add(t);
-            }
-            // return false always, the traversing will be from queue start to its end.
-            return false;
-        }
+        // The topic id of the message.
+        TMQTopicId topicId;
+        // The sequence of the message in the ring of the topic.
+        long long sequence;
     };
 
 /**
  * TMQHistory is the implementation for interface IHistory. This is the tmq history message,
- * resource constrained. In the TMQHistory, there is a shadowQueue a topicStats and a pointer to the
- * tmq storage where the tmq message saved. The shadowQueue is a fifo random access lock-free queue
- * that saves the shadows of consumed messages. The topicStats is a ordered list for count the
- * amount of each topic. The ordered list is more efficient for searching using a compared function,
- * which is based on a topic string. So, with the ordered list, we can find the TMQStat very
- * quickly. When the messages with the same topic reach the limitation, TMQHistory will start the
- * reduce task to release some tmq message.
+ * resource constrained. Each topic has its own HistoryRing, created on the first message appended,
+ * and indexed by the topic id the same way as the TMQQueues, so finding the ring needs no lock.
+ *
+ * The retention is configured by TMQSettings, for all topics or for one topic, by count, bytes and
+ * age, and a bytes budget for all topics. The count and the bytes of a topic are enforced on
+ * appending, costing O(1) for each message. The age and the budget are enforced incrementally by a
+ * maintenance executor, created on the first need, which evicts HISTORY_MAINTAIN_BATCH messages at
+ * most for each step, the oldest of all topics first for the budget. The evicted messages are
+ * removed from the storage in batches.
  */
-    class TMQHistory : public IHistory {
+    class TMQHistory : public IHistory, public TMQCallable {
     private:
-        // RCQueue for tmq message shadow.
-        RCQueue<Shadow> shadowQueue;
-        // Read-Write mutex for topicStats list.
-        RWMutex statMutex;
-        // a ordered list for TMQStat
-        Ordered<TMQStat> topicStats;
+        // Mutex for creating the rings and applying the settings.
+        TMQMutex createMutex;
+        // The chunks of HistoryRing pointer, indexed by the topic id.
+        HistoryRing **slots[HISTORY_CHUNK_COUNT]{nullptr};
+        // The chunks of HistoryRing pointer, in creation order.
+        HistoryRing **chunks[HISTORY_CHUNK_COUNT]{nullptr};
+        // The count of the rings.
+        volatile TMQSize count;
         // a pointer for tmq storage instance.
         IStorage *storage;
+        // The bytes of the messages of all topics.
+        volatile long long bytes;
+        // The version of the settings applied.
+        volatile TMQSize settingsVersion;
+        // The bytes budget for all topics, 0 for unlimited.
+        volatile long long budget;
+        // Whether any topic has the age limit.
+        volatile bool aged;
+        // The executor for the maintenance, created on the first need.
+        ThreadExecutor *maintainer;
+        // Whether the maintainer is waked or going to run again.
+        volatile bool scheduled;
+        // The delay before the next maintenance step.
+        volatile long maintainDelay;
 
     private:
         /**
-         * Internal private method for calculate the statistics, Checking the tmq messages of a topic
-         * Whether reach the limitation or not.
-         * @param topic, the topic to be check
-         * @param count, the exceeded count
-         * @return, a new count for these topic messages.
+         * Find the ring of a topic.
+         * @param topicId, the topic id.
+         * @return a pointer to the HistoryRing, nullptr if the topic has no history yet.
+         */
+        HistoryRing *Find(TMQTopicId topicId);
+
+        /**
+         * Find the ring of a topic, create it with the current settings if not exist.
+         * @param topicId, the topic id.
+         * @return a pointer to the HistoryRing, nullptr if the topic id is invalid.
+         */
+        HistoryRing *Obtain(TMQTopicId topicId);
+
+        /**
+         * Get the ring at position in creation order.
+         * @param position, the position, should be less than the count.
+         * @return a pointer to the HistoryRing.
+         */
+        HistoryRing *Get(TMQSize position);
+
+        /**
+         * Read the latest messages of a ring, the expired ones are skipped.
+         * @param ring, the ring to read.
+         * @param limit, the max count of the messages to read.
+         * @param msgs, an array to receive the messages.
+         * @return the count of the messages read.
+         */
+        int ReadRing(HistoryRing *ring, int limit, TMQMsg *msgs);
+
+        /**
+         * Apply the settings of the topic to a ring, createMutex should be held by the caller.
+         * @param ring, the ring to apply.
+         * @param snapshot, the snapshot of the settings.
+         * @param evicted, a list to receive the evicted shadows.
+         */
+        void ApplyLimits(HistoryRing *ring, TMQSettingsSnapshot *snapshot, List<Shadow> &evicted);
+
+        /**
+         * Apply the settings to all rings if they are changed.
+         */
+        void RefreshSettings();
+
+        /**
+         * Remove the evicted messages from the storage in one batch.
+         * @param evicted, the evicted shadows.
          */
-        TMQSize CalStat(const char *topic, int count);
+        void Remove(List<Shadow> &evicted);
 
         /**
-         * Reduce task for a topic.
-         * @param topic, the topic to run this task.
-         * @param count, message count that will be release.
+         * Check whether the maintenance is needed.
+         * @return true if the budget is exceeded, or there are messages with the age limit.
          */
-        void CalReduce(const char *topic, int count);
+        bool NeedMaintain();
+
+        /**
+         * Wake the maintainer if it is not scheduled yet.
+         */
+        void Schedule();
 
     public:
         /**
          * Default constructor for TMQHistory.
          */
-        TMQHistory() : storage(nullptr) {}
+        TMQHistory();
 
         /**
          * Construct a TMQHistory with the pointer to the storage.
          * @param storage, a pointer to the storage.
          */
-        TMQHistory(IStorage *storage) : storage(storage) {}
+        TMQHistory(IStorage *storage);
+
+        /**
+         * Destructor, stop the maintainer, and release all rings.
+         */
+        ~TMQHistory();
 
         /**
          * Append a history tmq message shadow. This can be called after a message is consumed from tmq.
+         * The message is marked consumed in the storage, so it is not delivered again after a crash.
          * @param shadow, a message shadow
          */
         void Append(Shadow &shadow);
 
+        /**
+         * The bytes of the messages of all topics.
+         * @return the bytes.
+         */
+        long long GetBytes();
+
     public:
         /**
-         * Override of the virtual method GetHistory
+         * Override of the virtual method GetHistory. The messages of each topic are in consuming
+         * order, and the topics are in the order of the parameter, or in the order of their first
+         * history if no topic is given.
          * @param topic, a topic array pointer to find.
          * @param len, the length of the topic array.
          * @param msg, a pointer to a tmq message pointer, that will be the found results.
          * @return int , the length of the results found by this method.
          */
         TMQSize GetHistory(const char **topic, int len, TMQMsg **msg);
+
+        /**
+         * Override of the virtual method CreateCursor.
+         * @param topics, a topic array pointer to read, nullptr for all topics.
+         * @param len, the length of the topic array.
+         * @param direction, the direction of the cursor, refer TMQ_HISTORY_XXX.
+         * @param limit, the max count of the messages read by the cursor, 0 for no limit.
+         * @return a pointer to the TMQHistoryCursor.
+         */
+        IHistoryCursor *CreateCursor(const char **topics, int len, int direction, int limit);
+
+        /**
+         * Get the topic ids of all rings, in the order of their first history.
+         * @param topicIds, a list to receive the topic ids.
+         */
+        void GetTopicIds(List<TMQTopicId> &topicIds);
+
+        /**
+         * Read a page of the messages of a topic from a position, the expired ones are skipped.
+         * Reading stops before max only at the end of the history of the topic.
+         * @param topicId, the topic id.
+         * @param forward, true to read from the older to the newer.
+         * @param started, false to start from the oldest one if forward, or the latest one if not.
+         * @param position, the sequence to start if started. It is moved to the sequence to start
+         *  the next page.
+         * @param finished, set to true when the position leaves the history of the topic.
+         * @param max, the max count to read.
+         * @param msgs, an array to receive the messages.
+         * @param payload, false to read the meta info only.
+         * @param marks, a list to receive the positions of the read messages.
+         * @return the count of the messages read.
+         */
+        int ReadPage(TMQTopicId topicId, bool forward, bool started, long long &position,
+                     bool &finished, int max, TMQMsg *msgs, bool payload, List<HistoryMark> &marks);
+
+        /**
+         * Read a message at a position.
+         * @param mark, the position of the message.
+         * @param msg, the message to receive.
+         * @return false if the message is evicted or expired.
+         */
+        bool ReadAt(const HistoryMark &mark, TMQMsg &msg);
+
+        /**
+         * Find the position of a message in the history of a topic.
+         * @param topicId, the topic id.
+         * @param msgId, the id of the message.
+         * @return the sequence of the message, -1 if not found.
+         */
+        long long Locate(TMQTopicId topicId, TMQMsgId msgId);
+
+        /**
+         * One maintenance step, called by the maintainer.
+         * @param eid, the id of the executor.
+         * @return true if there is more to do, after GetRecallDelay.
+         */
+        bool OnExecute(long eid) override;
+
+        /**
+         * The delay before the next maintenance step.
+         * @return the delay in milliseconds.
+         */
+        long GetRecallDelay() override;
+    };
+
+/**
+ * The implementation of IHistoryCursor on TMQHistory. It keeps the topic ids to read and the position
+ * in the ring of the current topic, and the positions of the last page for fetching the data
+ * lazily, so the memory is bounded by the page size whatever the history size is.
+ */
+    class TMQHistoryCursor : public IHistoryCursor {
+    private:
+        // The history to read.
+        TMQHistory *history;
+        // The topic ids to read in order.
+        List<TMQTopicId> topicIds;
+        // Whether to read from the older to the newer.
+        bool forward;
+        // The max count of messages to read, 0 for no limit.
+        int limit;
+        // The count of messages read.
+        int total;
+        // The position of the current topic in topicIds.
+        int topicIndex;
+        // Whether the current topic is started, the position is valid only if it is.
+        bool started;
+        // The sequence to start the next page in the current topic.
+        long long position;
+        // The positions of the messages in the last page.
+        List<HistoryMark> marks;
+
+    public:
+        /**
+         * Construct a cursor on the history.
+         * @param history, the history to read.
+         * @param topics, the topics to read, nullptr for all topics that have history now.
+         * @param len, the length of the topics.
+         * @param direction, the direction of the cursor, refer TMQ_HISTORY_XXX.
+         * @param limit, the max count of the messages to read, 0 for no limit.
+         */
+        TMQHistoryCursor(TMQHistory *history, const char **topics, int len, int direction,
+                         int limit);
+
+        /**
+         * Override method for Seek, the topics are searched in order.
+         * @param msgId, the id of the message.
+         * @return bool, false if the message is not found.
+         */
+        bool Seek(TMQMsgId msgId) override;
+
+        /**
+         * Override method for NextPage, the next topic is read once the current one is finished.
+         * @param msgs, the array to receive the messages.
+         * @param max, the max count of the messages.
+         * @param payload, whether to read the data of the messages.
+         * @return int, the count of the messages read.
+         */
+        int NextPage(TMQMsg *msgs, int max, bool payload) override;
+
+        /**
+         * Override method for Fetch.
+         * @param index, the index of the message in the last page.
+         * @param msg, the message to receive the data.
+         * @return bool, false if the index is invalid or the message is evicted.
+         */
+        bool Fetch(int index, TMQMsg &msg) override;
     };
 
 TMQ_NAMESPACE_END
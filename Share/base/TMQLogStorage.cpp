@@ -0,0 +1,865 @@
+//
+//  TMQLogStorage.cpp
+//  TMQLogStorage
+//
+//  Created by  on 2022/10/16.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#include "TMQLogStorage.h"
+#include "Watcher.h"
+#include "TMQCrc32.h"
+#include "TMQTopicRegistry.h"
+#include "TMQSettings.h"
+#include "TMQUtils.h"
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+USING_TMQ_NAMESPACE
+
+/**
+ * Compute the checksum of a record, the header from msgId, the topic and the data.
+ * @param record, the header of the record.
+ * @param topic, the topic name.
+ * @param data, the data of the message.
+ * @return the checksum.
+ */
+static unsigned int RecordCrc(const LogRecord &record, const char *topic, const void *data) {
+    const char *fields = (const char *) &(record.msgId);
+    long fieldsLen = (long) sizeof(LogRecord) - (fields - (const char *) &record);
+    unsigned int crc = TMQCrc32::Update(0, fields, fieldsLen);
+    if (record.topicLength > 0) {
+        crc = TMQCrc32::Update(crc, topic, record.topicLength);
+    }
+    if (record.length > 0) {
+        crc = TMQCrc32::Update(crc, data, record.length);
+    }
+    return crc;
+}
+
+/**
+ * Get the size of a record in the segment, aligned by LOG_RECORD_ALIGN.
+ * @param record, the header of the record.
+ * @return the size.
+ */
+static long RecordSize(const LogRecord &record) {
+    long size = (long) sizeof(LogRecord) + (long) record.topicLength + (long) record.length;
+    return (size + LOG_RECORD_ALIGN - 1) / LOG_RECORD_ALIGN * LOG_RECORD_ALIGN;
+}
+
+/**
+ * Check a record read from a segment, it is valid only if it is the record of the message.
+ * @param record, the record with its topic and data.
+ * @param shadow, the shadow of the message.
+ * @return true if the record is valid.
+ */
+static bool CheckRecord(const LogRecord *record, const Shadow &shadow) {
+    const char *topic = (const char *) (record + 1);
+    return record->magic == LOG_RECORD_MAGIC && record->type == LOG_RECORD_DATA
+           && record->msgId == shadow.msgId && record->length == (int) shadow.length
+           && record->crc == RecordCrc(*record, topic, topic + record->topicLength);
+}
+
+/**
+ * Compare the recovered messages by their ids.
+ * @param p1, a pointer to a recovered message.
+ * @param p2, a pointer to another recovered message.
+ * @return the result of comparing, refer qsort.
+ */
+static int CompareRecovered(const void *p1, const void *p2) {
+    TMQMsgId id = ((const RecoveredShadow *) p1)->shadow.msgId;
+    TMQMsgId another = ((const RecoveredShadow *) p2)->shadow.msgId;
+    return id == another ? 0 : (id > another ? 1 : -1);
+}
+
+/**
+ * Compare the segment numbers.
+ * @param p1, a pointer to a segment number.
+ * @param p2, a pointer to another segment number.
+ * @return the result of comparing, refer qsort.
+ */
+static int CompareNumber(const void *p1, const void *p2) {
+    unsigned long long number = *(const unsigned long long *) p1;
+    unsigned long long another = *(const unsigned long long *) p2;
+    return number == another ? 0 : (number > another ? 1 : -1);
+}
+
+/**
+ * Compare the acknowledgements by the positions of their messages.
+ * @param p1, a pointer to an acknowledgement.
+ * @param p2, a pointer to another acknowledgement.
+ * @return the result of comparing, refer qsort.
+ */
+static int CompareAck(const void *p1, const void *p2) {
+    auto *ack = (const LogAck *) p1;
+    auto *another = (const LogAck *) p2;
+    if (ack->number != another->number) {
+        return ack->number > another->number ? 1 : -1;
+    }
+    return ack->offset == another->offset ? 0 : (ack->offset > another->offset ? 1 : -1);
+}
+
+/**
+ * Reserve the disk space of a new segment, so that writing the mapped file never fails for the
+ * full disk. The file is extended without the reservation if the file system does not support it.
+ * @param fd, the file descriptor of the segment.
+ * @return true if the file has the size of a segment.
+ */
+static bool ReserveSegment(int fd) {
+#if defined(__linux__) || defined(__ANDROID__)
+    if (fallocate(fd, 0, 0, LOG_SEGMENT_SIZE) == 0) {
+        return true;
+    }
+    if (errno != EOPNOTSUPP) {
+        return false;
+    }
+#endif
+    return ftruncate(fd, LOG_SEGMENT_SIZE) == 0;
+}
+
+/*
+ * Enable or disable the persistence. During enabling, the directory is created, and the messages
+ * in its segments are recovered. A directory leaving no room for the segment names is rejected.
+ */
+bool TMQLogStorage::EnablePersist(bool enable, const char *file) {
+    if (enable && directory[0] == 0) {
+        if (file == nullptr || strlen(file) == 0
+            || strlen(file) > LOG_PATH_MAX_LENGTH - LOG_SEGMENT_NAME_LENGTH
+            || (mkdir(file, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0
+                && errno != EEXIST)) {
+            return false;
+        }
+        logMutex.Lock();
+        strncpy(directory, file, LOG_PATH_MAX_LENGTH - 1);
+        Recover();
+        if (syncer == nullptr) {
+            syncer = new ThreadExecutor(this);
+        }
+        syncStats = TMQSyncStats();
+        lastSync = TMQUtils::NowMillis();
+        logMutex.UnLock();
+    }
+    if (!enable && directory[0] != 0) {
+        // Give up the persistence and delete all segments.
+        logMutex.Lock();
+        for (int i = 0; i < segments.Size(); ++i) {
+            CloseSegment(segments.Get(i), true);
+        }
+        segments.Clear();
+        rmdir(directory);
+        directory[0] = 0;
+        recovered.Clear();
+        consumedIds.Clear();
+        periodicDirty = false;
+        bool waiting = !notices.Empty();
+        logMutex.UnLock();
+        // The waiting listeners are notified not durable.
+        if (waiting) {
+            syncer->Wakeup();
+        }
+    }
+    return directory[0] != 0;
+}
+
+/*
+ * Write a tmq message, generate a new id for it.
+ */
+Shadow TMQLogStorage::Write(TMQTopicId topicId, const TMQMsg &msg) {
+    return Write(topicId, msg, IDGenerator::GetInstance()->GetMsgId());
+}
+
+/*
+ * Write a tmq message with the id reserved by caller, without a listener.
+ */
+Shadow TMQLogStorage::Write(TMQTopicId topicId, const TMQMsg &msg, TMQMsgId msgId) {
+    return Write(topicId, msg, msgId, nullptr);
+}
+
+/*
+ * Write a tmq message with the id reserved by caller. A persistent message is appended to the log
+ * with the log mutex held, the record is packed before. The syncer is waked by its durability. A
+ * message saved into the memory is never durable, its listener is notified at once.
+ */
+Shadow TMQLogStorage::Write(TMQTopicId topicId, const TMQMsg &msg, TMQMsgId msgId,
+                            TMQDurableListener *listener) {
+    Shadow shadow(topicId, msg);
+    shadow.msgId = msgId;
+    if ((IS_PERSIST(msg.flag) || listener) && syncer) {
+        const char *topic = TMQTopicRegistry::GetInstance()->GetName(topicId);
+        LogRecord record;
+        memset(&record, 0, sizeof(LogRecord));
+        record.magic = LOG_RECORD_MAGIC;
+        record.msgId = msgId;
+        record.length = msg.length > 0 ? msg.length : 0;
+        record.flag = msg.flag;
+        record.type = LOG_RECORD_DATA;
+        record.priority = msg.priority;
+        record.topicLength = topic ? (int) strlen(topic) : 0;
+        record.crc = RecordCrc(record, topic, msg.data);
+        TMQSettingsSnapshot *snapshot = TMQSettings::GetInstance()->Acquire();
+        int durability = TMQStorage::GetDurability(topicId, msg.flag, listener, snapshot);
+        long period = snapshot->GetInt(KEY_PERSIST_SYNC_PERIOD, PERSIST_SYNC_PERIOD);
+        snapshot->Release();
+        bool wakeup = false;
+        logMutex.Lock();
+        bool appended = directory[0] != 0 && Append(record, topic, msg.data, shadow);
+        if (appended) {
+            syncPeriod = period;
+            if (listener) {
+                DurableNotice notice = {listener, msgId, true};
+                notices.Add(notice);
+            }
+            if (durability == TMQ_DURABILITY_BATCH) {
+                wakeup = true;
+                batchDirty = true;
+            } else if (durability == TMQ_DURABILITY_PERIODIC) {
+                wakeup = !periodicDirty;
+                periodicDirty = true;
+            }
+        }
+        logMutex.UnLock();
+        if (wakeup) {
+            syncer->Wakeup();
+        }
+        if (appended) {
+            return shadow;
+        }
+    }
+    // Write the message to the memory. The data is kept in a shared buffer, so that reading the
+    // message later will not copy the data again.
+    TMQMsg *memoryAddress;
+    if (msg.buffer) {
+        memoryAddress = new TMQMsg(msg);
+    } else {
+        TMQBuffer *buffer = TMQBuffer::Copy(msg.data, msg.length);
+        memoryAddress = new TMQMsg(buffer);
+        buffer->Release();
+        memoryAddress->priority = msg.priority;
+        memoryAddress->flag = msg.flag;
+    }
+    memoryAddress->msgId = shadow.msgId;
+    shadow.metaAddress = (TMQAddress) memoryAddress;
+    shadow.dataAddress = (TMQAddress) memoryAddress->data;
+    shadow.type = STORAGE_TYPE_MEMORY;
+    if (listener) {
+        listener->OnDurable(msgId, false);
+    }
+    return shadow;
+}
+
+/*
+ * Read a tmq message by the shadow. The record is copied with the log mutex held, and checked
+ * without it.
+ */
+bool TMQLogStorage::Read(const Shadow &shadow, TMQMsg &msg) {
+    bool suc = false;
+    // The message is appended to a segment.
+    if (shadow.type == STORAGE_TYPE_LOG) {
+        LogRecord *record = nullptr;
+        long offset = (long) shadow.dataAddress;
+        logMutex.Lock();
+        LogSegment *segment = FindSegment(shadow.metaAddress);
+        if (segment && offset + (long) sizeof(LogRecord) <= segment->end) {
+            auto *header = (LogRecord *) (segment->map + offset);
+            long size = RecordSize(*header);
+            if (header->topicLength >= 0 && header->length >= 0 && offset + size <= segment->end) {
+                record = (LogRecord *) malloc(size);
+                memcpy(record, header, size);
+            }
+        }
+        logMutex.UnLock();
+        suc = record && CheckRecord(record, shadow);
+        if (suc) {
+            msg = TMQMsg((char *) (record + 1) + record->topicLength, record->length);
+        }
+        free(record);
+    }
+    // The message is saved in memory, msg shares the buffer of the saved message.
+    if (shadow.type == STORAGE_TYPE_MEMORY) {
+        msg = *((TMQMsg *) shadow.metaAddress);
+        suc = true;
+    }
+    // Set the meta info of the messsage.
+    msg.length = shadow.length;
+    msg.flag = shadow.flag;
+    msg.msgId = shadow.msgId;
+    return suc;
+}
+
+/*
+ * Remove the tmq message by a shadow, delegate to the batch one.
+ */
+bool TMQLogStorage::Remove(const Shadow &shadow) {
+    return Remove(&shadow, 1);
+}
+
+/*
+ * Remove the tmq messages by shadows. A message in the log is acknowledged removed, and its
+ * segment loses a live message, the segments without live messages are deleted at last. A message
+ * whose acknowledgement fails stays live, it is recovered again on the next enabling.
+ */
+bool TMQLogStorage::Remove(const Shadow *shadows, int count) {
+    if (shadows == nullptr || count <= 0) {
+        return false;
+    }
+    bool locked = false;
+    for (int i = 0; i < count; ++i) {
+        const Shadow &shadow = shadows[i];
+        if (shadow.type == STORAGE_TYPE_LOG) {
+            if (!locked) {
+                logMutex.Lock();
+                locked = true;
+            }
+            LogSegment *segment = FindSegment(shadow.metaAddress);
+            if (segment && segment->live > 0 && Acknowledge(shadow.msgId, LOG_RECORD_REMOVED)) {
+                segment->live--;
+            }
+        }
+        // Remove from the memory.
+        if (shadow.type == STORAGE_TYPE_MEMORY) {
+            auto *ptr = (TMQMsg *) shadow.metaAddress;
+            delete ptr;
+        }
+    }
+    if (locked) {
+        Retain();
+        logMutex.UnLock();
+    }
+    return true;
+}
+
+/*
+ * Acknowledge a consumed message, except the recovered ones acknowledged by the last run.
+ */
+void TMQLogStorage::MarkConsumed(const Shadow &shadow) {
+    if (shadow.type != STORAGE_TYPE_LOG) {
+        return;
+    }
+    logMutex.Lock();
+    int low = 0;
+    int high = (int) consumedIds.Size() - 1;
+    bool acknowledged = false;
+    while (low <= high && !acknowledged) {
+        int mid = (low + high) / 2;
+        TMQMsgId msgId = consumedIds.Get(mid);
+        if (msgId == shadow.msgId) {
+            consumedIds.Remove(mid);
+            acknowledged = true;
+        } else if (msgId < shadow.msgId) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    if (!acknowledged && FindSegment(shadow.metaAddress)) {
+        Acknowledge(shadow.msgId, LOG_RECORD_CONSUMED);
+    }
+    logMutex.UnLock();
+}
+
+/*
+ * Find the recovered messages of the topics, they are registered on recovery.
+ */
+void TMQLogStorage::FindShadows(const char **topics, int len, List<Shadow> &shadowList,
+                                int limit) {
+    if (!topics || len <= 0) {
+        return;
+    }
+    auto *topicIds = new TMQTopicId[len];
+    for (int i = 0; i < len; ++i) {
+        topicIds[i] = TMQTopicRegistry::GetInstance()->Intern(topics[i]);
+    }
+    Watcher localWatcher(topicIds, len);
+    delete[] topicIds;
+    logMutex.Lock();
+    for (int i = 0; i < recovered.Size(); ++i) {
+        if (limit > 0 && shadowList.Size() >= limit) {
+            break;
+        }
+        Shadow &shadow = recovered.Get(i).shadow;
+        if (localWatcher.Contains(shadow.topicId)) {
+            shadowList.Add(shadow);
+        }
+    }
+    logMutex.UnLock();
+}
+
+/*
+ * Move the recovered messages to the caller.
+ */
+void TMQLogStorage::TakeRecovered(List<RecoveredShadow> &shadows) {
+    logMutex.Lock();
+    for (int i = 0; i < recovered.Size(); ++i) {
+        shadows.Add(recovered.Get(i));
+    }
+    recovered.Clear();
+    logMutex.UnLock();
+}
+
+/*
+ * The segment file is named by its number in the directory.
+ */
+void TMQLogStorage::SegmentPath(unsigned long long number, char *path) {
+    snprintf(path, LOG_PATH_MAX_LENGTH, "%s/%016llx%s", directory, number, LOG_SEGMENT_SUFFIX);
+}
+
+/*
+ * Open the file and map it whole. A fresh segment is truncated and reserved, an existing one is
+ * extended if it is shorter than a segment, which happens if the last run exits during creating.
+ */
+LogSegment *TMQLogStorage::OpenSegment(unsigned long long number, bool fresh) {
+    char path[LOG_PATH_MAX_LENGTH] = {0};
+    SegmentPath(number, path);
+    int flags = fresh ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+    int fd = open(path, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st{};
+    bool sized = !fresh && fstat(fd, &st) == 0 && st.st_size >= LOG_SEGMENT_SIZE;
+    void *map = MAP_FAILED;
+    if (sized || ReserveSegment(fd)) {
+        map = mmap(nullptr, LOG_SEGMENT_SIZE, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(fd);
+        if (fresh) {
+            unlink(path);
+        }
+        return nullptr;
+    }
+    auto *segment = new LogSegment();
+    segment->number = number;
+    segment->fd = fd;
+    segment->map = (char *) map;
+    segment->end = 0;
+    segment->synced = 0;
+    segment->sizeSynced = !fresh;
+    segment->live = 0;
+    segment->minId = ~0ULL;
+    segment->maxId = 0;
+    segment->nextIndex = 0;
+    return segment;
+}
+
+/*
+ * Unmap the file and close it, the file is deleted if required.
+ */
+void TMQLogStorage::CloseSegment(LogSegment *segment, bool unlinkFile) {
+    munmap(segment->map, LOG_SEGMENT_SIZE);
+    close(segment->fd);
+    if (unlinkFile) {
+        char path[LOG_PATH_MAX_LENGTH] = {0};
+        SegmentPath(segment->number, path);
+        unlink(path);
+    }
+    delete segment;
+}
+
+/*
+ * Binary search the segments, they are in the order of their numbers.
+ */
+LogSegment *TMQLogStorage::FindSegment(unsigned long long number) {
+    int low = 0;
+    int high = (int) segments.Size() - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        LogSegment *segment = segments.Get(mid);
+        if (segment->number == number) {
+            return segment;
+        }
+        if (segment->number < number) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * Append the record at the end of the active segment. A new segment is rolled if the record does
+ * not fit, a record larger than a segment is not appended. An index entry is added for the first
+ * message after each interval.
+ */
+bool TMQLogStorage::Append(const LogRecord &record, const char *topic, const void *data,
+                           Shadow &shadow) {
+    long size = RecordSize(record);
+    if (size > LOG_SEGMENT_SIZE) {
+        return false;
+    }
+    LogSegment *active = segments.Empty() ? nullptr : segments.Get(segments.Size() - 1);
+    if (active == nullptr || active->end + size > LOG_SEGMENT_SIZE) {
+        active = OpenSegment(nextNumber, true);
+        if (active == nullptr) {
+            return false;
+        }
+        nextNumber++;
+        segments.Add(active);
+    }
+    long offset = active->end;
+    if (record.type == LOG_RECORD_DATA) {
+        if (offset >= active->nextIndex) {
+            LogIndexEntry entry = {active->maxId, offset};
+            active->index.Add(entry);
+            active->nextIndex = offset + LOG_INDEX_INTERVAL;
+        }
+        active->minId = record.msgId < active->minId ? record.msgId : active->minId;
+        active->maxId = record.msgId > active->maxId ? record.msgId : active->maxId;
+        active->live++;
+    }
+    char *dst = active->map + offset;
+    memcpy(dst, &record, sizeof(LogRecord));
+    if (record.topicLength > 0) {
+        memcpy(dst + sizeof(LogRecord), topic, record.topicLength);
+    }
+    if (record.length > 0) {
+        memcpy(dst + sizeof(LogRecord) + record.topicLength, data, record.length);
+    }
+    active->end = offset + size;
+    shadow.metaAddress = active->number;
+    shadow.dataAddress = (TMQAddress) offset;
+    shadow.type = STORAGE_TYPE_LOG;
+    return true;
+}
+
+/*
+ * Append an acknowledgement without topic and data, it is synchronized with the next messages.
+ */
+bool TMQLogStorage::Acknowledge(TMQMsgId msgId, int type) {
+    LogRecord record;
+    memset(&record, 0, sizeof(LogRecord));
+    record.magic = LOG_RECORD_MAGIC;
+    record.msgId = msgId;
+    record.type = type;
+    record.crc = RecordCrc(record, nullptr, nullptr);
+    Shadow ignored;
+    return Append(record, nullptr, nullptr, ignored);
+}
+
+/*
+ * Binary search the last index entry before the message, then scan the records from it. The
+ * records are valid up to the end of the segment.
+ */
+long TMQLogStorage::Locate(LogSegment *segment, TMQMsgId msgId) {
+    int low = 0;
+    int high = (int) segment->index.Size() - 1;
+    long offset = 0;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        LogIndexEntry &entry = segment->index.Get(mid);
+        if (entry.maxBefore < msgId) {
+            offset = entry.offset;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    while (offset < segment->end) {
+        auto *record = (LogRecord *) (segment->map + offset);
+        if (record->type == LOG_RECORD_DATA && record->msgId == msgId) {
+            return offset;
+        }
+        offset += RecordSize(*record);
+    }
+    return -1;
+}
+
+/*
+ * Delete the head segments without live messages, the active one is kept.
+ */
+void TMQLogStorage::Retain() {
+    while (segments.Size() > 1 && segments.Get(0)->live <= 0) {
+        CloseSegment(segments.Get(0), true);
+        segments.Remove(0);
+    }
+}
+
+/*
+ * Recover the messages from the segments. Four key steps:
+ * 1. Scan the segments in the order of their numbers, rebuild their indexes.
+ * 2. Resolve the acknowledgements to the records of their messages through the indexes.
+ * 3. Drop the removed messages, mark the consumed ones, and keep them in the order of the ids, the
+ *  message ids are raised past all ids in the log.
+ * 4. Continue in a new segment, the tail of the last one may be broken, then delete the head
+ *  segments without live messages.
+ */
+void TMQLogStorage::Recover() {
+    recovered.Clear();
+    consumedIds.Clear();
+    List<unsigned long long> numbers;
+    DIR *dir = opendir(directory);
+    if (dir == nullptr) {
+        return;
+    }
+    int nameLen = 16 + (int) strlen(LOG_SEGMENT_SUFFIX);
+    for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+        char *end = nullptr;
+        unsigned long long number = strtoull(entry->d_name, &end, 16);
+        if ((int) strlen(entry->d_name) == nameLen && end == entry->d_name + 16
+            && strcmp(end, LOG_SEGMENT_SUFFIX) == 0) {
+            numbers.Add(number);
+        }
+    }
+    closedir(dir);
+    if (!numbers.Empty()) {
+        auto *sorted = (unsigned long long *) malloc(numbers.Size() * sizeof(unsigned long long));
+        for (int i = 0; i < numbers.Size(); ++i) {
+            sorted[i] = numbers.Get(i);
+        }
+        qsort(sorted, numbers.Size(), sizeof(unsigned long long), CompareNumber);
+        for (int i = 0; i < numbers.Size(); ++i) {
+            numbers.Set(i, sorted[i]);
+        }
+        free(sorted);
+    }
+    List<RecoveredShadow> found;
+    List<LogAck> acks;
+    TMQMsgId maxMsgId = 0;
+    for (int i = 0; i < numbers.Size(); ++i) {
+        nextNumber = numbers.Get(i) >= nextNumber ? numbers.Get(i) + 1 : nextNumber;
+        LogSegment *segment = OpenSegment(numbers.Get(i), false);
+        if (segment) {
+            segments.Add(segment);
+            ScanSegment(segment, found, acks, maxMsgId);
+        }
+    }
+    // An acknowledgement without its message is left at the head, its message is deleted.
+    LogAck *sortedAcks = acks.Empty() ? nullptr : (LogAck *) malloc(acks.Size() * sizeof(LogAck));
+    for (int i = 0; i < acks.Size(); ++i) {
+        LogAck &ack = acks.Get(i);
+        for (int j = 0; j < segments.Size() && ack.offset < 0; ++j) {
+            LogSegment *segment = segments.Get(j);
+            if (ack.msgId >= segment->minId && ack.msgId <= segment->maxId) {
+                ack.offset = Locate(segment, ack.msgId);
+                ack.number = segment->number;
+            }
+        }
+        if (ack.offset < 0) {
+            ack.number = 0;
+        }
+        sortedAcks[i] = ack;
+    }
+    if (sortedAcks) {
+        qsort(sortedAcks, acks.Size(), sizeof(LogAck), CompareAck);
+    }
+    // The messages are in the order of their positions as well.
+    int next = 0;
+    for (int i = 0; i < found.Size(); ++i) {
+        RecoveredShadow &message = found.Get(i);
+        LogAck position = {0, 0, message.shadow.metaAddress, (long) message.shadow.dataAddress};
+        bool removed = false;
+        while (next < acks.Size() && CompareAck(&sortedAcks[next], &position) < 0) {
+            next++;
+        }
+        for (; next < acks.Size() && CompareAck(&sortedAcks[next], &position) == 0; ++next) {
+            removed = removed || sortedAcks[next].type == LOG_RECORD_REMOVED;
+            message.consumed = message.consumed || sortedAcks[next].type == LOG_RECORD_CONSUMED;
+        }
+        if (removed) {
+            FindSegment(message.shadow.metaAddress)->live--;
+        } else {
+            recovered.Add(message);
+        }
+    }
+    free(sortedAcks);
+    if (!recovered.Empty()) {
+        auto *sorted = (RecoveredShadow *) malloc(recovered.Size() * sizeof(RecoveredShadow));
+        for (int i = 0; i < recovered.Size(); ++i) {
+            sorted[i] = recovered.Get(i);
+        }
+        qsort(sorted, recovered.Size(), sizeof(RecoveredShadow), CompareRecovered);
+        for (int i = 0; i < recovered.Size(); ++i) {
+            recovered.Set(i, sorted[i]);
+            if (sorted[i].consumed) {
+                consumedIds.Add(sorted[i].shadow.msgId);
+            }
+        }
+        free(sorted);
+    }
+    IDGenerator::GetInstance()->RaiseMsgId(maxMsgId);
+    LogSegment *last = segments.Empty() ? nullptr : segments.Get(segments.Size() - 1);
+    if (last && last->end > 0) {
+        LogSegment *active = OpenSegment(nextNumber, true);
+        if (active) {
+            nextNumber++;
+            segments.Add(active);
+        }
+    }
+    Retain();
+}
+
+/*
+ * Scan the records from the beginning, a record is valid if it is complete and its checksum is
+ * right. The end of the segment is the first invalid record.
+ */
+void TMQLogStorage::ScanSegment(LogSegment *segment, List<RecoveredShadow> &found,
+                                List<LogAck> &acks, TMQMsgId &maxMsgId) {
+    long offset = 0;
+    while (offset + (long) sizeof(LogRecord) <= LOG_SEGMENT_SIZE) {
+        auto *record = (LogRecord *) (segment->map + offset);
+        if (record->magic != LOG_RECORD_MAGIC || record->length < 0 || record->topicLength < 0
+            || record->topicLength >= TMQ_TOPIC_MAX_LENGTH || record->type < LOG_RECORD_DATA
+            || record->type > LOG_RECORD_REMOVED
+            || offset + RecordSize(*record) > LOG_SEGMENT_SIZE) {
+            break;
+        }
+        const char *topic = (const char *) (record + 1);
+        if (record->crc != RecordCrc(*record, topic, topic + record->topicLength)) {
+            break;
+        }
+        maxMsgId = record->msgId > maxMsgId ? record->msgId : maxMsgId;
+        if (record->type == LOG_RECORD_DATA) {
+            char name[TMQ_TOPIC_MAX_LENGTH] = {0};
+            memcpy(name, topic, record->topicLength);
+            RecoveredShadow message;
+            message.shadow.msgId = record->msgId;
+            message.shadow.topicId = TMQTopicRegistry::GetInstance()->Intern(name);
+            message.shadow.length = (TMQSize) record->length;
+            message.shadow.flag = record->flag;
+            message.shadow.type = STORAGE_TYPE_LOG;
+            message.shadow.metaAddress = segment->number;
+            message.shadow.dataAddress = (TMQAddress) offset;
+            message.priority = record->priority;
+            message.consumed = false;
+            if (offset >= segment->nextIndex) {
+                LogIndexEntry entry = {segment->maxId, offset};
+                segment->index.Add(entry);
+                segment->nextIndex = offset + LOG_INDEX_INTERVAL;
+            }
+            segment->minId = record->msgId < segment->minId ? record->msgId : segment->minId;
+            segment->maxId = record->msgId > segment->maxId ? record->msgId : segment->maxId;
+            // A message of an invalid topic can not be taken, it is not alive.
+            if (message.shadow.topicId != ID_INT_INVALID) {
+                segment->live++;
+                found.Add(message);
+            }
+        } else {
+            LogAck ack = {record->msgId, record->type, 0, -1};
+            acks.Add(ack);
+        }
+        offset += RecordSize(*record);
+    }
+    segment->end = offset;
+    segment->synced = offset;
+}
+
+/*
+ * Take the waiting listeners, synchronize for them or the batch messages at once, and for the
+ * periodic messages after the period. The listeners are notified without the log mutex.
+ */
+bool TMQLogStorage::OnExecute(long eid) {
+    List<DurableNotice> batch;
+    logMutex.Lock();
+    for (int i = 0; i < notices.Size(); ++i) {
+        batch.Add(notices.Get(i));
+    }
+    notices.Clear();
+    bool synced = directory[0] != 0;
+    bool due = periodicDirty && TMQUtils::NowMillis() - lastSync >= syncPeriod;
+    if (synced && (batchDirty || due)) {
+        synced = SyncSegments();
+    }
+    batchDirty = false;
+    bool again = periodicDirty && directory[0] != 0;
+    logMutex.UnLock();
+    for (int i = 0; i < batch.Size(); ++i) {
+        DurableNotice &notice = batch.Get(i);
+        notice.listener->OnDurable(notice.msgId, notice.durable && synced);
+    }
+    return again;
+}
+
+/*
+ * The time left until the period passes since the last synchronization.
+ */
+long TMQLogStorage::GetRecallDelay() {
+    logMutex.Lock();
+    long long delay = lastSync + syncPeriod - TMQUtils::NowMillis();
+    logMutex.UnLock();
+    return delay > 1 ? (long) delay : 1;
+}
+
+/*
+ * Synchronize the appended range of each segment, the start is aligned by the system page. The
+ * file and the directory are synchronized once for a new segment.
+ */
+bool TMQLogStorage::SyncSegments() {
+    long long start = TMQUtils::NowMicros();
+    long pageSize = sysconf(_SC_PAGESIZE);
+    pageSize = pageSize > 0 ? pageSize : 4096;
+    bool synced = true;
+    bool created = false;
+    for (int i = 0; i < segments.Size(); ++i) {
+        LogSegment *segment = segments.Get(i);
+        long from = segment->synced / pageSize * pageSize;
+        if (segment->end > segment->synced
+            && msync(segment->map + from, segment->end - from, MS_SYNC) != 0) {
+            synced = false;
+            continue;
+        }
+        segment->synced = segment->end;
+        if (!segment->sizeSynced) {
+            segment->sizeSynced = fsync(segment->fd) == 0;
+            synced = synced && segment->sizeSynced;
+            created = true;
+        }
+    }
+    if (created) {
+        int fd = open(directory, O_RDONLY);
+        synced = synced && fd >= 0 && fsync(fd) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    long long latency = TMQUtils::NowMicros() - start;
+    syncStats.count++;
+    syncStats.failures += synced ? 0 : 1;
+    syncStats.totalMicros += latency;
+    syncStats.maxMicros = latency > syncStats.maxMicros ? latency : syncStats.maxMicros;
+    syncStats.lastMicros = latency;
+    lastSync = TMQUtils::NowMillis();
+    periodicDirty = periodicDirty && !synced;
+    return synced;
+}
+
+/*
+ * Copy the statistics under the log mutex.
+ */
+bool TMQLogStorage::GetSyncStats(TMQSyncStats &stats) {
+    logMutex.Lock();
+    bool enabled = directory[0] != 0;
+    if (enabled) {
+        stats = syncStats;
+    }
+    logMutex.UnLock();
+    return enabled;
+}
+
+/**
+ * Constructor
+ */
+TMQLogStorage::TMQLogStorage()
+        : directory{0}, nextNumber(0), syncer(nullptr), batchDirty(false), periodicDirty(false),
+          lastSync(0), syncPeriod(PERSIST_SYNC_PERIOD) {
+
+}
+
+/*
+ * Destructor, stop the syncer, synchronize the messages left and close the segments.
+ */
+TMQLogStorage::~TMQLogStorage() {
+    delete syncer;
+    batchDirty = batchDirty || periodicDirty;
+    OnExecute(0);
+    for (int i = 0; i < segments.Size(); ++i) {
+        CloseSegment(segments.Get(i), false);
+    }
+    segments.Clear();
+}
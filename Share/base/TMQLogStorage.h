@@ -0,0 +1,382 @@
+//
+//  TMQLogStorage.h
+//  TMQLogStorage
+//
+//  Created by  on 2022/10/16.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#ifndef TMQ_LOG_STORAGE_H
+#define TMQ_LOG_STORAGE_H
+
+#include "Storage.h"
+#include "TMQStorage.h"
+#include "TMQMutex.h"
+#include "Shadow.h"
+#include "List.h"
+#include "ThreadExecutor.h"
+
+/// Const definitions
+// The size of a segment file, a record never spans the segments.
+#define LOG_SEGMENT_SIZE       (16 * 1024 * 1024)
+// The interval in bytes of the sparse index entries of a segment.
+#define LOG_INDEX_INTERVAL     (64 * 1024)
+// The magic of a log record.
+#define LOG_RECORD_MAGIC       0xFF514C47
+// The alignment of the log records.
+#define LOG_RECORD_ALIGN       8
+// The length of the path of a segment file, the name is the segment number in 16 hex digits.
+#define LOG_PATH_MAX_LENGTH    512
+// The suffix of the segment files.
+#define LOG_SEGMENT_SUFFIX     ".log"
+// The length appended to the directory for a segment path: the separator, 16 hex digits, the
+// suffix and the terminator.
+#define LOG_SEGMENT_NAME_LENGTH 22
+/// The types of the log records.
+// The record of a message, followed by its topic and data.
+#define LOG_RECORD_DATA        0
+// The acknowledgement that a message is consumed.
+#define LOG_RECORD_CONSUMED    1
+// The acknowledgement that a message is removed.
+#define LOG_RECORD_REMOVED     2
+
+/**
+ * The header of a record in a segment, followed by the topic name without '\0' and the data of the
+ * message. The acknowledgements carry the id of their message only. The checksum is the CRC32C of
+ * the header from msgId, the topic and the data, refer TMQCrc32.
+ */
+class LogRecord {
+public:
+    // LOG_RECORD_MAGIC.
+    unsigned int magic;
+    // The checksum of the record.
+    unsigned int crc;
+    // The id of the message.
+    TMQMsgId msgId;
+    // The length of the data.
+    int length;
+    // The flag of the message.
+    int flag;
+    // The type of the record, refer LOG_RECORD_XXX.
+    int type;
+    // The priority of the message.
+    int priority;
+    // The length of the topic name.
+    int topicLength;
+    // Padding, keeps the header aligned.
+    int reserved;
+};
+
+/**
+ * An entry of the sparse index of a segment. All messages before the offset have ids not larger
+ * than maxBefore, so a message with a larger id is at or after the offset.
+ */
+class LogIndexEntry {
+public:
+    // The max id of the messages before the offset.
+    TMQMsgId maxBefore;
+    // The offset of a message record.
+    long offset;
+};
+
+/**
+ * A segment file of the log, mapped whole. The records are appended at the end, and the file is
+ * deleted when none of its messages is alive.
+ */
+class LogSegment {
+public:
+    // The number of the segment, increasing in appending order.
+    unsigned long long number;
+    // The file descriptor.
+    int fd;
+    // The mapped file.
+    char *map;
+    // The offset to append the next record.
+    long end;
+    // The offset synchronized up to.
+    long synced;
+    // Whether the file length and the directory entry are synchronized.
+    bool sizeSynced;
+    // The count of the messages not removed.
+    long live;
+    // The range of the message ids in the segment.
+    TMQMsgId minId;
+    TMQMsgId maxId;
+    // The offset to add the next index entry.
+    long nextIndex;
+    // The sparse index, in the order of the offsets.
+    List<LogIndexEntry> index;
+};
+
+/**
+ * An acknowledgement found on recovery, resolved to the record of its message.
+ */
+class LogAck {
+public:
+    // The id of the message.
+    TMQMsgId msgId;
+    // The type of the acknowledgement, refer LOG_RECORD_XXX.
+    int type;
+    // The number of the segment of the message record.
+    unsigned long long number;
+    // The offset of the message record.
+    long offset;
+};
+
+/**
+ * TMQLogStorage is an append-only storage implementation for IStorage. The persistent messages are
+ * appended to a log of fixed-size segment files in a directory, instead of the section spaces of
+ * TMQStorage, so a write is a copy into the mapped active segment, and nothing is written in place.
+ *
+ * A message is consumed or removed by appending an acknowledgement with its id. Each segment keeps
+ * the count of its messages not removed, and a sparse index from the message ids to the offsets, an
+ * acknowledgement is resolved to its message through the index on recovery. The retention deletes
+ * the whole segments from the head of the log once none of their messages is alive, the active
+ * segment is never deleted. An acknowledgement is never before its message, so a deleted segment
+ * has no acknowledgement of the messages alive.
+ *
+ * On enabling, the segments are scanned in order until the first broken record of each one, the
+ * removed messages are dropped, and the others are kept in the order of the message ids for the
+ * topic to take, the consumed ones belong to the history. The appending continues in a new segment.
+ *
+ * The synchronization depends on the durability level of the messages, as TMQStorage does. The
+ * syncer thread synchronizes the appended ranges of all segments at once for the messages of
+ * TMQ_DURABILITY_BATCH and the listeners, or after the period for TMQ_DURABILITY_PERIODIC. The
+ * messages not persistent, or too large for a segment, are saved into the memory.
+ */
+class TMQLogStorage : public IStorage, public TMQCallable {
+private:
+    // The mutex for the log, includes the segments and the synchronization.
+    TMQMutex logMutex;
+    // The directory of the segment files, empty if the persistence is not enabled.
+    char directory[LOG_PATH_MAX_LENGTH];
+    // The segments in the order of their numbers, the last one is active.
+    List<LogSegment *> segments;
+    // The number of the next segment, past all segments on the disk and all used by this instance,
+    // so that the shadows of a deleted segment never find a new one after enabling again.
+    unsigned long long nextNumber;
+    // The syncer thread, created on enabling the persistence.
+    ThreadExecutor *syncer;
+    // The listeners waiting for the next synchronization.
+    List<DurableNotice> notices;
+    // Whether there are appended messages waiting for the synchronization at once.
+    bool batchDirty;
+    // Whether there are appended messages waiting for the periodic synchronization.
+    bool periodicDirty;
+    // The time in milliseconds of the last synchronization.
+    long long lastSync;
+    // The period in milliseconds of the periodic synchronization, read on each write.
+    long syncPeriod;
+    // The statistics of the synchronizations since the persistence is enabled.
+    TMQSyncStats syncStats;
+    // The messages recovered on enabling, until they are taken.
+    List<RecoveredShadow> recovered;
+    // The ids of the recovered consumed messages, in order, they are not acknowledged again.
+    List<TMQMsgId> consumedIds;
+
+private:
+    /**
+     * Get the path of a segment file.
+     * @param number, the number of the segment.
+     * @param path, a buffer of LOG_PATH_MAX_LENGTH for the path.
+     */
+    void SegmentPath(unsigned long long number, char *path);
+
+    /**
+     * Open and map a segment file.
+     * @param number, the number of the segment.
+     * @param fresh, whether to create an empty segment, or open an existing one.
+     * @return the segment, nullptr if failed.
+     */
+    LogSegment *OpenSegment(unsigned long long number, bool fresh);
+
+    /**
+     * Unmap and close a segment, and free it.
+     * @param segment, the segment.
+     * @param unlinkFile, whether to delete the file.
+     */
+    void CloseSegment(LogSegment *segment, bool unlinkFile);
+
+    /**
+     * Find a segment by its number, logMutex should be held by the caller.
+     * @param number, the number of the segment.
+     * @return the segment, nullptr if it is not found.
+     */
+    LogSegment *FindSegment(unsigned long long number);
+
+    /**
+     * Append a record to the active segment, a new segment is rolled if it is full. logMutex
+     * should be held by the caller.
+     * @param record, the header with the checksum.
+     * @param topic, the topic name, nullptr for none.
+     * @param data, the data of the message, nullptr for none.
+     * @param shadow, a reference to receive the segment number and the offset.
+     * @return true if the record is appended.
+     */
+    bool Append(const LogRecord &record, const char *topic, const void *data, Shadow &shadow);
+
+    /**
+     * Append an acknowledgement of a message, logMutex should be held by the caller.
+     * @param msgId, the id of the message.
+     * @param type, the type of the acknowledgement.
+     * @return true if the acknowledgement is appended.
+     */
+    bool Acknowledge(TMQMsgId msgId, int type);
+
+    /**
+     * Find the offset of a message record in a segment through the sparse index.
+     * @param segment, the segment.
+     * @param msgId, the id of the message.
+     * @return the offset, -1 if it is not found.
+     */
+    static long Locate(LogSegment *segment, TMQMsgId msgId);
+
+    /**
+     * Delete the segments from the head while none of their messages is alive, logMutex should be
+     * held by the caller.
+     */
+    void Retain();
+
+    /**
+     * Recover the messages from the segments in the directory, logMutex should be held by the
+     * caller.
+     */
+    void Recover();
+
+    /**
+     * Scan the records of a segment until the first broken one, the index is rebuilt.
+     * @param segment, the segment.
+     * @param found, the list to receive the messages, in the order of the offsets.
+     * @param acks, the list to receive the acknowledgements.
+     * @param maxMsgId, a reference to the max id found.
+     */
+    void ScanSegment(LogSegment *segment, List<RecoveredShadow> &found, List<LogAck> &acks,
+                     TMQMsgId &maxMsgId);
+
+    /**
+     * Synchronize the appended ranges and record the latency, logMutex should be held by the
+     * caller.
+     * @return true if the synchronization is success.
+     */
+    bool SyncSegments();
+
+public:
+    /**
+     * Default constructor.
+     */
+    TMQLogStorage();
+
+    /**
+     * Default destructor, the segments are kept.
+     */
+    virtual ~TMQLogStorage();
+
+    /**
+     * Enable the persistence in a directory, it is created if it does not exist. If the enable is
+     * false, all segment files are deleted.
+     * @param enable, a boolean value indicates whether enable the persistence.
+     * @param file, the path of the directory, the max length limits to
+     * LOG_PATH_MAX_LENGTH - LOG_SEGMENT_NAME_LENGTH, leaving room for the segment names.
+     * @return whether the persistence is enabled after the call.
+     */
+    virtual bool EnablePersist(bool enable, const char *file);
+
+    /**
+     * Save tmq message to the storage and return the shadow of this message.
+     * @param topicId, the id of the message topic.
+     * @param msg, the tmq message to write.
+     * @return Shadow, the shadow of the tmq message to be written.
+     */
+    virtual Shadow Write(TMQTopicId topicId, const TMQMsg &msg);
+
+    /**
+     * Save tmq message with a message id to the storage and return the shadow of this message.
+     * @param topicId, the id of the message topic.
+     * @param msg, the tmq message to write.
+     * @param msgId, the id for the message, reserved by IDGenerator.
+     * @return Shadow, the shadow of the tmq message to be written.
+     */
+    virtual Shadow Write(TMQTopicId topicId, const TMQMsg &msg, TMQMsgId msgId);
+
+    /**
+     * Save tmq message with a message id and a durable listener. A persistent message is appended
+     * to the log, the listener is notified after it is synchronized. A message with a listener is
+     * persistent whatever its flag is.
+     * @param topicId, the id of the message topic.
+     * @param msg, the tmq message to write.
+     * @param msgId, the id for the message, reserved by IDGenerator.
+     * @param listener, the listener for the durability, nullptr for none.
+     * @return Shadow, the shadow of the tmq message to be written.
+     */
+    virtual Shadow Write(TMQTopicId topicId, const TMQMsg &msg, TMQMsgId msgId,
+                         TMQDurableListener *listener);
+
+    /**
+     * Read a tmq message with the message shadow. True will be returned if success.
+     * @param store, the shadow of this msg.
+     * @param msg, a reference for the tmq message, which will be set new data.
+     * @return true if read success, false if not exist or some error occurs.
+     */
+    virtual bool Read(const Shadow &store, TMQMsg &msg);
+
+    /**
+     * Remove a tmq message using a shadow.
+     * @param store, the shadow of the tmq message.
+     * @return, a boolean value indicate whether it is success or not.
+     */
+    virtual bool Remove(const Shadow &store);
+
+    /**
+     * Remove a batch of tmq messages, the log mutex is locked once for all of them.
+     * @param stores, the shadows of the tmq messages.
+     * @param count, the count of the shadows.
+     * @return, a boolean value indicate whether it is success or not.
+     */
+    virtual bool Remove(const Shadow *stores, int count);
+
+    /**
+     * Mark a tmq message consumed by appending an acknowledgement.
+     * @param store, the shadow of the tmq message.
+     */
+    virtual void MarkConsumed(const Shadow &store);
+
+    /**
+     * Find the recovered shadows by topics with the amount limit, they are not taken by
+     * TakeRecovered yet.
+     * @param topics, the pointer to topics pointer.
+     * @param len, the length of the topics.
+     * @param shadowList, the list for store the found results.
+     * @param limit, a limit for search.
+     */
+    virtual void
+    FindShadows(const char **topics, int len, List<Shadow> &shadowList, int limit = -1);
+
+    /**
+     * Take the messages recovered on enabling, they are taken once.
+     * @param shadows, the list to receive the messages, in the order of the message ids.
+     */
+    virtual void TakeRecovered(List<RecoveredShadow> &shadows);
+
+    /**
+     * Get the statistics of the synchronizations.
+     * @param stats, a reference to receive the statistics.
+     * @return false if the persistence is not enabled.
+     */
+    virtual bool GetSyncStats(TMQSyncStats &stats);
+
+    /**
+     * Synchronize the appended ranges, and notify the listeners, called by the syncer.
+     * @param eid, the id of the executor.
+     * @return true if there are periodic messages waiting for the period.
+     */
+    bool OnExecute(long eid) override;
+
+    /**
+     * The delay before the periodic synchronization.
+     * @return the milliseconds left in the period, at least 1.
+     */
+    long GetRecallDelay() override;
+};
+
+
+#endif //TMQ_LOG_STORAGE_H
@@ -6,50 +6,272 @@
 //  Copyright (c)  Tencent. All rights reserved.
 //
 #include "TMQPicker.h"
+#include "Atomic.h"
 
 USING_TMQ_NAMESPACE
 
 /*
- * Implementation of the virtual method Pick. Three key point:
- * 1. Pick action will start from the end of the shadowIterators always, because the index of the
- *  shadowIterators represent the priority of the tmq message at the same time.
- * 2. If picked a valid message, append it to the history, and read detail from storage.
+ * Claim the stripe with CAS from 0 to 1.
+ */
+int TMQOrderClaims::TryClaim(TMQSize key) {
+    int stripe = (int) (key % ORDER_STRIPE_COUNT);
+    int local = 0;
+    int expect = 1;
+    if (load_acquire(&stripes[stripe]) != 0
+        || !compare_and_set_seq_cst(&stripes[stripe], &local, &expect)) {
+        return -1;
+    }
+    return stripe;
+}
+
+/*
+ * Release the stripe, the dispatching before is visible to the next claimer.
+ */
+void TMQOrderClaims::Release(int stripe) {
+    if (stripe >= 0 && stripe < ORDER_STRIPE_COUNT) {
+        store_release(&stripes[stripe], 0);
+    }
+}
+
+/*
+ * Create a shadow iterator for each priority queue of the topic.
+ */
+TopicCursor::TopicCursor(TopicQueues *queues, int type) : queues(queues) {
+    for (int i = 0; i < TMQ_PRIORITY_COUNT; ++i) {
+        iterators[i] = new ShadowIterator(&(queues->priorityQueue[i]), type);
+    }
+}
+
+/*
+ * Upon destructing, delete the shadow iterators also.
+ */
+TopicCursor::~TopicCursor() {
+    for (int i = 0; i < TMQ_PRIORITY_COUNT; ++i) {
+        delete iterators[i];
+    }
+}
+
+/*
+ * Lookup on the queue of priority, the size of the queue is checked first, an empty queue will
+ * not be traversed.
+ */
+bool TopicCursor::Lookup(int priority, Shadow &found) {
+    if (queues->priorityQueue[priority].Size() <= 0) {
+        return false;
+    }
+    return iterators[priority]->Lookup(found);
+}
+
+/*
+ * Pick a message with its topic id. Three key point:
+ * 1. Pick action will start from the highest priority always, for each priority, the cursors
+ *  will be looked up one by one, starting from the cursor after the last picked one.
+ * 2. If picked a valid message, release its room in the topic limit, read detail from storage, and
+ *  append it to the history.
  * 3. Return true if the invoke is success otherwise return false.
  */
-bool TMQPicker::Pick(char *topic, TMQMsg &tmqMsg) {
-    if (!topic || !topicStorage) {
+bool TMQPicker::Pick(TMQTopicId &topicId, TMQMsg &tmqMsg) {
+    if (!topicStorage) {
         return false;
     }
-    for (int i = TMQ_PRIORITY_COUNT - 1; i >= 0; --i) {
-        Shadow found;
-        if (shadowIterators[i]->Lookup(found)) {
-            if (topicHistory) {
-                ((TMQHistory *) topicHistory)->Append(found);
+    Shadow found;
+    TopicCursor *picked = nullptr;
+    pickMutex.Lock();
+    if (watchAll) {
+        RefreshCursors();
+    }
+    TMQSize count = cursors.Size();
+    TMQSize start = count > 0 ? cursorStart % count : 0;
+    for (int i = TMQ_PRIORITY_COUNT - 1; i >= 0 && !picked; --i) {
+        for (TMQSize j = NextCursor(i, start, 0, count); j < count;
+             j = NextCursor(i, start, j + 1, count)) {
+            TMQSize position = (start + j) % count;
+            TopicCursor *cursor = cursors.Get(position);
+            bool suc = cursor->Lookup(i, found);
+            if (watchAll) {
+                topicQueues->ClearPending(cursor->queues, i);
+            }
+            if (suc) {
+                picked = cursor;
+                cursorStart = (position + 1) % count;
+                break;
             }
-            strncpy(topic, found.topic, TMQ_TOPIC_MAX_LENGTH);
-            return topicStorage->Read(found, tmqMsg);
         }
     }
-    return false;
+    pickMutex.UnLock();
+    if (picked == nullptr) {
+        return false;
+    }
+    // Release the room of the limit out of the pick mutex, it may call the watermark listener.
+    picked->queues->Release(1, found.length);
+    // Read the message before appending it to the history, the history may release it.
+    bool suc = topicStorage->Read(found, tmqMsg);
+    if (topicHistory) {
+        ((TMQHistory *) topicHistory)->Append(found);
+    }
+    topicId = picked->queues->topicId;
+    return suc;
 }
 
 /*
- * Upon destructing, delete the shadow iterator also.
+ * Pick under a claim. Once a topic is claimed, its messages are picked from the highest priority,
+ * the same order as Pick, so the order of dispatching is kept when the topic is claimed later by
+ * other pickers.
+ */
+int TMQPicker::PickClaimed(TMQOrderClaims *claims, TMQTopicId &topicId, TMQMsg *msgs, int max,
+                           int &stripe) {
+    stripe = -1;
+    if (!topicStorage || !claims || !msgs || max <= 0) {
+        return 0;
+    }
+    max = max < ORDER_PICK_MAX ? max : ORDER_PICK_MAX;
+    Shadow found[ORDER_PICK_MAX];
+    int foundCount = 0;
+    TopicCursor *picked = nullptr;
+    pickMutex.Lock();
+    if (watchAll) {
+        RefreshCursors();
+    }
+    TMQSize count = cursors.Size();
+    TMQSize start = count > 0 ? cursorStart % count : 0;
+    for (int i = TMQ_PRIORITY_COUNT - 1; i >= 0 && !picked; --i) {
+        for (TMQSize j = NextCursor(i, start, 0, count); j < count;
+             j = NextCursor(i, start, j + 1, count)) {
+            TMQSize position = (start + j) % count;
+            TopicCursor *cursor = cursors.Get(position);
+            if (cursor->queues->priorityQueue[i].Size() <= 0) {
+                if (watchAll) {
+                    topicQueues->ClearPending(cursor->queues, i);
+                }
+                continue;
+            }
+            int claimed = claims->TryClaim(cursor->queues->orderKey);
+            if (claimed < 0) {
+                continue;
+            }
+            for (int k = TMQ_PRIORITY_COUNT - 1; k >= 0 && foundCount < max; --k) {
+                while (foundCount < max && cursor->Lookup(k, found[foundCount])) {
+                    foundCount++;
+                }
+                if (watchAll) {
+                    topicQueues->ClearPending(cursor->queues, k);
+                }
+            }
+            if (foundCount == 0) {
+                claims->Release(claimed);
+                continue;
+            }
+            picked = cursor;
+            stripe = claimed;
+            cursorStart = (position + 1) % count;
+            break;
+        }
+    }
+    pickMutex.UnLock();
+    if (picked == nullptr) {
+        return 0;
+    }
+    long long foundBytes = 0;
+    for (int i = 0; i < foundCount; ++i) {
+        foundBytes += found[i].length;
+    }
+    picked->queues->Release(foundCount, foundBytes);
+    // Read the messages before appending them to the history, the history may release them.
+    int msgCount = 0;
+    for (int i = 0; i < foundCount; ++i) {
+        if (topicStorage->Read(found[i], msgs[msgCount])) {
+            msgCount++;
+        }
+        if (topicHistory) {
+            ((TMQHistory *) topicHistory)->Append(found[i]);
+        }
+    }
+    topicId = picked->queues->topicId;
+    if (msgCount == 0) {
+        claims->Release(stripe);
+        stripe = -1;
+    }
+    return msgCount;
+}
+
+/*
+ * Implementation of the virtual method Pick, pick by the topic id and copy the name of the topic.
+ */
+bool TMQPicker::Pick(char *topic, TMQMsg &tmqMsg) {
+    if (!topic) {
+        return false;
+    }
+    TMQTopicId topicId = ID_INT_INVALID;
+    bool suc = Pick(topicId, tmqMsg);
+    const char *name = TMQTopicRegistry::GetInstance()->GetName(topicId);
+    if (name) {
+        strncpy(topic, name, TMQ_TOPIC_MAX_LENGTH);
+    }
+    return suc;
+}
+
+/*
+ * Create cursors for the new topic queues, the position of the queues is equal to the position of
+ * its cursor.
+ */
+void TMQPicker::RefreshCursors() {
+    TMQSize size = topicQueues->Size();
+    for (TMQSize i = cursors.Size(); i < size; ++i) {
+        cursors.Add(new TopicCursor(topicQueues->Get(i), type));
+    }
+}
+
+/*
+ * The picker of some topics looks up every cursor. The picker of all topics finds the marked queues
+ * in [start, count) and then in [0, start), its cursor positions are the positions of the queues.
+ */
+TMQSize TMQPicker::NextCursor(int priority, TMQSize start, TMQSize offset, TMQSize count) {
+    if (!watchAll || offset >= count) {
+        return offset;
+    }
+    if (!topicQueues->HasPending(priority)) {
+        return count;
+    }
+    TMQSize position = start + offset;
+    if (position < count) {
+        TMQSize found = topicQueues->NextPending(priority, position, count);
+        if (found < count) {
+            return found - start;
+        }
+        position = count;
+    }
+    TMQSize found = topicQueues->NextPending(priority, position - count, start);
+    return found < start ? found + count - start : count;
+}
+
+/*
+ * Upon destructing, delete the cursors also.
  */
 TMQPicker::~TMQPicker() {
-    for (int i = 0; i < TMQ_PRIORITY_COUNT; ++i) {
-        delete shadowIterators[i];
+    for (int i = 0; i < cursors.Size(); ++i) {
+        delete cursors.Get(i);
     }
 }
 
 /*
- * Construct the TMQPicker.
+ * Construct the TMQPicker. The queues of the watched topics will be created if not exist, so that
+ * the cursors can be created at once.
  */
-TMQPicker::TMQPicker(const char **topics, int len, int type)
-        : type(type), topicWatcher(topics, len, true), topicHistory(nullptr),
-          topicStorage(nullptr) {
-    this->topicStorage = nullptr;
-    this->topicHistory = nullptr;
+TMQPicker::TMQPicker(TMQQueues *queues, const char **topics, int len, int type)
+        : type(type), watchAll(topics == nullptr || len <= 0), topicQueues(queues),
+          topicStorage(nullptr), topicHistory(nullptr), cursorStart(0) {
+    for (int i = 0; !watchAll && i < len; ++i) {
+        TMQTopicId topicId = TMQTopicRegistry::GetInstance()->Intern(topics[i]);
+        TopicQueues *found = topicQueues->Obtain(topicId);
+        bool exist = found == nullptr;
+        for (int j = 0; j < cursors.Size() && !exist; ++j) {
+            exist = cursors.Get(j)->queues == found;
+        }
+        // Skip the duplicated topic.
+        if (!exist) {
+            cursors.Add(new TopicCursor(found, type));
+        }
+    }
 }
 
 // Set the storage
@@ -62,16 +284,9 @@ void TMQPicker::SetHistory(IHistory *history) {
     this->topicHistory = history;
 }
 
-// Set the rc queue, and create ShadowIterator for the queues.
-// The length of the shadow queues is const, defined by TMQ_PRIORITY_COUNT, so we called the shadow
-// queues as the priority queues.
-void TMQPicker::SetQueues(RCQueue<Shadow> *queues) {
-    for (int i = 0; i < TMQ_PRIORITY_COUNT; ++i) {
-        // Create ShadowIterator for each RCQueue.
-        shadowIterators[i] = new ShadowIterator(&(queues[i]), &topicWatcher, type);
-    }
+// Set the start position of cursor, it is wrapped by the count of cursors at picking.
+void TMQPicker::SetCursorStart(TMQSize start) {
+    pickMutex.Lock();
+    cursorStart = start;
+    pickMutex.UnLock();
 }
-
-
-
-
@@ -11,94 +11,173 @@
 
 #include "Defines.h"
 #include "TMQTopic.h"
-#include "RCQueue.h"
+#include "RCSegQueue.h"
 #include "Shadow.h"
 #include "List.h"
 #include "Chars.h"
 #include "Storage.h"
 #include "TMQHistory.h"
-#include "Watcher.h"
-#include "Topic.h"
+#include "TMQMutex.h"
+#include "TMQQueues.h"
+
+/// Const definitions
+// The count of the claim stripes for ordered picking, the order keys are mapped to the stripes.
+#define ORDER_STRIPE_COUNT          256
+// The max count of messages picked at once under a claim.
+#define ORDER_PICK_MAX              16
 
 TMQ_NAMESPACE
 
 /**
- * A Lookup shadow iterator. This class is used to implement the RCIterator and find the topic
- * messages. A ShadowIterator contains a pointer of watcher and a int value for message type. The
- * Lookup compare will be delegated to the watcher.
+ * Claims for ordered picking. A topic is claimed by its order key before its messages are picked,
+ * and released after the picked messages are dispatched, so that the messages of a topic are never
+ * dispatched concurrently. The keys are mapped to a fixed count of stripes, two keys on the same
+ * stripe are serialized too, which only costs parallelism.
+ */
+    class TMQOrderClaims {
+    private:
+        // The claim flags of the stripes, 1 for claimed.
+        volatile int stripes[ORDER_STRIPE_COUNT]{0};
+    public:
+        /**
+         * Try to claim the stripe of a key.
+         * @param key, the order key.
+         * @return the claimed stripe, -1 if the stripe is claimed by others.
+         */
+        int TryClaim(TMQSize key);
+
+        /**
+         * Release a claimed stripe.
+         * @param stripe, the stripe returned by TryClaim.
+         */
+        void Release(int stripe);
+    };
+
+/**
+ * A Lookup shadow iterator. This class is used to implement the RCSegIterator and find the messages
+ * with the message type. A ShadowIterator works on the rc queue of one topic, so there is no need
+ * to compare the topic any more.
  */
-    class ShadowIterator : public RCIterator<Shadow> {
+    class ShadowIterator : public RCSegIterator<Shadow> {
     private:
-        // A pointer to the topics watcher.
-        Watcher *watcher;
         // The message type for pick. This type will do AND operation with the flag of the shadow(msg).
-        // If the result by the AND operation is not zero, this shadow will compare the topics at next.
+        // If the result by the AND operation is not zero, this shadow will be consumed.
         int type;
+
     public:
         /**
          * Default constructor for ShadowIterator
          */
-        ShadowIterator() : watcher(nullptr), type(0) {
-
+        ShadowIterator() : type(0) {
         }
 
         /**
-         * Construct a ShadowIterator with rc queue and topics.
+         * Construct a ShadowIterator with rc queue and message type.
          * @param queue, the pointer to the rc queue
-         * @param watch, a pointer to the watcher.
          * @param type, the message type to be consumed.
          */
-        ShadowIterator(RCQueue<Shadow> *queue, Watcher *watch, int type)
-                : RCIterator<Shadow>(queue), type(type), watcher(watch) {
-
+        ShadowIterator(RCSegQueue<Shadow> *queue, int type)
+                : RCSegIterator<Shadow>(queue), type(type) {
         }
 
         /**
-         * Overriding method for RCIterator using to do compare.
+         * Overriding method for RCSegIterator using to do compare.
          * @param t, the shadow of a tmq message.
          * @return, a boolean value indicate whether to consume this message or not.
          */
         bool OnCompare(const Shadow &t) override {
-            // If AND operation between flag and type is fail, return false quickly.
-            if ((t.flag & type) == 0) {
-                return false;
-            }
-            // Special logic for scene of no topics, this scene will consume all messages. Be careful.
-            if (watcher->Size() == 0) {
-                return true;
-            }
-            // Delegate the topic compare to watcher.
-            return watcher->Contains(t.topic);
+            return (t.flag & type) != 0;
         }
     };
 
 /**
- * TMQ picker is used for picking topic messages. A picker will include a topic watcher, a storage,
- * a history and the priority rc queue iterators.
+ * A topic cursor includes the shadow iterators on the priority queues of one topic.
+ */
+    class TopicCursor {
+    public:
+        // The priority queues of the topic.
+        TopicQueues *queues;
+        // Shadow iterators for each priority queue.
+        ShadowIterator *iterators[TMQ_PRIORITY_COUNT]{nullptr};
+
+    public:
+        /**
+         * Construct a cursor with the topic queues and the message type.
+         * @param queues, the priority queues of a topic.
+         * @param type, the message type to be consumed.
+         */
+        TopicCursor(TopicQueues *queues, int type);
+
+        /**
+         * Destructor, delete the shadow iterators.
+         */
+        ~TopicCursor();
+
+        /**
+         * Lookup a shadow from the queue with the priority. An empty queue is skipped without
+         * traversing.
+         * @param priority, the priority of the queue.
+         * @param found, a reference to receive the shadow.
+         * @return bool, true if a shadow is consumed.
+         */
+        bool Lookup(int priority, Shadow &found);
+    };
+
+/**
+ * TMQ picker is used for picking topic messages. A picker will include a storage, a history and
+ * the topic cursors on the queues of the watched topics.
  * TMQ picker can pick messages with priorities. The message with high priority will be picked
- * faster.
+ * faster. Among the topics with the same priority, the picker starts from the topic after the last
+ * picked one, so that a busy topic will not starve the others.
+ *
+ * A picker without topics watches all topics, the cursors will be created for the new topics
+ * before picking. It only looks up the cursors whose queues are marked pending in TMQQueues, and
+ * clears the marks of the queues it finds empty.
  */
     class TMQPicker : public IPicker {
     private:
         // The type of the picker, indicate what messages can be picked from message queue.
         int type;
-        // A watcher that contains one or more topics.
-        Watcher topicWatcher;
+        // Whether the picker watches all topics or not.
+        bool watchAll;
+        // A pointer to the queues of all topics.
+        TMQQueues *topicQueues;
         // A pointer to the topic message storage.
         IStorage *topicStorage;
         // A pointer to the history messages.
         IHistory *topicHistory;
-        // A pointer to the shadow iterator pointer. The length of the iterators is TMQ_PRIORITY_COUNT.
-        ShadowIterator *shadowIterators[TMQ_PRIORITY_COUNT]{0};
+        // Mutex for picking, the cursors can not be shared by threads.
+        TMQMutex pickMutex;
+        // The cursors of the watched topics.
+        List<TopicCursor *> cursors;
+        // The position of cursor to start the next pick.
+        TMQSize cursorStart;
+
+    private:
+        /**
+         * Create cursors for the topics created after the last pick, for watching all topics.
+         */
+        void RefreshCursors();
+
+        /**
+         * Find the next cursor to look up at the priority, the cursors are traversed circularly.
+         * @param priority, the priority of the queues.
+         * @param start, the position of the first cursor, less than count.
+         * @param offset, the offset from start to begin finding.
+         * @param count, the count of the cursors.
+         * @return the offset of the cursor from start, count if not found.
+         */
+        TMQSize NextCursor(int priority, TMQSize start, TMQSize offset, TMQSize count);
 
     public:
         /**
          * Construct a tmq picker with topics and consumed message type.
+         * @param queues, a pointer to the queues of all topics.
          * @param topics, a pointer to the topic array pointer.
-         * @param len, the count of the topic.
+         * @param len, the count of the topic, zero means all topics.
          * @param type, the message type to be consumed.
          */
-        TMQPicker(const char **topics, int len, int type);
+        TMQPicker(TMQQueues *queues, const char **topics, int len, int type);
 
         /**
          * Set method for modifying the pointer of a storage.
@@ -113,10 +192,11 @@ TMQ_NAMESPACE
         void SetHistory(IHistory *history);
 
         /**
-         * Set method for RCQueues.
-         * @param topicQueues, the rc queues with priority.
+         * Set method for the position of cursor to start the next pick, so that pickers of the same
+         * topics can start from different topics.
+         * @param start, the position of the cursor.
          */
-        void SetQueues(RCQueue<Shadow> *topicQueues);
+        void SetCursorStart(TMQSize start);
 
         /*
          * Destructor the tmq picker.
@@ -130,6 +210,28 @@ TMQ_NAMESPACE
          * @return bool, a boolean value indicate whether we have picked a message or not.
          */
         virtual bool Pick(char *topic, TMQMsg &tmqMsg);
+
+        /**
+         * Pick a message with its topic id, the name of the topic is not copied.
+         * @param topicId, a reference to receive the topic id of the picked message.
+         * @param tmqMsg, a reference to the TMQMsg, using to receive the tmq message.
+         * @return bool, a boolean value indicate whether we have picked a message or not.
+         */
+        bool Pick(TMQTopicId &topicId, TMQMsg &tmqMsg);
+
+        /**
+         * Pick messages of one topic under a claim. The topics are tried in the same order as Pick,
+         * a topic whose order key is claimed by others is skipped. The claim is kept on success,
+         * the caller should release it after the messages are dispatched.
+         * @param claims, the claims shared by the pickers dispatching in order.
+         * @param topicId, a reference to receive the topic id of the picked messages.
+         * @param msgs, the array to receive the picked messages, in the order of picking.
+         * @param max, the max count to pick, limited by ORDER_PICK_MAX.
+         * @param stripe, a reference to receive the claimed stripe, -1 if nothing is picked.
+         * @return the count of the picked messages.
+         */
+        int PickClaimed(TMQOrderClaims *claims, TMQTopicId &topicId, TMQMsg *msgs, int max,
+                        int &stripe);
     };
 
 TMQ_NAMESPACE_END
@@ -0,0 +1,250 @@
+//
+//  TMQQueues.cpp
+//  TMQQueues
+//
+//  Created by  on 2022/5/28.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#include "TMQQueues.h"
+#include "Atomic.h"
+#include <cstring>
+
+USING_TMQ_NAMESPACE
+
+/*
+ * Construct the queues of a topic.
+ */
+TopicQueues::TopicQueues(TMQTopicId topicId, TMQSize index)
+        : topicId(topicId), index(index), orderKey((TMQSize) topicId), pending(0), bytes(0) {
+
+}
+
+/*
+ * Find a priority queue with the priority. Check and reset the index at first.
+ */
+RCSegQueue<Shadow> *TopicQueues::FindQueue(int priority) {
+    int position = priority < 0 ? 0 : priority;
+    position = position >= TMQ_PRIORITY_COUNT ? TMQ_PRIORITY_COUNT - 1 : position;
+    return &(priorityQueue[position]);
+}
+
+/*
+ * Sum up the size of all priority queues.
+ */
+int TopicQueues::Size() {
+    int size = 0;
+    for (int i = 0; i < TMQ_PRIORITY_COUNT; ++i) {
+        size += priorityQueue[i].Size();
+    }
+    return size;
+}
+
+/*
+ * Add the counters without lock, the admitting of a bounded topic is serialized by the caller.
+ */
+void TopicQueues::Accept(int count, long long size) {
+    add_and_fetch_seq_cst(&pending, count);
+    add_and_fetch_seq_cst(&bytes, size);
+}
+
+/*
+ * The counters are reduced before the waiters are checked, and a waiter is counted before it
+ * checks the counters, so either the waiter sees the room, or it is waked. The watermark is
+ * checked with the mutex, the same as admitting, so the config is never read while SetTopicLimit
+ * replaces it, and the listener is called after unlocking.
+ */
+void TopicQueues::Release(int count, long long size) {
+    sub_and_fetch_seq_cst(&pending, count);
+    sub_and_fetch_seq_cst(&bytes, size);
+    if (!load_acquire(&(limit.enabled))) {
+        return;
+    }
+    if (load_seq_cst(&(limit.waiters)) > 0) {
+        limit.condition.Lock();
+        limit.condition.Broadcast();
+        limit.condition.UnLock();
+    }
+    if (!load_acquire(&(limit.high))) {
+        return;
+    }
+    TMQLimitListener *listener = nullptr;
+    limit.condition.Lock();
+    // Only the one changing the flag calls the listener.
+    if (limit.high && Usage() <= limit.config.lowWatermark) {
+        store_release(&(limit.high), false);
+        listener = limit.config.listener;
+    }
+    limit.condition.UnLock();
+    if (listener) {
+        listener->OnLowWatermark(TMQTopicRegistry::GetInstance()->GetName(topicId));
+    }
+}
+
+/*
+ * A zero limit is unlimited.
+ */
+bool TopicQueues::HasRoom(int count, long long size) {
+    const TMQTopicLimit &config = limit.config;
+    return (config.maxMsgs <= 0 || load_seq_cst(&pending) + count <= config.maxMsgs)
+           && (config.maxBytes <= 0 || load_seq_cst(&bytes) + size <= config.maxBytes);
+}
+
+/*
+ * Calculate the ratios in percent with the counters.
+ */
+int TopicQueues::Usage() {
+    const TMQTopicLimit &config = limit.config;
+    long long usage = 0;
+    if (config.maxMsgs > 0) {
+        usage = (long long) load_acquire(&pending) * 100 / config.maxMsgs;
+    }
+    if (config.maxBytes > 0 && load_acquire(&bytes) * 100 / config.maxBytes > usage) {
+        usage = load_acquire(&bytes) * 100 / config.maxBytes;
+    }
+    return (int) usage;
+}
+
+/*
+ * Default constructor.
+ */
+TMQQueues::TMQQueues() : count(0) {
+
+}
+
+/*
+ * Release all TopicQueues and the chunks.
+ */
+TMQQueues::~TMQQueues() {
+    for (TMQSize i = 0; i < count; ++i) {
+        delete Get(i);
+    }
+    for (int i = 0; i < QUEUES_CHUNK_COUNT; ++i) {
+        delete[] slots[i];
+        delete[] chunks[i];
+        delete[] pendingMarks[i];
+    }
+}
+
+/*
+ * Find the queues from the slots directly, the slot is published by the creator with release
+ * order.
+ */
+TopicQueues *TMQQueues::Find(TMQTopicId topicId) {
+    if (topicId < 0 || topicId >= QUEUES_CHUNK_SIZE * QUEUES_CHUNK_COUNT) {
+        return nullptr;
+    }
+    TopicQueues **slot = load_acquire(&(slots[topicId / QUEUES_CHUNK_SIZE]));
+    return slot ? load_acquire(&(slot[topicId % QUEUES_CHUNK_SIZE])) : nullptr;
+}
+
+/*
+ * Find the queues, if not exist, create them with the mutex. The new queues is put into the chunk
+ * before the count increased, so that readers without lock can see the completed queues.
+ */
+TopicQueues *TMQQueues::Obtain(TMQTopicId topicId) {
+    TopicQueues *queues = Find(topicId);
+    if (queues || topicId < 0 || topicId >= QUEUES_CHUNK_SIZE * QUEUES_CHUNK_COUNT) {
+        return queues;
+    }
+    createMutex.Lock();
+    // Check again, it may be created by others before the lock.
+    queues = Find(topicId);
+    if (queues == nullptr) {
+        TMQSize slotChunk = topicId / QUEUES_CHUNK_SIZE;
+        if (slots[slotChunk] == nullptr) {
+            store_release(&(slots[slotChunk]), new TopicQueues *[QUEUES_CHUNK_SIZE]{nullptr});
+        }
+        TMQSize chunk = count / QUEUES_CHUNK_SIZE;
+        if (chunks[chunk] == nullptr) {
+            chunks[chunk] = new TopicQueues *[QUEUES_CHUNK_SIZE]{nullptr};
+            pendingMarks[chunk] = new unsigned long long[PENDING_CHUNK_WORDS
+                                                         * TMQ_PRIORITY_COUNT]{0};
+        }
+        queues = new TopicQueues(topicId, count);
+        chunks[chunk][count % QUEUES_CHUNK_SIZE] = queues;
+        store_release(&(slots[slotChunk][topicId % QUEUES_CHUNK_SIZE]), queues);
+        store_release(&count, count + 1);
+    }
+    createMutex.UnLock();
+    return queues;
+}
+
+/*
+ * The count of the TopicQueues.
+ */
+TMQSize TMQQueues::Size() {
+    return load_acquire(&count);
+}
+
+/*
+ * Get the TopicQueues from chunks directly.
+ */
+TopicQueues *TMQQueues::Get(TMQSize position) {
+    if (position >= Size()) {
+        return nullptr;
+    }
+    return chunks[position / QUEUES_CHUNK_SIZE][position % QUEUES_CHUNK_SIZE];
+}
+
+volatile unsigned long long *TMQQueues::PendingWord(TMQSize position, int priority) {
+    return &(pendingMarks[position / QUEUES_CHUNK_SIZE][priority * PENDING_CHUNK_WORDS
+                                                        + position % QUEUES_CHUNK_SIZE
+                                                          / PENDING_WORD_BITS]);
+}
+
+/*
+ * The enqueuing is fenced before checking the mark, and the clearing is fenced before checking the
+ * queue, so either the clearer sees the message, or the mark is set again here. The mark is read
+ * first, a busy queue is marked already.
+ */
+void TMQQueues::MarkPending(TopicQueues *queues, int priority) {
+    priority = priority < 0 ? 0 : priority;
+    priority = priority >= TMQ_PRIORITY_COUNT ? TMQ_PRIORITY_COUNT - 1 : priority;
+    volatile unsigned long long *word = PendingWord(queues->index, priority);
+    unsigned long long bit = 1ULL << (queues->index % PENDING_WORD_BITS);
+    fence_seq_cst();
+    if ((load_acquire(word) & bit) == 0 && (fetch_or_seq_cst(word, bit) & bit) == 0) {
+        add_and_fetch_seq_cst(&(pendingCount[priority]), 1);
+    }
+}
+
+/*
+ * Only the one clearing the mark uncounts it.
+ */
+void TMQQueues::ClearPending(TopicQueues *queues, int priority) {
+    RCSegQueue<Shadow> &queue = queues->priorityQueue[priority];
+    if (queue.Size() > 0) {
+        return;
+    }
+    volatile unsigned long long *word = PendingWord(queues->index, priority);
+    unsigned long long bit = 1ULL << (queues->index % PENDING_WORD_BITS);
+    if ((fetch_and_seq_cst(word, ~bit) & bit) == 0) {
+        return;
+    }
+    sub_and_fetch_seq_cst(&(pendingCount[priority]), 1);
+    fence_seq_cst();
+    if (queue.Size() > 0) {
+        MarkPending(queues, priority);
+    }
+}
+
+bool TMQQueues::HasPending(int priority) {
+    return load_acquire(&(pendingCount[priority])) > 0;
+}
+
+/*
+ * Scan the words of the range, the bits before from in the first word are shifted out.
+ */
+TMQSize TMQQueues::NextPending(int priority, TMQSize from, TMQSize end) {
+    while (from < end) {
+        TMQSize offset = from % PENDING_WORD_BITS;
+        unsigned long long word = load_acquire(PendingWord(from, priority)) >> offset;
+        if (word != 0) {
+            TMQSize found = from + (TMQSize) __builtin_ctzll(word);
+            return found < end ? found : end;
+        }
+        from += PENDING_WORD_BITS - offset;
+    }
+    return end;
+}
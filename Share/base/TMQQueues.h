@@ -0,0 +1,243 @@
+//
+//  TMQQueues.h
+//  TMQQueues
+//
+//  Created by  on 2022/5/28.
+//  Copyright (c)  Tencent. All rights reserved.
+//
+
+#ifndef TMQ_QUEUES_H
+#define TMQ_QUEUES_H
+
+#include "Defines.h"
+#include "TMQTopic.h"
+#include "RCSegQueue.h"
+#include "Shadow.h"
+#include "TMQMutex.h"
+#include "TMQTopicRegistry.h"
+#include "TMQCondition.h"
+
+/// Const definitions
+// The count of topic queues in one chunk.
+#define QUEUES_CHUNK_SIZE           TOPIC_CHUNK_SIZE
+// The max count of chunks, it is the same as the registry, so that every topic can have its queues.
+#define QUEUES_CHUNK_COUNT          TOPIC_CHUNK_COUNT
+// The bits of a pending mark word.
+#define PENDING_WORD_BITS           64
+// The count of the pending mark words of a priority in one chunk.
+#define PENDING_CHUNK_WORDS         (QUEUES_CHUNK_SIZE / PENDING_WORD_BITS)
+
+TMQ_NAMESPACE
+
+/**
+ * The limit state of a topic. The publishers are admitted under the mutex of the condition, and
+ * wait on it for the room. The consumers release the room without lock, and broadcast the
+ * condition only if there are waiters. The config and the watermark flag are read and changed
+ * under the mutex.
+ */
+    class TopicLimit {
+    public:
+        // Whether the topic is bounded, an unbounded topic is admitted without lock.
+        volatile bool enabled;
+        // The limits set by SetTopicLimit, written under the mutex of the condition.
+        TMQTopicLimit config;
+        // Condition for the blocked publishers.
+        TMQCondition condition;
+        // The count of the blocked publishers.
+        volatile int waiters;
+        // Whether the usage has reached the high watermark and not fallen to the low one.
+        volatile bool high;
+
+    public:
+        TopicLimit() : enabled(false), waiters(0), high(false) {
+
+        }
+    };
+
+/**
+ * The priority rc queues of one topic. Each RCSegQueue has its own priority defined by its position
+ * of index, the same as the priority queues in Topic before. A TopicQueues is created on the first
+ * use of the topic, and lives as long as the TMQQueues.
+ */
+    class TopicQueues {
+    public:
+        // The topic id of these queues.
+        TMQTopicId topicId;
+        // The position in the TMQQueues.
+        TMQSize index;
+        // The key for ordered dispatching, the topics with the same key are never dispatched
+        // concurrently. It is the topic id by default.
+        volatile TMQSize orderKey;
+        // Priority RCSegQueues.
+        RCSegQueue<Shadow> priorityQueue[TMQ_PRIORITY_COUNT];
+        // The count of the pending messages, counted for the limit.
+        volatile int pending;
+        // The bytes of the pending messages, counted for the limit.
+        volatile long long bytes;
+        // The limit of the topic.
+        TopicLimit limit;
+
+    public:
+        /**
+         * Construct the queues of a topic.
+         * @param topicId, the topic id of the queues.
+         * @param index, the position in the TMQQueues.
+         */
+        TopicQueues(TMQTopicId topicId, TMQSize index);
+
+        /**
+         * Find the RCSegQueue with the priority.
+         * @param priority, the priority of the queue, it will be limited to the valid range.
+         * @return a pointer to the RCSegQueue.
+         */
+        RCSegQueue<Shadow> *FindQueue(int priority);
+
+        /**
+         * The count of the messages in all priority queues.
+         * @return the size.
+         */
+        int Size();
+
+        /**
+         * Count the messages going to be enqueued.
+         * @param count, the count of the messages.
+         * @param size, the bytes of the messages.
+         */
+        void Accept(int count, long long size);
+
+        /**
+         * Uncount the messages picked or dropped. If the topic is bounded, the blocked publishers
+         * are waked, and OnLowWatermark is called if the usage falls to the low watermark.
+         * @param count, the count of the messages.
+         * @param size, the bytes of the messages.
+         */
+        void Release(int count, long long size);
+
+        /**
+         * Check whether there is room for more messages under the limit, the mutex of the limit
+         * condition should be held by the caller.
+         * @param count, the count of the messages.
+         * @param size, the bytes of the messages.
+         * @return true if the messages can be enqueued.
+         */
+        bool HasRoom(int count, long long size);
+
+        /**
+         * The usage of the limit in percent, the higher one of the message ratio and the byte
+         * ratio, the mutex of the limit condition should be held by the caller.
+         * @return the usage, 0 if the topic is unbounded.
+         */
+        int Usage();
+    };
+
+/**
+ * TMQQueues manages the priority rc queues of all topics. The queues of a topic are created
+ * lazily, and indexed by the topic id, so that a publisher or a picker can find its queues without
+ * any lock, and never touch the messages of other topics.
+ *
+ * All TopicQueues are put into chunks twice, by the topic id and by the creation order, the chunks
+ * are never moved. So traversing all queues by Size and Get needs no lock either, which is used by
+ * the picker for all topics.
+ *
+ * For each priority, the queues having pending messages are marked in a bitmap by their creation
+ * order, so that the picker for all topics only looks up the marked ones. A mark is set after
+ * enqueuing, and may stay with an empty queue, it is cleared by the picker finding the queue
+ * empty.
+ */
+    class TMQQueues {
+    private:
+        // Mutex for creating the queues.
+        TMQMutex createMutex;
+        // The chunks of TopicQueues pointer, indexed by the topic id.
+        TopicQueues **slots[QUEUES_CHUNK_COUNT]{nullptr};
+        // The chunks of TopicQueues pointer, in creation order.
+        TopicQueues **chunks[QUEUES_CHUNK_COUNT]{nullptr};
+        // The count of the TopicQueues.
+        volatile TMQSize count;
+        // The chunks of pending marks in creation order, PENDING_CHUNK_WORDS words per priority.
+        volatile unsigned long long *pendingMarks[QUEUES_CHUNK_COUNT]{nullptr};
+        // The count of the marked queues of each priority.
+        volatile int pendingCount[TMQ_PRIORITY_COUNT]{0};
+
+    private:
+        /**
+         * Get the pending mark word of the queues.
+         * @param position, the position of the queues.
+         * @param priority, the valid priority.
+         * @return a pointer to the word.
+         */
+        volatile unsigned long long *PendingWord(TMQSize position, int priority);
+
+    public:
+        /**
+         * Default constructor.
+         */
+        TMQQueues();
+
+        /**
+         * Destructor, release all TopicQueues.
+         */
+        ~TMQQueues();
+
+        /**
+         * Find the queues of a topic.
+         * @param topicId, the topic id.
+         * @return a pointer to the TopicQueues, nullptr if the topic has no queues yet.
+         */
+        TopicQueues *Find(TMQTopicId topicId);
+
+        /**
+         * Find the queues of a topic, create them if not exist.
+         * @param topicId, the topic id.
+         * @return a pointer to the TopicQueues, nullptr if the topic id is invalid.
+         */
+        TopicQueues *Obtain(TMQTopicId topicId);
+
+        /**
+         * The count of the TopicQueues.
+         * @return the size.
+         */
+        TMQSize Size();
+
+        /**
+         * Get the TopicQueues at position.
+         * @param position, the position, should be less than Size.
+         * @return a pointer to the TopicQueues.
+         */
+        TopicQueues *Get(TMQSize position);
+
+        /**
+         * Mark the queue of the priority pending, called after enqueuing.
+         * @param queues, the queues of a topic.
+         * @param priority, the priority of the queue, it will be limited to the valid range.
+         */
+        void MarkPending(TopicQueues *queues, int priority);
+
+        /**
+         * Clear the pending mark of the queue if it is empty. The queue is checked again after
+         * clearing, the messages enqueued meanwhile mark it again.
+         * @param queues, the queues of a topic.
+         * @param priority, the valid priority of the queue.
+         */
+        void ClearPending(TopicQueues *queues, int priority);
+
+        /**
+         * Whether any queue of the priority is marked pending.
+         * @param priority, the valid priority.
+         * @return true if there is one.
+         */
+        bool HasPending(int priority);
+
+        /**
+         * Find the first queues marked pending at the priority in a range of positions.
+         * @param priority, the valid priority.
+         * @param from, the first position of the range.
+         * @param end, the end position of the range, should not be greater than Size.
+         * @return the position of the marked queues, end if not found.
+         */
+        TMQSize NextPending(int priority, TMQSize from, TMQSize end);
+    };
+
+TMQ_NAMESPACE_END
+
+#endif //TMQ_QUEUES_H
@@ -8,27 +8,100 @@
 
 #include "TMQStorage.h"
 #include "FileSpace.h"
+#include "SectionSpace.h"
 #include "Shadow.h"
 #include "Watcher.h"
 #include "TMQBase64.h"
+#include "TMQCrc32.h"
+#include "TMQTopicRegistry.h"
+#include "TMQUtils.h"
+#include <cstring>
+#include <cstdlib>
 
 USING_TMQ_NAMESPACE
 
+/**
+ * Compute the checksum of a record, the header from msgId and the data following the header.
+ * @param record, the record with its data.
+ * @return the checksum.
+ */
+static unsigned int RecordCrc(const PersistRecord *record) {
+    const char *fields = (const char *) &(record->msgId);
+    long fieldsLen = (long) sizeof(PersistRecord) - (fields - (const char *) record);
+    unsigned int crc = TMQCrc32::Update(0, fields, fieldsLen);
+    return TMQCrc32::Update(crc, record + 1, record->length);
+}
+
+/**
+ * Check a record read from the data space, it is valid only if it is complete, and it is the
+ * record of the message.
+ * @param record, the record with its data.
+ * @param len, the length read.
+ * @param shadow, the shadow of the message.
+ * @return true if the record is valid.
+ */
+static bool CheckRecord(const PersistRecord *record, long len, const Shadow &shadow) {
+    return len == (long) sizeof(PersistRecord) + (long) shadow.length
+           && record->magic == RECORD_MAGIC && record->msgId == shadow.msgId
+           && record->length == (int) shadow.length && record->crc == RecordCrc(record);
+}
+
+/**
+ * Compare the recovered messages by their ids.
+ * @param p1, a pointer to a recovered message.
+ * @param p2, a pointer to another recovered message.
+ * @return the result of comparing, refer qsort.
+ */
+static int CompareRecovered(const void *p1, const void *p2) {
+    TMQMsgId id = ((const RecoveredShadow *) p1)->shadow.msgId;
+    TMQMsgId another = ((const RecoveredShadow *) p2)->shadow.msgId;
+    return id == another ? 0 : (id > another ? 1 : -1);
+}
+
+/**
+ * Pack a message into a record.
+ * @param msgId, the id of the message.
+ * @param flag, the flag of the message.
+ * @param data, the binary data.
+ * @param length, the length of the data.
+ * @return the record followed by the data, which should be freed by the caller.
+ */
+static PersistRecord *PackRecord(TMQMsgId msgId, int flag, const void *data, int length) {
+    auto *record = (PersistRecord *) malloc(sizeof(PersistRecord) + length);
+    record->magic = RECORD_MAGIC;
+    record->msgId = msgId;
+    record->length = length;
+    record->flag = flag;
+    if (length > 0) {
+        memcpy(record + 1, data, length);
+    }
+    record->crc = RecordCrc(record);
+    return record;
+}
+
 /*
  * Enable or disable the persistence. During enabling the persistence, TMQStorage will create the
  * persist and some section spaces.
  */
-void TMQStorage::EnablePersist(bool enable, const char *file) {
+bool TMQStorage::EnablePersist(bool enable, const char *file) {
     if (enable && !persist) {
         persistMutex.Lock();
-        // Create persistence and some extra section spaces.
-        persist = new Persistence(new FileSpace(file));
+        // Create persistence and some extra section spaces, the file is mapped in chunks.
+        persist = new Persistence(new FileSpace(file, FILE_SPACE_CHUNKED));
         dataSpace = persist->CreateLinearSpace(SECTION_DATA);
         metaSpace = persist->CreateLinearSpace(SECTION_META);
         backupSpace = persist->CreateLinearSpace(SECTION_BACKUP);
         // If the meta space is not empty, which means there are remained message, so append these
         // message to backup space and clear meta space.
         persist->AppendLinearSpace(backupSpace->GetName(), metaSpace->GetName());
+        MigrateRecords();
+        checkpointSpace = persist->CreateLinearSpace(SECTION_CHECKPOINT);
+        Recover();
+        if (committer == nullptr) {
+            committer = new ThreadExecutor(this);
+        }
+        syncStats = TMQSyncStats();
+        lastSync = TMQUtils::NowMillis();
         persistMutex.UnLock();
     }
     if (!enable && persist) {
@@ -37,12 +110,67 @@ void TMQStorage::EnablePersist(bool enable, const char *file) {
         persist->DropLinearSpace(SECTION_DATA);
         persist->DropLinearSpace(SECTION_TOPIC);
         persist->DropLinearSpace(SECTION_BACKUP);
-        persistMutex.UnLock();
+        persist->DropLinearSpace(SECTION_CHECKPOINT);
         dataSpace = nullptr;
         metaSpace = nullptr;
+        backupSpace = nullptr;
+        checkpointSpace = nullptr;
+        recovered.Clear();
         delete persist->GetPageSpace();
         delete persist;
         persist = nullptr;
+        periodicDirty = false;
+        persistMutex.UnLock();
+    }
+    return persist != nullptr;
+}
+
+/*
+ * Rewrite the backup messages one by one. The shadows saved by the early versions have no storage
+ * type, and the length of the raw data, and their data is the Base64 string with its '\0'. A record
+ * is told from the Base64 data by its magic, so the migrated messages are skipped, and the
+ * migration can be interrupted safely, the record of a message is saved before its Base64 data is
+ * deallocated. An empty message has no Base64 data to tell, it is migrated by its storage type into
+ * an empty record, so that it can be read and removed like the others.
+ */
+void TMQStorage::MigrateRecords() {
+    List<MetaAlloc> allocList;
+    if (!backupSpace->GetAllocList(allocList)) {
+        return;
+    }
+    for (int i = 0; i < allocList.Size(); ++i) {
+        PersistShadow shadow;
+        backupSpace->Read(allocList.Get(i).address, &shadow, sizeof(PersistShadow));
+        unsigned int magic = 0;
+        if (shadow.type == STORAGE_TYPE_MEMORY
+            || (shadow.length == 0 && shadow.type == STORAGE_TYPE_PERSIST)
+            || (shadow.length > 0
+                && (dataSpace->Read(shadow.dataAddress, &magic, sizeof(magic)) != sizeof(magic)
+                    || magic == RECORD_MAGIC))) {
+            continue;
+        }
+        char *base64Buf = nullptr;
+        char *decodedBuf = nullptr;
+        int msgLength = 0;
+        if (shadow.length > 0) {
+            // One more byte keeps the Base64 string terminated anyway.
+            int encodeLen = TMQBase64::EncodeLength((int) shadow.length);
+            base64Buf = (char *) calloc(encodeLen + 1, sizeof(char));
+            dataSpace->Read(shadow.dataAddress, base64Buf, encodeLen);
+            decodedBuf = (char *) calloc(TMQBase64::DecodeLength(base64Buf), sizeof(char));
+            msgLength = TMQBase64::Decode(decodedBuf, base64Buf);
+        }
+        PersistRecord *record = PackRecord(shadow.msgId, shadow.flag, decodedBuf, msgLength);
+        TMQAddress address = dataSpace->Allocate(sizeof(PersistRecord) + msgLength);
+        dataSpace->Write(address, record, sizeof(PersistRecord) + msgLength);
+        dataSpace->Deallocate(shadow.dataAddress);
+        shadow.dataAddress = address;
+        shadow.type = STORAGE_TYPE_PERSIST;
+        shadow.length = msgLength;
+        backupSpace->Write(allocList.Get(i).address, &shadow, sizeof(PersistShadow));
+        free(record);
+        free(decodedBuf);
+        free(base64Buf);
     }
 }
 
@@ -50,38 +178,68 @@ void TMQStorage::EnablePersist(bool enable, const char *file) {
  * Write a tmq message. This function will save the tmq message to memory or persistence based on
  * the flag of the tmq message required by user self.
  */
-Shadow TMQStorage::Write(const char *topic, const TMQMsg &msg) {
-    Shadow shadow(topic, msg);
+Shadow TMQStorage::Write(TMQTopicId topicId, const TMQMsg &msg) {
     // Generate an new id for the tmq message.
-    shadow.msgId = IDGenerator::GetInstance()->GetMsgId();
+    return Write(topicId, msg, IDGenerator::GetInstance()->GetMsgId());
+}
+
+/*
+ * Write a tmq message with the id reserved by caller, without a listener.
+ */
+Shadow TMQStorage::Write(TMQTopicId topicId, const TMQMsg &msg, TMQMsgId msgId) {
+    return Write(topicId, msg, msgId, nullptr);
+}
+
+/*
+ * Write a tmq message with the id reserved by caller. A persistent message is packed and staged,
+ * its shadow points to the stage, the committer writes it into the section spaces later. A message
+ * saved into the memory is never durable, its listener is notified at once.
+ */
+Shadow TMQStorage::Write(TMQTopicId topicId, const TMQMsg &msg, TMQMsgId msgId,
+                         TMQDurableListener *listener) {
+    Shadow shadow(topicId, msg);
+    shadow.msgId = msgId;
     // The message requires persistent storage, this need the persistence to be available, otherwise
-    // the tmq message will save into memory.
-    if (IS_PERSIST(msg.flag) && metaSpace && dataSpace) {
-        persistMutex.Lock();
-        // write binary data into data space, and assign metaAddress into shadow
-        int encodeLen = TMQBase64::EncodeLength(msg.length);
-        char *encodedBuf = (char *) calloc(encodeLen, sizeof(char *));
-        int realEncodeLen = TMQBase64::Encode(encodedBuf, (char *) msg.data, msg.length);
-        shadow.dataAddress = dataSpace->Allocate(realEncodeLen);
-        dataSpace->Write(shadow.dataAddress, encodedBuf, realEncodeLen);
-        if (encodedBuf) {
-            free(encodedBuf);
-        }
-        // write shadow info into meta space
-        shadow.metaAddress = metaSpace->Allocate(sizeof(Shadow));
-        metaSpace->Write(shadow.metaAddress, (void *) (&shadow), sizeof(Shadow));
-        persistMutex.UnLock();
-        // Set the storage type to STORAGE_TYPE_PERSIST.
-        shadow.type = STORAGE_TYPE_PERSIST;
-        shadow.length = realEncodeLen;
+    // the tmq message will save into memory. A message with a listener requires it as well.
+    if ((IS_PERSIST(msg.flag) || listener) && metaSpace && dataSpace && committer) {
+        auto *stage = new PersistStage();
+        stage->shadow = shadow;
+        stage->record = PackRecord(msgId, msg.flag, msg.data, msg.length);
+        stage->listener = listener;
+        stage->state = STAGE_PENDING;
+        stage->removed = false;
+        stage->consumed = false;
+        stage->priority = msg.priority;
+        stage->prev = nullptr;
+        stage->next = nullptr;
+        shadow.metaAddress = (TMQAddress) stage;
+        // Set the storage type to STORAGE_TYPE_STAGED.
+        shadow.type = STORAGE_TYPE_STAGED;
+        stageMutex.Lock();
+        staged.Add(stage);
+        stageMutex.UnLock();
+        committer->Wakeup();
     } else {
-        // Write the message to the memory.
-        auto *memoryAddress = new TMQMsg(msg);
+        // Write the message to the memory. The data is kept in a shared buffer, so that reading
+        // the message later will not copy the data again.
+        TMQMsg *memoryAddress;
+        if (msg.buffer) {
+            memoryAddress = new TMQMsg(msg);
+        } else {
+            TMQBuffer *buffer = TMQBuffer::Copy(msg.data, msg.length);
+            memoryAddress = new TMQMsg(buffer);
+            buffer->Release();
+            memoryAddress->priority = msg.priority;
+            memoryAddress->flag = msg.flag;
+        }
         memoryAddress->msgId = shadow.msgId;
         shadow.metaAddress = (TMQAddress) memoryAddress;
         shadow.dataAddress = (TMQAddress) memoryAddress->data;
         // Set the storage type to STORAGE_TYPE_MEMORY.
         shadow.type = STORAGE_TYPE_MEMORY;
+        if (listener) {
+            listener->OnDurable(msgId, false);
+        }
     }
     // Return the shadow of the tmq message.
     return shadow;
@@ -93,21 +251,23 @@ Shadow TMQStorage::Write(const char *topic, const TMQMsg &msg) {
  */
 bool TMQStorage::Read(const Shadow &shadow, TMQMsg &msg) {
     bool suc = false;
-    // The message is saved in persistence.
-    if (shadow.type == STORAGE_TYPE_PERSIST && dataSpace) {
-        char *base64Buf = (char *) calloc(shadow.length, sizeof(char));
+    // The message is saved in persistence, or recovered from the backup space.
+    if (shadow.type == STORAGE_TYPE_PERSIST || shadow.type == STORAGE_TYPE_RECOVERED) {
+        suc = ReadRecord(shadow, msg);
+    }
+    // The message is staged, read from its record if it is not committed yet.
+    if (shadow.type == STORAGE_TYPE_STAGED) {
+        auto *stage = (PersistStage *) shadow.metaAddress;
         persistMutex.Lock();
-        long len = dataSpace->Read(shadow.dataAddress, base64Buf, shadow.length);
+        if (stage->record) {
+            msg = TMQMsg(stage->record + 1, stage->record->length);
+            suc = true;
+        } else if (stage->state == STAGE_COMMITTED) {
+            suc = ReadRecord(stage->shadow, msg);
+        }
         persistMutex.UnLock();
-        int decodedLen = TMQBase64::DecodeLength(base64Buf);
-        char *decodedBuf = (char *) calloc(decodedLen, sizeof(char));
-        int msgLength = TMQBase64::Decode(decodedBuf, base64Buf);
-        msg = TMQMsg(decodedBuf, msgLength);
-        free(decodedBuf);
-        free(base64Buf);
-        suc = len == shadow.length;
     }
-    // The message is saved in memory.
+    // The message is saved in memory, msg shares the buffer of the saved message.
     if (shadow.type == STORAGE_TYPE_MEMORY) {
         msg = *((TMQMsg *) shadow.metaAddress);
         suc = true;
@@ -119,41 +279,306 @@ bool TMQStorage::Read(const Shadow &shadow, TMQMsg &msg) {
     return suc;
 }
 
+/*
+ * Read the record under the persist mutex, the record is valid only if it is complete, and it is
+ * the record of this message. The record is read into a buffer which is handed to msg, the data
+ * of msg points to the payload after the header, so the payload is copied only once.
+ */
+bool TMQStorage::ReadRecord(const Shadow &shadow, TMQMsg &msg) {
+    int recordLen = (int) sizeof(PersistRecord) + (int) shadow.length;
+    char *bytes = new char[recordLen];
+    auto *record = (PersistRecord *) bytes;
+    long len = -1;
+    persistMutex.Lock();
+    if (dataSpace) {
+        len = dataSpace->Read(shadow.dataAddress, record, recordLen);
+    }
+    persistMutex.UnLock();
+    bool suc = CheckRecord(record, len, shadow);
+    if (!suc) {
+        delete[] bytes;
+        return false;
+    }
+    // The buffer takes the ownership of the record, msg shares it.
+    TMQBuffer *buffer = TMQBuffer::Wrap(bytes, recordLen);
+    TMQMsg shared(buffer);
+    buffer->Release();
+    shared.data = record + 1;
+    shared.length = record->length;
+    msg = shared;
+    return true;
+}
+
+/*
+ * Commit the batch with the persist mutex held once. The removed messages are deleted, the others
+ * are written into the section spaces, or kept in memory if the persistence is not available. The
+ * file is synchronized once at last, then the listeners are notified without the mutex.
+ */
+void TMQStorage::Commit(List<PersistStage *> &batch) {
+    List<DurableNotice> notices;
+    bool batchSync = false;
+    bool periodic = false;
+    TMQSettingsSnapshot *snapshot = TMQSettings::GetInstance()->Acquire();
+    persistMutex.Lock();
+    syncPeriod = snapshot->GetInt(KEY_PERSIST_SYNC_PERIOD, PERSIST_SYNC_PERIOD);
+    for (int i = 0; i < batch.Size(); ++i) {
+        PersistStage *stage = batch.Get(i);
+        if (stage->removed) {
+            free(stage->record);
+            delete stage;
+            continue;
+        }
+        Shadow &shadow = stage->shadow;
+        if (dataSpace && metaSpace) {
+            int recordLen = (int) sizeof(PersistRecord) + stage->record->length;
+            shadow.dataAddress = dataSpace->Allocate(recordLen);
+            dataSpace->Write(shadow.dataAddress, stage->record, recordLen);
+            // Set the storage type to STORAGE_TYPE_PERSIST, before it is saved with the shadow info.
+            shadow.type = STORAGE_TYPE_PERSIST;
+            // write shadow info into meta space
+            shadow.metaAddress = metaSpace->Allocate(sizeof(PersistShadow));
+            PersistShadow record(shadow, TMQTopicRegistry::GetInstance()->GetName(shadow.topicId));
+            record.flag = PERSIST_PRIORITY(record.flag, stage->priority);
+            if (stage->consumed) {
+                record.flag = PERSIST_CONSUMED(record.flag);
+            }
+            metaSpace->Write(shadow.metaAddress, (void *) (&record), sizeof(PersistShadow));
+            free(stage->record);
+            stage->record = nullptr;
+            stage->state = STAGE_COMMITTED;
+            int durability = GetDurability(shadow.topicId, shadow.flag, stage->listener,
+                                           snapshot);
+            batchSync = batchSync || durability == TMQ_DURABILITY_BATCH;
+            periodic = periodic || durability == TMQ_DURABILITY_PERIODIC;
+        } else {
+            stage->state = STAGE_FAILED;
+        }
+        LinkStage(stage);
+        if (stage->listener) {
+            DurableNotice notice = {stage->listener, shadow.msgId,
+                                    stage->state == STAGE_COMMITTED};
+            notices.Add(notice);
+        }
+    }
+    bool synced = true;
+    if (batchSync) {
+        synced = SyncSpace();
+    } else if (periodic) {
+        periodicDirty = true;
+    }
+    persistMutex.UnLock();
+    snapshot->Release();
+    for (int i = 0; i < notices.Size(); ++i) {
+        DurableNotice &notice = notices.Get(i);
+        notice.listener->OnDurable(notice.msgId, notice.durable && synced);
+    }
+}
+
+/*
+ * Insert the stage at the head of the list.
+ */
+void TMQStorage::LinkStage(PersistStage *stage) {
+    stage->prev = nullptr;
+    stage->next = stages;
+    if (stages) {
+        stages->prev = stage;
+    }
+    stages = stage;
+}
+
+/*
+ * Unlink the stage from its neighbours, or the head.
+ */
+void TMQStorage::UnlinkStage(PersistStage *stage) {
+    if (stage->prev) {
+        stage->prev->next = stage->next;
+    } else {
+        stages = stage->next;
+    }
+    if (stage->next) {
+        stage->next->prev = stage->prev;
+    }
+}
+
+/*
+ * Take all staged messages as a batch, the messages staged during committing are taken by the next
+ * call, the committer is waked by them.
+ */
+bool TMQStorage::OnExecute(long eid) {
+    List<PersistStage *> batch;
+    stageMutex.Lock();
+    for (int i = 0; i < staged.Size(); ++i) {
+        batch.Add(staged.Get(i));
+    }
+    staged.Clear();
+    stageMutex.UnLock();
+    if (!batch.Empty()) {
+        Commit(batch);
+    }
+    // Synchronize the periodic messages after the period, call again until they are synchronized.
+    persistMutex.Lock();
+    bool again = periodicDirty && persist;
+    if (again && TMQUtils::NowMillis() - lastSync >= syncPeriod) {
+        SyncSpace();
+        again = periodicDirty;
+    }
+    persistMutex.UnLock();
+    return again;
+}
+
+/*
+ * The time left until the period passes since the last synchronization.
+ */
+long TMQStorage::GetRecallDelay() {
+    persistMutex.Lock();
+    long long delay = lastSync + syncPeriod - TMQUtils::NowMillis();
+    persistMutex.UnLock();
+    return delay > 1 ? (long) delay : 1;
+}
+
+/*
+ * Get the durability level by the priority: a listener, the flag of the message, the setting of
+ * its topic, the setting for all topics.
+ */
+int TMQStorage::GetDurability(TMQTopicId topicId, int flag, TMQDurableListener *listener,
+                              TMQSettingsSnapshot *snapshot) {
+    if (listener) {
+        return TMQ_DURABILITY_BATCH;
+    }
+    int durability = GET_DURABILITY(flag);
+    if (durability >= 0) {
+        return durability;
+    }
+    const char *topic = TMQTopicRegistry::GetInstance()->GetName(topicId);
+    return snapshot->GetTopicInt(KEY_PERSIST_DURABILITY, topic, TMQ_DURABILITY_BATCH);
+}
+
+/*
+ * Synchronize the written ranges of the file, the periodic messages are synchronized too.
+ */
+bool TMQStorage::SyncSpace() {
+    long long start = TMQUtils::NowMicros();
+    bool synced = persist->GetPageSpace()->Sync();
+    long long latency = TMQUtils::NowMicros() - start;
+    syncStats.count++;
+    syncStats.failures += synced ? 0 : 1;
+    syncStats.totalMicros += latency;
+    syncStats.maxMicros = latency > syncStats.maxMicros ? latency : syncStats.maxMicros;
+    syncStats.lastMicros = latency;
+    lastSync = TMQUtils::NowMillis();
+    periodicDirty = periodicDirty && !synced;
+    return synced;
+}
+
+/*
+ * Copy the statistics under the persist mutex.
+ */
+bool TMQStorage::GetSyncStats(TMQSyncStats &stats) {
+    persistMutex.Lock();
+    bool enabled = persist != nullptr;
+    if (enabled) {
+        stats = syncStats;
+    }
+    persistMutex.UnLock();
+    return enabled;
+}
+
 /**
  * Constructor
  */
 TMQStorage::TMQStorage()
-        : persist(nullptr), dataSpace(nullptr), metaSpace(nullptr), backupSpace(nullptr) {
+        : persist(nullptr), dataSpace(nullptr), metaSpace(nullptr), backupSpace(nullptr),
+          committer(nullptr), stages(nullptr), periodicDirty(false), lastSync(0),
+          syncPeriod(PERSIST_SYNC_PERIOD), checkpointSpace(nullptr) {
 
 }
 
 /*
- * Destructor
+ * Destructor, stop the committer, and commit the remained staged messages. Then synchronize the
+ * periodic ones, free the stages which are not removed, and close the persistence, the file is kept
+ * for the next recovery.
  */
-TMQStorage::~TMQStorage()
-= default;
+TMQStorage::~TMQStorage() {
+    delete committer;
+    OnExecute(0);
+    if (periodicDirty && persist) {
+        SyncSpace();
+    }
+    while (stages) {
+        PersistStage *stage = stages;
+        stages = stage->next;
+        free(stage->record);
+        delete stage;
+    }
+    if (persist) {
+        delete persist->GetPageSpace();
+        delete persist;
+        persist = nullptr;
+    }
+}
 
 /*
- * Remove the tmq message by a shadow.
+ * Remove the tmq message by a shadow, delegate to the batch one.
  */
 bool TMQStorage::Remove(const Shadow &shadow) {
-    // Remove from the persistence.
-    if (shadow.type == STORAGE_TYPE_PERSIST && dataSpace && metaSpace) {
-        persistMutex.Lock();
-        dataSpace->Deallocate(shadow.metaAddress);
-        metaSpace->Deallocate(shadow.dataAddress);
-        persistMutex.UnLock();
+    return Remove(&shadow, 1);
+}
+
+/*
+ * Remove the tmq messages by shadows. The persist mutex is locked once if there is any persistent
+ * one in the batch.
+ */
+bool TMQStorage::Remove(const Shadow *shadows, int count) {
+    if (shadows == nullptr || count <= 0) {
+        return false;
     }
-    // Remove from the memory.
-    if (shadow.type == STORAGE_TYPE_MEMORY) {
-        auto *ptr = (TMQMsg *) shadow.metaAddress;
-        delete ptr;
+    bool locked = false;
+    for (int i = 0; i < count; ++i) {
+        const Shadow &shadow = shadows[i];
+        if (shadow.type != STORAGE_TYPE_MEMORY && !locked) {
+            persistMutex.Lock();
+            locked = true;
+        }
+        // Remove from the persistence.
+        if (shadow.type == STORAGE_TYPE_PERSIST && dataSpace && metaSpace) {
+            dataSpace->Deallocate(shadow.dataAddress);
+            metaSpace->Deallocate(shadow.metaAddress);
+        }
+        // Remove a recovered message, its shadow is in the backup space.
+        if (shadow.type == STORAGE_TYPE_RECOVERED && dataSpace && backupSpace) {
+            dataSpace->Deallocate(shadow.dataAddress);
+            backupSpace->Deallocate(shadow.metaAddress);
+        }
+        // Remove a staged message, it is deleted by the committer if it is still pending.
+        if (shadow.type == STORAGE_TYPE_STAGED) {
+            auto *stage = (PersistStage *) shadow.metaAddress;
+            if (stage->state == STAGE_PENDING) {
+                stage->removed = true;
+                continue;
+            }
+            if (stage->state == STAGE_COMMITTED && dataSpace && metaSpace) {
+                dataSpace->Deallocate(stage->shadow.dataAddress);
+                metaSpace->Deallocate(stage->shadow.metaAddress);
+            }
+            UnlinkStage(stage);
+            free(stage->record);
+            delete stage;
+        }
+        // Remove from the memory.
+        if (shadow.type == STORAGE_TYPE_MEMORY) {
+            auto *ptr = (TMQMsg *) shadow.metaAddress;
+            delete ptr;
+        }
+    }
+    if (locked) {
+        persistMutex.UnLock();
     }
     return true;
 }
 
 /*
- * Find the shadow list from backup space.
+ * Find the shadow list from backup space. The records carry the topic names, the topics are
+ * registered here, so that the found shadows can be queued with their topic ids.
  */
 void TMQStorage::FindShadows(const char **topics, int len, List<Shadow> &shadowList, int limit) {
     // Parameters invalid, return quickly.
@@ -161,17 +586,30 @@ void TMQStorage::FindShadows(const char **topics, int len, List<Shadow> &shadowL
         return;
     }
     List<MetaAlloc> allocList;
-    // Construct a local watcher by topics and its length.
-    Watcher localWatcher(topics, len, false);
+    // Construct a local watcher by the ids of topics.
+    auto *topicIds = new TMQTopicId[len];
+    for (int i = 0; i < len; ++i) {
+        topicIds[i] = TMQTopicRegistry::GetInstance()->Intern(topics[i]);
+    }
+    Watcher localWatcher(topicIds, len);
+    delete[] topicIds;
     persistMutex.Lock();
     // Get all allocation list, and save to allocList
     if (backupSpace->GetAllocList(allocList)) {
         for (int i = 0; i < allocList.Size(); ++i) {
-            Shadow shadow;
+            PersistShadow record;
             // Read and check the topic, if it is a topic message we need, add it into the
             // shadowList.
-            backupSpace->Read(allocList.Get(i).address, &shadow, sizeof(Shadow));
-            if (localWatcher.Contains(shadow.topic)) {
+            backupSpace->Read(allocList.Get(i).address, &record, sizeof(PersistShadow));
+            record.topic[TMQ_TOPIC_MAX_LENGTH - 1] = 0;
+            TMQTopicId topicId = TMQTopicRegistry::GetInstance()->Find(record.topic);
+            if (record.type == STORAGE_TYPE_PERSIST && topicId != ID_INT_INVALID
+                && localWatcher.Contains(topicId)) {
+                // The meta address of the record is the one in the meta space of its run.
+                Shadow shadow = record.ToShadow(topicId);
+                shadow.type = STORAGE_TYPE_RECOVERED;
+                shadow.metaAddress = allocList.Get(i).address;
+                shadow.flag = CLEAR_PERSIST_BITS(shadow.flag);
                 shadowList.Add(shadow);
             }
             // Check whether the shadowList reaches to the limit. If reached, stop the loop, and
@@ -183,3 +621,256 @@ void TMQStorage::FindShadows(const char **topics, int len, List<Shadow> &shadowL
     }
     persistMutex.UnLock();
 }
+
+/*
+ * Set the consumed mark in place of a persisted shadow, a marked one is not written again.
+ */
+void TMQStorage::MarkRecord(ISectionSpace *space, TMQAddress address) {
+    PersistShadow record;
+    if (space->Read(address, &record, sizeof(PersistShadow)) == sizeof(PersistShadow)
+        && !IS_CONSUMED(record.flag)) {
+        record.flag = PERSIST_CONSUMED(record.flag);
+        space->Write(address, &record, sizeof(PersistShadow));
+    }
+}
+
+/*
+ * Mark a consumed message by its storage type, a pending staged message is marked on committing.
+ * The mark is synchronized with the messages written later.
+ */
+void TMQStorage::MarkConsumed(const Shadow &shadow) {
+    if (shadow.type != STORAGE_TYPE_PERSIST && shadow.type != STORAGE_TYPE_STAGED
+        && shadow.type != STORAGE_TYPE_RECOVERED) {
+        return;
+    }
+    persistMutex.Lock();
+    if (shadow.type == STORAGE_TYPE_PERSIST && metaSpace) {
+        MarkRecord(metaSpace, shadow.metaAddress);
+    }
+    if (shadow.type == STORAGE_TYPE_RECOVERED && backupSpace) {
+        MarkRecord(backupSpace, shadow.metaAddress);
+    }
+    if (shadow.type == STORAGE_TYPE_STAGED) {
+        auto *stage = (PersistStage *) shadow.metaAddress;
+        if (stage->state == STAGE_PENDING) {
+            stage->consumed = true;
+        } else if (stage->state == STAGE_COMMITTED && metaSpace) {
+            MarkRecord(metaSpace, stage->shadow.metaAddress);
+        }
+    }
+    persistMutex.UnLock();
+}
+
+/*
+ * Recover the backup records. Four key steps:
+ * 1. Validate the records in parallel, the records validated by the last recovery are trusted.
+ * 2. Remove the invalid records, the data is removed only if it is the record of the message.
+ * 3. Keep the valid ones in the order of the message ids, and raise the message ids past them, so
+ *  the ids of the messages written later are larger than all of them.
+ * 4. Save the checkpoint for the next recovery.
+ */
+void TMQStorage::Recover() {
+    recovered.Clear();
+    RecoveryCheckpoint checkpoint;
+    ReadCheckpoint(checkpoint);
+    LazyLinearList<SecAlloc> *backupAllocs = ((SectionSpace *) backupSpace)->GetLazyAllocList(
+            LAZY_RESERVE_READ);
+    if (backupAllocs == nullptr) {
+        return;
+    }
+    List<Shadow> invalid;
+    ValidateBackup(checkpoint, (TMQSize) backupAllocs->GetSize(), invalid);
+    for (int i = 0; i < invalid.Size(); ++i) {
+        dataSpace->Deallocate(invalid.Get(i).dataAddress);
+        backupSpace->Deallocate(invalid.Get(i).metaAddress);
+    }
+    TMQMsgId maxMsgId = checkpoint.maxMsgId;
+    if (!recovered.Empty()) {
+        auto *sorted = (RecoveredShadow *) malloc(recovered.Size() * sizeof(RecoveredShadow));
+        for (int i = 0; i < recovered.Size(); ++i) {
+            sorted[i] = recovered.Get(i);
+        }
+        qsort(sorted, recovered.Size(), sizeof(RecoveredShadow), CompareRecovered);
+        for (int i = 0; i < recovered.Size(); ++i) {
+            recovered.Set(i, sorted[i]);
+        }
+        TMQMsgId last = sorted[recovered.Size() - 1].shadow.msgId;
+        maxMsgId = last > maxMsgId ? last : maxMsgId;
+        free(sorted);
+    }
+    IDGenerator::GetInstance()->RaiseMsgId(maxMsgId);
+    backupAllocs = ((SectionSpace *) backupSpace)->GetLazyAllocList(LAZY_RESERVE_READ);
+    RecoveryCheckpoint saved = {CHECKPOINT_MAGIC,
+                                backupAllocs ? (TMQSize) backupAllocs->GetSize() : 0, maxMsgId};
+    WriteCheckpoint(saved);
+}
+
+/*
+ * Split the backup allocations into ranges for the workers, the caller validates the first range
+ * itself. The workers are started only if the page space can be read concurrently. The records
+ * deferred by the workers are validated through the data space at last.
+ */
+void TMQStorage::ValidateBackup(const RecoveryCheckpoint &checkpoint, TMQSize count,
+                                List<Shadow> &invalid) {
+    LazyLinearList<SecAlloc> *backupAllocs = ((SectionSpace *) backupSpace)->GetLazyAllocList(
+            LAZY_RESERVE_READ);
+    LazyLinearList<SecAlloc> *dataAllocs = ((SectionSpace *) dataSpace)->GetLazyAllocList(
+            LAZY_RESERVE_READ);
+    if (count == 0 || backupAllocs == nullptr || dataAllocs == nullptr) {
+        return;
+    }
+    IPageSpace *pageSpace = persist->GetPageSpace();
+    int workerCount = (int) (count / RECOVER_WORKER_RECORDS);
+    workerCount = workerCount < RECOVER_WORKER_MAX ? workerCount : RECOVER_WORKER_MAX;
+    if (workerCount < 1 || (workerCount > 1 && !pageSpace->PrepareConcurrentRead())) {
+        workerCount = 1;
+    }
+    TMQCondition finished;
+    int running = workerCount;
+    long range = ((long) count + workerCount - 1) / workerCount;
+    auto *workers = new RecoveryWorker[workerCount];
+    ThreadExecutor *executors[RECOVER_WORKER_MAX]{nullptr};
+    for (int i = 0; i < workerCount; ++i) {
+        RecoveryWorker &worker = workers[i];
+        worker.pageSpace = pageSpace;
+        worker.backupAllocs = *backupAllocs;
+        worker.dataAllocs = *dataAllocs;
+        worker.start = range * i;
+        worker.end = range * (i + 1) < (long) count ? range * (i + 1) : (long) count;
+        worker.checkpoint = checkpoint;
+        worker.finished = &finished;
+        worker.running = &running;
+        if (i > 0) {
+            executors[i] = new ThreadExecutor(&worker);
+            executors[i]->Wakeup();
+        }
+    }
+    workers[0].OnExecute(0);
+    finished.Lock();
+    while (running > 0) {
+        finished.Wait();
+    }
+    finished.UnLock();
+    for (int i = 0; i < workerCount; ++i) {
+        delete executors[i];
+        RecoveryWorker &worker = workers[i];
+        for (int j = 0; j < worker.results.Size(); ++j) {
+            recovered.Add(worker.results.Get(j));
+        }
+        for (int j = 0; j < worker.invalid.Size(); ++j) {
+            invalid.Add(worker.invalid.Get(j));
+        }
+        for (int j = 0; j < worker.deferred.Size(); ++j) {
+            RecoveredShadow &found = worker.deferred.Get(j);
+            TMQMsg msg;
+            if (ReadRecord(found.shadow, msg)) {
+                recovered.Add(found);
+            } else {
+                found.shadow.dataAddress = ADDRESS_NULL;
+                invalid.Add(found.shadow);
+            }
+        }
+    }
+    delete[] workers;
+}
+
+/*
+ * The checkpoint is the only allocation of the checkpoint space.
+ */
+void TMQStorage::ReadCheckpoint(RecoveryCheckpoint &checkpoint) {
+    List<MetaAlloc> allocList;
+    if (checkpointSpace && checkpointSpace->GetAllocList(allocList) && !allocList.Empty()
+        && checkpointSpace->Read(allocList.Get(0).address, &checkpoint, sizeof(RecoveryCheckpoint))
+           == sizeof(RecoveryCheckpoint) && checkpoint.magic == CHECKPOINT_MAGIC) {
+        return;
+    }
+    memset(&checkpoint, 0, sizeof(RecoveryCheckpoint));
+}
+
+/*
+ * Overwrite the checkpoint, it is allocated at the first time.
+ */
+void TMQStorage::WriteCheckpoint(const RecoveryCheckpoint &checkpoint) {
+    List<MetaAlloc> allocList;
+    if (!checkpointSpace || !checkpointSpace->GetAllocList(allocList)) {
+        return;
+    }
+    TMQAddress address = allocList.Empty() ? checkpointSpace->Allocate(sizeof(RecoveryCheckpoint))
+                                           : allocList.Get(0).address;
+    checkpointSpace->Write(address, (void *) &checkpoint, sizeof(RecoveryCheckpoint));
+}
+
+/*
+ * Move the recovered messages to the caller.
+ */
+void TMQStorage::TakeRecovered(List<RecoveredShadow> &shadows) {
+    persistMutex.Lock();
+    for (int i = 0; i < recovered.Size(); ++i) {
+        shadows.Add(recovered.Get(i));
+    }
+    recovered.Clear();
+    persistMutex.UnLock();
+}
+
+/*
+ * Validate the records one by one. A record is read from the page space directly if its data
+ * allocation is found at its index, otherwise it is deferred. The data of an invalid record is
+ * removed only if the record belongs to the message, a broken shadow may point to others.
+ */
+bool RecoveryWorker::OnExecute(long eid) {
+    for (long i = start; i < end; ++i) {
+        SecAlloc alloc = backupAllocs.Get(i);
+        PersistShadow record;
+        if (alloc.state != ADDRESS_ALLOC
+            || pageSpace->Read(PAGE(alloc.address), OFFSET(alloc.address), &record,
+                               sizeof(PersistShadow)) != sizeof(PersistShadow)
+            || record.type != STORAGE_TYPE_PERSIST) {
+            continue;
+        }
+        record.topic[TMQ_TOPIC_MAX_LENGTH - 1] = 0;
+        RecoveredShadow found;
+        found.shadow = record.ToShadow(TMQTopicRegistry::GetInstance()->Intern(record.topic));
+        found.shadow.type = STORAGE_TYPE_RECOVERED;
+        found.shadow.metaAddress = alloc.secAddress;
+        found.shadow.flag = CLEAR_PERSIST_BITS(record.flag);
+        found.priority = GET_PERSIST_PRIORITY(record.flag);
+        found.consumed = IS_CONSUMED(record.flag) != 0;
+        if (found.shadow.topicId == ID_INT_INVALID) {
+            found.shadow.dataAddress = ADDRESS_NULL;
+            invalid.Add(found.shadow);
+            continue;
+        }
+        if (i < (long) checkpoint.count && record.msgId <= checkpoint.maxMsgId) {
+            results.Add(found);
+            continue;
+        }
+        SecAlloc dataAlloc = dataAllocs.Get(SECTION_INDEX(record.dataAddress));
+        if (dataAlloc.secAddress != record.dataAddress) {
+            deferred.Add(found);
+            continue;
+        }
+        long recordLen = (long) sizeof(PersistRecord) + (long) record.length;
+        PersistRecord *data = nullptr;
+        long len = -1;
+        if (dataAlloc.state == ADDRESS_ALLOC && recordLen <= (long) dataAlloc.size) {
+            data = (PersistRecord *) malloc(recordLen);
+            len = pageSpace->Read(PAGE(dataAlloc.address), OFFSET(dataAlloc.address), data,
+                                  (int) recordLen);
+        }
+        if (data && CheckRecord(data, len, found.shadow)) {
+            results.Add(found);
+        } else {
+            if (!data || len != recordLen || data->magic != RECORD_MAGIC
+                || data->msgId != record.msgId) {
+                found.shadow.dataAddress = ADDRESS_NULL;
+            }
+            invalid.Add(found.shadow);
+        }
+        free(data);
+    }
+    finished->Lock();
+    (*running)--;
+    finished->Broadcast();
+    finished->UnLock();
+    return false;
+}
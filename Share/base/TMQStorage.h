@@ -15,6 +15,10 @@
 #include "RWMutex.h"
 #include "Ordered.h"
 #include "Shadow.h"
+#include "List.h"
+#include "ThreadExecutor.h"
+#include "TMQSettings.h"
+#include "TMQCondition.h"
 
 /// Const definitions
 // data persistent section
@@ -25,6 +29,143 @@
 #define SECTION_META           "META"
 // backup persistent section
 #define SECTION_BACKUP         "BACKUP"
+// checkpoint persistent section, refer RecoveryCheckpoint
+#define SECTION_CHECKPOINT     "CHECKPOINT"
+// The magic of a binary record, the byte 0xFF never appears in the Base64 data of early versions.
+#define RECORD_MAGIC           0xFF514D54
+// The default period in milliseconds of the periodic synchronization.
+#define PERSIST_SYNC_PERIOD    1000
+// The magic of the recovery checkpoint.
+#define CHECKPOINT_MAGIC       0xFF514350
+// The max count of the workers validating the backup records on recovery, including the caller.
+#define RECOVER_WORKER_MAX     4
+// The min count of the backup records for each worker, fewer records are not worth a thread.
+#define RECOVER_WORKER_RECORDS 4096
+/// Setting keys of the durability, a key followed by ":{topic}" is the setting for one topic, which
+/// overrides the setting for all topics.
+// The durability level of the persistent messages, refer TMQ_DURABILITY_XXX, TMQ_DURABILITY_BATCH
+// by default.
+#define KEY_PERSIST_DURABILITY "PERSIST_DURABILITY"
+// The period in milliseconds of the periodic synchronization, for all topics only.
+#define KEY_PERSIST_SYNC_PERIOD "PERSIST_SYNC_PERIOD"
+
+/**
+ * The header of a message record in the data space, followed by the binary data of the message.
+ * The checksum is the CRC32C of the header from msgId and the data, refer TMQCrc32.
+ */
+class PersistRecord {
+public:
+    // RECORD_MAGIC.
+    unsigned int magic;
+    // The checksum of the record.
+    unsigned int crc;
+    // The id of the message.
+    TMQMsgId msgId;
+    // The length of the data.
+    int length;
+    // The flag of the message.
+    int flag;
+};
+
+/// The states of a staged message.
+// Waiting for the committer.
+#define STAGE_PENDING          0
+// Committed to the section spaces.
+#define STAGE_COMMITTED        1
+// Failed to commit, kept in memory.
+#define STAGE_FAILED           2
+
+/**
+ * A persistent message staged for the committer, the shadow of the message points to it. It keeps
+ * the packed record until it is committed, then the addresses of the record in the section spaces.
+ * It is modified with the persist mutex held.
+ */
+class PersistStage {
+public:
+    // The shadow of the message, with the addresses in the section spaces once committed.
+    Shadow shadow;
+    // The packed record, nullptr once committed.
+    PersistRecord *record;
+    // The listener for the durability, nullptr for none.
+    TMQDurableListener *listener;
+    // The state, refer STAGE_XXX.
+    int state;
+    // Whether the message is removed before it is committed, the committer deletes it then.
+    bool removed;
+    // Whether the message is consumed before it is committed.
+    bool consumed;
+    // The priority of the message, kept in the flag of the persisted shadow.
+    int priority;
+    // The neighbours in the list of the committed or failed stages, owned by the storage.
+    PersistStage *prev;
+    PersistStage *next;
+};
+
+/**
+ * The notification of the durability of a message, called after the persist mutex is released.
+ */
+class DurableNotice {
+public:
+    // The listener to call.
+    TMQDurableListener *listener;
+    // The id of the message.
+    TMQMsgId msgId;
+    // Whether the message is durable.
+    bool durable;
+};
+
+/**
+ * The checkpoint of the recovery saved in the checkpoint section. The message ids are raised past
+ * the recovered ones, so a backup record before the count with an id not larger than the max id
+ * is validated by the last recovery, the records appended after it are validated only.
+ */
+class RecoveryCheckpoint {
+public:
+    // CHECKPOINT_MAGIC.
+    unsigned int magic;
+    // The count of the backup allocations after the last recovery.
+    TMQSize count;
+    // The max id of the messages after the last recovery.
+    TMQMsgId maxMsgId;
+};
+
+/**
+ * A worker validating a range of the backup records on recovery. The workers read the page space
+ * without the persist mutex, the page space is prepared for the concurrent reading, and nothing is
+ * written until all workers finish.
+ */
+class RecoveryWorker : public TMQCallable {
+public:
+    // The page space of the persistence.
+    IPageSpace *pageSpace;
+    // The allocations of the backup space.
+    LazyLinearList<SecAlloc> backupAllocs;
+    // The allocations of the data space.
+    LazyLinearList<SecAlloc> dataAllocs;
+    // The range of the backup allocations, [start, end).
+    long start;
+    long end;
+    // The checkpoint of the last recovery.
+    RecoveryCheckpoint checkpoint;
+    // The valid messages.
+    List<RecoveredShadow> results;
+    // The messages with invalid records.
+    List<Shadow> invalid;
+    // The messages whose data allocations are moved, they are validated by the storage.
+    List<RecoveredShadow> deferred;
+    // The condition notified when a worker finishes, shared by the workers.
+    TMQCondition *finished;
+    // The count of the running workers, guarded by the condition.
+    int *running;
+
+public:
+    /**
+     * Validate the records in the range, and notify the finish.
+     * @param eid, the id of the executor.
+     * @return false, the worker runs once.
+     */
+    bool OnExecute(long eid) override;
+};
 
 /**
  * TMQStorage is a mix storage implementation for IStorage. It can save tmq message to a file called
@@ -44,12 +185,29 @@
  * information.
  *
  * On persistence, TMQStorage will create three section space: dataSpace, metaSpace, and backupSpace.
- * The dataSpace is used to save the binary data of a tmq message. The metaSpace is used to save the
- * base meta information of the tmq message. Well, the backupSpace is a special section space used
- * to record the lost messages, which are not dispatched or picked on time. Such as power down
- * during game running.
+ * The dataSpace is used to save the binary data of a tmq message, as a PersistRecord followed by
+ * the raw data. The early versions saved the data in Base64, they are rewritten on enabling. The
+ * metaSpace is used to save the base meta information of the tmq message. Well, the backupSpace is
+ * a special section space used to record the lost messages, which are not dispatched or picked on
+ * time. Such as power down during game running.
+ *
+ * On enabling, the backup records are recovered: the records are validated by parallel workers,
+ * the invalid ones are removed, and the others are kept in the order of the message ids for the
+ * topic to take. A checkpoint is saved after the recovery, the next recovery validates the records
+ * appended after it only. The priority and the consumed mark of a message are kept in the flag of
+ * its persisted shadow, so the consumed messages are recovered into the history.
+ *
+ * The persistent messages are written ahead by group commit. A writer packs the record and stages
+ * it under a light mutex, then returns its shadow at once. The committer thread takes all staged
+ * messages, writes them into the section spaces with the persist mutex held once, and synchronizes
+ * the file once for the batch. A staged message is read from its record before it is committed.
+ *
+ * The synchronization depends on the durability level of the messages, refer TMQ_DURABILITY_XXX. A
+ * batch with any message of TMQ_DURABILITY_BATCH is synchronized at once. Otherwise the messages of
+ * TMQ_DURABILITY_PERIODIC are synchronized by the committer after the period, and the messages of
+ * TMQ_DURABILITY_NONE are left to the system. The file space synchronizes the written ranges only.
  */
-class TMQStorage : public IStorage {
+class TMQStorage : public IStorage, public TMQCallable {
 private:
     // The pointer to the persistence implementation.
     Persistence *persist;
@@ -61,6 +219,99 @@ private:
     ISectionSpace *metaSpace;
     // The ISectionSpace pointer to BACKUP section space, using to record lost messages at last time.
     ISectionSpace *backupSpace;
+    // The mutex for the staged messages.
+    TMQMutex stageMutex;
+    // The messages staged for the committer, in writing order.
+    List<PersistStage *> staged;
+    // The committer thread, created on enabling the persistence.
+    ThreadExecutor *committer;
+    // The head of the committed or failed stages which are not removed, freed on destruction.
+    PersistStage *stages;
+    // Whether there are written messages waiting for the periodic synchronization.
+    bool periodicDirty;
+    // The time in milliseconds of the last synchronization.
+    long long lastSync;
+    // The period in milliseconds of the periodic synchronization, read on each commit.
+    long syncPeriod;
+    // The statistics of the synchronizations since the persistence is enabled.
+    TMQSyncStats syncStats;
+    // The ISectionSpace pointer to CHECKPOINT section space, using to save the recovery checkpoint.
+    ISectionSpace *checkpointSpace;
+    // The messages recovered on enabling, until they are taken.
+    List<RecoveredShadow> recovered;
+
+private:
+    /**
+     * Rewrite the Base64 data of the backup messages saved by the early versions into records.
+     * persistMutex should be held by the caller.
+     */
+    void MigrateRecords();
+
+    /**
+     * Read the record of a persistent message from the data space, and check it. msg shares the
+     * buffer of the record, the payload is not copied again.
+     * @param shadow, the shadow with the address of the record.
+     * @param msg, a reference for the tmq message.
+     * @return true if the record is valid.
+     */
+    bool ReadRecord(const Shadow &shadow, TMQMsg &msg);
+
+    /**
+     * Commit a batch of staged messages, and notify their listeners.
+     * @param batch, the staged messages.
+     */
+    void Commit(List<PersistStage *> &batch);
+
+    /**
+     * Add a committed or failed stage to the list, persistMutex should be held by the caller.
+     * @param stage, the stage to add.
+     */
+    void LinkStage(PersistStage *stage);
+
+    /**
+     * Remove a stage from the list, persistMutex should be held by the caller.
+     * @param stage, the stage to remove.
+     */
+    void UnlinkStage(PersistStage *stage);
+
+    /**
+     * Synchronize the file space and record the latency, persistMutex should be held by the caller.
+     * @return true if the synchronization is success.
+     */
+    bool SyncSpace();
+
+    /**
+     * Recover the backup records, persistMutex should be held by the caller.
+     */
+    void Recover();
+
+    /**
+     * Validate the records of the backup allocations in parallel.
+     * @param checkpoint, the checkpoint of the last recovery.
+     * @param count, the count of the backup allocations.
+     * @param invalid, the list to receive the messages with invalid records.
+     */
+    void ValidateBackup(const RecoveryCheckpoint &checkpoint, TMQSize count, List<Shadow> &invalid);
+
+    /**
+     * Read the checkpoint of the last recovery.
+     * @param checkpoint, a reference to receive the checkpoint, zero if there is none.
+     */
+    void ReadCheckpoint(RecoveryCheckpoint &checkpoint);
+
+    /**
+     * Save the checkpoint of this recovery.
+     * @param checkpoint, the checkpoint to save.
+     */
+    void WriteCheckpoint(const RecoveryCheckpoint &checkpoint);
+
+    /**
+     * Set the consumed mark in the flag of a persisted shadow, persistMutex should be held by the
+     * caller.
+     * @param space, the section space of the shadow, metaSpace or backupSpace.
+     * @param address, the address of the shadow in the space.
+     */
+    static void MarkRecord(ISectionSpace *space, TMQAddress address);
 
 public:
     /**
@@ -81,16 +332,39 @@ public:
      * function will create a new file first, if the enable is false, file parameter is valid, or
      * persist is not nullptr, this function will drop all section and erase all data. You can set
      * the enable parameter to true and invoke multiply, but be careful of disable.
+     * @return whether the persistence is enabled after the call.
      */
-    void EnablePersist(bool enable, const char *file);
+    virtual bool EnablePersist(bool enable, const char *file);
 
     /**
      * Save tmq message to the storage and return the shadow of this message.
-     * @param topic, a pointer to the message topic.
+     * @param topicId, the id of the message topic.
+     * @param msg, the tmq message to write.
+     * @return Shadow, the shadow of the tmq message to be written.
+     */
+    virtual Shadow Write(TMQTopicId topicId, const TMQMsg &msg);
+
+    /**
+     * Save tmq message with a message id to the storage and return the shadow of this message.
+     * @param topicId, the id of the message topic.
+     * @param msg, the tmq message to write.
+     * @param msgId, the id for the message, reserved by IDGenerator.
+     * @return Shadow, the shadow of the tmq message to be written.
+     */
+    virtual Shadow Write(TMQTopicId topicId, const TMQMsg &msg, TMQMsgId msgId);
+
+    /**
+     * Save tmq message with a message id and a durable listener. A persistent message is staged
+     * for the committer, the listener is notified after it is committed. A message with a listener
+     * is persistent whatever its flag is.
+     * @param topicId, the id of the message topic.
      * @param msg, the tmq message to write.
+     * @param msgId, the id for the message, reserved by IDGenerator.
+     * @param listener, the listener for the durability, nullptr for none.
      * @return Shadow, the shadow of the tmq message to be written.
      */
-    virtual Shadow Write(const char *topic, const TMQMsg &msg);
+    virtual Shadow Write(TMQTopicId topicId, const TMQMsg &msg, TMQMsgId msgId,
+                         TMQDurableListener *listener);
 
     /**
      * Read a tmq message with the message shadow. True will be returned if success.
@@ -107,10 +381,31 @@ public:
      */
     virtual bool Remove(const Shadow &store);
 
+    /**
+     * Remove a batch of tmq messages, the persist mutex is locked once for all of them.
+     * @param stores, the shadows of the tmq messages.
+     * @param count, the count of the shadows.
+     * @return, a boolean value indicate whether it is success or not.
+     */
+    virtual bool Remove(const Shadow *stores, int count);
+
+    /**
+     * Mark a tmq message consumed, the consumed mark is kept in the flag of its persisted shadow.
+     * @param store, the shadow of the tmq message.
+     */
+    virtual void MarkConsumed(const Shadow &store);
+
+    /**
+     * Take the messages recovered on enabling, they are taken once.
+     * @param shadows, the list to receive the messages, in the order of the message ids.
+     */
+    virtual void TakeRecovered(List<RecoveredShadow> &shadows);
+
     /**
      * Find shadow list by topics with the amount limit. Attentions, FindShadows will search
      * messages from backupSpace, that means we can get the shadows which are not picked or
-     * dispatched timely on the next startup.
+     * dispatched timely on the next startup. The shadows are STORAGE_TYPE_RECOVERED, they are
+     * taken by TakeRecovered as well.
      * @param topics, the pointer to topics pointer.
      * @param len, the length of the topics.
      * @param shadowList, the list for store the found results.
@@ -120,6 +415,38 @@ public:
      */
     virtual void
     FindShadows(const char **topics, int len, List<Shadow> &shadowList, int limit = -1);
+
+    /**
+     * Commit all staged messages, called by the committer.
+     * @param eid, the id of the executor.
+     * @return false, the committer is waked by the next staged message.
+     */
+    bool OnExecute(long eid) override;
+
+    /**
+     * The delay before the periodic synchronization.
+     * @return the milliseconds left in the period, at least 1.
+     */
+    long GetRecallDelay() override;
+
+    /**
+     * Get the statistics of the synchronizations.
+     * @param stats, a reference to receive the statistics.
+     * @return false if the persistence is not enabled.
+     */
+    virtual bool GetSyncStats(TMQSyncStats &stats);
+
+    /**
+     * Get the durability level of a persistent message, a message with a listener is synchronized
+     * with its batch.
+     * @param topicId, the id of the message topic.
+     * @param flag, the flag of the message.
+     * @param listener, the listener for the durability, nullptr for none.
+     * @param snapshot, the snapshot of the settings.
+     * @return the durability level, refer TMQ_DURABILITY_XXX.
+     */
+    static int GetDurability(TMQTopicId topicId, int flag, TMQDurableListener *listener,
+                             TMQ::TMQSettingsSnapshot *snapshot);
 };
 
 
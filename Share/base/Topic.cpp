@@ -7,6 +7,7 @@
 //
 
 #include "Topic.h"
+#include "TMQLogStorage.h"
 #include "TMQFactory.h"
 #include "TMQDispatcher.h"
 #include "TMQC.h"
@@ -15,19 +16,53 @@
 #include "TMQPicker.h"
 #include "IDGenerator.h"
 #include "TMQSettings.h"
+#include "TMQTopicRegistry.h"
+#include "TMQUtils.h"
+#include "Atomic.h"
 #include <cstring>
 
 #define KEY_TMQ_VERSION     "tmq_version"
 
 USING_TMQ_NAMESPACE
 
+// The error of the last publish on the current thread.
+static thread_local int lastError = TMQ_ERROR_NONE;
+
+/**
+ * The messages of one topic in a batch, admitted by the limit of the topic at once.
+ */
+class BatchAdmit {
+public:
+    // The queues of the topic.
+    TopicQueues *queues;
+    // The count of the messages.
+    int count;
+    // The bytes of the messages.
+    long long size;
+
+public:
+    /**
+     * Construct an admit of a topic without messages.
+     * @param queues, the queues of the topic.
+     */
+    explicit BatchAdmit(TopicQueues *queues = nullptr) : queues(queues), count(0), size(0) {
+    }
+};
+
 /*
- * Init the base members.
+ * Init the base members, the storage is created by the engine in the settings.
  * In order to record the version of the tmq, we put it into the settings, so that all modules can
  * achieve the tmq version easily.
  */
 Topic::Topic() {
-    storage = new TMQStorage();
+    TMQSettingsSnapshot *snapshot = TMQSettings::GetInstance()->Acquire();
+    int engine = snapshot->GetInt(KEY_STORAGE_ENGINE, TMQ_STORAGE_MAPPED);
+    snapshot->Release();
+    if (engine == TMQ_STORAGE_LOG) {
+        storage = new TMQLogStorage();
+    } else {
+        storage = new TMQStorage();
+    }
     history = new TMQHistory(storage);
     dispatcher = new TMQDispatcher(this);
     TMQSettings::GetInstance()->Put(KEY_TMQ_VERSION, TMQ_VERSION);
@@ -38,8 +73,9 @@ Topic::Topic() {
  */
 Topic::~Topic() {
     delete dispatcher;
-    delete storage;
+    // The history removes the evicted messages from the storage until it is deleted.
     delete history;
+    delete storage;
 }
 
 /*
@@ -53,15 +89,51 @@ TMQMsgId Topic::Publish(const char *topic, void *data, int length, int flag, int
 }
 
 /*
- * Publish a tmq message. Four key steps:
+ * Wrap the binary data into a buffer without copy, and publish it as a tmq message. The buffer is
+ * released by tmqMsg at last, so the data will be freed if it is not kept by storage.
+ */
+TMQMsgId Topic::PublishOwned(const char *topic, void *data, int length, int flag, int priority) {
+    TMQBuffer *buffer = TMQBuffer::Wrap(data, length);
+    if (buffer == nullptr) {
+        // Invalid data, release it as the ownership has been transferred.
+        delete[] (char *) data;
+        lastError = TMQ_ERROR_INVALID;
+        return ID_LONG_INVALID;
+    }
+    TMQMsg tmqMsg(buffer);
+    buffer->Release();
+    tmqMsg.flag = flag;
+    tmqMsg.priority = priority;
+    return Publish(topic, tmqMsg);
+}
+
+/*
+ * Publish a tmq message, without a durable listener. Five key steps:
  * 1. Parse and save settings, if the topic is TOPIC_SETTINGS
- * 2. Write the TMQMsg into storage and achieve the shadow.
- * 3. Enqueue TMQMsg into the priority rc queues.
- * 4. Wakeup the dispatcher if it is not pick only message.
+ * 2. Admit the message by the limit of the topic, it may block, drop or reject.
+ * 3. Write the TMQMsg into storage and achieve the shadow, the topic is carried by its id.
+ * 4. Enqueue TMQMsg into the priority rc queues of the topic.
+ * 5. Wakeup the dispatcher if it is not pick only message.
  */
 TMQMsgId Topic::Publish(const char *topic, const TMQMsg &tmqMsg) {
+    return publish(topic, tmqMsg, nullptr);
+}
+
+/*
+ * Publish a tmq message persistently with a durable listener.
+ */
+TMQMsgId Topic::PublishDurable(const char *topic, const TMQMsg &tmqMsg,
+                               TMQDurableListener *listener) {
+    return publish(topic, tmqMsg, listener);
+}
+
+/*
+ * Publish a tmq message with a durable listener, refer Publish for the key steps.
+ */
+TMQMsgId Topic::publish(const char *topic, const TMQMsg &tmqMsg, TMQDurableListener *listener) {
+    lastError = TMQ_ERROR_INVALID;
     // Check the topic
-    if (topic == nullptr || strlen(topic) == 0 || strlen(topic) > TMQ_TOPIC_MAX_LENGTH) {
+    if (!isValidTopic(topic)) {
         return ID_LONG_INVALID;
     }
     // Check the TMQMsg.
@@ -71,15 +143,33 @@ TMQMsgId Topic::Publish(const char *topic, const TMQMsg &tmqMsg) {
     // Check the topic is TOPIC_SETTINGS or not.
     if (strncmp(topic, TOPIC_SETTINGS, strlen(TOPIC_SETTINGS)) == 0) {
         TMQSettings::Parse(static_cast<const char *>(tmqMsg.data), tmqMsg.length);
+        lastError = TMQ_ERROR_NONE;
+        return ID_LONG_INVALID;
+    }
+    // Find or create the queues of the topic.
+    TMQTopicId topicId = TMQTopicRegistry::GetInstance()->Intern(topic);
+    TopicQueues *queues = topicQueues.Obtain(topicId);
+    if (queues == nullptr) {
+        return ID_LONG_INVALID;
+    }
+    // Admit the message before writing, a rejected message is never stored.
+    lastError = admitMessages(queues, 1, tmqMsg.length);
+    if (lastError != TMQ_ERROR_NONE) {
         return ID_LONG_INVALID;
     }
     // Write the tmq message to storage
-    Shadow msgShadow = storage->Write(topic, tmqMsg);
+    Shadow msgShadow = storage->Write(topicId, tmqMsg, IDGenerator::GetInstance()->GetMsgId(),
+                                      listener);
     if (GET_MSG_TYPE(msgShadow.flag) == 0) {
         msgShadow.flag = FORCE_TYPE_ALL(msgShadow.flag);
     }
+    // The stored length is released by the picker, it differs from the message if it is encoded.
+    if (msgShadow.length != (TMQSize) tmqMsg.length) {
+        queues->Accept(0, (long long) msgShadow.length - tmqMsg.length);
+    }
     // Enqueue shadow of this message into priority queues.
-    FindQueue(tmqMsg.priority)->Enqueue(msgShadow);
+    queues->FindQueue(tmqMsg.priority)->Enqueue(msgShadow);
+    topicQueues.MarkPending(queues, tmqMsg.priority);
     if (msgShadow.flag != TMQ_MSG_TYPE_PICK) {
         // Wake up the dispatcher if necessary.
         dispatcher->Wakeup();
@@ -87,6 +177,263 @@ TMQMsgId Topic::Publish(const char *topic, const TMQMsg &tmqMsg) {
     return msgShadow.msgId;
 }
 
+/*
+ * Publish a batch of tmq messages with the same topic.
+ */
+TMQMsgId Topic::PublishBatch(const char *topic, const TMQMsg *msgs, int n) {
+    return publishBatch(topic, nullptr, msgs, n);
+}
+
+/*
+ * Publish a batch of tmq messages with their own topics.
+ */
+TMQMsgId Topic::PublishBatch(const char **topics, const TMQMsg *msgs, int n) {
+    if (topics == nullptr) {
+        lastError = TMQ_ERROR_INVALID;
+        return ID_LONG_INVALID;
+    }
+    return publishBatch(nullptr, topics, msgs, n);
+}
+
+/*
+ * Set the order key of the topic queues, FNV-1a hash of the key, or the topic id for reset.
+ */
+bool Topic::SetOrderingKey(const char *topic, const char *key) {
+    TopicQueues *queues = topicQueues.Obtain(TMQTopicRegistry::GetInstance()->Intern(topic));
+    if (queues == nullptr) {
+        return false;
+    }
+    TMQSize orderKey = (TMQSize) queues->topicId;
+    if (key != nullptr) {
+        orderKey = 2166136261u;
+        for (const char *c = key; *c; ++c) {
+            orderKey = (orderKey ^ (unsigned char) *c) * 16777619u;
+        }
+    }
+    queues->orderKey = orderKey;
+    return true;
+}
+
+/*
+ * Replace the config of the limit under its mutex, and wake up the blocked publishers to check
+ * the new limits.
+ */
+bool Topic::SetTopicLimit(const char *topic, const TMQTopicLimit &limit) {
+    if (limit.maxMsgs < 0 || limit.maxBytes < 0 || limit.timeoutMs < 0
+        || limit.policy < TMQ_LIMIT_BLOCK || limit.policy > TMQ_LIMIT_DROP_NEWEST) {
+        return false;
+    }
+    TopicQueues *queues = topicQueues.Obtain(TMQTopicRegistry::GetInstance()->Intern(topic));
+    if (queues == nullptr) {
+        return false;
+    }
+    TopicLimit &topicLimit = queues->limit;
+    topicLimit.condition.Lock();
+    topicLimit.config = limit;
+    topicLimit.high = false;
+    store_release(&(topicLimit.enabled), limit.maxMsgs > 0 || limit.maxBytes > 0);
+    topicLimit.condition.Broadcast();
+    topicLimit.condition.UnLock();
+    return true;
+}
+
+/*
+ * The error is kept by the thread local variable.
+ */
+int Topic::GetLastError() {
+    return lastError;
+}
+
+/*
+ * Count the messages directly for an unbounded topic. Otherwise loop under the mutex of the limit
+ * until there is room, or the policy gives up. The high watermark listener is called out of the
+ * mutex.
+ */
+int Topic::admitMessages(TopicQueues *queues, int count, long long size) {
+    TopicLimit &limit = queues->limit;
+    if (!load_acquire(&(limit.enabled))) {
+        queues->Accept(count, size);
+        return TMQ_ERROR_NONE;
+    }
+    int error = TMQ_ERROR_NONE;
+    long long start = TMQUtils::NowMillis();
+    limit.condition.Lock();
+    while (limit.enabled && !queues->HasRoom(count, size)) {
+        int policy = limit.config.policy;
+        if (policy == TMQ_LIMIT_DROP_OLDEST) {
+            if (!dropOldest(queues)) {
+                error = TMQ_ERROR_FULL;
+                break;
+            }
+        } else if (policy == TMQ_LIMIT_BLOCK) {
+            long long remain = start + limit.config.timeoutMs - TMQUtils::NowMillis();
+            if (remain <= 0) {
+                error = TMQ_ERROR_TIMEOUT;
+                break;
+            }
+            // Count the waiter before checking again, refer TopicQueues::Release.
+            add_and_fetch_seq_cst(&(limit.waiters), 1);
+            if (!queues->HasRoom(count, size)) {
+                limit.condition.WaitFor((long) remain);
+            }
+            sub_and_fetch_seq_cst(&(limit.waiters), 1);
+        } else {
+            error = policy == TMQ_LIMIT_DROP_NEWEST ? TMQ_ERROR_DROPPED : TMQ_ERROR_FULL;
+            break;
+        }
+    }
+    TMQLimitListener *listener = nullptr;
+    if (error == TMQ_ERROR_NONE) {
+        queues->Accept(count, size);
+        if (limit.config.highWatermark > 0 && !limit.high
+            && queues->Usage() >= limit.config.highWatermark) {
+            store_release(&(limit.high), true);
+            listener = limit.config.listener;
+        }
+    }
+    limit.condition.UnLock();
+    if (listener) {
+        listener->OnHighWatermark(TMQTopicRegistry::GetInstance()->GetName(queues->topicId));
+    }
+    return error;
+}
+
+/*
+ * Take the first message from the lowest priority queue. The counters are reduced directly,
+ * without waking the waiters, the caller is the one waiting for the room.
+ */
+bool Topic::dropOldest(TopicQueues *queues) {
+    Shadow found;
+    for (int i = 0; i < TMQ_PRIORITY_COUNT; ++i) {
+        if (queues->priorityQueue[i].Size() <= 0) {
+            continue;
+        }
+        ShadowIterator iterator(&(queues->priorityQueue[i]), TMQ_MSG_TYPE_ALL);
+        if (iterator.Lookup(found)) {
+            sub_and_fetch_seq_cst(&(queues->pending), 1);
+            sub_and_fetch_seq_cst(&(queues->bytes), (long long) found.length);
+            storage->Remove(found);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Publish a batch of tmq messages. Five key steps:
+ * 1. Check all topics and messages, settings are not allowed in a batch.
+ * 2. Admit the messages of each topic by its limit, the batch is rejected if any topic fails.
+ * 3. Reserve a contiguous id range, write each message into storage with its id.
+ * 4. Group the shadows by topic and priority, and enqueue each group at once.
+ * 5. Wakeup the dispatcher once if there is any message not pick only.
+ */
+TMQMsgId Topic::publishBatch(const char *topic, const char **topics, const TMQMsg *msgs, int n) {
+    lastError = TMQ_ERROR_INVALID;
+    if (msgs == nullptr || n <= 0) {
+        return ID_LONG_INVALID;
+    }
+    // Check all of the topics and messages, the batch is published all or nothing.
+    for (int i = 0; i < n; ++i) {
+        const char *msgTopic = topics ? topics[i] : topic;
+        if (!isValidTopic(msgTopic) || msgs[i].data == nullptr || msgs[i].length <= 0
+            || strncmp(msgTopic, TOPIC_SETTINGS, strlen(TOPIC_SETTINGS)) == 0) {
+            return ID_LONG_INVALID;
+        }
+    }
+    // Find the queues of each message, the queues of one topic is found once.
+    auto **queues = new TopicQueues *[n];
+    for (int i = 0; i < n; ++i) {
+        queues[i] = (i > 0 && (!topics || strcmp(topics[i], topics[i - 1]) == 0))
+                    ? queues[i - 1] : topicQueues.Obtain(
+                        TMQTopicRegistry::GetInstance()->Intern(topics ? topics[i] : topic));
+        if (queues[i] == nullptr) {
+            delete[] queues;
+            return ID_LONG_INVALID;
+        }
+    }
+    // Sum up the messages of each topic, and admit them. The admitted ones are released if a
+    // later topic fails.
+    List<BatchAdmit> admits;
+    for (int i = 0; i < n; ++i) {
+        int position = 0;
+        while (position < admits.Size() && admits.Get(position).queues != queues[i]) {
+            position++;
+        }
+        if (position == admits.Size()) {
+            admits.Add(BatchAdmit(queues[i]));
+        }
+        admits.Get(position).count += 1;
+        admits.Get(position).size += msgs[i].length;
+    }
+    for (int i = 0; i < admits.Size(); ++i) {
+        BatchAdmit &admit = admits.Get(i);
+        lastError = admitMessages(admit.queues, admit.count, admit.size);
+        if (lastError != TMQ_ERROR_NONE) {
+            for (int j = 0; j < i; ++j) {
+                admits.Get(j).queues->Release(admits.Get(j).count, admits.Get(j).size);
+            }
+            delete[] queues;
+            return ID_LONG_INVALID;
+        }
+    }
+    TMQMsgId firstId = IDGenerator::GetInstance()->GetMsgIds(n);
+    // The shadows and their queues, in the order of the messages.
+    auto *shadows = new Shadow[n];
+    auto **targets = new RCSegQueue<Shadow> *[n];
+    int dispatchCount = 0;
+    for (int i = 0; i < n; ++i) {
+        Shadow msgShadow = storage->Write(queues[i]->topicId, msgs[i], firstId + i);
+        if (GET_MSG_TYPE(msgShadow.flag) == 0) {
+            msgShadow.flag = FORCE_TYPE_ALL(msgShadow.flag);
+        }
+        if (msgShadow.flag != TMQ_MSG_TYPE_PICK) {
+            dispatchCount += 1;
+        }
+        if (msgShadow.length != (TMQSize) msgs[i].length) {
+            queues[i]->Accept(0, (long long) msgShadow.length - msgs[i].length);
+        }
+        shadows[i] = msgShadow;
+        targets[i] = queues[i]->FindQueue(msgs[i].priority);
+    }
+    // Enqueue the shadows of each queue as one group, keeping their order.
+    auto *group = new Shadow[n];
+    for (int i = 0; i < n; ++i) {
+        RCSegQueue<Shadow> *queue = targets[i];
+        if (queue == nullptr) {
+            continue;
+        }
+        int count = 0;
+        for (int j = i; j < n; ++j) {
+            if (targets[j] == queue) {
+                group[count++] = shadows[j];
+                targets[j] = nullptr;
+            }
+        }
+        queue->EnqueueBatch(group, count);
+    }
+    for (int i = 0; i < n; ++i) {
+        topicQueues.MarkPending(queues[i], msgs[i].priority);
+    }
+    delete[] queues;
+    delete[] group;
+    delete[] targets;
+    delete[] shadows;
+    if (dispatchCount > 0) {
+        // Wake up the dispatcher once for the whole batch.
+        dispatcher->Wakeup(false, dispatchCount);
+    }
+    lastError = TMQ_ERROR_NONE;
+    return firstId;
+}
+
+/*
+ * Check the topic, it should not be empty and shorter than TMQ_TOPIC_MAX_LENGTH, the same as the
+ * names kept by the registry with their '\0'.
+ */
+bool Topic::isValidTopic(const char *topic) {
+    return topic != nullptr && strlen(topic) != 0 && strlen(topic) < TMQ_TOPIC_MAX_LENGTH;
+}
+
 /*
  * Subscribe a topic message by TMQReceiver. Delegating this operation to dispatcher directly.
  */
@@ -94,6 +441,14 @@ TMQId Topic::Subscribe(const char *topic, TMQReceiver *receiver) {
     return dispatcher->AddReceiver(topic, receiver);
 }
 
+/*
+ * Subscribe a topic message with batched delivery. Delegating this operation to dispatcher
+ * directly.
+ */
+TMQId Topic::Subscribe(const char *topic, TMQReceiver *receiver, int maxBatch, int lingerMs) {
+    return dispatcher->AddReceiver(topic, receiver, maxBatch, lingerMs);
+}
+
 /*
  * UnSubscribe a topic message by subscribeId. Delegating this operation to dispatcher directly.
  */
@@ -110,11 +465,60 @@ TMQReceiver *Topic::FindSubscriber(TMQId subscribeId) {
 }
 
 /*
- * Enable persistent storage, invoke EnablePersistent in Storage directly.
+ * Enable persistent storage, invoke EnablePersist in Storage directly, then restore the recovered
+ * messages.
  */
 bool Topic::EnablePersistent(bool enable, const char *file) {
     if (storage) {
-        return EnablePersistent(enable, file);
+        bool suc = storage->EnablePersist(enable, file) == enable;
+        if (suc && enable) {
+            restoreRecovered();
+        }
+        return suc;
+    }
+    return false;
+}
+
+/*
+ * Restore the recovered messages in the order of their ids. The consumed ones are appended to the
+ * history, the others are queued by their priorities, and counted into the limits without being
+ * admitted again, they were admitted by the last run.
+ */
+void Topic::restoreRecovered() {
+    List<RecoveredShadow> shadows;
+    storage->TakeRecovered(shadows);
+    bool dispatch = false;
+    for (int i = 0; i < shadows.Size(); ++i) {
+        RecoveredShadow &found = shadows.Get(i);
+        Shadow &shadow = found.shadow;
+        if (found.consumed) {
+            ((TMQHistory *) history)->Append(shadow);
+            continue;
+        }
+        TopicQueues *queues = topicQueues.Obtain(shadow.topicId);
+        if (queues == nullptr) {
+            continue;
+        }
+        if (GET_MSG_TYPE(shadow.flag) == 0) {
+            shadow.flag = FORCE_TYPE_ALL(shadow.flag);
+        }
+        queues->Accept(1, shadow.length);
+        int priority = found.priority >= 0 ? found.priority : TMQ_PRIORITY_DEFAULT;
+        queues->FindQueue(priority)->Enqueue(shadow);
+        topicQueues.MarkPending(queues, priority);
+        dispatch = dispatch || shadow.flag != TMQ_MSG_TYPE_PICK;
+    }
+    if (dispatch) {
+        dispatcher->Wakeup();
+    }
+}
+
+/*
+ * Get the statistics of the file synchronizations from the storage.
+ */
+bool Topic::GetSyncStats(TMQSyncStats &stats) {
+    if (storage) {
+        return storage->GetSyncStats(stats);
     }
     return false;
 }
@@ -123,10 +527,9 @@ bool Topic::EnablePersistent(bool enable, const char *file) {
  * Create a tmq picker with topics and consuming types.
  */
 IPicker *Topic::CreatePicker(const char **topics, int len, int type) {
-    auto *picker = new TMQ::TMQPicker(topics, len, type);
+    auto *picker = new TMQ::TMQPicker(&topicQueues, topics, len, type);
     picker->SetHistory(history);
     picker->SetStorage(storage);
-    picker->SetQueues(priorityQueue);
     return picker;
 }
 
@@ -139,15 +542,14 @@ void Topic::DestroyPicker(IPicker *picker) {
 }
 
 /**
- * Find a priority queue with the priority
+ * Find a priority queue of the topic with the priority
+ * @param topic, the topic of the queue.
  * @param priority, the priority of the queue.
- * @return, a pointer to the RCQueue<Shadow>
+ * @return, a pointer to the RCSegQueue<Shadow>, nullptr if the topic has no queues.
  */
-RCQueue<Shadow> *Topic::FindQueue(int priority) {
-    // Check and reset the index.
-    int index = priority < 0 ? 0 : priority;
-    index = index >= TMQ_PRIORITY_COUNT ? TMQ_PRIORITY_COUNT - 1 : index;
-    return &(priorityQueue[index]);
+RCSegQueue<Shadow> *Topic::FindQueue(const char *topic, int priority) {
+    TopicQueues *queues = topicQueues.Find(TMQTopicRegistry::GetInstance()->Find(topic));
+    return queues ? queues->FindQueue(priority) : nullptr;
 }
 
 /*
@@ -157,6 +559,21 @@ TMQSize Topic::GetHistory(const char **topics, int len, TMQMsg **values) {
     return history->GetHistory(topics, len, values);
 }
 
+/*
+ * Create a history cursor, delegate this operation to the history directly.
+ */
+IHistoryCursor *Topic::CreateHistoryCursor(const char **topics, int len, int direction,
+                                           int limit) {
+    return history->CreateCursor(topics, len, direction, limit);
+}
+
+/*
+ * Destroy a history cursor.
+ */
+void Topic::DestroyHistoryCursor(IHistoryCursor *cursor) {
+    delete cursor;
+}
+
 /*
  * Get the storage, return directly.
  */
@@ -18,36 +18,81 @@
 #include "TMQMutex.h"
 #include "TMQPicker.h"
 #include "Dispatcher.h"
-#include "RCQueue.h"
+#include "RCSegQueue.h"
 #include "Shadow.h"
 #include "TMQStorage.h"
 #include "TMQHistory.h"
+#include "TMQQueues.h"
+
+/// Setting keys
+// The storage engine, refer TMQ_STORAGE_XXX, read on constructing, TMQ_STORAGE_MAPPED by default.
+#define KEY_STORAGE_ENGINE  "STORAGE_ENGINE"
 
 TMQ_NAMESPACE
 
 /**
  * Implementation for the TMQTopic interface. The class includes a dispatcher, a storage, a history
- * and a priority rc queue.
+ * and the priority rc queues of topics.
  *
  * It is a manager for coordinate different modules: dispatcher, storage, history and priority rc
  * queues. The rc queues with multiply priorities are the core member for the Topic. We take
- * advantages of the rc queue(RCQueue) to improve the efficiency of message enqueuing and consuming,
- * that is fifo queue with look-free, and consuming on any positions. There are TMQ_PRIORITY_COUNT
- * RCQueues, each RCQueue has its own priority defined by its position of index.
+ * advantages of the rc queue(RCSegQueue) to improve the efficiency of message enqueuing and
+ * consuming, that is fifo queue with look-free, and consuming on any positions. Each topic has its
+ * own TMQ_PRIORITY_COUNT RCSegQueues, created on its first use. Each RCSegQueue has its own priority
+ * defined by its position of index.
  *
  * Upon a tmq message coming, it will save to storage first, then enqueue its shadow into correct
- * priority queue. At last, notify the dispatcher there is a message came.
+ * priority queue of its topic. At last, notify the dispatcher there is a message came.
  */
     class Topic : public TMQTopic {
     private:
+        /**
+         * Publish a tmq message, the listener is notified when it is durable if it is not nullptr.
+         */
+        TMQMsgId publish(const char *topic, const TMQMsg &tmqMsg, TMQDurableListener *listener);
+
+        /**
+         * Publish a batch of tmq messages, the topic of msgs[i] is topics[i] if topics is not
+         * nullptr, otherwise it is topic.
+         */
+        TMQMsgId publishBatch(const char *topic, const char **topics, const TMQMsg *msgs, int n);
+
+        /**
+         * Check whether the topic can be published by a tmq message.
+         */
+        static bool isValidTopic(const char *topic);
+
+        /**
+         * Admit messages into the queues of a topic by its limit, the messages are counted if
+         * they are admitted. A bounded topic may block or drop the oldest messages by its policy.
+         * @param queues, the queues of the topic.
+         * @param count, the count of the messages.
+         * @param size, the bytes of the messages.
+         * @return the error code, TMQ_ERROR_NONE if the messages are admitted.
+         */
+        int admitMessages(TopicQueues *queues, int count, long long size);
+
+        /**
+         * Drop the oldest message of the lowest priority in the queues, and remove it from the
+         * storage. The mutex of the limit condition should be held by the caller.
+         * @param queues, the queues of the topic.
+         * @return false if there is no message to drop.
+         */
+        bool dropOldest(TopicQueues *queues);
+
+        /**
+         * Restore the messages recovered by the storage on enabling the persistence.
+         */
+        void restoreRecovered();
+
         // A pointer to dispatcher.
         Dispatcher *dispatcher;
         // A pointer to the storage.
         IStorage *storage;
         // A pointer to the history.
         IHistory *history;
-        // Priority RCQueues.
-        RCQueue<Shadow> priorityQueue[TMQ_PRIORITY_COUNT];
+        // Priority RCSegQueues of all topics.
+        TMQQueues topicQueues;
 
     public:
         /// Public member methods
@@ -62,11 +107,12 @@ TMQ_NAMESPACE
         ~Topic();
 
         /**
-         * Find the RCQueue with the priority.
+         * Find the RCSegQueue of a topic with the priority.
+         * @param topic, the topic of the queue.
          * @param priority, the priority of the queue.
-         * @return  a pointer to the found RCQueue, nullptr will be returned if not exist.
+         * @return  a pointer to the found RCSegQueue, nullptr will be returned if not exist.
          */
-        RCQueue<Shadow> *FindQueue(int priority);
+        RCSegQueue<Shadow> *FindQueue(const char *topic, int priority);
 
         /**
          * Get method for the storage pointer.
@@ -88,6 +134,17 @@ TMQ_NAMESPACE
          */
         virtual TMQId Subscribe(const char *topic, TMQReceiver *receiver);
 
+        /**
+         * Subscribe a topic message with a TMQReceiver, delivering the messages in batches.
+         * @param topic, the topic to bind to the receiver.
+         * @param receiver, a pointer to the TMQReceiver.
+         * @param maxBatch, the max count of the messages in a batch.
+         * @param lingerMs, the max time in milliseconds for a message waiting for its batch.
+         * @return long, a long type value for this subscription.
+         */
+        virtual TMQId Subscribe(const char *topic, TMQReceiver *receiver, int maxBatch,
+                                int lingerMs);
+
         /**
          * Cancel a subscription using the subscriber id return by Subscribe.
          * @param subscribeId, the subscribe id
@@ -126,17 +183,92 @@ TMQ_NAMESPACE
          */
         virtual TMQMsgId Publish(const char *topic, const TMQMsg &tmqMsg);
 
+        /**
+         * Publish a tmq message persistently, and notify the listener when it is durable.
+         * @param topic, the topic of this tmq message.
+         * @param tmqMsg, the message detail, it is persistent whatever its flag is.
+         * @param listener, the listener for the durability.
+         * @return, long, a long type value represents the id of this published message.
+         */
+        virtual TMQMsgId PublishDurable(const char *topic, const TMQMsg &tmqMsg,
+                                        TMQDurableListener *listener);
+
+        /**
+         * Publish binary data and take its ownership. The data will be wrapped into a TMQBuffer,
+         * which is shared by storage, history and receivers without copying.
+         * @param topic, the topic to publish.
+         * @param data, a pointer to the raw data allocated by tmq_malloc.
+         * @param length, the length of the raw data.
+         * @param flag, flag for this message, refer Publish for detail.
+         * @param priority, message priority, default value is PRIORITY_NORMAL
+         * @return TMQMsgId, a long type value represents the id of this published message.
+         */
+        virtual TMQMsgId PublishOwned(const char *topic, void *data, int length, int flag = 0,
+                                      int priority = PRIORITY_NORMAL);
+
+        /**
+         * Publish a batch of tmq messages with one topic, refer the PublishBatch below.
+         * @param topic, the topic of these tmq messages.
+         * @param msgs, the tmq message array.
+         * @param n, the length of msgs.
+         * @return TMQMsgId, the id of the first message, the others follow it one by one.
+         */
+        virtual TMQMsgId PublishBatch(const char *topic, const TMQMsg *msgs, int n);
+
+        /**
+         * Publish a batch of tmq messages. Unlike publishing them one by one, the batch reserves
+         * a contiguous id range at once, links the shadows of each priority into a chain and
+         * enqueues the chain with one tail swap, then wakes up the dispatcher only once.
+         * @param topics, the topic of each tmq message.
+         * @param msgs, the tmq message array.
+         * @param n, the length of topics and msgs.
+         * @return TMQMsgId, the id of the first message, the others follow it one by one.
+         */
+        virtual TMQMsgId PublishBatch(const char **topics, const TMQMsg *msgs, int n);
+
+        /**
+         * Set the ordering key of a topic, refer to TMQTopic for detail. The key is hashed into the
+         * order key of the topic queues.
+         * @param topic, the topic to set.
+         * @param key, the ordering key, nullptr to reset the key to the topic itself.
+         * @return bool, a boolean value indicates whether the invoke is success or not.
+         */
+        virtual bool SetOrderingKey(const char *topic, const char *key);
+
+        /**
+         * Set the capacity limits of a topic.
+         * @param topic, the topic to set.
+         * @param limit, the limits, the policy and the watermarks.
+         * @return bool, a boolean value indicates whether the invoke is success or not.
+         */
+        virtual bool SetTopicLimit(const char *topic, const TMQTopicLimit &limit);
+
+        /**
+         * Get the error of the last publish on the calling thread.
+         * @return int, the error code, refer TMQ_ERROR_XXX for detail.
+         */
+        virtual int GetLastError();
+
         /**
          * Enable persistent storage for tmq messages. If the enable is true, the parameter file should
          * be valid file path, the file associated with the path must have read/write permissions. If
          * the file is not exist, it will be created. Besides, if the enable is false, and the
-         * persistent instance is running, it will clear the persistence and clear its file.
+         * persistent instance is running, it will clear the persistence and clear its file. The
+         * messages persisted by the last run are restored on enabling, the undelivered ones into
+         * the queues, the consumed ones into the history.
          * @param enable, a boolean value indicate whether the persistent is enable or not.
          * @param file, a pointer to file path, max length limits to 255.
          * @return bool, a boolean value for whether the persistent is enable or not.
          */
         virtual bool EnablePersistent(bool enable, const char *file);
 
+        /**
+         * Get the statistics of the file synchronizations.
+         * @param stats, a reference to receive the statistics.
+         * @return bool, false if the persistence is not enabled.
+         */
+        virtual bool GetSyncStats(TMQSyncStats &stats);
+
         /**
          * Create a tmq picker by topics and its message consuming type.
          * @param topics, a pointer to the tmq topic pointers.
@@ -162,6 +294,23 @@ TMQ_NAMESPACE
          * @return long, a long type value represents the length of the results(values).
          */
         virtual TMQSize GetHistory(const char **topics, int len, TMQMsg **values);
+
+        /**
+         * Create a history cursor, delegate to the history.
+         * @param topics, the topics to read, nullptr for all topics.
+         * @param len, the length of the topics.
+         * @param direction, the direction of the cursor, refer TMQ_HISTORY_XXX.
+         * @param limit, the max count of the messages read by the cursor, 0 for no limit.
+         * @return IHistoryCursor*, a pointer to the created cursor.
+         */
+        virtual IHistoryCursor *CreateHistoryCursor(const char **topics, int len, int direction,
+                                                    int limit);
+
+        /**
+         * Destroy and release a history cursor.
+         * @param cursor, a pointer to the cursor.
+         */
+        virtual void DestroyHistoryCursor(IHistoryCursor *cursor);
     };
 
 TMQ_NAMESPACE_END
@@ -20,6 +20,17 @@
 #endif  //  WIN32
 // Default message priority, all priority values can be [0, 10]
 #define PRIORITY_NORMAL     5
+// Backpressure policies of a bounded topic, the same as TMQTopic.h
+#define TMQ_LIMIT_BLOCK             0
+#define TMQ_LIMIT_REJECT            1
+#define TMQ_LIMIT_DROP_OLDEST       2
+#define TMQ_LIMIT_DROP_NEWEST       3
+// Error codes of the last publish, the same as TMQTopic.h
+#define TMQ_ERROR_NONE              0
+#define TMQ_ERROR_INVALID           1
+#define TMQ_ERROR_FULL              2
+#define TMQ_ERROR_TIMEOUT           3
+#define TMQ_ERROR_DROPPED           4
 
 /*
  * This is tmq message callback function, which can receive the callback invoke.
@@ -88,6 +99,43 @@ TMQ_EXPORTS int tmq_pick(const char *topic, void **data);
  */
 TMQ_EXPORTS TMQMsgId tmq_publish(const char *topic, void *data, int length, int flag = 0,
                                  int priority = PRIORITY_NORMAL);
+/**
+ * Publish a binary data to the topic without copy, and return the message id. The ownership of the
+ * data is transferred to tmq, tmq will free the data after all receivers released it. So never use
+ * or free the data after this call, even the publish is failed.
+ * @param topic, a topic the message will be add.
+ * @param data, a pointer to the binary data, which must be allocated by tmq_malloc.
+ * @param length, the length of the binary data.
+ * @param flag, the flag for the message, refer tmq_publish for detail.
+ * @return TMQId, a long type value represent the published message id.
+ */
+TMQ_EXPORTS TMQMsgId tmq_publish_owned(const char *topic, void *data, int length, int flag = 0,
+                                       int priority = PRIORITY_NORMAL);
+/**
+ * Set the ordering key of a topic, the messages of the topics with the same key are dispatched one
+ * by one when the setting DISPATCH_ORDERED is true.
+ * @param topic, the topic to set.
+ * @param key, the ordering key, nullptr to reset it to the topic itself.
+ * @return bool, a boolean value indicates whether the invoke is success or not.
+ */
+TMQ_EXPORTS bool tmq_set_ordering_key(const char *topic, const char *key);
+/**
+ * Set the capacity limits of a topic, refer TMQTopicLimit for detail. The watermark listener is
+ * not supported by the c api.
+ * @param topic, the topic to set.
+ * @param maxMsgs, the max count of the pending messages, 0 for no limit.
+ * @param maxBytes, the max bytes of the pending messages, 0 for no limit.
+ * @param policy, the policy when the limits are exceeded, refer TMQ_LIMIT_XXX for detail.
+ * @param timeoutMs, the max time in milliseconds for blocking, used by TMQ_LIMIT_BLOCK.
+ * @return bool, a boolean value indicates whether the invoke is success or not.
+ */
+TMQ_EXPORTS bool tmq_set_topic_limit(const char *topic, int maxMsgs, long long maxBytes,
+                                     int policy = TMQ_LIMIT_REJECT, int timeoutMs = 0);
+/**
+ * Get the error of the last publish on the calling thread.
+ * @return int, the error code, refer TMQ_ERROR_XXX for detail.
+ */
+TMQ_EXPORTS int tmq_get_last_error();
 
 /// For tmq context functions.
 /// A context represent operations with multiple topics. This can be regarded as a view of the tmq
@@ -22,6 +22,47 @@
 // Default message priority
 #define PRIORITY_NORMAL             5
 
+// backpressure policies of a bounded topic, refer TMQTopicLimit.
+// block the publisher until there is room, fail with TMQ_ERROR_TIMEOUT after the timeout.
+#define TMQ_LIMIT_BLOCK             0
+// reject the new message with TMQ_ERROR_FULL.
+#define TMQ_LIMIT_REJECT            1
+// drop the oldest messages of the lowest priority in the topic to make room.
+#define TMQ_LIMIT_DROP_OLDEST       2
+// drop the new message with TMQ_ERROR_DROPPED.
+#define TMQ_LIMIT_DROP_NEWEST       3
+
+// error codes of the last publish on the calling thread, refer GetLastError.
+#define TMQ_ERROR_NONE              0
+#define TMQ_ERROR_INVALID           1
+#define TMQ_ERROR_FULL              2
+#define TMQ_ERROR_TIMEOUT           3
+#define TMQ_ERROR_DROPPED           4
+
+// directions of a history cursor, refer IHistoryCursor.
+// from the latest consumed message to the oldest one.
+#define TMQ_HISTORY_NEWEST_FIRST    0
+// from the oldest kept message to the latest one.
+#define TMQ_HISTORY_OLDEST_FIRST    1
+
+// durability levels of the persistent messages, for a topic by the setting PERSIST_DURABILITY, or
+// for a message by TMQ_MSG_DURABILITY in its flag.
+// written to the file, the synchronization is left to the system.
+#define TMQ_DURABILITY_NONE         0
+// synchronized by the background thread every PERSIST_SYNC_PERIOD milliseconds.
+#define TMQ_DURABILITY_PERIODIC     1
+// synchronized with the batch of the group commit, before the messages are reported durable.
+#define TMQ_DURABILITY_BATCH        2
+// the flag bits of a message for a durability level, overriding the level of its topic.
+#define TMQ_MSG_DURABILITY(level)   ((((level) & 0x3) + 1) << 28)
+
+// storage engines of the persistent messages, by the setting STORAGE_ENGINE before the tmq instance
+// is created.
+// the section spaces in a mapped file, the persistent path is a file.
+#define TMQ_STORAGE_MAPPED          0
+// the append-only log of segment files, the persistent path is a directory.
+#define TMQ_STORAGE_LOG             1
+
 // Id for unsigned long long integer.
 typedef unsigned long long TMQMsgId;
 // Common id for long integer.
@@ -29,6 +70,71 @@ typedef long TMQId;
 // Redefine unsigned int as TMQSize
 typedef unsigned int TMQSize;
 
+/**
+ * Reference counted binary buffer. A buffer is created with one reference which belongs to its
+ * creator, each Retain adds a reference and each Release drops one. The data will be freed when the
+ * last reference is released.
+ *
+ * A buffer is read only after it is created, so it can be shared by the storage, history and all
+ * receivers without copying. The data of a buffer must be allocated by tmq_malloc(new char[]).
+ */
+class TMQBuffer {
+private:
+    // the pointer for the binary data, owned by this buffer.
+    void *data;
+    // the length of the data.
+    int length;
+    // reference count of this buffer.
+    volatile int refCount;
+
+private:
+    // Construct a buffer with the ownership of data, only by Wrap or Copy.
+    TMQBuffer(void *data, int length);
+
+    // Destructor, only by Release.
+    ~TMQBuffer();
+
+public:
+    /**
+     * Create a buffer which takes the ownership of data.
+     * @param data, a pointer to the data allocated by tmq_malloc.
+     * @param length, the length of the data.
+     * @return TMQBuffer*, a buffer with one reference, nullptr if the parameters are invalid.
+     */
+    static TMQBuffer *Wrap(void *data, int length);
+
+    /**
+     * Create a buffer with a copy of data.
+     * @param data, a pointer to the binary data.
+     * @param length, the length of the data.
+     * @return TMQBuffer*, a buffer with one reference, nullptr if the parameters are invalid.
+     */
+    static TMQBuffer *Copy(const void *data, int length);
+
+    /**
+     * Get the pointer to the binary data.
+     * @return void*, the data, which should be read only.
+     */
+    void *Data() const;
+
+    /**
+     * Get the length of the data.
+     * @return int, the length.
+     */
+    int Length() const;
+
+    /**
+     * Add a reference to this buffer.
+     * @return TMQBuffer*, this buffer.
+     */
+    TMQBuffer *Retain();
+
+    /**
+     * Drop a reference of this buffer, the buffer will be freed if it is the last one.
+     */
+    void Release();
+};
+
 /**
  * class for TMQMsg, wrapper for the binary data and necessary properties.
  */
@@ -47,6 +153,8 @@ public:
     int priority;
     // flag of the tmq message, refer TMQ_MSG_TYPE_{XXX} for detail.
     int flag;
+    // the shared buffer of the data, data points into this buffer if it is not nullptr.
+    TMQBuffer *buffer;
 public:
     // default construct for TMQMsg.
     TMQMsg();
@@ -55,7 +163,13 @@ public:
     TMQMsg(const void *data, int length);
 
     /**
-     * Construct with a tmqMsg.
+     * Construct a tmq msg sharing the data of buffer, a reference is retained by the msg.
+     * @param buffer, the shared buffer.
+     */
+    explicit TMQMsg(TMQBuffer *buffer);
+
+    /**
+     * Construct with a tmqMsg. The data will be shared if tmqMsg has a buffer, otherwise copied.
      * @param tmqMsg
      */
     TMQMsg(const TMQMsg &tmqMsg);
@@ -63,7 +177,7 @@ public:
     /**
      * Override of the assign operator
      * @param msg original tmq msg
-     * @return a new msg with deep copy.
+     * @return a new msg with deep copy, or sharing the buffer of msg.
      */
     TMQMsg &operator=(const TMQMsg &msg);
 
@@ -73,6 +187,20 @@ public:
     virtual ~TMQMsg();
 };
 
+/**
+ * A range of message ids, the payload of the messages of the topic "__SENT__". Subscribing this
+ * topic receives the receipts of the dispatched messages, a receipt is an array of ranges, each
+ * range covers the ids from first to last inclusive. The receipts are generated only when the
+ * topic has subscribers, one receipt for a batch of dispatched messages.
+ */
+class TMQSentRange {
+public:
+    // the first message id of the range.
+    TMQMsgId first;
+    // the last message id of the range, inclusive.
+    TMQMsgId last;
+};
+
 /**
  * Interface defined for message picker. A picker can be used to pick message from tmq instance.
  * One picker can include one or more topics, any message with the same topic will be picked by
@@ -97,6 +225,92 @@ public:
     virtual ~IPicker() {}
 };
 
+/**
+ * Interface defined for reading the history messages page by page. A cursor walks the topics one by
+ * one in the given order, and the messages of each topic in the direction of the cursor, so only a
+ * page of messages is read at a time. The position of a cursor is kept by the history, it is still
+ * valid when the older messages are evicted, the evicted ones are just skipped.
+ *
+ * A cursor is not thread safe, use it on one thread, and destroy it before the tmq instance.
+ */
+class IHistoryCursor {
+public:
+    /**
+     * Move the cursor to a message, the next page starts from it.
+     * @param msgId, the id of the message.
+     * @return bool, false if the message is not in the history of the topics, the cursor is not
+     *  moved then.
+     */
+    virtual bool Seek(TMQMsgId msgId) = 0;
+
+    /**
+     * Read the next page of messages.
+     * @param msgs, the array to receive the messages.
+     * @param max, the max count of the messages, the size of msgs.
+     * @param payload, whether to read the data of the messages, if false, only the id, the length
+     *  and the flag are read, the data can be fetched later by Fetch.
+     * @return int, the count of the messages read, 0 if there are no more messages, or the limit
+     *  of the cursor is reached.
+     */
+    virtual int NextPage(TMQMsg *msgs, int max, bool payload) = 0;
+
+    /**
+     * Fetch the data of a message in the last page.
+     * @param index, the index of the message in the last page.
+     * @param msg, the message to receive the data.
+     * @return bool, false if the index is invalid, or the message has been evicted.
+     */
+    virtual bool Fetch(int index, TMQMsg &msg) = 0;
+
+    /**
+     * virtual method of destructor.
+     */
+    virtual ~IHistoryCursor() {}
+};
+
+/**
+ * Listener for the durability of a persistent message, refer TMQTopic::PublishDurable. The
+ * persistent messages are committed to the file in batches by a background thread, and the file is
+ * synchronized once for each batch, OnDurable is called on that thread after the synchronization.
+ */
+class TMQDurableListener {
+public:
+    /**
+     * Called when a message is durable, or it can not be.
+     * @param msgId, the id of the message.
+     * @param durable, true if the message is saved to the file, false if the persistence is not
+     *  enabled or failed, the message is kept in memory then.
+     */
+    virtual void OnDurable(TMQMsgId msgId, bool durable) = 0;
+
+    /**
+     * virtual method of destructor.
+     */
+    virtual ~TMQDurableListener() {}
+};
+
+/**
+ * The statistics of the file synchronizations of the persistent messages, refer
+ * TMQTopic::GetSyncStats.
+ */
+class TMQSyncStats {
+public:
+    // the count of the synchronizations.
+    long long count;
+    // the count of the failed synchronizations.
+    long long failures;
+    // the total latency of the synchronizations in microseconds.
+    long long totalMicros;
+    // the max latency of a synchronization in microseconds.
+    long long maxMicros;
+    // the latency of the last synchronization in microseconds.
+    long long lastMicros;
+public:
+    TMQSyncStats() : count(0), failures(0), totalMicros(0), maxMicros(0), lastMicros(0) {
+
+    }
+};
+
 /**
  * Topic message receiver, an interface defined for receive a topic message. It is used during
  * message dispatch.
@@ -112,12 +326,80 @@ public:
      */
     virtual void OnReceive(const TMQMsg *msg) = 0;
 
+    /**
+     * The virtual method for receive a batch of messages, it is called instead of OnReceive when
+     * the receiver is subscribed with a max batch size greater than 1. The messages are valid only
+     * during the call. By default, it calls OnReceive for each message in order.
+     * @param msgs, the messages dispatched by tmq, in the order of dispatching.
+     * @param n, the count of the messages.
+     * @return, void.
+     */
+    virtual void OnReceiveBatch(const TMQMsg **msgs, int n) {
+        for (int i = 0; i < n; ++i) {
+            OnReceive(msgs[i]);
+        }
+    }
+
     /**
      * virtual method of destructor.
      */
     virtual ~TMQReceiver() {}
 };
 
+/**
+ * Listener for the watermarks of a bounded topic, so that the producers can throttle before the
+ * limit is reached. OnHighWatermark is called on the publishing thread when the usage of the topic
+ * rises to the high watermark, and OnLowWatermark is called on the consuming thread when the usage
+ * falls back to the low watermark. They are called alternately, never twice in a row.
+ */
+class TMQLimitListener {
+public:
+    /**
+     * Called when the usage of the topic rises to the high watermark.
+     * @param topic, the topic.
+     */
+    virtual void OnHighWatermark(const char *topic) = 0;
+
+    /**
+     * Called when the usage of the topic falls to the low watermark after the high watermark.
+     * @param topic, the topic.
+     */
+    virtual void OnLowWatermark(const char *topic) = 0;
+
+    /**
+     * virtual method of destructor.
+     */
+    virtual ~TMQLimitListener() {}
+};
+
+/**
+ * The capacity limits of a topic. The messages published but not picked or dispatched yet are
+ * counted, a publish exceeding either of the limits is handled by the policy. The usage of a topic
+ * is the higher one of the message ratio and the byte ratio, in percent.
+ */
+class TMQTopicLimit {
+public:
+    // the max count of the pending messages, 0 for no limit.
+    int maxMsgs;
+    // the max bytes of the pending messages, 0 for no limit.
+    long long maxBytes;
+    // the policy when the limits are exceeded, refer TMQ_LIMIT_XXX for detail.
+    int policy;
+    // the max time in milliseconds for blocking, used by TMQ_LIMIT_BLOCK.
+    int timeoutMs;
+    // the usage in percent to call OnHighWatermark, 0 for none.
+    int highWatermark;
+    // the usage in percent to call OnLowWatermark.
+    int lowWatermark;
+    // the listener of the watermarks, nullptr for none.
+    TMQLimitListener *listener;
+public:
+    TMQTopicLimit() : maxMsgs(0), maxBytes(0), policy(TMQ_LIMIT_REJECT), timeoutMs(0),
+                      highWatermark(0), lowWatermark(0), listener(nullptr) {
+
+    }
+};
+
 /**
  * API methods for tmq. It is a virtual class, defined as interface. You can get an instance by
  * TMQFactory. These methods can be divide into four categories: subscribe, picker, publish
@@ -137,6 +419,21 @@ public:
      */
     virtual TMQId Subscribe(const char *topic, TMQReceiver *receiver) = 0;
 
+    /**
+     * Subscribe topic messages with batched delivery. The messages are accumulated for the
+     * receiver, and delivered by OnReceiveBatch when maxBatch messages are pending, or the first
+     * pending message has waited for lingerMs. A batching receiver is called by one thread at a
+     * time, the batches are delivered in the order of dispatching.
+     * @param topic, the topic to be subscribed
+     * @param receiver, the receiver for dealing with the messages.
+     * @param maxBatch, the max count of the messages in a batch, 1 or less for no batching.
+     * @param lingerMs, the max time in milliseconds for a message waiting for its batch, 0 to
+     *  deliver the pending messages once the dispatcher has no more message to dispatch.
+     * @return long, a long value represent this subscriber id.
+     */
+    virtual TMQId Subscribe(const char *topic, TMQReceiver *receiver, int maxBatch,
+                            int lingerMs) = 0;
+
     /**
      * Cancel a subscription. This method may be time consuming, when the subscriber is on running.
      * @param subscribeId, The subscriber id returned by Subscribe
@@ -188,17 +485,101 @@ public:
      */
     virtual TMQMsgId Publish(const char *topic, const TMQMsg &msg) = 0;
 
+    /**
+     * Publish a tmq message persistently, and get notified when it is durable. The message is
+     * published as soon as it is staged, the listener is called later, after the message is
+     * committed to the file of the persistence, refer EnablePersistent.
+     * @param topic, the topic for this message.
+     * @param msg, the tmq msg, it is persistent whatever its flag is.
+     * @param listener, the listener for the durability, called once if the message is published.
+     * @return TMQMsgId, a TMQMsgId type value indicate the id of the msg.
+     */
+    virtual TMQMsgId PublishDurable(const char *topic, const TMQMsg &msg,
+                                    TMQDurableListener *listener) = 0;
+
+    /**
+     * Publish a binary data and transfer its ownership to tmq. The data will not be copied, it is
+     * shared by storage, history and receivers, and freed after the last of them released it.
+     * The ownership is transferred even the publish is failed, so never use or free data after.
+     * @param topic, the topic for this message.
+     * @param data, the pointer to the binary data, must be allocated by tmq_malloc.
+     * @param length, the length of the data.
+     * @param flag, the message flag, refer TMQ_MSG_TYPE_XXX for detail.
+     * @param priority, message priority, all priority values can be [0, 10]
+     * @return TMQMsgId, a TMQMsgId type value indicate the id of the msg.
+     */
+    virtual TMQMsgId PublishOwned(const char *topic, void *data, int length, int flag = 0,
+                                  int priority = PRIORITY_NORMAL) = 0;
+
+    /**
+     * Publish a batch of tmq messages with the same topic. The messages get a contiguous range of
+     * ids, the id of msgs[i] is the returned id plus i. Nothing is published if any of the messages
+     * is invalid.
+     * @param topic, the topic for these messages.
+     * @param msgs, the tmq msg array.
+     * @param n, the length of the msgs.
+     * @return TMQMsgId, the id of the first msg, ID_LONG_INVALID if the batch is not published.
+     */
+    virtual TMQMsgId PublishBatch(const char *topic, const TMQMsg *msgs, int n) = 0;
+
+    /**
+     * Publish a batch of tmq messages, msgs[i] is published to topics[i]. It is the same as the
+     * PublishBatch with one topic except for the topics.
+     * @param topics, the topic array for each message.
+     * @param msgs, the tmq msg array.
+     * @param n, the length of the topics and msgs.
+     * @return TMQMsgId, the id of the first msg, ID_LONG_INVALID if the batch is not published.
+     */
+    virtual TMQMsgId PublishBatch(const char **topics, const TMQMsg *msgs, int n) = 0;
+
+    /**
+     * Set the ordering key of a topic for the ordered dispatching, which is enabled by the setting
+     * DISPATCH_ORDERED=true. The messages of the topics with the same key are dispatched one by
+     * one, never concurrently, and the messages of each topic keep their order. By default, the
+     * key of a topic is itself. Set it before publishing to the topic, the messages being
+     * dispatched keep the old key.
+     * @param topic, the topic to set.
+     * @param key, the ordering key, nullptr to reset the key to the topic itself.
+     * @return bool, a boolean value indicates whether the invoke is success or not.
+     */
+    virtual bool SetOrderingKey(const char *topic, const char *key) = 0;
+
+    /**
+     * Set the capacity limits of a topic, it is enforced on the later publishes, the pending
+     * messages are not dropped for a smaller limit. A topic is unbounded by default.
+     * @param topic, the topic to set.
+     * @param limit, the limits, the policy and the watermarks, a limit with neither maxMsgs nor
+     *  maxBytes makes the topic unbounded again.
+     * @return bool, a boolean value indicates whether the invoke is success or not.
+     */
+    virtual bool SetTopicLimit(const char *topic, const TMQTopicLimit &limit) = 0;
+
+    /**
+     * Get the error of the last publish on the calling thread, so that a ID_LONG_INVALID returned
+     * by publishing can be told apart.
+     * @return int, the error code, refer TMQ_ERROR_XXX for detail.
+     */
+    virtual int GetLastError() = 0;
+
     /**
      * Enable persistent storage for tmq messages. If the enable is true, the parameter file should
      * be valid file path, the file associated with the path must have read/write permissions. If
-     * the file is not exist, it will be created. Besides, if the enable is false, and the
-     * persistent instance is running, it will clear the persistence and clear its file.
+     * the file is not exist, it will be created. The path is a directory for TMQ_STORAGE_LOG.
+     * Besides, if the enable is false, and the persistent instance is running, it will clear the
+     * persistence and clear its file.
      * @param enable, a boolean value indicate whether the persistent is enable or not.
      * @param file, a pointer to file path, max length limits to 255.
      * @return bool, a boolean value for whether the persistent is enable or not.
      */
     virtual bool EnablePersistent(bool enable, const char *file) = 0;
 
+    /**
+     * Get the statistics of the file synchronizations since the persistence is enabled.
+     * @param stats, a reference to receive the statistics.
+     * @return bool, false if the persistence is not enabled.
+     */
+    virtual bool GetSyncStats(TMQSyncStats &stats) = 0;
+
     /**
      * Get the history message for some topics. The history messages is the kind of message
      *  that picked or dispatched. The history messages are all resource constrained,
@@ -210,6 +591,26 @@ public:
      * @return long, a long type value indicate the length of *values.
      */
     virtual TMQSize GetHistory(const char **topics, int len, TMQMsg **values) = 0;
+
+    /**
+     * Create a cursor to read the history messages page by page, instead of reading all of them
+     * at once by GetHistory. After use, invoke destroy method timely.
+     * @param topics, the topic array includes one or more topics, nullptr for all topics that have
+     *  history when the cursor is created.
+     * @param len, the length of the topics.
+     * @param direction, the direction of the cursor, refer TMQ_HISTORY_XXX for detail.
+     * @param limit, the max count of the messages read by the cursor, 0 for no limit.
+     * @return IHistoryCursor*, a pointer to the cursor.
+     */
+    virtual IHistoryCursor *CreateHistoryCursor(const char **topics, int len, int direction,
+                                                int limit) = 0;
+
+    /**
+     * Destroy the history cursor.
+     * @param cursor, a pointer to the cursor created by CreateHistoryCursor.
+     * @return void, nothing.
+     */
+    virtual void DestroyHistoryCursor(IHistoryCursor *cursor) = 0;
 };
 
 
@@ -9,6 +9,18 @@
 #include "TestSuite.h"
 #include "Persistence.h"
 #include "MemSpace.h"
+#include "FileSpace.h"
+#include "SectionSpace.h"
+#include "LazyBTree.h"
+#include "TMQStorage.h"
+#include "TMQLogStorage.h"
+#include "TMQBase64.h"
+#include "TMQCrc32.h"
+#include "TMQTopicRegistry.h"
+#include <cstring>
+#include <unistd.h>
+
+USING_TMQ_NAMESPACE
 
 void TestCreatePersistence() {
     MemSpace memSpace;
@@ -124,6 +136,80 @@ void TestPersistenceGetPageSize() {
                 "The page count should be equal to size by alloc");
 }
 
+static int ComparePage(void *p1, void *p2) {
+    unsigned int start = ((MetaPage *) p1)->start;
+    unsigned int another = ((MetaPage *) p2)->start;
+    return start == another ? 0 : (start > another ? 1 : -1);
+}
+
+void TestLazyBTree() {
+    const int count = 1000;
+    MemSpace memSpace;
+    int page = memSpace.Allocate(-1, 64);
+    LazyBTree<MetaPage> tree(&memSpace, ADDRESS(page, 0), 64 * TMQ_PAGE_SIZE, ComparePage);
+    // Insert the pages in a scattered order, then check that they are iterated in order.
+    for (int i = 0; i < count; ++i) {
+        ASSERT_TRUE(tree.Add(MetaPage((i * 7) % count, i)), "Add should be success with capacity.");
+    }
+    unsigned int expect = 0;
+    LazyBTreeIterator<MetaPage> iterator(&tree);
+    while (iterator.HasNext()) {
+        ASSERT_TRUE(iterator.Next().start == expect++, "The pages should be iterated in order.");
+    }
+    ASSERT_TRUE(expect == count && tree.GetSize() == count, "All of the pages should be iterated.");
+    MetaPage found;
+    ASSERT_TRUE(tree.Find(MetaPage(700, 0), found) && found.count == 100,
+                "The page should be found with its count.");
+    found.occupied = true;
+    ASSERT_TRUE(tree.Set(found) && tree.Find(MetaPage(700, 0), found) && found.occupied,
+                "The page should be updated in place.");
+    // Remove the even pages through the tree, and the odd pages through the iterator.
+    for (int i = 0; i < count; i += 2) {
+        ASSERT_TRUE(tree.Remove(MetaPage(i, 0)), "Remove should be success for an existed page.");
+    }
+    ASSERT_TRUE(!tree.Remove(MetaPage(0, 0)) && !tree.Find(MetaPage(0, 0), found),
+                "The removed page should not be found.");
+    ASSERT_TRUE(tree.Last(found) && found.start == count - 1, "The last page should be the largest.");
+    LazyBTreeIterator<MetaPage> remover(&tree);
+    while (remover.HasNext()) {
+        remover.Next();
+        ASSERT_TRUE(remover.Remove(), "Remove by iterator should be success.");
+    }
+    ASSERT_TRUE(tree.Empty() && !tree.Last(found), "The tree should be empty.");
+    // The freed nodes should be reused by the next insertions.
+    for (int i = 0; i < count; ++i) {
+        ASSERT_TRUE(tree.Add(MetaPage(i, 1)), "Add should reuse the freed nodes.");
+    }
+    LazyBTree<MetaPage> reopen(&memSpace, ADDRESS(page, 0), 64 * TMQ_PAGE_SIZE, ComparePage);
+    ASSERT_TRUE(reopen.GetSize() == count && reopen.Find(MetaPage(count - 1, 0), found),
+                "The tree should be read again from the page space.");
+}
+
+void TestUpgradePageTable() {
+    MemSpace memSpace;
+    // Save the page table as a linear list, as the earlier versions do.
+    memSpace.Allocate(0, 1);
+    LazyLinearList<MetaSection> sectionList(&memSpace, ADDRESS(0, 0), TMQ_PAGE_SIZE);
+    sectionList.Add(MetaSection(SECTION_ALLOC, 1, 1));
+    memSpace.Allocate(1, 1);
+    memSpace.Allocate(2, 2);
+    memSpace.Allocate(3, 1);
+    LazyLinearList<MetaPage> pageList(&memSpace, ADDRESS(1, 0), TMQ_PAGE_SIZE);
+    pageList.Add(MetaPage(1, 1, true));
+    pageList.Add(MetaPage(2, 2, true));
+    pageList.Add(MetaPage(3, 1, true));
+    Persistence persist(&memSpace);
+    MetaSection pageSection = persist.FindSection(SECTION_ALLOC, false);
+    ASSERT_TRUE(pageSection.start != 1
+                && LazyBTree<MetaPage>::Exists(&memSpace, ADDRESS(pageSection.start, 0)),
+                "The page table should be moved to a tree.");
+    int size = 1;
+    ASSERT_TRUE(persist.GetAllocPageSize(2) == 2 && persist.GetAllocPageSize(3) == 1,
+                "The allocated pages should be kept in the tree.");
+    ASSERT_TRUE(persist.ReusePages(size, &size) == 1 && size == 1,
+                "The pages of the list should be released for reuse.");
+}
+
 void TestCreateLinearSpace() {
     const char *testSection = "Test";
     MemSpace memSpace;
@@ -164,6 +250,275 @@ void TestEraseLinearSpace() {
     persist.EraseLinearSpace(testSection);
 }
 
+/**
+ * Find the linear address of a section address, and count the freed allocations.
+ */
+static TMQAddress FindAddress(SectionSpace *space, TMQAddress secAddress, int *freed) {
+    LazyLinearList<SecAlloc> *allocList = space->GetLazyAllocList(LAZY_RESERVE_READ);
+    TMQAddress address = ADDRESS_NULL;
+    *freed = 0;
+    for (int i = 0; allocList && i < allocList->GetSize(); ++i) {
+        SecAlloc alloc = allocList->Get(i);
+        // The section space may be reset, so that only the alloc id is kept.
+        if (alloc.state == ADDRESS_ALLOC
+            && SECTION_ALLOC_ID(alloc.secAddress) == SECTION_ALLOC_ID(secAddress)) {
+            address = alloc.address;
+        }
+        *freed += alloc.state == ADDRESS_FREE ? 1 : 0;
+    }
+    return address;
+}
+
+void TestSectionFreeIndex() {
+    const char *testSection = "Test";
+    MemSpace memSpace;
+    Persistence persist(&memSpace);
+    auto *space = (SectionSpace *) persist.CreateLinearSpace(testSection);
+    int freed = 0;
+    TMQAddress first = space->Allocate(100);
+    TMQAddress second = space->Allocate(100);
+    TMQAddress third = space->Allocate(100);
+    TMQAddress firstAddress = FindAddress(space, first, &freed);
+    TMQAddress secondAddress = FindAddress(space, second, &freed);
+    ASSERT_TRUE(PAGE(firstAddress) == PAGE(secondAddress) && freed == 1,
+                "The allocations should share the page, with its remainder freed.");
+    space->Deallocate(second);
+    TMQAddress reused = space->Allocate(60);
+    ASSERT_TRUE(FindAddress(space, reused, &freed) == secondAddress && freed == 2,
+                "The smallest class fitting should be reused, with its remainder freed.");
+    space->Deallocate(first);
+    space->Deallocate(reused);
+    TMQAddress merged = space->Allocate(200);
+    ASSERT_TRUE(FindAddress(space, merged, &freed) == firstAddress && freed == 1,
+                "The adjacent freed allocations should be merged.");
+    space->Deallocate(merged);
+    space->Deallocate(third);
+    FindAddress(space, ADDRESS_NULL, &freed);
+    ASSERT_TRUE(freed == 0, "The page should be released when all of its allocations are freed.");
+    persist.DropLinearSpace(testSection);
+}
+
+void TestFileSpaceChunked() {
+    if (strlen(PERSIST_TEST_FILE) == 0) {
+        return;
+    }
+    remove(PERSIST_TEST_FILE);
+    const int len = TMQ_PAGE_SIZE * 3;
+    char *data = (char *) calloc(len, sizeof(char));
+    char *read = (char *) calloc(len, sizeof(char));
+    for (int i = 0; i < len; ++i) {
+        data[i] = (char) (i % 251);
+    }
+    auto *fileSpace = new FileSpace(PERSIST_TEST_FILE, FILE_SPACE_CHUNKED);
+    int page = fileSpace->Allocate(-1, 4);
+    ASSERT_TRUE(page == 0, "The pages should be allocated at the start of the file.");
+    ASSERT_TRUE(fileSpace->Write(page, 100, data, len) == len
+                && fileSpace->Read(page, 100, read, len) == len && memcmp(data, read, len) == 0,
+                "The data across pages should be read as it is written.");
+    ASSERT_TRUE(fileSpace->Write(page, TMQ_PAGE_SIZE * 4 - 10, data, 20) < 0,
+                "Writing beyond the end of file should fail.");
+    ASSERT_TRUE(fileSpace->Allocate(-1, 4) == 4
+                && fileSpace->Copy(4, 100, page, 100, len)
+                && fileSpace->Read(4, 100, read, len) == len && memcmp(data, read, len) == 0,
+                "The data should be copied to the grown pages.");
+    fileSpace->Zero(page, 100, len);
+    ASSERT_TRUE(fileSpace->Sync(), "Sync should success.");
+    delete fileSpace;
+    // The content is the same for a file space in page mode.
+    fileSpace = new FileSpace(PERSIST_TEST_FILE);
+    ASSERT_TRUE(fileSpace->Read(4, 100, read, len) == len && memcmp(data, read, len) == 0,
+                "The copied data should be read in page mode.");
+    ASSERT_TRUE(fileSpace->Read(page, 100, read, len) == len && read[0] == 0
+                && read[len - 1] == 0, "The zeroed data should be read in page mode.");
+    delete fileSpace;
+    free(data);
+    free(read);
+    remove(PERSIST_TEST_FILE);
+}
+
+void TestFileSpaceGrowth() {
+    if (strlen(PERSIST_TEST_FILE) == 0) {
+        return;
+    }
+    remove(PERSIST_TEST_FILE);
+    const int count = 300;
+    auto *fileSpace = new FileSpace(PERSIST_TEST_FILE, FILE_SPACE_CHUNKED);
+    bool success = true;
+    for (int i = 0; i < count && success; ++i) {
+        char zero = 1;
+        success = fileSpace->Allocate(-1, 1) == i && fileSpace->Read(i, 0, &zero, 1) == 1
+                  && zero == 0 && fileSpace->Write(i, TMQ_PAGE_SIZE - sizeof(int), &i, sizeof(int))
+                                  == sizeof(int);
+    }
+    ASSERT_TRUE(success, "The grown pages should be zero and writable.");
+    delete fileSpace;
+    // The preallocation does not change the size of the file.
+    FILE *f = fopen(PERSIST_TEST_FILE, "rb");
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    ASSERT_TRUE(size == (long) count * TMQ_PAGE_SIZE, "The file should be as long as the pages.");
+    fileSpace = new FileSpace(PERSIST_TEST_FILE, FILE_SPACE_CHUNKED);
+    int last = 0;
+    ASSERT_TRUE(fileSpace->Read(count - 1, TMQ_PAGE_SIZE - sizeof(int), &last, sizeof(int))
+                == sizeof(int) && last == count - 1, "The last page should be read after reopen.");
+    fileSpace->Deallocate(count / 2);
+    ASSERT_TRUE(fileSpace->Allocate(-1, 1) == count / 2, "The pages should be allocated after the "
+                                                         "truncated end.");
+    delete fileSpace;
+    remove(PERSIST_TEST_FILE);
+}
+
+void TestFileSpaceLarge() {
+    if (strlen(PERSIST_TEST_FILE) == 0) {
+        return;
+    }
+    remove(PERSIST_TEST_FILE);
+    // A sparse file past 2 GB, the pages after it overflow an int offset.
+    const int count = 524288 + 2;
+    FILE *f = fopen(PERSIST_TEST_FILE, "wb");
+    fclose(f);
+    ASSERT_TRUE(truncate(PERSIST_TEST_FILE, (off_t) count * TMQ_PAGE_SIZE) == 0,
+                "The sparse file should be created.");
+    auto *fileSpace = new FileSpace(PERSIST_TEST_FILE, FILE_SPACE_CHUNKED);
+    int page = count - 1;
+    int value = page;
+    int read = 0;
+    ASSERT_TRUE(fileSpace->Write(page, 8, &value, sizeof(int)) == sizeof(int)
+                && fileSpace->Read(page, 8, &read, sizeof(int)) == sizeof(int) && read == page,
+                "A page past 2 GB should be written and read.");
+    ASSERT_TRUE(fileSpace->Read(count, 0, &read, sizeof(int)) < 0,
+                "A page past the end should not be read.");
+    ASSERT_TRUE(fileSpace->Load(page) != nullptr && fileSpace->Load(count) == nullptr,
+                "Only the pages in the file should be loaded.");
+    fileSpace->Deallocate(page);
+    ASSERT_TRUE(fileSpace->Read(page, 8, &read, sizeof(int)) < 0
+                && fileSpace->Read(page - 1, 0, &read, sizeof(int)) == sizeof(int),
+                "The file should be truncated at the page past 2 GB.");
+    ASSERT_TRUE(fileSpace->Allocate(-1, 1) == page
+                && fileSpace->Read(page, 8, &read, sizeof(int)) == sizeof(int) && read == 0,
+                "A page past 2 GB should be allocated at the end.");
+    delete fileSpace;
+    remove(PERSIST_TEST_FILE);
+}
+
+void TestPersistRecord() {
+    LOG_TEST_ENTRY();
+    ASSERT_TRUE(TMQCrc32::Update(0, "123456789", 9) == 0xE3069283,
+                "The CRC32C of the check string should be 0xE3069283.");
+    ASSERT_TRUE(TMQCrc32::Update(TMQCrc32::Update(0, "1234", 4), "56789", 5) == 0xE3069283,
+                "The CRC32C can be updated in pieces.");
+    if (strlen(STORAGE_TEST_FILE) == 0) {
+        return;
+    }
+    remove(STORAGE_TEST_FILE);
+    const char *topic = "TestPersistRecord";
+    const char *legacy = "A message saved in Base64 by the early versions";
+    int legacyLen = (int) strlen(legacy) + 1;
+    // Save a message as the early versions did, the data in Base64, the shadow without type.
+    auto *fileSpace = new FileSpace(STORAGE_TEST_FILE);
+    auto *persist = new Persistence(fileSpace);
+    ISectionSpace *dataSpace = persist->CreateLinearSpace(SECTION_DATA);
+    ISectionSpace *metaSpace = persist->CreateLinearSpace(SECTION_META);
+    persist->CreateLinearSpace(SECTION_BACKUP);
+    char *encoded = (char *) calloc(TMQBase64::EncodeLength(legacyLen), sizeof(char));
+    int encodedLen = TMQBase64::Encode(encoded, legacy, legacyLen);
+    Shadow shadow(TMQTopicRegistry::GetInstance()->Intern(topic));
+    shadow.msgId = 1;
+    shadow.length = legacyLen;
+    shadow.dataAddress = dataSpace->Allocate(encodedLen);
+    dataSpace->Write(shadow.dataAddress, encoded, encodedLen);
+    free(encoded);
+    PersistShadow record(shadow, topic);
+    shadow.metaAddress = metaSpace->Allocate(sizeof(PersistShadow));
+    metaSpace->Write(shadow.metaAddress, &record, sizeof(PersistShadow));
+    // An empty message has no Base64 data.
+    Shadow empty(shadow.topicId);
+    empty.msgId = 2;
+    empty.length = 0;
+    empty.dataAddress = dataSpace->Allocate(0);
+    PersistShadow emptyRecord(empty, topic);
+    empty.metaAddress = metaSpace->Allocate(sizeof(PersistShadow));
+    metaSpace->Write(empty.metaAddress, &emptyRecord, sizeof(PersistShadow));
+    delete persist;
+    delete fileSpace;
+    // The message should be read after the migration on enabling.
+    TMQStorage storage;
+    ASSERT_TRUE(storage.EnablePersist(true, STORAGE_TEST_FILE), "Enable persist should success.");
+    List<Shadow> shadows;
+    storage.FindShadows(&topic, 1, shadows);
+    TMQMsg msg;
+    ASSERT_TRUE(shadows.Size() == 2 && storage.Read(shadows.Get(0), msg)
+                && msg.length == legacyLen && strcmp((char *) msg.data, legacy) == 0,
+                "The Base64 message should be migrated to a record.");
+    ASSERT_TRUE(msg.buffer && (char *) msg.data > (char *) msg.buffer->Data(),
+                "The message should share the payload in the buffer of the record.");
+    ASSERT_TRUE(storage.Read(shadows.Get(1), msg) && msg.msgId == 2 && msg.length == 0,
+                "The empty message should be migrated to an empty record.");
+    const char *data = "A message saved in a record";
+    TMQMsg written(data, (int) strlen(data) + 1);
+    written.flag = FORCE_PERSIST(TMQ_MSG_TYPE_PICK);
+    shadow = storage.Write(shadows.Get(0).topicId, written);
+    ASSERT_TRUE(shadow.type == STORAGE_TYPE_STAGED && shadow.length == written.length
+                && storage.Read(shadow, msg) && strcmp((char *) msg.data, data) == 0,
+                "A record should be read as it is written.");
+    storage.Remove(shadow);
+    storage.EnablePersist(false, STORAGE_TEST_FILE);
+    remove(STORAGE_TEST_FILE);
+}
+
+void TestLogStorageRetention() {
+    LOG_TEST_ENTRY();
+    if (strlen(LOG_TEST_DIR) == 0) {
+        return;
+    }
+    TMQLogStorage storage;
+    char longDirectory[LOG_PATH_MAX_LENGTH] = {0};
+    memset(longDirectory, 'd', LOG_PATH_MAX_LENGTH - LOG_SEGMENT_NAME_LENGTH + 1);
+    ASSERT_TRUE(!storage.EnablePersist(true, longDirectory),
+                "A directory without room for the segment names should be rejected.");
+    ASSERT_TRUE(storage.EnablePersist(true, LOG_TEST_DIR), "Enable persist should success.");
+    TMQTopicId topicId = TMQTopicRegistry::GetInstance()->Intern("TestLogStorageRetention");
+    const int length = 64 * 1024;
+    char *data = (char *) calloc(length, sizeof(char));
+    TMQMsg msg(data, length);
+    msg.flag = FORCE_PERSIST(TMQ_MSG_TYPE_PICK);
+    List<Shadow> shadows;
+    while (shadows.Empty() || shadows.Get(shadows.Size() - 1).metaAddress == 0) {
+        Shadow shadow = storage.Write(topicId, msg);
+        ASSERT_TRUE(shadow.type == STORAGE_TYPE_LOG, "A message should be appended to the log.");
+        shadows.Add(shadow);
+    }
+    Shadow last = shadows.Get(shadows.Size() - 1);
+    char path[LOG_PATH_MAX_LENGTH] = {0};
+    snprintf(path, sizeof(path), "%s/%016llx%s", LOG_TEST_DIR, 0ULL, LOG_SEGMENT_SUFFIX);
+    TMQMsg read;
+    ASSERT_TRUE(last.metaAddress == 1 && access(path, F_OK) == 0
+                && storage.Read(shadows.Get(0), read) && read.length == length,
+                "A full segment should be kept after a new one is rolled.");
+    for (int i = 0; i < shadows.Size() - 2; ++i) {
+        storage.Remove(shadows.Get(i));
+    }
+    ASSERT_TRUE(access(path, F_OK) == 0, "A segment with live messages should be kept.");
+    storage.Remove(shadows.Get(shadows.Size() - 2));
+    ASSERT_TRUE(access(path, F_OK) != 0 && storage.Read(last, read),
+                "A segment without live messages should be deleted.");
+    storage.EnablePersist(false, LOG_TEST_DIR);
+    // The segments are numbered after the deleted ones on enabling again, so removing a shadow
+    // written before never touches the new segments.
+    ASSERT_TRUE(storage.EnablePersist(true, LOG_TEST_DIR), "Enable persist should success.");
+    Shadow renewed = storage.Write(topicId, msg);
+    ASSERT_TRUE(renewed.type == STORAGE_TYPE_LOG && renewed.metaAddress > last.metaAddress,
+                "The segment numbers should not be reused after enabling again.");
+    storage.Remove(last);
+    Shadow next = storage.Write(topicId, msg);
+    ASSERT_TRUE(storage.Read(renewed, read) && read.length == length
+                && next.metaAddress == renewed.metaAddress,
+                "A stale shadow should not release a new segment.");
+    storage.EnablePersist(false, LOG_TEST_DIR);
+    free(data);
+}
+
 void TestPersistence() {
     TestCreatePersistence();
     TestPersistenceFindSection();
@@ -175,9 +530,17 @@ void TestPersistence() {
     TestPersistenceDeallocatePages();
     TestPersistenceReusePages();
     TestPersistenceGetPageSize();
+    TestLazyBTree();
+    TestUpgradePageTable();
     TestCreateLinearSpace();
     TestDestroyLinearSpace();
     TestFindLinearSpace();
     TestEraseLinearSpace();
+    TestSectionFreeIndex();
+    TestFileSpaceChunked();
+    TestFileSpaceGrowth();
+    TestFileSpaceLarge();
+    TestPersistRecord();
+    TestLogStorageRetention();
 }
 
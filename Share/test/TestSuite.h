@@ -20,12 +20,15 @@
 #if defined(__ANDROID__)
 #define STORAGE_TEST_FILE   "/data/data/com.link.invoker/storage_test"
 #define PERSIST_TEST_FILE   "/data/data/com.link.invoker/persist_test"
+#define LOG_TEST_DIR        "/data/data/com.link.invoker/log_test"
 #elif defined(__APPLE__)
 #define STORAGE_TEST_FILE   ""
 #define PERSIST_TEST_FILE   ""
+#define LOG_TEST_DIR        ""
 #else
-#define STORAGE_TEST_FILE   ""
-#define PERSIST_TEST_FILE   ""
+#define STORAGE_TEST_FILE   "storage_test"
+#define PERSIST_TEST_FILE   "persist_test"
+#define LOG_TEST_DIR        "log_test"
 #endif
 
 #define ASSERT_TRUE(x, msg)                 \
@@ -9,6 +9,8 @@
 #include <unistd.h>
 #include "TestSuite.h"
 #include "Topic.h"
+#include "TMQTopicRegistry.h"
+#include "TMQSettings.h"
 
 USING_TMQ_NAMESPACE
 
@@ -48,13 +50,178 @@ void TestPublishTmqMsg() {
     ASSERT_TRUE(msgId > 0, "The return value by publish tmq msg should be valid.");
 }
 
+void TestPublishOwned() {
+    LOG_TEST_ENTRY();
+    Topic topicInst;
+    const char *topic = "TestTopic";
+    const char *data = "This is the test data";
+    int length = strlen(data) + 1;
+    char *owned = new char[length];
+    memcpy(owned, data, length);
+    TMQMsgId msgId = topicInst.PublishOwned(topic, owned, length, TMQ_MSG_TYPE_PICK);
+    ASSERT_TRUE(msgId > 0, "The return value by publish owned data should be valid.");
+    IPicker *picker = topicInst.CreatePicker(&topic, 1, TMQ_MSG_TYPE_ALL);
+    char pickedTopic[TMQ_TOPIC_MAX_LENGTH] = {0};
+    TMQMsg tmqMsg;
+    bool suc = picker->Pick(pickedTopic, tmqMsg);
+    topicInst.DestroyPicker(picker);
+    ASSERT_TRUE(suc && tmqMsg.msgId == msgId, "The owned msg should be picked.");
+    ASSERT_TRUE(tmqMsg.data == owned, "The owned data should be shared without copy.");
+}
+
+void TestPublishBatch() {
+    LOG_TEST_ENTRY();
+    Topic topicInst;
+    const char *topic = "TestTopic";
+    const char *data = "This is the test data";
+    const int count = 8;
+    TMQMsg msgs[count];
+    for (int i = 0; i < count; ++i) {
+        msgs[i] = TMQMsg(data, strlen(data) + 1);
+        msgs[i].flag = TMQ_MSG_TYPE_PICK;
+        msgs[i].priority = i % 2 ? PRIORITY_NORMAL : PRIORITY_NORMAL + 1;
+    }
+    TMQMsgId firstId = topicInst.PublishBatch(topic, msgs, count);
+    ASSERT_TRUE(firstId > 0, "The return value by publish batch should be valid.");
+    IPicker *picker = topicInst.CreatePicker(&topic, 1, TMQ_MSG_TYPE_ALL);
+    char pickedTopic[TMQ_TOPIC_MAX_LENGTH] = {0};
+    TMQMsg tmqMsg;
+    int picked = 0;
+    while (picker->Pick(pickedTopic, tmqMsg)) {
+        ASSERT_TRUE(tmqMsg.msgId >= firstId && tmqMsg.msgId < firstId + count,
+                    "Picked msg id should be in the range reserved by the batch.");
+        picked++;
+    }
+    topicInst.DestroyPicker(picker);
+    ASSERT_TRUE(picked == count, "All messages of the batch should be picked.");
+}
+
+void TestTopicLength() {
+    LOG_TEST_ENTRY();
+    Topic topicInst;
+    char topic[TMQ_TOPIC_MAX_LENGTH + 1] = {0};
+    memset(topic, 't', TMQ_TOPIC_MAX_LENGTH - 1);
+    int data = 0;
+    ASSERT_TRUE(topicInst.Publish(topic, &data, sizeof(int), TMQ_MSG_TYPE_PICK) != ID_LONG_INVALID,
+                "A topic of the max storable length should be published.");
+    topic[TMQ_TOPIC_MAX_LENGTH - 1] = 't';
+    ASSERT_TRUE(topicInst.Publish(topic, &data, sizeof(int), TMQ_MSG_TYPE_PICK) == ID_LONG_INVALID
+                && topicInst.GetLastError() == TMQ_ERROR_INVALID,
+                "A topic without room for its terminator should be invalid.");
+}
+
 void TestFindQueue() {
     LOG_TEST_ENTRY();
     Topic topicInst;
+    const char *topic = "TestTopic";
+    const char *data = "This is the test data";
+    for (int i = 0; i < TMQ_PRIORITY_COUNT; ++i) {
+        ASSERT_TRUE(topicInst.FindQueue(topic, i) == nullptr,
+                    "When there is no message, the queues of the topic should not be created.");
+    }
+    topicInst.Publish(topic, (void *) data, strlen(data) + 1, TMQ_MSG_TYPE_PICK);
     for (int i = 0; i < TMQ_PRIORITY_COUNT; ++i) {
-        ASSERT_TRUE(topicInst.FindQueue(i)->Size() == 0,
-                    "When there is no message, size of the queue should be zero.");
+        ASSERT_TRUE(topicInst.FindQueue(topic, i)->Size() == (i == PRIORITY_NORMAL ? 1 : 0),
+                    "The message should be enqueued into the queue of its topic and priority.");
+    }
+    ASSERT_TRUE(topicInst.FindQueue("OtherTopic", PRIORITY_NORMAL) == nullptr,
+                "The queues of other topics should not be created.");
+}
+
+void TestSegQueue() {
+    LOG_TEST_ENTRY();
+    RCSegQueue<Shadow> queue;
+    ASSERT_TRUE(queue.head == nullptr, "An empty queue should have no segment.");
+    ShadowIterator early(&queue, 1);
+    Shadow found;
+    ASSERT_TRUE(!early.Lookup(found), "Nothing should be found before enqueuing.");
+    int count = RC_SEGMENT_SIZE * 3 + 5;
+    auto *shadows = new Shadow[count];
+    for (int i = 0; i < count; ++i) {
+        shadows[i].msgId = i;
+        shadows[i].flag = i % 2 == 0 ? 1 : 2;
     }
+    queue.EnqueueBatch(shadows, count);
+    delete[] shadows;
+    RCSegment<Shadow, RC_SEGMENT_SIZE> *first = queue.head;
+    ASSERT_TRUE(queue.Size() == count, "All shadows of the batch should be enqueued.");
+    // Take the odd ones in the middle of the segments, the even ones are left.
+    ShadowIterator odd(&queue, 2);
+    int taken = 0;
+    while (odd.Lookup(found)) {
+        ASSERT_TRUE(found.msgId == (TMQMsgId) taken * 2 + 1, "The shadows should be in order.");
+        taken++;
+    }
+    ASSERT_TRUE(taken == count / 2 && queue.Size() == count - taken,
+                "The odd shadows should be taken only.");
+    ShadowIterator even(&queue, 1);
+    while (even.Lookup(found)) {
+        taken++;
+    }
+    ASSERT_TRUE(taken == count && queue.Size() == 0, "All shadows should be taken.");
+    ASSERT_TRUE(queue.head != first, "The taken segments should be retired.");
+    // The iterators go on with the shadows enqueued later.
+    Shadow more;
+    more.msgId = count;
+    more.flag = 2;
+    queue.Enqueue(more);
+    ASSERT_TRUE(odd.Lookup(found) && found.msgId == count,
+                "The shadow enqueued later should be found.");
+}
+
+void TestTopicRegistry() {
+    LOG_TEST_ENTRY();
+    TMQTopicRegistry *registry = TMQTopicRegistry::GetInstance();
+    ASSERT_TRUE(registry->Find("TestRegistryTopic") == ID_INT_INVALID,
+                "A topic not registered should have no id.");
+    TMQTopicId topicId = registry->Intern("TestRegistryTopic");
+    ASSERT_TRUE(topicId != ID_INT_INVALID, "Register a valid topic should be success.");
+    ASSERT_TRUE(registry->Intern("TestRegistryTopic") == topicId,
+                "Register a topic again should return the same id.");
+    ASSERT_TRUE(registry->Find("TestRegistryTopic") == topicId,
+                "Find a registered topic should return its id.");
+    ASSERT_TRUE(registry->Intern("TestRegistryOther") != topicId,
+                "Different topics should have different ids.");
+    ASSERT_TRUE(strcmp(registry->GetName(topicId), "TestRegistryTopic") == 0,
+                "The name of the id should be the registered topic.");
+    ASSERT_TRUE(registry->Intern("") == ID_INT_INVALID, "An empty topic should not be registered.");
+}
+
+void TestSettingsSnapshot() {
+    LOG_TEST_ENTRY();
+    Topic topicInst;
+    TMQSettings *settings = TMQSettings::GetInstance();
+    TMQSize version = settings->GetVersion();
+    const char *data = "TestSettingsCount = 12";
+    topicInst.Publish(TOPIC_SETTINGS, (void *) data, (int) strlen(data), TMQ_MSG_TYPE_DISPATCH);
+    ASSERT_TRUE(settings->GetVersion() > version, "A setting message should change the version.");
+    settings->Put("TestSettingsFlag", "true");
+    TMQSettingsSnapshot *snapshot = settings->Acquire();
+    ASSERT_TRUE(snapshot->GetInt("TestSettingsCount", -1) == 12,
+                "The parsed setting should be read by its key.");
+    ASSERT_TRUE(snapshot->GetBool("TestSettingsFlag", false), "The flag should be true.");
+    settings->Put("TestSettingsCount", "13");
+    ASSERT_TRUE(snapshot->GetInt("TestSettingsCount", -1) == 12,
+                "A snapshot should not be changed by the later settings.");
+    snapshot->Release();
+    snapshot = settings->Acquire();
+    ASSERT_TRUE(snapshot->GetInt("TestSettingsCount", -1) == 13,
+                "Put an exist key should replace its value.");
+    ASSERT_TRUE(snapshot->Get("TestSettingsMissing") == nullptr, "A missing key has no value.");
+    snapshot->Release();
+    settings->Put("TestSettingsBytes", "8589934592");
+    settings->Put("TestSettingsBytes:TestTopic", "-4294967296");
+    snapshot = settings->Acquire();
+    ASSERT_TRUE(snapshot->GetLong("TestSettingsBytes", -1) == 8589934592LL,
+                "A 64-bit setting should be read without truncation.");
+    ASSERT_TRUE(snapshot->GetTopicLong("TestSettingsBytes", "TestTopic", -1) == -4294967296LL
+                && snapshot->GetTopicLong("TestSettingsBytes", "OtherTopic", -1) == 8589934592LL,
+                "The 64-bit setting of a topic should override the one for all topics.");
+    snapshot->Release();
+    settings->Remove("TestSettingsCount");
+    settings->Remove("TestSettingsFlag");
+    settings->Remove("TestSettingsBytes");
+    settings->Remove("TestSettingsBytes:TestTopic");
 }
 
 void TestCreatePicker() {
@@ -95,6 +262,202 @@ void TestPickMsg() {
                 "Picked tmq msg id should be equal to msg id by publish.");
 }
 
+void TestPickAllTopics() {
+    LOG_TEST_ENTRY();
+    Topic topicInst;
+    const int topicCount = 200;
+    char topics[topicCount][TMQ_TOPIC_MAX_LENGTH];
+    for (int i = 0; i < topicCount; ++i) {
+        snprintf(topics[i], TMQ_TOPIC_MAX_LENGTH, "TestPickAll%d", i);
+        int data = i;
+        topicInst.Publish(topics[i], &data, sizeof(int), TMQ_MSG_TYPE_PICK);
+    }
+    IPicker *picker = topicInst.CreatePicker(nullptr, 0, TMQ_MSG_TYPE_PICK);
+    char pickedTopic[TMQ_TOPIC_MAX_LENGTH] = {0};
+    TMQMsg tmqMsg;
+    int picked = 0;
+    while (picker->Pick(pickedTopic, tmqMsg)) {
+        picked++;
+    }
+    ASSERT_TRUE(picked == topicCount, "The picker of all topics should pick every topic.");
+    // The marks of the drained queues are cleared, new messages mark them again.
+    int high = 130;
+    int normal = 70;
+    topicInst.Publish(topics[normal], &normal, sizeof(int), TMQ_MSG_TYPE_PICK);
+    topicInst.Publish(topics[high], &high, sizeof(int), TMQ_MSG_TYPE_PICK, PRIORITY_NORMAL + 1);
+    ASSERT_TRUE(picker->Pick(pickedTopic, tmqMsg) && *(int *) tmqMsg.data == high,
+                "The marked queue of the higher priority should be picked first.");
+    ASSERT_TRUE(picker->Pick(pickedTopic, tmqMsg) && *(int *) tmqMsg.data == normal,
+                "The marked queue of the lower priority should be picked next.");
+    ASSERT_TRUE(!picker->Pick(pickedTopic, tmqMsg), "All queues should be drained.");
+    topicInst.DestroyPicker(picker);
+}
+
+void TestHistoryRing() {
+    LOG_TEST_ENTRY();
+    Topic topicInst;
+    const char *topics[] = {"TestHistoryTopic", "TestHistoryOther"};
+    int count = HISTORY_TOPIC_MSG_MAX + HISTORY_EVICT_BATCH * 2 + 3;
+    TMQMsgId lastId = 0;
+    for (int i = 0; i < count; ++i) {
+        lastId = topicInst.Publish(topics[0], &i, sizeof(int), TMQ_MSG_TYPE_PICK);
+    }
+    int other = 5;
+    topicInst.Publish(topics[1], &other, sizeof(int), TMQ_MSG_TYPE_PICK);
+    IPicker *picker = topicInst.CreatePicker(topics, 2, TMQ_MSG_TYPE_ALL);
+    char pickedTopic[TMQ_TOPIC_MAX_LENGTH] = {0};
+    TMQMsg tmqMsg;
+    while (picker->Pick(pickedTopic, tmqMsg));
+    topicInst.DestroyPicker(picker);
+    TMQMsg *msgs = nullptr;
+    TMQSize size = topicInst.GetHistory(topics, 1, &msgs);
+    ASSERT_TRUE(size == HISTORY_TOPIC_MSG_MAX && msgs != nullptr,
+                "The history of a topic should be limited to HISTORY_TOPIC_MSG_MAX.");
+    ASSERT_TRUE(msgs[size - 1].msgId == lastId && *(int *) msgs[size - 1].data == count - 1
+                && *(int *) msgs[0].data == count - HISTORY_TOPIC_MSG_MAX,
+                "The history should keep the latest messages in consuming order.");
+    delete[] msgs;
+    msgs = nullptr;
+    size = topicInst.GetHistory(nullptr, 0, &msgs);
+    ASSERT_TRUE(size == HISTORY_TOPIC_MSG_MAX + 1, "The history of all topics should be got.");
+    delete[] msgs;
+}
+
+void TestHistoryRetention() {
+    LOG_TEST_ENTRY();
+    Topic topicInst;
+    TMQSettings *settings = TMQSettings::GetInstance();
+    const char *topics[] = {"TestRetentionCount", "TestRetentionBytes", "TestRetentionAge"};
+    settings->Put(KEY_HISTORY_MSG_MAX ":TestRetentionCount", "4");
+    settings->Put(KEY_HISTORY_BYTES_MAX ":TestRetentionBytes", "12");
+    settings->Put(KEY_HISTORY_AGE_MAX ":TestRetentionAge", "50");
+    for (int i = 0; i < 10; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            topicInst.Publish(topics[j], &i, sizeof(int), TMQ_MSG_TYPE_PICK);
+        }
+    }
+    IPicker *picker = topicInst.CreatePicker(topics, 3, TMQ_MSG_TYPE_ALL);
+    char pickedTopic[TMQ_TOPIC_MAX_LENGTH] = {0};
+    TMQMsg tmqMsg;
+    while (picker->Pick(pickedTopic, tmqMsg));
+    topicInst.DestroyPicker(picker);
+    TMQMsg *msgs = nullptr;
+    TMQSize size = topicInst.GetHistory(topics, 1, &msgs);
+    ASSERT_TRUE(size == 4 && *(int *) msgs[0].data == 6,
+                "The history should be limited by the max count of the topic.");
+    delete[] msgs;
+    size = topicInst.GetHistory(topics + 1, 1, &msgs);
+    ASSERT_TRUE(size == 3 && *(int *) msgs[0].data == 7,
+                "The history should be limited by the max bytes of the topic.");
+    delete[] msgs;
+    size = topicInst.GetHistory(topics + 2, 1, &msgs);
+    ASSERT_TRUE(size == 10, "The history should be kept before it is expired.");
+    delete[] msgs;
+    usleep(100 * 1000);
+    msgs = nullptr;
+    size = topicInst.GetHistory(topics + 2, 1, &msgs);
+    ASSERT_TRUE(size == 0 && msgs == nullptr, "The expired history should not be got.");
+    settings->Put(KEY_HISTORY_MSG_MAX ":TestRetentionCount", "2");
+    topicInst.Publish(topics[0], &size, sizeof(int), TMQ_MSG_TYPE_PICK);
+    picker = topicInst.CreatePicker(topics, 1, TMQ_MSG_TYPE_ALL);
+    while (picker->Pick(pickedTopic, tmqMsg));
+    topicInst.DestroyPicker(picker);
+    size = topicInst.GetHistory(topics, 1, &msgs);
+    ASSERT_TRUE(size == 2 && *(int *) msgs[0].data == 9,
+                "A changed setting should be applied to the exist history.");
+    delete[] msgs;
+    settings->Remove(KEY_HISTORY_MSG_MAX ":TestRetentionCount");
+    settings->Remove(KEY_HISTORY_BYTES_MAX ":TestRetentionBytes");
+    settings->Remove(KEY_HISTORY_AGE_MAX ":TestRetentionAge");
+}
+
+void TestHistoryBudget() {
+    LOG_TEST_ENTRY();
+    Topic topicInst;
+    TMQSettings *settings = TMQSettings::GetInstance();
+    const char *topics[] = {"TestBudgetFirst", "TestBudgetSecond"};
+    settings->Put(KEY_HISTORY_BUDGET, "200");
+    for (int j = 0; j < 2; ++j) {
+        for (int i = 0; i < 48; ++i) {
+            topicInst.Publish(topics[j], &i, sizeof(int), TMQ_MSG_TYPE_PICK);
+        }
+        IPicker *picker = topicInst.CreatePicker(topics + j, 1, TMQ_MSG_TYPE_ALL);
+        char pickedTopic[TMQ_TOPIC_MAX_LENGTH] = {0};
+        TMQMsg tmqMsg;
+        while (picker->Pick(pickedTopic, tmqMsg));
+        topicInst.DestroyPicker(picker);
+    }
+    TMQMsg *msgs = nullptr;
+    TMQSize size = 0;
+    for (int i = 0; i < 100; ++i) {
+        size = topicInst.GetHistory(topics, 1, &msgs);
+        delete[] msgs;
+        msgs = nullptr;
+        if (size == 0) {
+            break;
+        }
+        usleep(10 * 1000);
+    }
+    ASSERT_TRUE(size == 0, "The oldest topic should be evicted for the budget.");
+    size = topicInst.GetHistory(topics + 1, 1, &msgs);
+    ASSERT_TRUE(size > 0 && size * sizeof(int) <= 200, "The latest messages should be in budget.");
+    delete[] msgs;
+    settings->Remove(KEY_HISTORY_BUDGET);
+}
+
+void TestHistoryCursor() {
+    LOG_TEST_ENTRY();
+    Topic topicInst;
+    const char *topics[] = {"TestCursorFirst", "TestCursorSecond"};
+    TMQMsgId ids[20] = {0};
+    for (int i = 0; i < 20; ++i) {
+        ids[i] = topicInst.Publish(topics[0], &i, sizeof(int), TMQ_MSG_TYPE_PICK);
+    }
+    for (int i = 0; i < 5; ++i) {
+        topicInst.Publish(topics[1], &i, sizeof(int), TMQ_MSG_TYPE_PICK);
+    }
+    IPicker *picker = topicInst.CreatePicker(topics, 2, TMQ_MSG_TYPE_ALL);
+    char pickedTopic[TMQ_TOPIC_MAX_LENGTH] = {0};
+    TMQMsg tmqMsg;
+    while (picker->Pick(pickedTopic, tmqMsg));
+    topicInst.DestroyPicker(picker);
+    TMQMsg page[8];
+    IHistoryCursor *cursor = topicInst.CreateHistoryCursor(topics, 2, TMQ_HISTORY_NEWEST_FIRST, 22);
+    int size = cursor->NextPage(page, 8, false);
+    ASSERT_TRUE(size == 8 && page[0].msgId == ids[19] && page[7].msgId == ids[12]
+                && page[0].data == nullptr && page[0].length == sizeof(int),
+                "A lazy page should be read from the newest without the data.");
+    ASSERT_TRUE(cursor->Fetch(0, tmqMsg) && *(int *) tmqMsg.data == 19,
+                "The data of a message in the page should be fetched.");
+    ASSERT_TRUE(!cursor->Fetch(8, tmqMsg), "Fetch out of the page should fail.");
+    size = cursor->NextPage(page, 8, true);
+    ASSERT_TRUE(size == 8 && *(int *) page[7].data == 4, "The next page should follow.");
+    size = cursor->NextPage(page, 8, true);
+    ASSERT_TRUE(size == 6 && *(int *) page[3].data == 0 && *(int *) page[4].data == 4,
+                "A page should cross the topics until the limit.");
+    ASSERT_TRUE(cursor->NextPage(page, 8, true) == 0, "No page after the limit.");
+    topicInst.DestroyHistoryCursor(cursor);
+    cursor = topicInst.CreateHistoryCursor(topics, 1, TMQ_HISTORY_OLDEST_FIRST, 0);
+    ASSERT_TRUE(cursor->Seek(ids[10]) && !cursor->Seek(ID_LONG_INVALID),
+                "Seek should find the message in the history only.");
+    size = cursor->NextPage(page, 5, true);
+    ASSERT_TRUE(size == 5 && *(int *) page[0].data == 10 && *(int *) page[4].data == 14,
+                "A page should start from the seeking message.");
+    ASSERT_TRUE(cursor->NextPage(page, 8, true) == 5, "The last page should end the topic.");
+    topicInst.DestroyHistoryCursor(cursor);
+    // The page size divides the history, the page ending at the oldest one ends the topic.
+    cursor = topicInst.CreateHistoryCursor(topics + 1, 1, TMQ_HISTORY_NEWEST_FIRST, 0);
+    size = cursor->NextPage(page, 5, true);
+    ASSERT_TRUE(size == 5 && *(int *) page[0].data == 4 && *(int *) page[4].data == 0,
+                "A page should read the whole history of the topic.");
+    ASSERT_TRUE(cursor->NextPage(page, 5, true) == 0, "No page after the oldest one.");
+    topicInst.DestroyHistoryCursor(cursor);
+    cursor = topicInst.CreateHistoryCursor(topics + 1, 1, TMQ_HISTORY_OLDEST_FIRST, 0);
+    ASSERT_TRUE(cursor->NextPage(page, 5, true) == 5 && cursor->NextPage(page, 5, true) == 0,
+                "No page after the newest one.");
+    topicInst.DestroyHistoryCursor(cursor);
+}
+
 void TestSubscribe() {
     LOG_TEST_ENTRY();
     const char *topic = "TestTopic";
@@ -120,14 +483,529 @@ void TestSubscribeAndReceive() {
     ASSERT_TRUE(suc, "UnSubscribe a valid receiver id, the result should be success.");
 }
 
+class UnSubscribeTestReceiver : public TMQReceiver {
+public:
+    Topic *topicInst = nullptr;
+    volatile TMQId rid = 0;
+    volatile int count = 0;
+public:
+    void OnReceive(const TMQMsg *msg) override {
+        while (rid == 0);
+        topicInst->UnSubscribe(rid);
+        count++;
+    }
+};
+
+void TestUnSubscribeInCallback() {
+    LOG_TEST_ENTRY();
+    const char *topic = "TestTopic";
+    const char *data = "This is data.";
+    Topic topicInst;
+    UnSubscribeTestReceiver receiver;
+    receiver.topicInst = &topicInst;
+    receiver.rid = topicInst.Subscribe(topic, &receiver);
+    topicInst.Publish(topic, (void *) data, strlen(data) + 1, TMQ_MSG_TYPE_DISPATCH);
+    LOG_TEST_INFO("Waiting msg dispatched by tmq...");
+    while (receiver.count == 0);
+    ASSERT_TRUE(topicInst.FindSubscriber(receiver.rid) == nullptr,
+                "A receiver should be able to unsubscribe itself in its callback.");
+    topicInst.Publish(topic, (void *) data, strlen(data) + 1, TMQ_MSG_TYPE_DISPATCH);
+    usleep(10000);
+    ASSERT_TRUE(receiver.count == 1, "The unsubscribed receiver should receive no more msg.");
+}
+
+class OrderedTestReceiver : public TMQReceiver {
+public:
+    volatile int running = 0;
+    volatile int count = 0;
+    int last[3] = {-1, -1, -1};
+    bool ordered = true;
+public:
+    void OnReceive(const TMQMsg *msg) override {
+        // The receiver of one ordering key should never run concurrently.
+        if (__atomic_add_fetch(&running, 1, __ATOMIC_SEQ_CST) != 1) {
+            ordered = false;
+        }
+        // The message i is published to the topic i % 3.
+        int seq = *(const int *) msg->data;
+        ordered = ordered && seq > last[seq % 3];
+        last[seq % 3] = seq;
+        usleep(seq % 64 == 0 ? 100 : 0);
+        __atomic_sub_fetch(&running, 1, __ATOMIC_SEQ_CST);
+        count++;
+    }
+};
+
+void TestOrderedDispatch() {
+    LOG_TEST_ENTRY();
+    const char *topics[] = {"TestOrderedA", "TestOrderedB", "TestOrderedC"};
+    TMQSettings::GetInstance()->Put("DISPATCH_ORDERED", "true");
+    Topic topicInst;
+    // A and B share one key, so they share one receiver.
+    topicInst.SetOrderingKey(topics[0], "TestOrderedKey");
+    topicInst.SetOrderingKey(topics[1], "TestOrderedKey");
+    OrderedTestReceiver shared, single;
+    topicInst.Subscribe(topics[0], &shared);
+    topicInst.Subscribe(topics[1], &shared);
+    topicInst.Subscribe(topics[2], &single);
+    const int count = 3000;
+    for (int i = 0; i < count; ++i) {
+        topicInst.Publish(topics[i % 3], &i, sizeof(int), TMQ_MSG_TYPE_DISPATCH);
+    }
+    LOG_TEST_INFO("Waiting msg dispatched by tmq...");
+    while (shared.count + single.count < count) {
+        usleep(1000);
+    }
+    TMQSettings::GetInstance()->Remove("DISPATCH_ORDERED");
+    ASSERT_TRUE(shared.ordered, "The topics with one ordering key should be dispatched one by one.");
+    ASSERT_TRUE(single.ordered, "The messages of a topic should be dispatched in order.");
+}
+
+class BatchTestReceiver : public TMQReceiver {
+public:
+    volatile int count = 0;
+    int batches = 0;
+    int single = 0;
+    int largest = 0;
+public:
+    void OnReceive(const TMQMsg *msg) override {
+        single++;
+    }
+
+    void OnReceiveBatch(const TMQMsg **msgs, int n) override {
+        batches++;
+        largest = n > largest ? n : largest;
+        __atomic_add_fetch(&count, n, __ATOMIC_SEQ_CST);
+    }
+};
+
+void TestReceiveBatch() {
+    LOG_TEST_ENTRY();
+    const char *topic = "TestReceiveBatch";
+    Topic topicInst;
+    BatchTestReceiver receiver;
+    topicInst.Subscribe(topic, &receiver, 16, 20);
+    // The last 4 messages are not enough for a batch, they are delivered after the linger time.
+    const int count = 100;
+    for (int i = 0; i < count; ++i) {
+        topicInst.Publish(topic, &i, sizeof(int), TMQ_MSG_TYPE_DISPATCH);
+    }
+    LOG_TEST_INFO("Waiting msg dispatched by tmq...");
+    for (int i = 0; i < 5000 && receiver.count < count; ++i) {
+        usleep(1000);
+    }
+    ASSERT_TRUE(receiver.count == count, "All messages should be delivered in batches.");
+    ASSERT_TRUE(receiver.single == 0, "A batching receiver should not be called by OnReceive.");
+    ASSERT_TRUE(receiver.largest <= 16, "A batch should not exceed the max batch size.");
+    ASSERT_TRUE(receiver.batches < count, "The messages should be delivered in batches.");
+}
+
+class UnSubscribeBatchReceiver : public BatchTestReceiver {
+public:
+    Topic *topicInst = nullptr;
+    volatile TMQId rid = 0;
+    int depth = 0;
+    bool nested = false;
+public:
+    void OnReceiveBatch(const TMQMsg **msgs, int n) override {
+        nested = nested || depth > 0;
+        depth++;
+        if (rid != 0) {
+            topicInst->UnSubscribe(rid);
+        }
+        BatchTestReceiver::OnReceiveBatch(msgs, n);
+        depth--;
+    }
+};
+
+void TestUnSubscribeBatch() {
+    LOG_TEST_ENTRY();
+    const char *topic = "TestUnSubscribeBatch";
+    Topic topicInst;
+    UnSubscribeBatchReceiver receiver;
+    receiver.topicInst = &topicInst;
+    TMQId rid = topicInst.Subscribe(topic, &receiver, 16, 60000);
+    for (int i = 0; i < 5; ++i) {
+        topicInst.Publish(topic, &i, sizeof(int), TMQ_MSG_TYPE_DISPATCH);
+    }
+    usleep(50000);
+    topicInst.UnSubscribe(rid);
+    ASSERT_TRUE(receiver.count == 5, "The pending messages should be delivered on unsubscribing.");
+    // Unsubscribe in the callback, the pending messages should not overtake the running batch.
+    UnSubscribeBatchReceiver self;
+    self.topicInst = &topicInst;
+    self.rid = topicInst.Subscribe(topic, &self, 4, 60000);
+    for (int i = 0; i < 10; ++i) {
+        topicInst.Publish(topic, &i, sizeof(int), TMQ_MSG_TYPE_DISPATCH);
+    }
+    for (int i = 0; i < 5000 && self.count == 0; ++i) {
+        usleep(1000);
+    }
+    usleep(50000);
+    ASSERT_TRUE(self.count == 4 && !self.nested && topicInst.FindSubscriber(self.rid) == nullptr,
+                "A batching receiver should unsubscribe itself without a nested batch.");
+}
+
+class ReceiptTestReceiver : public TMQReceiver {
+public:
+    TMQMutex mutex;
+    TMQSentRange ranges[1024]{};
+    int count = 0;
+    int receipts = 0;
+    bool valid = true;
+public:
+    void OnReceive(const TMQMsg *msg) override {
+        mutex.Lock();
+        receipts++;
+        valid = valid && msg->length > 0 && msg->length % sizeof(TMQSentRange) == 0;
+        for (int i = 0; i < msg->length / (int) sizeof(TMQSentRange) && count < 1024; ++i) {
+            ranges[count] = ((const TMQSentRange *) msg->data)[i];
+            valid = valid && ranges[count].first <= ranges[count].last;
+            count++;
+        }
+        mutex.UnLock();
+    }
+
+    int Covered(TMQMsgId first, TMQMsgId last) {
+        int covered = 0;
+        mutex.Lock();
+        for (int i = 0; i < count; ++i) {
+            for (TMQMsgId id = ranges[i].first; id <= ranges[i].last; ++id) {
+                covered += id >= first && id <= last ? 1 : 0;
+            }
+        }
+        mutex.UnLock();
+        return covered;
+    }
+};
+
+void TestSentReceipt() {
+    LOG_TEST_ENTRY();
+    const char *topic = "TestSentReceipt";
+    Topic topicInst;
+    ReceiptTestReceiver receiver;
+    TMQId id = topicInst.Subscribe("__SENT__", &receiver);
+    // A batch is published with one wakeup, so it is picked into full dispatch batches.
+    const int count = 100;
+    TMQMsg msgs[count];
+    for (int i = 0; i < count; ++i) {
+        msgs[i] = TMQMsg(&i, sizeof(int));
+        msgs[i].flag = TMQ_MSG_TYPE_DISPATCH;
+    }
+    TMQMsgId first = topicInst.PublishBatch(topic, msgs, count);
+    TMQMsgId last = first + count - 1;
+    LOG_TEST_INFO("Waiting msg dispatched by tmq...");
+    for (int i = 0; i < 5000 && receiver.Covered(first, last) < count; ++i) {
+        usleep(1000);
+    }
+    topicInst.UnSubscribe(id);
+    ASSERT_TRUE(receiver.valid, "A receipt should be an array of valid ranges.");
+    ASSERT_TRUE(receiver.Covered(first, last) == count, "The dispatched ids should be receipted.");
+    ASSERT_TRUE(receiver.receipts < count, "The receipts should be coalesced by batches.");
+}
+
+class LimitTestListener : public TMQLimitListener {
+public:
+    int high = 0;
+    int low = 0;
+public:
+    void OnHighWatermark(const char *topic) override {
+        high++;
+    }
+
+    void OnLowWatermark(const char *topic) override {
+        low++;
+    }
+};
+
+class DurableTestListener : public TMQDurableListener {
+public:
+    volatile int durable = 0;
+    volatile int failed = 0;
+public:
+    void OnDurable(TMQMsgId msgId, bool success) override {
+        if (success) {
+            durable++;
+        } else {
+            failed++;
+        }
+    }
+};
+
+void TestPublishDurable() {
+    LOG_TEST_ENTRY();
+    const char *topic = "TestPublishDurable";
+    Topic topicInst;
+    DurableTestListener listener;
+    int data = 0;
+    TMQMsg msg(&data, sizeof(int));
+    msg.flag = TMQ_MSG_TYPE_PICK;
+    topicInst.PublishDurable(topic, msg, &listener);
+    ASSERT_TRUE(listener.failed == 1, "A message can not be durable without the persistence.");
+    if (strlen(STORAGE_TEST_FILE) == 0) {
+        return;
+    }
+    remove(STORAGE_TEST_FILE);
+    ASSERT_TRUE(topicInst.EnablePersistent(true, STORAGE_TEST_FILE), "Enable should be success.");
+    for (int i = 1; i <= 100; ++i) {
+        msg = TMQMsg(&i, sizeof(int));
+        msg.flag = TMQ_MSG_TYPE_PICK;
+        topicInst.PublishDurable(topic, msg, &listener);
+    }
+    for (int i = 0; i < 500 && listener.durable < 100; ++i) {
+        usleep(10 * 1000);
+    }
+    ASSERT_TRUE(listener.durable == 100 && listener.failed == 1,
+                "All persistent messages should be durable.");
+    IPicker *picker = topicInst.CreatePicker(&topic, 1, TMQ_MSG_TYPE_ALL);
+    char pickedTopic[TMQ_TOPIC_MAX_LENGTH] = {0};
+    TMQMsg tmqMsg;
+    int expected = 0;
+    while (picker->Pick(pickedTopic, tmqMsg)) {
+        ASSERT_TRUE(*(int *) tmqMsg.data == expected++, "The messages should be read in order.");
+    }
+    topicInst.DestroyPicker(picker);
+    ASSERT_TRUE(expected == 101, "All messages should be picked.");
+    topicInst.EnablePersistent(false, STORAGE_TEST_FILE);
+    remove(STORAGE_TEST_FILE);
+}
+
+void TestPersistDurability() {
+    LOG_TEST_ENTRY();
+    if (strlen(STORAGE_TEST_FILE) == 0) {
+        return;
+    }
+    const char *topic = "TestPersistDurability";
+    TMQSettings *settings = TMQSettings::GetInstance();
+    char key[TOPIC_SETTINGS_KEY_LENGTH] = {0};
+    snprintf(key, sizeof(key), "%s:%s", KEY_PERSIST_DURABILITY, topic);
+    settings->Put(key, "0");
+    settings->Put(KEY_PERSIST_SYNC_PERIOD, "20");
+    remove(STORAGE_TEST_FILE);
+    Topic topicInst;
+    TMQSyncStats stats;
+    ASSERT_TRUE(!topicInst.GetSyncStats(stats), "There are no statistics without the persistence.");
+    ASSERT_TRUE(topicInst.EnablePersistent(true, STORAGE_TEST_FILE), "Enable should be success.");
+    int data = 0;
+    topicInst.Publish(topic, &data, sizeof(int), FORCE_PERSIST(TMQ_MSG_TYPE_PICK));
+    usleep(100 * 1000);
+    ASSERT_TRUE(topicInst.GetSyncStats(stats) && stats.count == 0,
+                "A message of the topic without durability should not be synchronized.");
+    int flag = FORCE_PERSIST(TMQ_MSG_TYPE_PICK) | TMQ_MSG_DURABILITY(TMQ_DURABILITY_PERIODIC);
+    topicInst.Publish(topic, &data, sizeof(int), flag);
+    for (int i = 0; i < 200 && stats.count == 0; ++i) {
+        usleep(10 * 1000);
+        topicInst.GetSyncStats(stats);
+    }
+    ASSERT_TRUE(stats.count == 1 && stats.failures == 0,
+                "A periodic message should be synchronized after the period.");
+    DurableTestListener listener;
+    TMQMsg msg(&data, sizeof(int));
+    msg.flag = TMQ_MSG_TYPE_PICK;
+    topicInst.PublishDurable(topic, msg, &listener);
+    for (int i = 0; i < 200 && listener.durable == 0; ++i) {
+        usleep(10 * 1000);
+    }
+    ASSERT_TRUE(listener.durable == 1 && topicInst.GetSyncStats(stats) && stats.count == 2
+                && stats.maxMicros >= stats.lastMicros && stats.totalMicros >= stats.maxMicros,
+                "A durable message should be synchronized with its batch.");
+    topicInst.EnablePersistent(false, STORAGE_TEST_FILE);
+    remove(STORAGE_TEST_FILE);
+    settings->Remove(key);
+    settings->Remove(KEY_PERSIST_SYNC_PERIOD);
+}
+
+void TestPersistRecovery() {
+    LOG_TEST_ENTRY();
+    if (strlen(STORAGE_TEST_FILE) == 0) {
+        return;
+    }
+    const char *topic = "TestPersistRecovery";
+    const int count = 6;
+    char pickedTopic[TMQ_TOPIC_MAX_LENGTH] = {0};
+    TMQMsg tmqMsg;
+    TMQMsgId lastId = 0;
+    remove(STORAGE_TEST_FILE);
+    auto *crashed = new Topic();
+    ASSERT_TRUE(crashed->EnablePersistent(true, STORAGE_TEST_FILE), "Enable should be success.");
+    for (int i = 0; i < count; ++i) {
+        lastId = crashed->Publish(topic, &i, sizeof(int), FORCE_PERSIST(TMQ_MSG_TYPE_PICK),
+                                  i % 2 ? PRIORITY_NORMAL : PRIORITY_NORMAL + 1);
+    }
+    IPicker *picker = crashed->CreatePicker(&topic, 1, TMQ_MSG_TYPE_ALL);
+    ASSERT_TRUE(picker->Pick(pickedTopic, tmqMsg) && *(int *) tmqMsg.data == 0,
+                "The first message of the high priority should be picked.");
+    crashed->DestroyPicker(picker);
+    // The messages are left in the file as a crash does.
+    delete crashed;
+    auto *recovered = new Topic();
+    ASSERT_TRUE(recovered->EnablePersistent(true, STORAGE_TEST_FILE), "Enable should be success.");
+    TMQMsg *msgs = nullptr;
+    TMQSize size = recovered->GetHistory(&topic, 1, &msgs);
+    ASSERT_TRUE(size == 1 && *(int *) msgs[0].data == 0,
+                "The consumed message should be recovered into the history.");
+    delete[] msgs;
+    const int expected[] = {2, 4, 1, 3, 5};
+    int picked = 0;
+    picker = recovered->CreatePicker(&topic, 1, TMQ_MSG_TYPE_ALL);
+    while (picker->Pick(pickedTopic, tmqMsg)) {
+        ASSERT_TRUE(picked < count - 1 && *(int *) tmqMsg.data == expected[picked]
+                    && tmqMsg.msgId <= lastId,
+                    "The messages should be recovered in the order of priorities and ids.");
+        picked++;
+    }
+    recovered->DestroyPicker(picker);
+    ASSERT_TRUE(picked == count - 1, "All undelivered messages should be recovered.");
+    TMQMsgId msgId = recovered->Publish(topic, &picked, sizeof(int),
+                                        FORCE_PERSIST(TMQ_MSG_TYPE_PICK));
+    ASSERT_TRUE(msgId > lastId, "The message ids should be raised past the recovered ones.");
+    delete recovered;
+    // The records validated by the last recovery are trusted by the checkpoint.
+    Topic restarted;
+    ASSERT_TRUE(restarted.EnablePersistent(true, STORAGE_TEST_FILE), "Enable should be success.");
+    size = restarted.GetHistory(&topic, 1, &msgs);
+    ASSERT_TRUE(size == count, "All consumed messages should be recovered into the history.");
+    delete[] msgs;
+    picker = restarted.CreatePicker(&topic, 1, TMQ_MSG_TYPE_ALL);
+    ASSERT_TRUE(picker->Pick(pickedTopic, tmqMsg) && tmqMsg.msgId == msgId
+                && !picker->Pick(pickedTopic, tmqMsg),
+                "Only the message published after the recovery should be picked.");
+    restarted.DestroyPicker(picker);
+    restarted.EnablePersistent(false, STORAGE_TEST_FILE);
+    remove(STORAGE_TEST_FILE);
+}
+
+void TestLogStorageRecovery() {
+    LOG_TEST_ENTRY();
+    if (strlen(LOG_TEST_DIR) == 0) {
+        return;
+    }
+    const char *topic = "TestLogStorageRecovery";
+    const int count = 6;
+    char pickedTopic[TMQ_TOPIC_MAX_LENGTH] = {0};
+    TMQMsg tmqMsg;
+    TMQMsgId lastId = 0;
+    TMQSettings::GetInstance()->Put(KEY_STORAGE_ENGINE, "1");
+    auto *crashed = new Topic();
+    ASSERT_TRUE(crashed->EnablePersistent(true, LOG_TEST_DIR), "Enable should be success.");
+    for (int i = 0; i < count; ++i) {
+        lastId = crashed->Publish(topic, &i, sizeof(int), FORCE_PERSIST(TMQ_MSG_TYPE_PICK),
+                                  i % 2 ? PRIORITY_NORMAL : PRIORITY_NORMAL + 1);
+    }
+    IPicker *picker = crashed->CreatePicker(&topic, 1, TMQ_MSG_TYPE_ALL);
+    ASSERT_TRUE(picker->Pick(pickedTopic, tmqMsg) && *(int *) tmqMsg.data == 0,
+                "The first message of the high priority should be picked.");
+    crashed->DestroyPicker(picker);
+    // The segments are left in the directory as a crash does.
+    delete crashed;
+    auto *recovered = new Topic();
+    ASSERT_TRUE(recovered->EnablePersistent(true, LOG_TEST_DIR), "Enable should be success.");
+    TMQMsg *msgs = nullptr;
+    TMQSize size = recovered->GetHistory(&topic, 1, &msgs);
+    ASSERT_TRUE(size == 1 && *(int *) msgs[0].data == 0,
+                "The consumed message should be recovered into the history.");
+    delete[] msgs;
+    const int expected[] = {2, 4, 1, 3, 5};
+    int picked = 0;
+    picker = recovered->CreatePicker(&topic, 1, TMQ_MSG_TYPE_ALL);
+    while (picker->Pick(pickedTopic, tmqMsg)) {
+        ASSERT_TRUE(picked < count - 1 && *(int *) tmqMsg.data == expected[picked]
+                    && tmqMsg.msgId <= lastId,
+                    "The messages should be recovered in the order of priorities and ids.");
+        picked++;
+    }
+    recovered->DestroyPicker(picker);
+    ASSERT_TRUE(picked == count - 1, "All undelivered messages should be recovered.");
+    TMQMsgId msgId = recovered->Publish(topic, &picked, sizeof(int),
+                                        FORCE_PERSIST(TMQ_MSG_TYPE_PICK));
+    ASSERT_TRUE(msgId > lastId, "The message ids should be raised past the recovered ones.");
+    delete recovered;
+    Topic restarted;
+    ASSERT_TRUE(restarted.EnablePersistent(true, LOG_TEST_DIR), "Enable should be success.");
+    size = restarted.GetHistory(&topic, 1, &msgs);
+    ASSERT_TRUE(size == count, "All consumed messages should be recovered into the history.");
+    delete[] msgs;
+    picker = restarted.CreatePicker(&topic, 1, TMQ_MSG_TYPE_ALL);
+    ASSERT_TRUE(picker->Pick(pickedTopic, tmqMsg) && tmqMsg.msgId == msgId
+                && !picker->Pick(pickedTopic, tmqMsg),
+                "Only the message published after the recovery should be picked.");
+    restarted.DestroyPicker(picker);
+    restarted.EnablePersistent(false, LOG_TEST_DIR);
+    TMQSettings::GetInstance()->Remove(KEY_STORAGE_ENGINE);
+}
+
+void TestTopicLimit() {
+    LOG_TEST_ENTRY();
+    const char *topic = "TestTopicLimit";
+    Topic topicInst;
+    LimitTestListener listener;
+    TMQTopicLimit limit;
+    limit.maxMsgs = 4;
+    limit.policy = TMQ_LIMIT_REJECT;
+    limit.highWatermark = 75;
+    limit.lowWatermark = 25;
+    limit.listener = &listener;
+    ASSERT_TRUE(topicInst.SetTopicLimit(topic, limit), "Set topic limit should be success.");
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(topicInst.Publish(topic, &i, sizeof(int), TMQ_MSG_TYPE_PICK) != ID_LONG_INVALID,
+                    "The messages under the limit should be published.");
+    }
+    ASSERT_TRUE(listener.high == 1, "The high watermark should be called once.");
+    int data = 4;
+    ASSERT_TRUE(topicInst.Publish(topic, &data, sizeof(int), TMQ_MSG_TYPE_PICK) == ID_LONG_INVALID
+                && topicInst.GetLastError() == TMQ_ERROR_FULL, "A full topic should reject.");
+    limit.policy = TMQ_LIMIT_BLOCK;
+    limit.timeoutMs = 10;
+    topicInst.SetTopicLimit(topic, limit);
+    ASSERT_TRUE(topicInst.Publish(topic, &data, sizeof(int), TMQ_MSG_TYPE_PICK) == ID_LONG_INVALID
+                && topicInst.GetLastError() == TMQ_ERROR_TIMEOUT, "A full topic should time out.");
+    // The message 0 is dropped for the message 4.
+    limit.policy = TMQ_LIMIT_DROP_OLDEST;
+    topicInst.SetTopicLimit(topic, limit);
+    ASSERT_TRUE(topicInst.Publish(topic, &data, sizeof(int), TMQ_MSG_TYPE_PICK) != ID_LONG_INVALID,
+                "A full topic should drop the oldest.");
+    IPicker *picker = topicInst.CreatePicker(&topic, 1, TMQ_MSG_TYPE_PICK);
+    char pickedTopic[TMQ_TOPIC_MAX_LENGTH] = {0};
+    TMQMsg tmqMsg;
+    int expected = 1;
+    while (picker->Pick(pickedTopic, tmqMsg)) {
+        ASSERT_TRUE(*(int *) tmqMsg.data == expected++, "The remained messages should be in order.");
+    }
+    topicInst.DestroyPicker(picker);
+    ASSERT_TRUE(expected == 5, "The messages should be picked except the dropped one.");
+    ASSERT_TRUE(listener.low == 1, "The low watermark should be called once.");
+    topicInst.SetTopicLimit(topic, TMQTopicLimit());
+}
+
 void TestTopic() {
     TestTopicStorage();
     TestPublishData();
     TestPublishTmqMsg();
+    TestPublishOwned();
+    TestPublishBatch();
     TestCreatePicker();
+    TestTopicRegistry();
+    TestSettingsSnapshot();
+    TestTopicLength();
     TestFindQueue();
+    TestSegQueue();
     TestPickEmpty();
     TestPickMsg();
+    TestPickAllTopics();
+    TestHistoryRing();
+    TestHistoryRetention();
+    TestHistoryBudget();
+    TestHistoryCursor();
     TestSubscribe();
     TestSubscribeAndReceive();
+    TestUnSubscribeInCallback();
+    TestOrderedDispatch();
+    TestReceiveBatch();
+    TestUnSubscribeBatch();
+    TestSentReceipt();
+    TestTopicLimit();
+    TestPublishDurable();
+    TestPersistDurability();
+    TestPersistRecovery();
+    TestLogStorageRecovery();
 }